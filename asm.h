@@ -0,0 +1,795 @@
+#pragma once
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "common.h"
+
+// Same order as the name tables below
+typedef enum {
+    REG_RAX,
+    REG_RBX,
+    REG_RCX,
+    REG_RDX,
+    REG_RDI,
+    REG_RSI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_COUNT,
+    // Never allocated, only used by the prolog, the epilog and `lea`
+    REG_RSP = REG_COUNT,
+    REG_RBP,
+} mkt_reg_t;
+
+static const char regs[REG_RBP + 1][5] = {
+    [REG_RAX] = "%rax", [REG_RBX] = "%rbx", [REG_RCX] = "%rcx",
+    [REG_RDX] = "%rdx", [REG_RDI] = "%rdi", [REG_RSI] = "%rsi",
+    [REG_R8] = "%r8",   [REG_R9] = "%r9",   [REG_R10] = "%r10",
+    [REG_R11] = "%r11", [REG_R12] = "%r12", [REG_R13] = "%r13",
+    [REG_R14] = "%r14", [REG_R15] = "%r15", [REG_RSP] = "%rsp",
+    [REG_RBP] = "%rbp",
+};
+static const char regs32[REG_RBP + 1][6] = {
+    [REG_RAX] = "%eax",  [REG_RBX] = "%ebx",  [REG_RCX] = "%ecx",
+    [REG_RDX] = "%edx",  [REG_RDI] = "%edi",  [REG_RSI] = "%esi",
+    [REG_R8] = "%r8d",   [REG_R9] = "%r9d",   [REG_R10] = "%r10d",
+    [REG_R11] = "%r11d", [REG_R12] = "%r12d", [REG_R13] = "%r13d",
+    [REG_R14] = "%r14d", [REG_R15] = "%r15d", [REG_RSP] = "%esp",
+    [REG_RBP] = "%ebp",
+};
+static const char regs16[REG_RBP + 1][6] = {
+    [REG_RAX] = "%ax",   [REG_RBX] = "%bx",   [REG_RCX] = "%cx",
+    [REG_RDX] = "%dx",   [REG_RDI] = "%di",   [REG_RSI] = "%si",
+    [REG_R8] = "%r8w",   [REG_R9] = "%r9w",   [REG_R10] = "%r10w",
+    [REG_R11] = "%r11w", [REG_R12] = "%r12w", [REG_R13] = "%r13w",
+    [REG_R14] = "%r14w", [REG_R15] = "%r15w", [REG_RSP] = "%sp",
+    [REG_RBP] = "%bp",
+};
+static const char regs8[REG_RBP + 1][6] = {
+    [REG_RAX] = "%al",   [REG_RBX] = "%bl",   [REG_RCX] = "%cl",
+    [REG_RDX] = "%dl",   [REG_RDI] = "%dil",  [REG_RSI] = "%sil",
+    [REG_R8] = "%r8b",   [REG_R9] = "%r9b",   [REG_R10] = "%r10b",
+    [REG_R11] = "%r11b", [REG_R12] = "%r12b", [REG_R13] = "%r13b",
+    [REG_R14] = "%r14b", [REG_R15] = "%r15b", [REG_RSP] = "%spl",
+    [REG_RBP] = "%bpl",
+};
+
+// Number of the register in the ModRM/REX encoding
+static const u8 reg_encodings[REG_RBP + 1] = {
+    [REG_RAX] = 0,  [REG_RBX] = 3,  [REG_RCX] = 1,  [REG_RDX] = 2,
+    [REG_RDI] = 7,  [REG_RSI] = 6,  [REG_R8] = 8,   [REG_R9] = 9,
+    [REG_R10] = 10, [REG_R11] = 11, [REG_R12] = 12, [REG_R13] = 13,
+    [REG_R14] = 14, [REG_R15] = 15, [REG_RSP] = 4,  [REG_RBP] = 5,
+};
+
+typedef enum {
+    ASM_MOV,
+    ASM_MOVSX,  // Sign extend to 64 bits, size is the source size
+    ASM_MOVZX,  // Zero extend a byte to 32 (hence 64) bits
+    ASM_LEA,
+    ASM_ADD,
+    ASM_SUB,
+    ASM_IMUL,  // %rdx:%rax = %rax * src without a destination
+    ASM_SHL,
+    ASM_SAR,
+    ASM_SHR,
+    ASM_CMP,
+    ASM_IDIV,
+    ASM_CQO,
+    ASM_SETCC,
+    ASM_PUSH,
+    ASM_POP,
+    ASM_CALL,
+    ASM_JMP,
+    ASM_JCC,
+    ASM_RET,
+    ASM_COUNT,
+} mkt_asm_op_t;
+
+static const char mkt_asm_op_to_str[ASM_COUNT][6] = {
+    [ASM_MOV] = "mov",   [ASM_MOVSX] = "movs", [ASM_MOVZX] = "movzb",
+    [ASM_LEA] = "lea",   [ASM_ADD] = "add",    [ASM_SUB] = "sub",
+    [ASM_IMUL] = "imul", [ASM_SHL] = "shl",    [ASM_SAR] = "sar",
+    [ASM_SHR] = "shr",   [ASM_CMP] = "cmp",    [ASM_IDIV] = "idiv",
+    [ASM_CQO] = "cqo",   [ASM_SETCC] = "set",  [ASM_PUSH] = "push",
+    [ASM_POP] = "pop",   [ASM_CALL] = "call",  [ASM_JMP] = "jmp",
+    [ASM_JCC] = "j",     [ASM_RET] = "ret",
+};
+
+// Values are the condition field of `setcc` and `jcc`
+typedef enum {
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+} mkt_cc_t;
+
+static const char mkt_cc_to_str[16][3] = {
+    [CC_E] = "e",   [CC_NE] = "ne", [CC_L] = "l",
+    [CC_GE] = "ge", [CC_LE] = "le", [CC_G] = "g",
+};
+
+typedef enum {
+    OPD_NONE,
+    OPD_REG,
+    OPD_IMM,
+    OPD_MEM,  // Base register plus displacement, plus a scaled index for
+              // `lea`
+    OPD_SYM,  // Direct target of a call/jump, %rip-relative for `lea`
+} mkt_opd_kind_t;
+
+typedef struct {
+    mkt_opd_kind_t op_kind;
+    mkt_reg_t op_reg;    // OPD_REG, base of OPD_MEM
+    mkt_reg_t op_index;  // Index of OPD_MEM when op_scale is not 0
+    u8 op_scale;         // 0, or 1, 2, 4 or 8
+    i32 op_sym;
+    i64 op_imm;  // OPD_IMM, displacement of OPD_MEM
+} mkt_opd_t;
+
+typedef struct {
+    i32 sy_name /* Offset in as_names */,
+        sy_offset /* Offset in as_text, -1 while undefined */;
+    bool sy_global;
+} mkt_asm_sym_t;
+
+typedef enum {
+    FIX_PC32,
+    FIX_PLT32,
+    FIX_ABS64,
+} mkt_asm_fixup_kind_t;
+
+// A 32 bits %rip-relative field to patch with `symbol + addend - position`,
+// or for FIX_ABS64 a 64 bits field to patch with the address `symbol + addend`
+typedef struct {
+    mkt_asm_fixup_kind_t fi_kind;
+    i32 fi_offset, fi_sym, fi_addend;
+} mkt_asm_fixup_t;
+
+// Either prints textual assembly to `as_out`, or encodes machine code to
+// `as_text`. Fixups to symbols still undefined after `asm_resolve`, and
+// absolute ones, are left to the linker
+typedef struct {
+    bool as_is_text,
+        as_verbose;  // Comments and a `.loc` per instruction in textual
+                     // assembly, see -fverbose-asm
+    char* as_out;
+    u8* as_text;
+    char* as_names;
+    mkt_asm_sym_t* as_syms;
+    mkt_asm_fixup_t* as_fixups;
+} mkt_asm_t;
+
+static bool asm_is_text(const mkt_asm_t* as) { return as->as_is_text; }
+
+// Textual assembly is formatted by hand into `as_out`, written out at once
+// by `asm_write`
+static void asm_put(mkt_asm_t* as, const char* s, i32 len) {
+    const i32 size = buf_size(as->as_out), capacity = buf_capacity(as->as_out);
+    if (capacity - size < len)
+        buf_grow(as->as_out, len > capacity ? len + 4096 : capacity);
+
+    memcpy(as->as_out + size, s, len);
+    buf_ptr(as->as_out)->size += len;
+}
+
+static void asm_puts(mkt_asm_t* as, const char* s) {
+    asm_put(as, s, strlen(s));
+}
+
+static void asm_putc(mkt_asm_t* as, char c) { buf_push(as->as_out, c); }
+
+static void asm_put_i64(mkt_asm_t* as, i64 n) {
+    char digits[20];
+    i32 len = 0;
+    u64 u = n < 0 ? -(u64)n : (u64)n;
+    do {
+        digits[sizeof(digits) - 1 - len++] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    if (n < 0) asm_putc(as, '-');
+    asm_put(as, &digits[sizeof(digits) - len], len);
+}
+
+static mkt_res_t asm_write(const mkt_asm_t* as, i32 fd) {
+    const char* out = as->as_out;
+    size_t len = buf_size(as->as_out);
+    while (len > 0) {
+        const ssize_t written = write(fd, out, len);
+        if (written == -1 && errno == EINTR) continue;
+        if (written == -1) return RES_ERR;
+
+        out += written;
+        len -= written;
+    }
+    return RES_OK;
+}
+
+static mkt_opd_t opd_reg(mkt_reg_t reg) {
+    return (mkt_opd_t){.op_kind = OPD_REG, .op_reg = reg};
+}
+
+static mkt_opd_t opd_imm(i64 imm) {
+    return (mkt_opd_t){.op_kind = OPD_IMM, .op_imm = imm};
+}
+
+static mkt_opd_t opd_mem(mkt_reg_t base, i64 disp) {
+    CHECK(disp == (i32)disp, ==, true, "%d");
+    return (mkt_opd_t){.op_kind = OPD_MEM, .op_reg = base, .op_imm = disp};
+}
+
+// base + index * scale
+static mkt_opd_t opd_mem_index(mkt_reg_t base, mkt_reg_t index, u8 scale) {
+    CHECK(scale == 1 || scale == 2 || scale == 4 || scale == 8, ==, true,
+          "%d");
+    CHECK(index, !=, REG_RSP, "%d");  // Encodes `no index`
+    return (mkt_opd_t){.op_kind = OPD_MEM,
+                       .op_reg = base,
+                       .op_index = index,
+                       .op_scale = scale};
+}
+
+static mkt_opd_t opd_sym(i32 sym) {
+    return (mkt_opd_t){.op_kind = OPD_SYM, .op_sym = sym};
+}
+
+static const char* asm_sym_name(const mkt_asm_t* as, i32 sym) {
+    CHECK(sym, >=, 0, "%d");
+    CHECK(sym, <, (i32)buf_size(as->as_syms), "%d");
+    return &as->as_names[as->as_syms[sym].sy_name];
+}
+
+#if defined(__clang__) || defined(__GNUC__) || defined(__GNUG__)
+__attribute__((format(printf, 2, 3)))
+#endif
+static i32
+asm_sym_make(mkt_asm_t* as, const char* fmt, ...) {
+    CHECK((void*)as, !=, NULL, "%p");
+
+    char name[256] = "";
+    va_list ap;
+    va_start(ap, fmt);
+    const i32 name_len = vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+    CHECK(name_len, <, (i32)sizeof(name), "%d");
+
+    const mkt_asm_sym_t sym = {.sy_name = buf_size(as->as_names),
+                               .sy_offset = -1};
+    for (i32 i = 0; i <= name_len; i++) buf_push(as->as_names, name[i]);
+    buf_push(as->as_syms, sym);
+    return buf_size(as->as_syms) - 1;
+}
+
+static void asm_sym_global(mkt_asm_t* as, i32 sym) {
+    as->as_syms[sym].sy_global = true;
+    if (asm_is_text(as)) {
+        asm_puts(as, ".global ");
+        asm_puts(as, asm_sym_name(as, sym));
+        asm_putc(as, '\n');
+    }
+}
+
+// Define the symbol at the current position
+static void asm_sym_here(mkt_asm_t* as, i32 sym) {
+    CHECK(as->as_syms[sym].sy_offset, ==, -1, "%d");
+
+    if (asm_is_text(as)) {
+        asm_puts(as, asm_sym_name(as, sym));
+        asm_put(as, ":\n", 2);
+    } else
+        as->as_syms[sym].sy_offset = buf_size(as->as_text);
+}
+
+static const char* asm_reg_name(mkt_reg_t reg, u8 size) {
+    switch (size) {
+        case 1:
+            return regs8[reg];
+        case 2:
+            return regs16[reg];
+        case 4:
+            return regs32[reg];
+        case 8:
+            return regs[reg];
+        default:
+            UNREACHABLE();
+    }
+}
+
+static char asm_size_suffix(u8 size) {
+    switch (size) {
+        case 1:
+            return 'b';
+        case 2:
+            return 'w';
+        case 4:
+            return 'l';
+        case 8:
+            return 'q';
+        default:
+            UNREACHABLE();
+    }
+}
+
+static void asm_print_opd(mkt_asm_t* as, mkt_asm_op_t op, mkt_opd_t opd,
+                          u8 size) {
+    switch (opd.op_kind) {
+        case OPD_REG:
+            if (op == ASM_CALL) asm_putc(as, '*');
+            asm_puts(as, asm_reg_name(opd.op_reg, size));
+            return;
+        case OPD_IMM:
+            asm_putc(as, '$');
+            asm_put_i64(as, opd.op_imm);
+            return;
+        case OPD_MEM:
+            asm_put_i64(as, opd.op_imm);
+            asm_putc(as, '(');
+            asm_puts(as, regs[opd.op_reg]);
+            if (opd.op_scale != 0) {
+                asm_putc(as, ',');
+                asm_puts(as, regs[opd.op_index]);
+                asm_putc(as, ',');
+                asm_put_i64(as, opd.op_scale);
+            }
+            asm_putc(as, ')');
+            return;
+        case OPD_SYM:
+            asm_puts(as, asm_sym_name(as, opd.op_sym));
+            if (op == ASM_LEA) asm_puts(as, "(%rip)");
+            return;
+        default:
+            UNREACHABLE();
+    }
+}
+
+static void asm_print(mkt_asm_t* as, mkt_asm_op_t op, mkt_cc_t cc, u8 size,
+                      mkt_opd_t src, mkt_opd_t dst) {
+    asm_puts(as, mkt_asm_op_to_str[op]);
+
+    u8 src_size = size, dst_size = size;
+    switch (op) {
+        case ASM_MOVSX:
+            asm_putc(as, asm_size_suffix(size));
+            asm_putc(as, 'q');
+            dst_size = 8;
+            break;
+        case ASM_MOVZX:
+            asm_putc(as, 'l');
+            dst_size = 4;
+            break;
+        case ASM_SETCC:
+        case ASM_JCC:
+            asm_puts(as, mkt_cc_to_str[cc]);
+            break;
+        case ASM_CQO:
+        case ASM_CALL:
+        case ASM_JMP:
+        case ASM_RET:
+            break;
+        default:
+            asm_putc(as, asm_size_suffix(size));
+    }
+
+    if (src.op_kind != OPD_NONE) {
+        asm_putc(as, ' ');
+        asm_print_opd(as, op, src, src_size);
+    }
+    if (dst.op_kind != OPD_NONE) {
+        asm_puts(as, src.op_kind != OPD_NONE ? ", " : " ");
+        asm_print_opd(as, op, dst, dst_size);
+    }
+    asm_putc(as, '\n');
+}
+
+static void asm_u8(mkt_asm_t* as, u8 byte) { buf_push(as->as_text, byte); }
+
+static void asm_u32(mkt_asm_t* as, u32 n) {
+    for (i32 i = 0; i < 4; i++) asm_u8(as, (n >> (8 * i)) & 0xff);
+}
+
+static void asm_u64(mkt_asm_t* as, u64 n) {
+    for (i32 i = 0; i < 8; i++) asm_u8(as, (n >> (8 * i)) & 0xff);
+}
+
+static void asm_imm(mkt_asm_t* as, i64 imm, u8 size) {
+    if (size == 1)
+        asm_u8(as, imm);
+    else if (size == 2) {
+        asm_u8(as, imm & 0xff);
+        asm_u8(as, (imm >> 8) & 0xff);
+    } else
+        asm_u32(as, imm);
+}
+
+static void asm_rel32(mkt_asm_t* as, mkt_asm_fixup_kind_t kind, i32 sym,
+                      i32 addend) {
+    const mkt_asm_fixup_t fixup = {.fi_kind = kind,
+                                   .fi_offset = buf_size(as->as_text),
+                                   .fi_sym = sym,
+                                   .fi_addend = addend};
+    buf_push(as->as_fixups, fixup);
+    asm_u32(as, 0);
+}
+
+static bool asm_is_i8(i64 n) { return n == (i8)n; }
+
+// Data following the code: in its own section for textual assembly,
+// appended to `as_text` otherwise
+static void asm_data_begin(mkt_asm_t* as, const char* section) {
+    CHECK((void*)section, !=, NULL, "%p");
+
+    if (!asm_is_text(as)) return;
+
+    asm_puts(as, ".section ");
+    asm_puts(as, section);
+    asm_putc(as, '\n');
+}
+
+// Pad to a multiple of `alignment`, a power of two
+static void asm_align(mkt_asm_t* as, u8 alignment) {
+    CHECK(alignment & (alignment - 1), ==, 0, "%d");
+
+    if (asm_is_text(as)) {
+        asm_puts(as, ".p2align ");
+        asm_put_i64(as, __builtin_ctz(alignment));
+        asm_putc(as, '\n');
+        return;
+    }
+    while (buf_size(as->as_text) % alignment != 0)
+        asm_u8(as, 0xcc /* int3 */);
+}
+
+static void asm_bytes(mkt_asm_t* as, const char* bytes, i32 len) {
+    CHECK((void*)bytes, !=, NULL, "%p");
+    CHECK(len, >=, 0, "%d");
+
+    if (!asm_is_text(as)) {
+        for (i32 i = 0; i < len; i++) asm_u8(as, bytes[i]);
+        return;
+    }
+
+    asm_puts(as, ".ascii \"");
+    for (i32 i = 0; i < len; i++) {
+        const u8 c = bytes[i];
+        if (c == '"' || c == '\\') {
+            asm_putc(as, '\\');
+            asm_putc(as, c);
+        } else if (c >= ' ' && c <= '~')
+            asm_putc(as, c);
+        else {
+            const char octal[4] = {'\\', '0' + (c >> 6), '0' + ((c >> 3) & 7),
+                                   '0' + (c & 7)};
+            asm_put(as, octal, sizeof(octal));
+        }
+    }
+    asm_put(as, "\"\n", 2);
+}
+
+// 64 bits of data: an immediate or the address of a symbol
+static void asm_quad(mkt_asm_t* as, mkt_opd_t opd) {
+    CHECK(opd.op_kind == OPD_IMM || opd.op_kind == OPD_SYM, ==, true, "%d");
+
+    if (asm_is_text(as)) {
+        asm_puts(as, ".quad ");
+        if (opd.op_kind == OPD_IMM)
+            asm_put_i64(as, opd.op_imm);
+        else
+            asm_puts(as, asm_sym_name(as, opd.op_sym));
+        asm_putc(as, '\n');
+        return;
+    }
+
+    if (opd.op_kind == OPD_IMM) {
+        asm_u64(as, opd.op_imm);
+        return;
+    }
+    const mkt_asm_fixup_t fixup = {.fi_kind = FIX_ABS64,
+                                   .fi_offset = buf_size(as->as_text),
+                                   .fi_sym = opd.op_sym};
+    buf_push(as->as_fixups, fixup);
+    asm_u64(as, 0);
+}
+
+// Optional operand size prefix, REX prefix, opcode, then the ModRM byte with
+// `reg` (a register encoding or an opcode extension) and `rm`. `imm_len` is
+// the size of an immediate following the instruction, needed for
+// %rip-relative addressing
+static void asm_encode_rm(mkt_asm_t* as, u8 size, const u8* opcode,
+                          i32 opcode_len, u8 reg, bool reg_is_byte,
+                          mkt_opd_t rm, bool rm_is_byte, i32 imm_len) {
+    if (size == 2) asm_u8(as, 0x66);
+
+    const u8 base = (rm.op_kind == OPD_REG || rm.op_kind == OPD_MEM)
+                        ? reg_encodings[rm.op_reg]
+                        : 0;
+    const u8 index = (rm.op_kind == OPD_MEM && rm.op_scale != 0)
+                         ? reg_encodings[rm.op_index]
+                         : 0;
+    const u8 rex = 0x40 | ((size == 8) << 3) | ((reg >> 3) << 2) |
+                   ((index >> 3) << 1) | (base >> 3);
+    // Without REX, byte registers 4 to 7 are %ah, %ch, %dh, %bh
+    const bool needs_rex =
+        rex != 0x40 || (reg_is_byte && reg >= 4 && reg <= 7) ||
+        (rm_is_byte && rm.op_kind == OPD_REG && base >= 4 && base <= 7);
+    if (needs_rex) asm_u8(as, rex);
+
+    for (i32 i = 0; i < opcode_len; i++) asm_u8(as, opcode[i]);
+
+    const u8 modrm_reg = (reg & 7) << 3;
+    switch (rm.op_kind) {
+        case OPD_REG:
+            asm_u8(as, 0xc0 | modrm_reg | (base & 7));
+            return;
+        case OPD_SYM:
+            asm_u8(as, 0x05 | modrm_reg);
+            asm_rel32(as, FIX_PC32, rm.op_sym, -4 - imm_len);
+            return;
+        case OPD_MEM: {
+            // %rbp and %r13 have no encoding without displacement
+            const u8 mod = (rm.op_imm == 0 && (base & 7) != 5) ? 0x00
+                           : asm_is_i8(rm.op_imm)               ? 0x40
+                                                                : 0x80;
+            if (rm.op_scale != 0) {
+                // SIB byte: scale, index and base
+                asm_u8(as, mod | modrm_reg | 4);
+                asm_u8(as, (__builtin_ctz(rm.op_scale) << 6) |
+                               ((index & 7) << 3) | (base & 7));
+            } else {
+                asm_u8(as, mod | modrm_reg | (base & 7));
+                // %rsp and %r12 as a base need a SIB byte
+                if ((base & 7) == 4) asm_u8(as, 0x24);
+            }
+            if (mod == 0x40)
+                asm_u8(as, rm.op_imm);
+            else if (mod == 0x80)
+                asm_u32(as, rm.op_imm);
+            return;
+        }
+        default:
+            UNREACHABLE();
+    }
+}
+
+static void asm_encode_mov(mkt_asm_t* as, u8 size, mkt_opd_t src,
+                           mkt_opd_t dst) {
+    const bool byte = size == 1;
+
+    if (src.op_kind == OPD_REG) {
+        const u8 opcode = byte ? 0x88 : 0x89;
+        asm_encode_rm(as, size, &opcode, 1, reg_encodings[src.op_reg], byte,
+                      dst, byte, 0);
+    } else if (src.op_kind == OPD_MEM) {
+        CHECK(dst.op_kind, ==, OPD_REG, "%d");
+        const u8 opcode = byte ? 0x8a : 0x8b;
+        asm_encode_rm(as, size, &opcode, 1, reg_encodings[dst.op_reg], byte,
+                      src, byte, 0);
+    } else if (dst.op_kind == OPD_REG &&
+               (size != 8 || src.op_imm != (i32)src.op_imm)) {
+        // `mov $imm, %reg` with the register in the opcode
+        const u8 reg = reg_encodings[dst.op_reg];
+        if (size == 2) asm_u8(as, 0x66);
+        if (size == 8 || reg >= 8 || (byte && reg >= 4))
+            asm_u8(as, 0x40 | ((size == 8) << 3) | (reg >> 3));
+        asm_u8(as, (byte ? 0xb0 : 0xb8) + (reg & 7));
+        if (size == 8)
+            asm_u64(as, src.op_imm);
+        else
+            asm_imm(as, src.op_imm, size);
+    } else {
+        // Sign extended 32 bits immediate for 64 bits
+        CHECK(src.op_kind, ==, OPD_IMM, "%d");
+        CHECK(src.op_imm == (i32)src.op_imm, ==, true, "%d");
+        const u8 opcode = byte ? 0xc6 : 0xc7;
+        const i32 imm_len = MIN(size, 4);
+        asm_encode_rm(as, size, &opcode, 1, 0, false, dst, byte, imm_len);
+        asm_imm(as, src.op_imm, size);
+    }
+}
+
+// add, sub, cmp: `digit` is the opcode extension of the immediate forms and
+// `base` the opcode of the 8 bits `r/m <- reg` form
+static void asm_encode_alu(mkt_asm_t* as, u8 size, u8 digit, u8 base,
+                           mkt_opd_t src, mkt_opd_t dst) {
+    const bool byte = size == 1;
+
+    if (src.op_kind == OPD_REG) {
+        const u8 opcode = base + !byte;
+        asm_encode_rm(as, size, &opcode, 1, reg_encodings[src.op_reg], byte,
+                      dst, byte, 0);
+    } else if (src.op_kind == OPD_MEM) {
+        CHECK(dst.op_kind, ==, OPD_REG, "%d");
+        const u8 opcode = base + 2 + !byte;
+        asm_encode_rm(as, size, &opcode, 1, reg_encodings[dst.op_reg], byte,
+                      src, byte, 0);
+    } else {
+        CHECK(src.op_kind, ==, OPD_IMM, "%d");
+        CHECK(src.op_imm == (i32)src.op_imm, ==, true, "%d");
+        const bool imm8 = byte || asm_is_i8(src.op_imm);
+        const u8 opcode = byte ? 0x80 : imm8 ? 0x83 : 0x81;
+        const i32 imm_len = imm8 ? 1 : MIN(size, 4);
+        asm_encode_rm(as, size, &opcode, 1, digit, false, dst, byte, imm_len);
+        asm_imm(as, src.op_imm, imm_len);
+    }
+}
+
+static void asm_encode(mkt_asm_t* as, mkt_asm_op_t op, mkt_cc_t cc, u8 size,
+                       mkt_opd_t src, mkt_opd_t dst) {
+    switch (op) {
+        case ASM_MOV:
+            asm_encode_mov(as, size, src, dst);
+            return;
+        case ASM_MOVSX: {
+            const u8 opcode[2] = {0x0f, size == 1 ? 0xbe : 0xbf};
+            if (size == 4)
+                asm_encode_rm(as, 8, (const u8[]){0x63}, 1,
+                              reg_encodings[dst.op_reg], false, src, false, 0);
+            else
+                asm_encode_rm(as, 8, opcode, 2, reg_encodings[dst.op_reg],
+                              false, src, size == 1, 0);
+            return;
+        }
+        case ASM_MOVZX:
+            asm_encode_rm(as, 4, (const u8[]){0x0f, 0xb6}, 2,
+                          reg_encodings[dst.op_reg], false, src, true, 0);
+            return;
+        case ASM_LEA:
+            asm_encode_rm(as, 8, (const u8[]){0x8d}, 1,
+                          reg_encodings[dst.op_reg], false, src, false, 0);
+            return;
+        case ASM_ADD:
+            asm_encode_alu(as, size, 0, 0x00, src, dst);
+            return;
+        case ASM_SUB:
+            asm_encode_alu(as, size, 5, 0x28, src, dst);
+            return;
+        case ASM_CMP:
+            asm_encode_alu(as, size, 7, 0x38, src, dst);
+            return;
+        case ASM_IMUL:
+            if (dst.op_kind == OPD_NONE)
+                asm_encode_rm(as, size, (const u8[]){0xf7}, 1, 5, false, src,
+                              false, 0);
+            else if (src.op_kind == OPD_IMM) {
+                const bool imm8 = asm_is_i8(src.op_imm);
+                const u8 opcode = imm8 ? 0x6b : 0x69;
+                asm_encode_rm(as, size, &opcode, 1, reg_encodings[dst.op_reg],
+                              false, dst, false, 0);
+                asm_imm(as, src.op_imm, imm8 ? 1 : MIN(size, 4));
+            } else
+                asm_encode_rm(as, size, (const u8[]){0x0f, 0xaf}, 2,
+                              reg_encodings[dst.op_reg], false, src, false, 0);
+            return;
+        case ASM_SHL:
+        case ASM_SAR:
+        case ASM_SHR: {
+            // By an immediate only
+            CHECK(src.op_kind, ==, OPD_IMM, "%d");
+            const u8 digit = op == ASM_SHL ? 4 : op == ASM_SAR ? 7 : 5;
+            if (src.op_imm == 1) {
+                asm_encode_rm(as, size, (const u8[]){0xd1}, 1, digit, false,
+                              dst, false, 0);
+                return;
+            }
+            asm_encode_rm(as, size, (const u8[]){0xc1}, 1, digit, false, dst,
+                          false, 1);
+            asm_u8(as, src.op_imm);
+            return;
+        }
+        case ASM_IDIV:
+            asm_encode_rm(as, size, (const u8[]){0xf7}, 1, 7, false, src,
+                          false, 0);
+            return;
+        case ASM_CQO:
+            asm_u8(as, 0x48);
+            asm_u8(as, 0x99);
+            return;
+        case ASM_SETCC:
+            asm_encode_rm(as, 1, (const u8[]){0x0f, 0x90 + cc}, 2, 0, false,
+                          dst, true, 0);
+            return;
+        case ASM_PUSH:
+        case ASM_POP: {
+            const u8 reg = reg_encodings[src.op_reg];
+            if (reg >= 8) asm_u8(as, 0x41);
+            asm_u8(as, (op == ASM_PUSH ? 0x50 : 0x58) + (reg & 7));
+            return;
+        }
+        case ASM_CALL:
+            if (src.op_kind == OPD_REG) {
+                // 64 bits by default, no REX.W
+                asm_encode_rm(as, 4, (const u8[]){0xff}, 1, 2, false, src,
+                              false, 0);
+                return;
+            }
+            asm_u8(as, 0xe8);
+            asm_rel32(as, FIX_PLT32, src.op_sym, -4);
+            return;
+        case ASM_JMP:
+            asm_u8(as, 0xe9);
+            asm_rel32(as, FIX_PC32, src.op_sym, -4);
+            return;
+        case ASM_JCC:
+            asm_u8(as, 0x0f);
+            asm_u8(as, 0x80 + cc);
+            asm_rel32(as, FIX_PC32, src.op_sym, -4);
+            return;
+        case ASM_RET:
+            asm_u8(as, 0xc3);
+            return;
+        default:
+            UNREACHABLE();
+    }
+}
+
+static void asm_ins(mkt_asm_t* as, mkt_asm_op_t op, mkt_cc_t cc, u8 size,
+                    mkt_opd_t src, mkt_opd_t dst) {
+    CHECK((void*)as, !=, NULL, "%p");
+    CHECK(size == 1 || size == 2 || size == 4 || size == 8, ==, true, "%d");
+
+    if (asm_is_text(as))
+        asm_print(as, op, cc, size, src, dst);
+    else
+        asm_encode(as, op, cc, size, src, dst);
+}
+
+static void asm_op0(mkt_asm_t* as, mkt_asm_op_t op) {
+    asm_ins(as, op, 0, 8, (mkt_opd_t){0}, (mkt_opd_t){0});
+}
+
+static void asm_op1(mkt_asm_t* as, mkt_asm_op_t op, u8 size, mkt_opd_t opd) {
+    asm_ins(as, op, 0, size, opd, (mkt_opd_t){0});
+}
+
+static void asm_op2(mkt_asm_t* as, mkt_asm_op_t op, u8 size, mkt_opd_t src,
+                    mkt_opd_t dst) {
+    asm_ins(as, op, 0, size, src, dst);
+}
+
+static void asm_setcc(mkt_asm_t* as, mkt_cc_t cc, mkt_reg_t reg) {
+    asm_ins(as, ASM_SETCC, cc, 1, (mkt_opd_t){0}, opd_reg(reg));
+}
+
+static void asm_jcc(mkt_asm_t* as, mkt_cc_t cc, i32 sym) {
+    asm_ins(as, ASM_JCC, cc, 8, opd_sym(sym), (mkt_opd_t){0});
+}
+
+// Patch the fixups to defined symbols and keep the others for the linker
+static void asm_resolve(mkt_asm_t* as) {
+    CHECK((void*)as, !=, NULL, "%p");
+
+    i32 unresolved_len = 0;
+    for (i32 i = 0; i < (i32)buf_size(as->as_fixups); i++) {
+        const mkt_asm_fixup_t fixup = as->as_fixups[i];
+        const i32 target = as->as_syms[fixup.fi_sym].sy_offset;
+        if (target == -1 || fixup.fi_kind == FIX_ABS64) {
+            as->as_fixups[unresolved_len++] = fixup;
+            continue;
+        }
+
+        const i32 rel = target + fixup.fi_addend - fixup.fi_offset;
+        for (i32 b = 0; b < 4; b++)
+            as->as_text[fixup.fi_offset + b] = (rel >> (8 * b)) & 0xff;
+    }
+    if (as->as_fixups != NULL) buf_ptr(as->as_fixups)->size = unresolved_len;
+}
+
+static void asm_free(mkt_asm_t* as) {
+    buf_free(as->as_out);
+    buf_free(as->as_text);
+    buf_free(as->as_names);
+    buf_free(as->as_syms);
+    buf_free(as->as_fixups);
+}
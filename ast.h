@@ -60,6 +60,8 @@ typedef enum {
     NODE_EQ,
     NODE_NEQ,
     NODE_NOT,
+    NODE_AND,
+    NODE_OR,
     NODE_IF,
     NODE_BLOCK,
     NODE_VAR,
@@ -90,6 +92,8 @@ static const char mkt_node_kind_to_str[NODE_COUNT][30] = {
     [NODE_EQ] = "Eq",
     [NODE_NEQ] = "Neq",
     [NODE_NOT] = "Not",
+    [NODE_AND] = "And",
+    [NODE_OR] = "Or",
     [NODE_IF] = "If",
     [NODE_BLOCK] = "Block",
     [NODE_VAR] = "Var",
@@ -113,9 +117,15 @@ typedef struct {
         if_node_else_i;
 } mkt_if_t;
 
+// Entry of the declarations hash table of a scope
+typedef struct {
+    i32 de_sym /* Interned name, -1 when empty */, de_node_i;
+} mkt_decl_t;
+
 typedef struct {
     i32 bl_first_tok_i, bl_last_tok_i, *bl_nodes_i, bl_parent_scope_i,
-        *bl_decls;
+        bl_decls_len;
+    mkt_decl_t* bl_decls;  // Open addressing, the capacity is a power of two
 } mkt_block_t;
 
 static const u16 MKT_VAR_FLAGS_VAL = 0x1;
@@ -172,7 +182,7 @@ typedef struct {
         mkt_string_t no_string;                    // NODE_STRING
         mkt_number_t no_num;                       // NODE_NUM, NODE_CHAR
         mkt_binary_t no_binary;  // NODE_ADD, NODE_SUBTRACT, NODE_MULTIPLY,
-        // NODE_DIVIDE, NODE_MODULO, NODE_MEMBER
+        // NODE_DIVIDE, NODE_MODULO, NODE_MEMBER, NODE_AND, NODE_OR
         mkt_unary_t no_unary;        // NODE_NOT
         mkt_if_t no_if;              // NODE_IF
         mkt_block_t no_block;        // NODE_BLOCK
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "parse.h"
+
+#define RUNS 5
+
+static u64 now_ns() {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 * 1000 * 1000 + (u64)ts.tv_nsec;
+}
+
+// Run the command with stdout discarded and measure the wall clock time
+static mkt_res_t proc_time(char* const argv[], u64* elapsed_ns) {
+    CHECK((void*)argv, !=, NULL, "%p");
+    CHECK((void*)elapsed_ns, !=, NULL, "%p");
+
+    const char* const exe_name = argv[0];
+    const u64 start = now_ns();
+    const pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "Error forking: errno=%d err=%s\n", errno,
+                strerror(errno));
+        return RES_ERR;
+    }
+    if (pid == 0) {
+        const int dev_null = open("/dev/null", O_WRONLY);
+        if (dev_null != -1) dup2(dev_null, 1);
+        execv(exe_name, argv);
+        _exit(127);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) {
+        fprintf(stderr, "Error waiting for `%s`: errno=%d err=%s\n", exe_name,
+                errno, strerror(errno));
+        return RES_ERR;
+    }
+    *elapsed_ns = now_ns() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s✘ %s:%s status=%d\n", mkt_colors[is_tty][COL_RED],
+                exe_name, mkt_colors[is_tty][COL_RESET], status);
+        return RES_ERR;
+    }
+
+    return RES_OK;
+}
+
+static int u64_cmp(const void* a, const void* b) {
+    const u64 x = *(const u64*)a, y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+static mkt_res_t bench_run(const char* name, char* const argv[]) {
+    u64 runs[RUNS] = {0};
+    for (i32 i = 0; i < RUNS; i++)
+        if (proc_time(argv, &runs[i]) != RES_OK) return RES_ERR;
+
+    qsort(runs, RUNS, sizeof(runs[0]), u64_cmp);
+    fprintf(stderr, "%s| %s%s min=%.2fms median=%.2fms\n",
+            mkt_colors[is_tty][COL_GRAY], name,
+            mkt_colors[is_tty][COL_RESET], runs[0] / 1e6,
+            runs[RUNS / 2] / 1e6);
+
+    return RES_OK;
+}
+
+// Many top level declarations, each referring to the previous one, to
+// measure name resolution in the compiler
+static mkt_res_t bench_write_decls(const char* file_name, i32 count) {
+    FILE* const file = fopen(file_name, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening `%s`: errno=%d err=%s\n", file_name,
+                errno, strerror(errno));
+        return RES_ERR;
+    }
+
+    fprintf(file, "fun f0(): Int { return 0 }\n");
+    for (i32 i = 1; i < count; i++)
+        fprintf(file, "fun f%d(): Int { return f%d() }\n", i, i - 1);
+    fprintf(file, "fun main() { println(f%d()) }\n", count - 1);
+
+    fclose(file);
+    return RES_OK;
+}
+
+static mkt_res_t bench_compile_decls() {
+    char file_name[] = "/tmp/mkt_bench_decls.kt";
+    if (bench_write_decls(file_name, 100 * 1000) != RES_OK) return RES_ERR;
+
+    // Skip the external assembler and linker which would dominate
+#if defined(__linux__) && defined(__x86_64__)
+    char* const argv[] = {"./mktc", "-fdirect-elf", file_name, NULL};
+#else
+    char* const argv[] = {"./mktc", file_name, NULL};
+#endif
+    const mkt_res_t res = bench_run("compile 100k declarations", argv);
+
+    unlink(file_name);
+    unlink("/tmp/mkt_bench_decls.exe");
+    return res;
+}
+
+// `header`, then `count` times `snippet`, then `footer`
+static char* bench_corpus(const char* header, const char* snippet, i32 count,
+                          const char* footer) {
+    const i32 header_len = strlen(header), snippet_len = strlen(snippet),
+              footer_len = strlen(footer);
+
+    char* source = NULL;
+    buf_grow(source, header_len + snippet_len * count + footer_len);
+    for (i32 j = 0; j < header_len; j++) buf_push(source, header[j]);
+    for (i32 i = 0; i < count; i++)
+        for (i32 j = 0; j < snippet_len; j++) buf_push(source, snippet[j]);
+    for (i32 j = 0; j < footer_len; j++) buf_push(source, footer[j]);
+
+    return source;
+}
+
+static void bench_report_throughput(const char* name, i32 source_len,
+                                    u64* runs) {
+    qsort(runs, RUNS, sizeof(runs[0]), u64_cmp);
+    fprintf(stderr, "%s| %s%s %.1fMB: max=%.1fMB/s median=%.1fMB/s\n",
+            mkt_colors[is_tty][COL_GRAY], name,
+            mkt_colors[is_tty][COL_RESET], source_len / 1e6,
+            source_len / 1e6 / (runs[0] / 1e9),
+            source_len / 1e6 / (runs[RUNS / 2] / 1e9));
+}
+
+// In-process, on a large generated corpus mixing the usual kinds of tokens
+static mkt_res_t bench_lex() {
+    static const char snippet[] =
+        "// Computes the sum of the squares, the slow way\n"
+        "fun sum_of_squares_up_to(upper_bound: Long): Long {\n"
+        "    var accumulator: Long = 0L\n"
+        "    var i: Long = 0L\n"
+        "    while (i <= upper_bound) {\n"
+        "        accumulator = accumulator + i * i\n"
+        "        i = i + 1L\n"
+        "    }\n"
+        "    if (accumulator != 0L && upper_bound > 1L) {\n"
+        "        println(\"the sum of the squares is not zero\")\n"
+        "    }\n"
+        "    return accumulator\n"
+        "}\n\n";
+    char* source = bench_corpus("", snippet, 64 * 1024, "");
+    const i32 source_len = buf_size(source);
+
+    u64 runs[RUNS] = {0};
+    for (i32 i = 0; i < RUNS; i++) {
+        mkt_lexer_t lexer = {0};
+        const u64 start = now_ns();
+        const mkt_res_t res = lex_init("bench.kt", source, source_len, &lexer);
+        runs[i] = now_ns() - start;
+
+        buf_free(lexer.lex_tokens);
+        buf_free(lexer.lex_line_starts);
+        if (res != RES_OK) {
+            buf_free(source);
+            return RES_ERR;
+        }
+    }
+    buf_free(source);
+
+    bench_report_throughput("lex", source_len, runs);
+
+    return RES_OK;
+}
+
+// In-process, lexing included, on one long function made of expressions of
+// every precedence level
+static mkt_res_t bench_parse() {
+    static const char header[] =
+        "fun main() {\n"
+        "    var a: Long = 3L\n"
+        "    var b: Long = 4L\n"
+        "    var ok: Boolean = true\n";
+    static const char snippet[] =
+        "    a = a + b * (a - 1L) % 7L\n"
+        "    ok = a < b == !ok || a >= 2L && b != a\n"
+        "    println(a * a + b / 2L)\n";
+    char* source = bench_corpus(header, snippet, 16 * 1024, "}\n");
+    const i32 source_len = buf_size(source);
+
+    u64 runs[RUNS] = {0};
+    for (i32 i = 0; i < RUNS; i++) {
+        parser_t parser = {0};
+        const u64 start = now_ns();
+        mkt_res_t res = parser_init("bench.kt", source, source_len, &parser);
+        if (res == RES_OK) res = parser_parse(&parser);
+        runs[i] = now_ns() - start;
+
+        // Like the compiler, leave the per node allocations alone
+        buf_free(parser.par_nodes);
+        buf_free(parser.par_types);
+        buf_free(parser.par_tok_syms);
+        buf_free(parser.par_lexer.lex_tokens);
+        buf_free(parser.par_lexer.lex_line_starts);
+        if (res != RES_OK) {
+            buf_free(source);
+            return RES_ERR;
+        }
+    }
+    buf_free(source);
+
+    bench_report_throughput("parse", source_len, runs);
+
+    return RES_OK;
+}
+
+i32 main() {
+    is_tty = isatty(2);
+
+    // Compute-heavy programs, to measure the generated code
+    const char benches[][MAXPATHLEN] = {
+        "./tests/arith_loop.exe",
+        "./tests/fibo_iter.exe",
+        "./tests/fibonacci_rec.exe",
+    };
+
+    bool failed = false;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        char* const argv[] = {(char*)benches[i], NULL};
+        if (bench_run(benches[i], argv) != RES_OK) failed = true;
+    }
+
+    // Compiler throughput
+    if (bench_lex() != RES_OK) failed = true;
+    if (bench_parse() != RES_OK) failed = true;
+    if (bench_compile_decls() != RES_OK) failed = true;
+
+    return failed;
+}
@@ -23,6 +23,8 @@
  *         printf("values[%zu] = %f\n", i, values[i]);
  *     buf_free(values);
  */
+#pragma once
+
 #include <stddef.h>
 #include <stdlib.h>
 
@@ -1,756 +1,968 @@
 #pragma once
 
 #include "ast.h"
+#include "ir.h"
 #include "parse.h"
+#include "regalloc.h"
 
 #ifdef __APPLE__
 #define MKT_PUB_PREFIX "_"
+#define MKT_RODATA_SECTION "__TEXT,__const"
+#define MKT_STACK_MAPS_SECTION "__DATA,__mkt_stack_maps"
 #else
 #define MKT_PUB_PREFIX ""
+#define MKT_RODATA_SECTION ".rodata"
+#define MKT_STACK_MAPS_SECTION ".mkt_stack_maps,\"aw\""
 #endif
 
-static FILE* output_file = NULL;
+// See runtime_val_header in mkt_stdlib.c
+#define RV_TAG_STRING 0x02
+#define RV_TAG_IMMORTAL 0x08
+#define RV_TAG_SHIFT 56
 
-static const char regs[14][5] = {
-    [0] = "%rax",  [1] = "%rbx",  [2] = "%rcx",  [3] = "%rdx",  [4] = "%rdi",
-    [5] = "%rsi",  [6] = "%r8",   [7] = "%r9",   [8] = "%r10",  [9] = "%r11",
-    [10] = "%r12", [11] = "%r13", [12] = "%r14", [13] = "%r15",
-};
-static const char fn_args[6][5] = {
-    [0] = "%rdi", [1] = "%rsi", [2] = "%rdx",
-    [3] = "%rcx", [4] = "%r8",  [5] = "%r9",
+static mkt_asm_t* output_asm = NULL;
+
+static const mkt_reg_t fn_args[6] = {
+    [0] = REG_RDI, [1] = REG_RSI, [2] = REG_RDX,
+    [3] = REG_RCX, [4] = REG_R8,  [5] = REG_R9,
 };
 
 static u32 stack_size = 0;
 
-static void emit_stmt(const parser_t* parser, i32 stmt_i);
+// Symbols: node -> function, node -> string literal, runtime functions, and
+// the current function's blocks and epilog
+static i32 *fn_syms = NULL, *string_syms = NULL, *bb_syms = NULL,
+           rt_syms[RT_COUNT] = {0},
+           init_sym = -1, flush_sym = -1, return_sym = -1,
+           stack_maps_sym = -1;
 
-#if defined(__clang__) || defined(__GNUC__) || defined(__GNUG__)
-__attribute__((format(printf, 1, 2)))
-#endif
-static void
-println(char* fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(output_file, fmt, ap);
-    va_end(ap);
-    fprintf(output_file, "\n");
-}
-
-static void emit_push(const char* reg) {
-    CHECK((void*)reg, !=, NULL, "%p");
-    println("push %s", reg);
+// Call sites with GC references live across them, see emit_stack_maps
+typedef struct {
+    i32 sm_ret_sym, sm_roots_i, sm_roots_len;
+} stack_map_t;
+
+static stack_map_t* stack_maps = NULL;
+static i32* stack_map_roots = NULL;  // Offsets from %rbp
+
+// Directives, only meaningful for textual assembly
+static void emit_directive(const char* directive) {
+    if (!asm_is_text(output_asm)) return;
+
+    asm_puts(output_asm, directive);
+    asm_putc(output_asm, '\n');
+}
+
+// Comments, only with -fverbose-asm
+static void emit_comment(const char* comment) {
+    if (!asm_is_text(output_asm) || !output_asm->as_verbose) return;
+
+    asm_put(output_asm, "# ", 2);
+    emit_directive(comment);
+}
+
+static void emit_op0(mkt_asm_op_t op) { asm_op0(output_asm, op); }
+
+static void emit_op1(mkt_asm_op_t op, mkt_opd_t opd) {
+    asm_op1(output_asm, op, 8, opd);
+}
+
+static void emit_op2(mkt_asm_op_t op, u8 size, mkt_opd_t src, mkt_opd_t dst) {
+    asm_op2(output_asm, op, size, src, dst);
+}
+
+static void emit_push(mkt_reg_t reg) {
+    emit_op1(ASM_PUSH, opd_reg(reg));
     stack_size += 8;
 }
 
-static void emit_pop(const char* reg) {
-    CHECK((void*)reg, !=, NULL, "%p");
-    println("pop %s", reg);
+static void emit_pop(mkt_reg_t reg) {
+    emit_op1(ASM_POP, opd_reg(reg));
     stack_size -= 8;
 }
 
-static void emit_pusha() {
-    println("#  spill begin");
-    for (u32 i = 1; i < sizeof(regs) / sizeof(regs[0]); i++) emit_push(regs[i]);
-    println("#  spill end");
+// Caller-saved registers still needed after a runtime call. Being on the
+// stack during the call also makes them visible to the GC
+static void emit_save(u16 saved) {
+    for (i32 r = 0; r < REG_COUNT; r++)
+        if ((saved >> r) & 1) emit_push(r);
 }
 
-static void emit_popa() {
-    println("# unspill begin");
-    for (u32 i = 1; i < sizeof(regs) / sizeof(regs[0]); i++) emit_pop(regs[i]);
-    println("# unspill end");
+static void emit_restore(u16 saved) {
+    for (i32 r = REG_COUNT - 1; r >= 0; r--)
+        if ((saved >> r) & 1) emit_pop(r);
 }
 
-static void emit_call(const char* fn) {
-    CHECK((void*)fn, !=, NULL, "%p");
+// The GC references in `roots` are found through the return address while
+// the callee runs
+static void emit_call(mkt_opd_t fn, const i32* roots) {
     const u32 old_stack_size = stack_size;
     if ((stack_size % 16) != 0) {
-        println("sub $8, %%rsp # Align to 16 bytes before call");
+        emit_comment("Align to 16 bytes before call");
+        emit_op2(ASM_SUB, 8, opd_imm(8), opd_reg(REG_RSP));
         stack_size += 8;
     }
 
     CHECK(stack_size % 16, ==, 0, "%u");
-    println("call %s", fn);
+    emit_op1(ASM_CALL, fn);
+
+    if (buf_size(roots) > 0) {
+        const stack_map_t map = {
+            .sm_ret_sym = asm_sym_make(output_asm, ".L.ret.%d",
+                                       (i32)buf_size(stack_maps)),
+            .sm_roots_i = buf_size(stack_map_roots),
+            .sm_roots_len = buf_size(roots)};
+        asm_sym_here(output_asm, map.sm_ret_sym);
+        buf_push(stack_maps, map);
+        for (i32 i = 0; i < (i32)buf_size(roots); i++)
+            buf_push(stack_map_roots, roots[i]);
+    }
 
     if ((old_stack_size % 16) != 0) {
-        println("add $8, %%rsp # Reset alignement after call");
+        emit_comment("Reset alignement after call");
+        emit_op2(ASM_ADD, 8, opd_imm(8), opd_reg(REG_RSP));
         stack_size -= 8;
     }
 }
 
-// The System V ABI requires a 16-bit aligned stack.
-// Round up to a multiple of 16
-static i32 emit_align_to_16(i32 stack_size) {
-    CHECK(stack_size, >=, 0, "%d");
+// Operand for a vreg: its register or its spill slot
+static mkt_opd_t emit_vreg_operand(const mkt_regalloc_t* ra, i32 vreg) {
+    CHECK((void*)ra, !=, NULL, "%p");
+    CHECK(vreg, >=, 0, "%d");
+
+    const i32 reg = ra->ra_regs[vreg];
+    if (reg >= 0) return opd_reg(reg);
 
-    return (stack_size + 16 - 1) / 16 * 16;
+    CHECK(ra->ra_spill_offsets[vreg], <, 0, "%d");
+    return opd_mem(REG_RBP, ra->ra_spill_offsets[vreg]);
 }
 
-static void emit_load(const mkt_type_t* type) {
-    CHECK((void*)type, !=, NULL, "%p");
+static void emit_vreg_to_reg(const mkt_regalloc_t* ra, i32 vreg,
+                             mkt_reg_t reg) {
+    if (ra->ra_regs[vreg] == (i32)reg) return;
 
-    switch (type->ty_kind) {
-        case TYPE_FN:
-        case TYPE_CLASS:
-            // Do not try to load the value into a register since it likely
-            // would not fit. So we 'decay' to the address of the array and
-            // hence also of the  first element
-            return;
-        default:;
-    }
+    emit_op2(ASM_MOV, 8, emit_vreg_operand(ra, vreg), opd_reg(reg));
+}
 
-    const char* const type_s = mkt_type_to_str[type->ty_kind];
+static void emit_reg_to_vreg(const mkt_regalloc_t* ra, mkt_reg_t reg,
+                             i32 vreg) {
+    if (ra->ra_regs[vreg] == (i32)reg) return;
 
-    if (type->ty_size == 1)
-        println("movsbl (%%rax), %%eax # load type %s", type_s);
-    else if (type->ty_size == 2)
-        println("movswl (%%rax), %%eax # load type %s", type_s);
-    else if (type->ty_size == 4)
-        println("mov (%%rax), %%eax # load type %s", type_s);
-    else
-        println("mov (%%rax), %%rax # load type %s", type_s);
+    emit_op2(ASM_MOV, 8, opd_reg(reg), emit_vreg_operand(ra, vreg));
 }
 
-// Pop the top of the stack and store it in rax
+// Moves `srcs[i]` to `dsts[i]` for all i as if at once. Destinations must be
+// distinct. Cycles are broken with %r11
+static void emit_parallel_move(const mkt_reg_t* srcs, const mkt_reg_t* dsts,
+                               i32 len) {
+    mkt_reg_t pending_srcs[REG_COUNT], pending_dsts[REG_COUNT];
+    i32 pending_len = 0;
+    CHECK(len, <=, REG_COUNT, "%d");
+
+    for (i32 i = 0; i < len; i++) {
+        if (srcs[i] == dsts[i]) continue;
+        pending_srcs[pending_len] = srcs[i];
+        pending_dsts[pending_len] = dsts[i];
+        pending_len++;
+    }
 
-static void emit_addr(const parser_t* parser, i32 node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK(node_i, >=, 0, "%d");
-    CHECK(node_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-    const mkt_node_t* const node = &parser->par_nodes[node_i];
-    const mkt_type_t* const type = &parser->par_types[node->no_type_i];
-    const char* const type_s = mkt_type_to_str[type->ty_kind];
-    const char* const node_s = mkt_node_kind_to_str[node->no_kind];
-
-    switch (node->no_kind) {
-        case NODE_VAR: {
-            const mkt_var_t var = node->no_n.no_var;
-
-            if (type->ty_kind == TYPE_FN) {
-                CHECK(var.va_var_node_i, >=, 0, "%d");
-                const i32 fn_i = var.va_var_node_i;
-                const mkt_node_t* const fn_node = &parser->par_nodes[fn_i];
-                const mkt_fn_t fn = fn_node->no_n.no_fn;
-                const char* name = NULL;
-                i32 name_len = 0;
-                parser_tok_source(parser, fn.fd_name_tok_i, &name, &name_len);
-                CHECK((void*)name, !=, NULL, "%p");
-                CHECK(name_len, >=, 0, "%d");
-                CHECK(name_len, <, parser->par_lexer.lex_source_len, "%d");
-
-                println("lea " MKT_PUB_PREFIX
-                        "%.*s(%%rip), %%rax # address of node %s of type %s of "
-                        "id %d",
-                        name_len, name, node_s, type_s, node_i);
-                return;
-            }
+    while (pending_len > 0) {
+        i32 ready = -1;
+        for (i32 i = 0; i < pending_len && ready == -1; i++) {
+            bool is_src = false;
+            for (i32 j = 0; j < pending_len; j++)
+                is_src |= pending_srcs[j] == pending_dsts[i];
+            if (!is_src) ready = i;
+        }
 
-            println(
-                "lea -%d(%%rbp), %%rax # address of node %s of type %s of id "
-                "%d",
-                var.va_offset, node_s, type_s, node_i);
-            return;
+        if (ready == -1) {
+            // Only cycles left: free the destination of the first move
+            const mkt_reg_t dst = pending_dsts[0];
+            emit_op2(ASM_MOV, 8, opd_reg(dst), opd_reg(REG_R11));
+            for (i32 j = 0; j < pending_len; j++)
+                if (pending_srcs[j] == dst) pending_srcs[j] = REG_R11;
+            ready = 0;
         }
-        case NODE_MEMBER: {
-            const mkt_binary_t bin = node->no_n.no_binary;
-
-            const mkt_node_t* const lhs = &parser->par_nodes[bin.bi_lhs_i];
-            const mkt_type_t* const lhs_type =
-                &parser->par_types[lhs->no_type_i];
-            CHECK(lhs_type->ty_kind, ==, TYPE_PTR, "%d");
-            emit_addr(parser, bin.bi_lhs_i);
-            emit_load(lhs_type);
-
-            const mkt_node_t* const rhs = &parser->par_nodes[bin.bi_rhs_i];
-            CHECK(rhs->no_kind, ==, NODE_VAR, "%d");
-            const mkt_var_t var = rhs->no_n.no_var;
-            CHECK(var.va_var_node_i, ==, -1, "%d");
-
-            const char* member_src = NULL;
-            i32 member_src_len = 0;
-            parser_tok_source(parser, var.va_tok_i, &member_src,
-                              &member_src_len);
-            println(
-                "add $%d, %%rax # address of node %s of type %s of id %d of "
-                "value `%.*s` at "
-                "offset %d",
-                var.va_offset, node_s, type_s, node_i, member_src_len,
-                member_src, var.va_offset);
-            return;
+
+        emit_op2(ASM_MOV, 8, opd_reg(pending_srcs[ready]),
+                 opd_reg(pending_dsts[ready]));
+        pending_len--;
+        pending_srcs[ready] = pending_srcs[pending_len];
+        pending_dsts[ready] = pending_dsts[pending_len];
+    }
+}
+
+// Arguments of a call, from wherever they live, to their ABI registers
+static void emit_call_args(const mkt_regalloc_t* ra, const i32* args) {
+    const i32 args_len = buf_size(args);
+    CHECK(args_len, <=, 6, "%d");  // TODO: stack args
+
+    mkt_reg_t srcs[6] = {0}, dsts[6] = {0};
+    i32 len = 0;
+    for (i32 i = 0; i < args_len; i++) {
+        if (ra->ra_regs[args[i]] < 0) continue;
+        srcs[len] = ra->ra_regs[args[i]];
+        dsts[len] = fn_args[i];
+        len++;
+    }
+    emit_parallel_move(srcs, dsts, len);
+
+    // Spill slots are not touched by the moves above
+    for (i32 i = 0; i < args_len; i++)
+        if (ra->ra_regs[args[i]] < 0) emit_vreg_to_reg(ra, args[i], fn_args[i]);
+}
+
+// Parameters, from their ABI registers to wherever they live
+static void emit_params(const mkt_regalloc_t* ra, const mkt_ir_block_t* entry) {
+    mkt_reg_t srcs[6], dsts[6];
+    i32 len = 0;
+
+    for (i32 i = 0; i < (i32)buf_size(entry->bb_ins); i++) {
+        const mkt_ir_ins_t* const ins = &entry->bb_ins[i];
+        if (ins->ins_op != IR_PARAM) break;
+        CHECK((i32)ins->ins_imm, <, 6, "%d");  // FIXME: stack args
+
+        const mkt_reg_t src = fn_args[ins->ins_imm];
+        if (ra->ra_regs[ins->ins_dst] < 0) {
+            // Before the argument registers get overwritten
+            emit_reg_to_vreg(ra, src, ins->ins_dst);
+            continue;
         }
-        default:
-            UNREACHABLE();
+        srcs[len] = src;
+        dsts[len] = ra->ra_regs[ins->ins_dst];
+        len++;
     }
+    emit_parallel_move(srcs, dsts, len);
 }
 
-static void emit_store(const mkt_type_t* type) {
-    emit_pop("%rdi # store");
-
-    /* switch (type->ty_kind) { */
-    /*     case TYPE_USER: */
-    /*         //     for (i32 i = 0; i < type->ty_size; i++) { */
-    /*         //         println("  mov %d(%%rax), %%r8b", i); */
-    /*         //         println("  mov %%r8b, %d(%%rdi)", i); */
-    /*         //     } */
-    /*         return; */
-    /*     default:; */
-    /* } */
-
-    const char* const type_s = mkt_type_to_str[type->ty_kind];
-
-    if (type->ty_size == 1)
-        println("mov %%al, (%%rdi) # store %s", type_s);
-    else if (type->ty_size == 2)
-        println("mov %%ax, (%%rdi) # store %s", type_s);
-    else if (type->ty_size == 4)
-        println("mov %%eax, (%%rdi) # store %s", type_s);
-    else if (type->ty_size == 8)
-        println("mov %%rax, (%%rdi) # store %s", type_s);
-    else
-        UNREACHABLE();
+static i32 last_loc_line = -1;
+
+// Without -fverbose-asm, one `.loc` per source line is enough
+static void emit_loc_at(const parser_t* parser, mkt_loc_t loc) {
+    if (!asm_is_text(output_asm)) return;
+    if (!output_asm->as_verbose && loc.loc_line == last_loc_line) return;
+    last_loc_line = loc.loc_line;
+
+    asm_puts(output_asm, ".loc 1 ");
+    asm_put_i64(output_asm, loc.loc_line);
+    asm_putc(output_asm, ' ');
+    asm_put_i64(output_asm, loc.loc_column);
+    if (output_asm->as_verbose) {
+        asm_puts(output_asm, "\t## ");
+        asm_puts(output_asm, parser->par_file_name0);
+        asm_putc(output_asm, ':');
+        asm_put_i64(output_asm, loc.loc_line);
+        asm_putc(output_asm, ':');
+        asm_put_i64(output_asm, loc.loc_column);
+    }
+    asm_putc(output_asm, '\n');
 }
 
-static void fn_prolog(const parser_t* parser, int node_fn_i,
-                      i32 aligned_stack_size) {
+static void emit_loc(const parser_t* parser, i32 node_i) {
     CHECK((void*)parser, !=, NULL, "%p");
-    CHECK(node_fn_i, >=, 0, "%d");
-    CHECK(aligned_stack_size, >=, 0, "%d");
-    CHECK(aligned_stack_size % 16, ==, 0, "%d");
-
-    const mkt_node_t* const node = &parser->par_nodes[node_fn_i];
-    const mkt_fn_t* const fn = &node->no_n.no_fn;
-    const char* fn_name = NULL;
-    i32 fn_name_len = 0;
-    parser_tok_source(parser, fn->fd_name_tok_i, &fn_name, &fn_name_len);
-
-    println(".cfi_startproc");
-    emit_push("%rbp");
-    // Save the top of the stack for this program
-    if (node_fn_i == parser->par_main_fn_i) {
-        println("call " MKT_PUB_PREFIX "mkt_save_rbp");
-        println("mov $0, %%rax");
-    }
-    println(".cfi_def_cfa_offset 16");
-    println(".cfi_offset %%rbp, -16");
+    CHECK(node_i, >=, 0, "%d");
 
-    println("mov %%rsp, %%rbp");
-    println(".cfi_def_cfa_register %%rbp");
-    println("sub $%d, %%rsp\n", aligned_stack_size);
-    stack_size = aligned_stack_size;
+    emit_loc_at(parser,
+                lex_loc(&parser->par_lexer, node_first_token(parser, node_i)));
+}
 
-    for (i32 i = 0; i < (i32)buf_size(fn->fd_arg_nodes_i); i++) {
-        CHECK(i, <, 6, "%d");  // FIXME: stack args
+static void fn_prolog(const parser_t* parser, const mkt_ir_fn_t* irf,
+                      const mkt_regalloc_t* ra) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)irf, !=, NULL, "%p");
+    CHECK((void*)ra, !=, NULL, "%p");
+    CHECK(ra->ra_frame_size % 16, ==, 0, "%d");
 
-        const i32 arg_i = fn->fd_arg_nodes_i[i];
-        CHECK(arg_i, >=, 0, "%d");
-        CHECK(arg_i, <, (i32)buf_size(parser->par_nodes), "%d");
+    emit_directive(".cfi_startproc");
+    emit_push(REG_RBP);
+    emit_directive(".cfi_def_cfa_offset 16");
+    emit_directive(".cfi_offset %rbp, -16");
 
-        const mkt_node_t* const arg = &parser->par_nodes[arg_i];
-        const i32 stack_offset = arg->no_n.no_var.va_offset;
-        CHECK(stack_offset, >=, 0, "%d");
+    emit_op2(ASM_MOV, 8, opd_reg(REG_RSP), opd_reg(REG_RBP));
+    emit_directive(".cfi_def_cfa_register %rbp");
+    stack_size = 0;
 
-        println(
-            "mov %s, -%d(%%rbp) # save argument %d of function %.*s to "
-            "the stack",
-            fn_args[i], stack_offset, i, fn_name_len, fn_name);
+    // Give the runtime the outermost frame of this program, where the GC
+    // stops walking the stack, and the stack maps
+    if (irf->irf_node_i == parser->par_main_fn_i) {
+        emit_op2(ASM_MOV, 8, opd_reg(REG_RBP), opd_reg(fn_args[0]));
+        emit_op2(ASM_LEA, 8, opd_sym(stack_maps_sym), opd_reg(fn_args[1]));
+        emit_call(opd_sym(init_sym), NULL);
+        emit_op2(ASM_MOV, 8, opd_imm(0), opd_reg(REG_RAX));
     }
-}
 
-static void fn_epilog(i32 aligned_stack_size, i32 fn_i) {
-    CHECK(aligned_stack_size, >=, 0, "%d");
-    CHECK(aligned_stack_size % 16, ==, 0, "%d");
+    i32 callee_saved_size = 0;
+    for (i32 r = 0; r < REG_COUNT; r++) {
+        if (!((ra->ra_callee_saved >> r) & 1)) continue;
+        emit_push(r);
+        callee_saved_size += 8;
+    }
 
-    println(".L.return.%d:", fn_i);
-    println("addq $%d, %%rsp", aligned_stack_size);
-    emit_pop("%rbp");
-    println(".cfi_endproc");
-    println("ret\n");
-    stack_size = 0;
+    const i32 spills_size = ra->ra_frame_size - callee_saved_size;
+    if (spills_size > 0)
+        emit_op2(ASM_SUB, 8, opd_imm(spills_size), opd_reg(REG_RSP));
+    stack_size = ra->ra_frame_size;
+
+    // A stack map may list the slot of a reference not assigned yet on this
+    // path: it must not hold garbage then
+    for (i32 v = 0; v < (i32)buf_size(irf->irf_vregs); v++) {
+        if (!irf->irf_vregs[v].vr_gc_ref || ra->ra_regs[v] != -1 ||
+            ra->ra_spill_offsets[v] == -1)
+            continue;
+        emit_op2(ASM_MOV, 8, opd_imm(0),
+                 opd_mem(REG_RBP, ra->ra_spill_offsets[v]));
+    }
 }
 
-static void emit_loc(const parser_t* parser, i32 node_i) {
+static void fn_epilog(const parser_t* parser, int node_fn_i,
+                      const mkt_regalloc_t* ra) {
     CHECK((void*)parser, !=, NULL, "%p");
-    CHECK(node_i, >=, 0, "%d");
+    CHECK((void*)ra, !=, NULL, "%p");
+    CHECK(ra->ra_frame_size % 16, ==, 0, "%d");
 
-    const mkt_loc_t loc =
-        parser->par_lexer.lex_locs[node_first_token(parser, node_i)];
-    println(".loc 1 %d %d\t## %s:%d:%d", loc.loc_line, loc.loc_column,
-            parser->par_file_name0, loc.loc_line, loc.loc_column);
-}
+    asm_sym_here(output_asm, return_sym);
 
-static void emit_expr(const parser_t* parser, const i32 expr_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    if (expr_i < 0) return;
-    CHECK(expr_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-    const mkt_node_t* const expr = &parser->par_nodes[expr_i];
-    const char* const node_s = mkt_node_kind_to_str[expr->no_kind];
-
-    CHECK(expr->no_type_i, >=, 0, "%d");
-    CHECK(expr->no_type_i, <, (i32)buf_size(parser->par_types), "%d");
-    const mkt_type_t* const type = &parser->par_types[expr->no_type_i];
-    const char* const type_s = mkt_type_to_str[type->ty_kind];
-
-    const char *ax, *di /*, *dx */;
-    if (type->ty_size == 8) {
-        ax = "%rax";
-        di = "%rdi";
-        /* dx = "%rdx"; */
-    } else {
-        ax = "%eax";
-        di = "%edi";
-        /* dx = "%edx"; */
+    // Write what the runtime buffered for stdout, keeping the return value
+    if (node_fn_i == parser->par_main_fn_i) {
+        emit_push(REG_RAX);
+        emit_call(opd_sym(flush_sym), NULL);
+        emit_pop(REG_RAX);
     }
 
-    switch (expr->no_kind) {
-        case NODE_KEYWORD_BOOL: {
-            emit_loc(parser, expr_i);
-            println("mov $%d, %s # node %s of type %s",
-                    (int8_t)expr->no_n.no_num.nu_val, ax, node_s, type_s);
-            return;
-        }
-        case NODE_STRING: {
-            const char* source = NULL;
-            i32 source_len = 0;
-            parser_tok_source(parser, expr->no_n.no_string.st_tok_i, &source,
-                              &source_len);
-            CHECK((void*)source, !=, NULL, "%p");
-            CHECK(source_len, >=, 0, "%d");
-            CHECK(source_len, <, parser->par_lexer.lex_source_len, "%d");
-
-            emit_loc(parser, expr_i);
-            emit_push(fn_args[0]);
-            println("mov $%d, %s # node %s of type %s len=%d", source_len,
-                    fn_args[0], node_s, type_s, source_len);
-            emit_pusha();
-            emit_call(MKT_PUB_PREFIX "mkt_string_make");
-            emit_popa();
-            emit_pop(fn_args[0]);
-
-            for (i32 i = 0; i < source_len; i++)
-                println("movb $%d, %d(%%rax) # set string[%d]", source[i], i,
-                        i);
+    i32 callee_saved_size = 0;
+    for (i32 r = 0; r < REG_COUNT; r++)
+        callee_saved_size += 8 * ((ra->ra_callee_saved >> r) & 1);
 
-            return;
-        }
-        case NODE_CHAR: {
-            emit_loc(parser, expr_i);
-            println("mov $%d, %s # node %s of type %s",
-                    (char)expr->no_n.no_num.nu_val, ax, node_s, type_s);
-            return;
-        }
-        case NODE_NUM: {
-            emit_loc(parser, expr_i);
-            println("mov $%lld, %s # node %s of type %s",
-                    expr->no_n.no_num.nu_val, ax, node_s, type_s);
-            return;
-        }
-        case NODE_MODULO: {
-            emit_loc(parser, expr_i);
-            const mkt_binary_t bin = expr->no_n.no_binary;
-
-            emit_expr(parser, bin.bi_rhs_i);
-            emit_push("%rax");
-            emit_expr(parser, bin.bi_lhs_i);
-            emit_pop("%rdi");
-            println("cqo");  // ?
-            println("xor %%rdx, %%rdx");
-            println("idiv %%rdi");
-            println("mov %%rdx, %%rax");
+    if (callee_saved_size > 0) {
+        emit_op2(ASM_LEA, 8, opd_mem(REG_RBP, -callee_saved_size),
+                 opd_reg(REG_RSP));
+        for (i32 r = REG_COUNT - 1; r >= 0; r--)
+            if ((ra->ra_callee_saved >> r) & 1) emit_pop(r);
+    } else
+        emit_op2(ASM_MOV, 8, opd_reg(REG_RBP), opd_reg(REG_RSP));
 
-            return;
-        }
-        case NODE_DIVIDE: {
-            emit_loc(parser, expr_i);
-            const mkt_binary_t bin = expr->no_n.no_binary;
+    stack_size = 0;
+    emit_pop(REG_RBP);
+    emit_directive(".cfi_endproc");
+    emit_op0(ASM_RET);
+    emit_directive("");
+}
 
-            emit_expr(parser, bin.bi_rhs_i);
-            emit_push("%rax");
-            emit_expr(parser, bin.bi_lhs_i);
-            emit_pop("%rdi");
-            println("cqo");  // ?
-            println("idiv %%rdi");
+// String literals live in read-only data, see emit_strings
+static void emit_string(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    CHECK(ins->ins_node_i, >=, 0, "%d");
 
-            return;
-        }
-        case NODE_MULTIPLY: {
-            emit_loc(parser, expr_i);
-            const mkt_binary_t bin = expr->no_n.no_binary;
+    if (string_syms[ins->ins_node_i] == -1)
+        string_syms[ins->ins_node_i] =
+            asm_sym_make(output_asm, ".L.string.%d", ins->ins_node_i);
 
-            emit_expr(parser, bin.bi_rhs_i);
-            emit_push("%rax");
-            emit_expr(parser, bin.bi_lhs_i);
-            emit_pop("%rdi");
-            println("imul %%rdi, %%rax");
+    const i32 dst_reg = ra->ra_regs[ins->ins_dst];
+    const mkt_reg_t reg = dst_reg >= 0 ? dst_reg : REG_RAX;
+    emit_op2(ASM_LEA, 8, opd_sym(string_syms[ins->ins_node_i]), opd_reg(reg));
+    if (dst_reg < 0) emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+}
 
-            return;
-        }
-        case NODE_SUBTRACT: {
-            emit_loc(parser, expr_i);
-            const mkt_binary_t bin = expr->no_n.no_binary;
+// Base register of a load or store: the vreg holding the address when it is
+// in a register, %r11 otherwise
+static mkt_reg_t emit_base(const mkt_regalloc_t* ra, i32 vreg) {
+    if (ra->ra_regs[vreg] >= 0) return ra->ra_regs[vreg];
 
-            emit_expr(parser, bin.bi_rhs_i);
-            emit_push("%rax");
-            emit_expr(parser, bin.bi_lhs_i);
-            emit_pop("%rdi");
-            println("sub %%rdi, %%rax");
+    emit_vreg_to_reg(ra, vreg, REG_R11);
+    return REG_R11;
+}
 
-            return;
-        }
-        case NODE_ADD: {
-            emit_loc(parser, expr_i);
-            const mkt_binary_t bin = expr->no_n.no_binary;
-
-            emit_expr(parser, bin.bi_rhs_i);
-            emit_push("%rax");
-            emit_expr(parser, bin.bi_lhs_i);
-
-            const mkt_type_kind_t type_kind =
-                parser->par_types[expr->no_type_i].ty_kind;
-            if (type_kind == TYPE_STRING) {
-                println("movq %%rax, %s", fn_args[0]);
-                emit_pop(fn_args[1]);
-                emit_pusha();
-                emit_call(MKT_PUB_PREFIX "mkt_string_concat");
-                emit_popa();
-            } else {
-                emit_pop("%rdi");
-                println("add %s, %s", di, ax);
-            }
+// Operand for the right side of an instruction: its vreg, an immediate or
+// memory (see isel_select)
+static mkt_opd_t emit_rhs_operand(const mkt_regalloc_t* ra,
+                                  const mkt_ir_ins_t* ins) {
+    if (ins->ins_rhs == IR_VREG_IMM) return opd_imm(ins->ins_rhs_imm);
+    if (ins->ins_rhs_mem)
+        return opd_mem(emit_base(ra, ins->ins_rhs), ins->ins_rhs_imm);
+    return emit_vreg_operand(ra, ins->ins_rhs);
+}
 
-            return;
-        }
-        case NODE_MEMBER: {
-            emit_loc(parser, expr_i);
-            println("# node %s of type %s", node_s, type_s);
-            emit_addr(parser, expr_i);
-            emit_load(type);
-            return;
-        }
-        case NODE_ASSIGN:
+// Register of the right operand or of its address, -1 for a spill slot or an
+// immediate
+static i32 emit_rhs_reg(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    return ins->ins_rhs >= 0 ? ra->ra_regs[ins->ins_rhs] : -1;
+}
+
+// Compare the operands of `ins`, returning the condition code of the IR
+// comparison `op`
+static mkt_cc_t emit_cmp(const mkt_regalloc_t* ra, mkt_ir_op_t op,
+                         const mkt_ir_ins_t* ins) {
+    const i32 lhs = ins->ins_lhs;
+    mkt_opd_t cmp_opd = opd_reg(REG_RAX);
+    if (ra->ra_regs[lhs] >= 0 || ins->ins_rhs == IR_VREG_IMM)
+        cmp_opd = emit_vreg_operand(ra, lhs);
+    else
+        emit_vreg_to_reg(ra, lhs, REG_RAX);
+    emit_op2(ASM_CMP, 8, emit_rhs_operand(ra, ins), cmp_opd);
+
+    switch (op) {
+        case IR_LT:
+            return CC_L;
+        case IR_LE:
+            return CC_LE;
+        case IR_EQ:
+            return CC_E;
+        case IR_NEQ:
+            return CC_NE;
+        default:
             UNREACHABLE();
-        case NODE_LT:
-        case NODE_EQ:
-        case NODE_NEQ:
-        case NODE_LE: {
-            const mkt_binary_t bin = expr->no_n.no_binary;
-
-            emit_expr(parser, bin.bi_rhs_i);
-            emit_push("%rax");
-            emit_expr(parser, bin.bi_lhs_i);
-            emit_loc(parser, expr_i);
-            emit_pop("%rdi");
-            println("cmp %%rdi, %%rax");
-
-            if (expr->no_kind == NODE_LT)
-                println("setl %%al");
-            else if (expr->no_kind == NODE_LE)
-                println("setle %%al");
-            else if (expr->no_kind == NODE_EQ)
-                println("sete %%al");
-            else if (expr->no_kind == NODE_NEQ)
-                println("setne %%al");
-            else
-                UNREACHABLE();
+    }
+}
+
+// Jump to `target` if `cc` holds, to `target_else` otherwise, falling through
+// to the next block when possible
+static void emit_branch(mkt_cc_t cc, i32 target, i32 target_else,
+                        i32 next_block_i) {
+    if (target == next_block_i)
+        asm_jcc(output_asm, cc ^ 1 /* Negation */, bb_syms[target_else]);
+    else {
+        asm_jcc(output_asm, cc, bb_syms[target]);
+        if (target_else != next_block_i)
+            emit_op1(ASM_JMP, opd_sym(bb_syms[target_else]));
+    }
+}
 
-            // Required to be able to do later `push %rax`
-            println("movzb %%al, %%rax");
+// Instruction selection of the leaves, once the trees are chosen by
+// isel_select. A pattern covers an IR instruction together with the leaves
+// it reads: a vreg in a register, one in a spill slot, an immediate (see
+// ir_fold_imms) or memory. emit_select emits the cheapest pattern matching.
+// Without a match, emit_ins has a generic sequence for every instruction.
+
+typedef enum {
+    SHAPE_NONE,  // No operand
+    SHAPE_REG,   // Vreg in a register
+    SHAPE_MEM,   // Vreg in a spill slot
+    SHAPE_IMM,   // IR_VREG_IMM
+    SHAPE_LOAD,  // ins_rhs_mem
+    SHAPE_ANY,
+} emit_shape_t;
+
+typedef struct {
+    mkt_ir_op_t pt_op;
+    emit_shape_t pt_dst, pt_lhs, pt_rhs;
+    bool (*pt_when)(const mkt_regalloc_t* ra,
+                    const mkt_ir_ins_t* ins);  // Or NULL
+    i32 pt_cost;  // Instructions, plus memory accesses. The first one wins a
+                  // tie
+    void (*pt_emit)(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins);
+} emit_pattern_t;
+
+static emit_shape_t emit_shape(const mkt_regalloc_t* ra, i32 vreg) {
+    if (vreg == IR_VREG_IMM) return SHAPE_IMM;
+    if (vreg < 0) return SHAPE_NONE;
+    return ra->ra_regs[vreg] >= 0 ? SHAPE_REG : SHAPE_MEM;
+}
 
-            return;
-        }
-        case NODE_RETURN: {
-            const mkt_return_t ret = expr->no_n.no_return;
-            emit_expr(parser, ret.re_node_i);
-            emit_loc(parser, expr_i);
-            println("jmp .L.return.%d", ret.re_fn_i);
-            return;
-        }
-        case NODE_NOT: {
-            emit_expr(parser, expr->no_n.no_unary.un_node_i);
-            emit_loc(parser, expr_i);
-            println("cmp $0, %%rax # node %s of type %s", node_s, type_s);
-            println("sete %%al");
-            return;
-        }
-        case NODE_IF: {
-            const mkt_if_t node = expr->no_n.no_if;
+static bool emit_shape_matches(emit_shape_t pattern, emit_shape_t shape) {
+    return pattern == SHAPE_ANY || pattern == shape;
+}
 
-            emit_expr(parser, node.if_node_cond_i);
-            emit_loc(parser, expr_i);
-            println("cmp $0, %%rax");
-            println("je .L.else.%d", expr_i);
+static mkt_asm_op_t emit_alu_op(mkt_ir_op_t op) {
+    switch (op) {
+        case IR_ADD:
+            return ASM_ADD;
+        case IR_SUB:
+            return ASM_SUB;
+        case IR_MUL:
+            return ASM_IMUL;
+        default:
+            UNREACHABLE();
+    }
+}
 
-            emit_expr(parser, node.if_node_then_i);
+// The destination is the register of the left operand
+static bool emit_is_tied(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    return ra->ra_regs[ins->ins_dst] == ra->ra_regs[ins->ins_lhs];
+}
 
-            println("jmp .L.end.%d", expr_i);
+// The destination is the register of the right operand, which can be
+// swapped with the left one
+static bool emit_is_tied_rhs(const mkt_regalloc_t* ra,
+                             const mkt_ir_ins_t* ins) {
+    return ra->ra_regs[ins->ins_dst] == ra->ra_regs[ins->ins_rhs] &&
+           ir_op_is_commutative(ins->ins_op);
+}
 
-            println(".L.else.%d:", expr_i);
-            if (node.if_node_else_i >= 0)
-                emit_expr(parser, node.if_node_else_i);
+// Zero extended by a 32 bits move
+static bool emit_is_u32(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    IGNORE(ra);
+    return ins->ins_imm >= 0 && ins->ins_imm <= UINT32_MAX;
+}
 
-            println(".L.end.%d:", expr_i);
+// movl $imm, %dst
+static void emit_imm32(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    emit_op2(ASM_MOV, 4, opd_imm(ins->ins_imm),
+             opd_reg(ra->ra_regs[ins->ins_dst]));
+}
 
-            return;
-        }
-        case NODE_BUILTIN_PRINTLN: {
-            const mkt_builtin_println_t builtin_println =
-                expr->no_n.no_builtin_println;
-            emit_expr(parser, builtin_println.bp_arg_i);
-
-            const mkt_node_t* arg =
-                &parser->par_nodes[builtin_println.bp_arg_i];
-            const mkt_type_kind_t type =
-                parser->par_types[arg->no_type_i].ty_kind;
-
-            emit_loc(parser, expr_i);
-            println("mov %%rax, %s", fn_args[0]);
-
-            if (type == TYPE_LONG || type == TYPE_INT || type == TYPE_SHORT ||
-                type == TYPE_BYTE)
-                emit_call(MKT_PUB_PREFIX "mkt_int_println");
-            else if (type == TYPE_CHAR)
-                emit_call(MKT_PUB_PREFIX "mkt_char_println");
-            else if (type == TYPE_BOOL)
-                emit_call(MKT_PUB_PREFIX "mkt_bool_println");
-            else if (type == TYPE_STRING) {
-                emit_call(MKT_PUB_PREFIX "mkt_string_println");
-            } else if (type == TYPE_PTR) {
-                emit_call(MKT_PUB_PREFIX "mkt_instance_println");
-            } else {
-                log_debug("Type %s unimplemented", mkt_type_to_str[type]);
-                UNIMPLEMENTED();
-            }
-            println("movq $0, %%rax");  // Return value 0
+// op rhs, %dst with %dst being lhs
+static void emit_alu_tied(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    emit_op2(emit_alu_op(ins->ins_op), 8, emit_rhs_operand(ra, ins),
+             opd_reg(ra->ra_regs[ins->ins_dst]));
+}
 
-            return;
-        }
-        case NODE_BLOCK: {
-            const mkt_block_t block = expr->no_n.no_block;
+// op lhs, %dst with %dst being rhs
+static void emit_alu_tied_rhs(const mkt_regalloc_t* ra,
+                              const mkt_ir_ins_t* ins) {
+    emit_op2(emit_alu_op(ins->ins_op), 8,
+             emit_vreg_operand(ra, ins->ins_lhs),
+             opd_reg(ra->ra_regs[ins->ins_dst]));
+}
 
-            for (i32 i = 0; i < (i32)buf_size(block.bl_nodes_i); i++) {
-                const i32 stmt_node_i = block.bl_nodes_i[i];
-                emit_stmt(parser, stmt_node_i);
-            }
+// lea ±imm(%lhs), %dst
+static void emit_lea_imm(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    const i64 disp =
+        ins->ins_op == IR_SUB ? -ins->ins_rhs_imm : ins->ins_rhs_imm;
+    emit_op2(ASM_LEA, 8, opd_mem(ra->ra_regs[ins->ins_lhs], disp),
+             opd_reg(ra->ra_regs[ins->ins_dst]));
+}
 
-            return;
-        }
-        case NODE_VAR: {
-            emit_loc(parser, expr_i);
-            emit_addr(parser, expr_i);
-            emit_load(type);
-            return;
-        }
-        case NODE_CALL: {
-            const mkt_call_t call = expr->no_n.no_call;
-            CHECK(buf_size(call.ca_arg_nodes_i), <=, 6UL, "%zu");  // TODO
-
-            for (i32 i = 0; i < (i32)buf_size(call.ca_arg_nodes_i); i++) {
-                emit_expr(parser, call.ca_arg_nodes_i[i]);
-                emit_loc(parser, expr_i);
-                emit_push(fn_args[i]);
-                println("mov %%rax, %s", fn_args[i]);
-
-                // TODO: preserver registers by spilling
-                // TODO: use the stack if # args > 6
-            }
-            emit_expr(parser, call.ca_lhs_node_i);
-            println("mov %%rax, %%r10");
+// lea (%lhs,%rhs,scale), %dst with a scale of 1 for an addition
+static void emit_lea_add(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    emit_op2(ASM_LEA, 8,
+             opd_mem_index(ra->ra_regs[ins->ins_lhs],
+                           ra->ra_regs[ins->ins_rhs],
+                           ins->ins_op == IR_SCALE ? ins->ins_imm : 1),
+             opd_reg(ra->ra_regs[ins->ins_dst]));
+}
 
-            emit_call("*%r10");
+// The right operand, or its address, is not in the register of the
+// destination
+static bool emit_is_untied(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    return emit_rhs_reg(ra, ins) != ra->ra_regs[ins->ins_dst];
+}
 
-            for (i32 i = 0; i < (i32)buf_size(call.ca_arg_nodes_i); i++)
-                emit_pop(fn_args[i]);
+// mov lhs, %dst then op rhs, %dst
+static void emit_alu_mov(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    const mkt_reg_t dst_reg = ra->ra_regs[ins->ins_dst];
+    emit_vreg_to_reg(ra, ins->ins_lhs, dst_reg);
+    emit_alu_tied(ra, ins);
+}
 
-            return;
-        }
-        case NODE_INSTANCE: {
-            CHECK(type->ty_kind, ==, TYPE_PTR, "%d");
-            CHECK(type->ty_ptr_type_i, >=, 0, "%d");
-            CHECK(type->ty_ptr_type_i, <, (i32)buf_size(parser->par_types),
-                  "%d");
-
-            const mkt_type_t* const instance_type =
-                &parser->par_types[type->ty_ptr_type_i];
-
-            emit_push(fn_args[0]);
-            println("mov $%d, %s", instance_type->ty_size, fn_args[0]);
-            emit_pusha();
-            emit_call(MKT_PUB_PREFIX "mkt_instance_make");
-            emit_popa();
-            emit_pop(fn_args[0]);
-
-            // Push the pointer to the instance on the stack to avoid losing it
-            // when handling the members
-            // emit_push("%rax");
-
-            // mkt_instance_t instance = expr->no_n.no_instance;
-            // const mkt_node_t* const class_node =
-            //    &parser->par_nodes[instance.in_class];
-            // mkt_class_t class = class_node->no_n.no_class;
-            // for (i32 i = 0; i < (i32)buf_size(class.cl_members); i++) {
-            //    const i32 m_i = class.cl_members[i];
-            //    /* const mkt_type_t* const type = &parser->par_types[m_i]; */
-            //    // FIXME
-            //    emit_stmt(parser, m_i);
-            //}
+// movsx lhs, %dst with the size of the source
+static void emit_sext(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    CHECK(ins->ins_size, <, 8, "%d");
+    emit_op2(ASM_MOVSX, ins->ins_size, emit_vreg_operand(ra, ins->ins_lhs),
+             opd_reg(ra->ra_regs[ins->ins_dst]));
+}
 
-            return;
-        }
-        case NODE_FN:
-            return;  // Already generated in the .data section
+// mov disp(base), %dst, sign extended to 64 bits
+static void emit_load(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    const mkt_opd_t src = opd_mem(emit_base(ra, ins->ins_lhs), ins->ins_imm);
+    const mkt_opd_t dst = opd_reg(ra->ra_regs[ins->ins_dst]);
+    if (ins->ins_size == 8)
+        emit_op2(ASM_MOV, 8, src, dst);
+    else
+        emit_op2(ASM_MOVSX, ins->ins_size, src, dst);
+}
 
-            // Forbidden by the grammar or simply impossible
-        default:
-            log_debug("no_kind=%s", mkt_node_kind_to_str[expr->no_kind]);
-            UNREACHABLE();
+// mov $imm, disp(base) or mov %rhs, disp(base), with the stored size
+static void emit_store(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    const mkt_opd_t dst = opd_mem(emit_base(ra, ins->ins_lhs), ins->ins_imm);
+    emit_op2(ASM_MOV, ins->ins_size, emit_rhs_operand(ra, ins), dst);
+}
+
+// The generic sequence of an operation comes first, the cheaper ones that
+// only apply to some operands after it
+static const emit_pattern_t emit_patterns[] = {
+    {IR_IMM, SHAPE_REG, SHAPE_NONE, SHAPE_NONE, emit_is_u32, 1, emit_imm32},
+    {IR_ADD, SHAPE_REG, SHAPE_ANY, SHAPE_ANY, emit_is_untied, 2, emit_alu_mov},
+    {IR_ADD, SHAPE_REG, SHAPE_REG, SHAPE_ANY, emit_is_tied, 1, emit_alu_tied},
+    {IR_ADD, SHAPE_REG, SHAPE_ANY, SHAPE_REG, emit_is_tied_rhs, 1,
+     emit_alu_tied_rhs},
+    {IR_ADD, SHAPE_REG, SHAPE_REG, SHAPE_IMM, NULL, 1, emit_lea_imm},
+    {IR_ADD, SHAPE_REG, SHAPE_REG, SHAPE_REG, NULL, 1, emit_lea_add},
+    {IR_SUB, SHAPE_REG, SHAPE_ANY, SHAPE_ANY, emit_is_untied, 2, emit_alu_mov},
+    {IR_SUB, SHAPE_REG, SHAPE_REG, SHAPE_ANY, emit_is_tied, 1, emit_alu_tied},
+    {IR_SUB, SHAPE_REG, SHAPE_REG, SHAPE_IMM, NULL, 1, emit_lea_imm},
+    {IR_MUL, SHAPE_REG, SHAPE_ANY, SHAPE_ANY, emit_is_untied, 2, emit_alu_mov},
+    {IR_MUL, SHAPE_REG, SHAPE_REG, SHAPE_ANY, emit_is_tied, 1, emit_alu_tied},
+    {IR_MUL, SHAPE_REG, SHAPE_ANY, SHAPE_REG, emit_is_tied_rhs, 1,
+     emit_alu_tied_rhs},
+    {IR_SCALE, SHAPE_REG, SHAPE_REG, SHAPE_REG, NULL, 1, emit_lea_add},
+    {IR_SEXT, SHAPE_REG, SHAPE_ANY, SHAPE_NONE, NULL, 1, emit_sext},
+    {IR_LOAD, SHAPE_REG, SHAPE_ANY, SHAPE_NONE, NULL, 2, emit_load},
+    {IR_STORE, SHAPE_NONE, SHAPE_ANY, SHAPE_IMM, NULL, 2, emit_store},
+    {IR_STORE, SHAPE_NONE, SHAPE_ANY, SHAPE_REG, NULL, 2, emit_store},
+};
+
+// Whether a pattern matched and was emitted
+static bool emit_select(const mkt_regalloc_t* ra, const mkt_ir_ins_t* ins) {
+    const emit_shape_t dst = emit_shape(ra, ins->ins_dst),
+                       lhs = emit_shape(ra, ins->ins_lhs),
+                       rhs = ins->ins_rhs_mem ? SHAPE_LOAD
+                                              : emit_shape(ra, ins->ins_rhs);
+
+    const emit_pattern_t* best = NULL;
+    for (i32 p = 0; p < (i32)(sizeof(emit_patterns) / sizeof(emit_patterns[0]));
+         p++) {
+        const emit_pattern_t* const pattern = &emit_patterns[p];
+        if (pattern->pt_op != ins->ins_op ||
+            !emit_shape_matches(pattern->pt_dst, dst) ||
+            !emit_shape_matches(pattern->pt_lhs, lhs) ||
+            !emit_shape_matches(pattern->pt_rhs, rhs))
+            continue;
+        if (pattern->pt_when != NULL && !pattern->pt_when(ra, ins)) continue;
+        if (best == NULL || pattern->pt_cost < best->pt_cost) best = pattern;
     }
+    if (best == NULL) return false;
+
+    best->pt_emit(ra, ins);
+    return true;
 }
 
-static void emit_stmt(const parser_t* parser, i32 stmt_i) {
+static void emit_ins(const parser_t* parser, const mkt_regalloc_t* ra,
+                     const mkt_ir_ins_t* ins, i32 ins_k, i32 next_block_i,
+                     bool is_last) {
     CHECK((void*)parser, !=, NULL, "%p");
-    CHECK(stmt_i, >=, 0, "%d");
-    CHECK(stmt_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-    const mkt_node_t* const stmt = &parser->par_nodes[stmt_i];
-    const mkt_type_t* const type = &parser->par_types[stmt->no_type_i];
-    const mkt_loc_t loc =
-        parser->par_lexer.lex_locs[node_first_token(parser, stmt_i)];
-    println(".loc 1 %d %d\t## %s:%d:%d", loc.loc_line, loc.loc_column,
-            parser->par_file_name0, loc.loc_line, loc.loc_column);
-
-    switch (stmt->no_kind) {
-        case NODE_BUILTIN_PRINTLN:
-        case NODE_BLOCK:
-        case NODE_NUM:
-        case NODE_CHAR:
-        case NODE_STRING:
-        case NODE_KEYWORD_BOOL:
-        case NODE_LT:
-        case NODE_LE:
-        case NODE_EQ:
-        case NODE_NEQ:
-        case NODE_MULTIPLY:
-        case NODE_MODULO:
-        case NODE_DIVIDE:
-        case NODE_SUBTRACT:
-        case NODE_ADD:
-        case NODE_RETURN:
-        case NODE_NOT:
-        case NODE_INSTANCE:
-        case NODE_MEMBER:
-        case NODE_IF: {
-            emit_expr(parser, stmt_i);
+    CHECK((void*)ra, !=, NULL, "%p");
+    CHECK((void*)ins, !=, NULL, "%p");
+
+    if (emit_select(ra, ins)) return;
+
+    const i32 dst_reg = ins->ins_dst >= 0 ? ra->ra_regs[ins->ins_dst] : -1;
+
+    switch (ins->ins_op) {
+        case IR_IMM:
+            if (dst_reg >= 0 || ins->ins_imm != (i32)ins->ins_imm) {
+                const mkt_reg_t reg = dst_reg >= 0 ? dst_reg : REG_RAX;
+                emit_op2(ASM_MOV, 8, opd_imm(ins->ins_imm), opd_reg(reg));
+                if (dst_reg < 0) emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+            } else
+                emit_op2(ASM_MOV, 8, opd_imm(ins->ins_imm),
+                         emit_vreg_operand(ra, ins->ins_dst));
+            return;
+        case IR_MOV: {
+            const i32 src_reg = ra->ra_regs[ins->ins_lhs];
+            if (src_reg >= 0)
+                emit_reg_to_vreg(ra, src_reg, ins->ins_dst);
+            else if (dst_reg >= 0)
+                emit_vreg_to_reg(ra, ins->ins_lhs, dst_reg);
+            else {
+                emit_vreg_to_reg(ra, ins->ins_lhs, REG_RAX);
+                emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+            }
             return;
         }
-        case NODE_ASSIGN: {
-            emit_loc(parser, stmt_i);
-
-            const mkt_binary_t binary = stmt->no_n.no_binary;
-
-            emit_addr(parser, binary.bi_lhs_i);
-            emit_push("%rax");
-            emit_expr(parser, binary.bi_rhs_i);
-            emit_store(type);
-
+        case IR_PARAM:
+            return;  // See emit_params
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL: {
+            const mkt_asm_op_t op = ins->ins_op == IR_ADD   ? ASM_ADD
+                                    : ins->ins_op == IR_SUB ? ASM_SUB
+                                                            : ASM_IMUL;
+            // Compute in place when the destination is a register not
+            // clobbering the right operand
+            const mkt_reg_t acc =
+                (dst_reg >= 0 && emit_rhs_reg(ra, ins) != dst_reg) ? dst_reg
+                                                                   : REG_RAX;
+            emit_vreg_to_reg(ra, ins->ins_lhs, acc);
+            emit_op2(op, 8, emit_rhs_operand(ra, ins), opd_reg(acc));
+            emit_reg_to_vreg(ra, acc, ins->ins_dst);
             return;
         }
-        case NODE_VAR: {
-            emit_expr(parser, stmt_i);
+        case IR_DIV:
+        case IR_MOD:
+            emit_vreg_to_reg(ra, ins->ins_lhs, REG_RAX);
+            emit_op0(ASM_CQO);
+            emit_op1(ASM_IDIV, emit_vreg_operand(ra, ins->ins_rhs));
+            emit_reg_to_vreg(ra, ins->ins_op == IR_DIV ? REG_RAX : REG_RDX,
+                             ins->ins_dst);
+            return;
+        case IR_MULHI:
+            emit_vreg_to_reg(ra, ins->ins_lhs, REG_RAX);
+            emit_op2(ASM_MOV, 8, opd_imm(ins->ins_imm), opd_reg(REG_RDX));
+            emit_op1(ASM_IMUL, opd_reg(REG_RDX));
+            emit_reg_to_vreg(ra, REG_RDX, ins->ins_dst);
+            return;
+        case IR_SCALE: {
+            const i32 lhs_reg = ra->ra_regs[ins->ins_lhs],
+                      rhs_reg = ra->ra_regs[ins->ins_rhs];
+            const mkt_reg_t base = lhs_reg >= 0 ? lhs_reg : REG_RAX,
+                            index = rhs_reg >= 0 ? rhs_reg : REG_R11;
+            emit_vreg_to_reg(ra, ins->ins_lhs, base);
+            emit_vreg_to_reg(ra, ins->ins_rhs, index);
+
+            const mkt_reg_t acc = dst_reg >= 0 ? dst_reg : REG_RAX;
+            emit_op2(ASM_LEA, 8, opd_mem_index(base, index, ins->ins_imm),
+                     opd_reg(acc));
+            emit_reg_to_vreg(ra, acc, ins->ins_dst);
             return;
         }
-        case NODE_WHILE: {
-            const mkt_while_t w = stmt->no_n.no_while;
-            emit_loc(parser, stmt_i);
-            println(".Lwhile_loop_start%d:", stmt_i);
-            emit_expr(parser, w.wh_cond_i);
-
-            println("cmp $0, %%rax");
-            println("je .Lwhile_loop_end%d", stmt_i);
-
-            emit_stmt(parser, w.wh_body_i);
-            println("jmp .Lwhile_loop_start%d", stmt_i);
-
-            println(".Lwhile_loop_end%d:", stmt_i);
+        case IR_SHL:
+        case IR_SAR:
+        case IR_SHR: {
+            const mkt_asm_op_t op = ins->ins_op == IR_SHL   ? ASM_SHL
+                                    : ins->ins_op == IR_SAR ? ASM_SAR
+                                                            : ASM_SHR;
+            const mkt_reg_t acc = dst_reg >= 0 ? dst_reg : REG_RAX;
+            emit_vreg_to_reg(ra, ins->ins_lhs, acc);
+            emit_op2(op, 8, opd_imm(ins->ins_imm), opd_reg(acc));
+            emit_reg_to_vreg(ra, acc, ins->ins_dst);
             return;
         }
-            // No-op: Already generated in the `.data` section
-        case NODE_FN:
-
-            // No-op: Generated for NODE_INSTANCE, does not
-            // exist at runtime
-        case NODE_CLASS:
+        case IR_LT:
+        case IR_LE:
+        case IR_EQ:
+        case IR_NEQ: {
+            const mkt_cc_t cc = emit_cmp(ra, ins->ins_op, ins);
+            const mkt_reg_t set_reg = dst_reg >= 0 ? dst_reg : REG_RAX;
+            asm_setcc(output_asm, cc, set_reg);
+            emit_op2(ASM_MOVZX, 1, opd_reg(set_reg), opd_reg(set_reg));
+            emit_reg_to_vreg(ra, set_reg, ins->ins_dst);
+            return;
+        }
+        case IR_NOT:
+            emit_op2(ASM_CMP, 8, opd_imm(0),
+                     emit_vreg_operand(ra, ins->ins_lhs));
+            asm_setcc(output_asm, CC_E, REG_RAX);
+            emit_op2(ASM_MOVZX, 1, opd_reg(REG_RAX), opd_reg(REG_RAX));
+            emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
             return;
-        case NODE_CALL: {
-            emit_expr(parser, stmt_i);
+        case IR_SEXT:
+            CHECK(ins->ins_size, <, 8, "%d");
+            emit_vreg_to_reg(ra, ins->ins_lhs, REG_RAX);
+            emit_op2(ASM_MOVSX, ins->ins_size, opd_reg(REG_RAX),
+                     opd_reg(REG_RAX));
+            emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+            return;
+        case IR_LOAD: {
+            const mkt_opd_t src =
+                opd_mem(emit_base(ra, ins->ins_lhs), ins->ins_imm);
+            if (ins->ins_size == 8)
+                emit_op2(ASM_MOV, 8, src, opd_reg(REG_RAX));
+            else
+                emit_op2(ASM_MOVSX, ins->ins_size, src, opd_reg(REG_RAX));
+            emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
             return;
         }
+        case IR_STORE: {
+            const mkt_opd_t dst =
+                opd_mem(emit_base(ra, ins->ins_lhs), ins->ins_imm);
+            CHECK(ins->ins_rhs, >=, 0, "%d");  // See emit_store
+            emit_vreg_to_reg(ra, ins->ins_rhs, REG_RAX);
+            emit_op2(ASM_MOV, ins->ins_size, opd_reg(REG_RAX), dst);
+            return;
+        }
+        case IR_FN_ADDR:
+            CHECK(fn_syms[ins->ins_node_i], >=, 0, "%d");
+            emit_op2(ASM_LEA, 8, opd_sym(fn_syms[ins->ins_node_i]),
+                     opd_reg(REG_RAX));
+            emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+            return;
+        case IR_STRING:
+            emit_string(ra, ins);
+            return;
+        case IR_CALL:
+            if (ins->ins_lhs < 0) {
+                emit_call_args(ra, ins->ins_args);
+                emit_call(opd_sym(fn_syms[ins->ins_imm]),
+                          ra->ra_gc_roots[ins_k]);
+            } else {
+                emit_vreg_to_reg(ra, ins->ins_lhs, REG_R10);
+                emit_call_args(ra, ins->ins_args);
+                emit_call(opd_reg(REG_R10), ra->ra_gc_roots[ins_k]);
+            }
+            if (ins->ins_dst >= 0) emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+            return;
+        case IR_CALL_RT:
+            emit_save(ra->ra_saved_across[ins_k]);
+            emit_call_args(ra, ins->ins_args);
+            emit_call(opd_sym(rt_syms[ins->ins_imm]), ra->ra_gc_roots[ins_k]);
+            emit_restore(ra->ra_saved_across[ins_k]);
+            if (ins->ins_dst >= 0) emit_reg_to_vreg(ra, REG_RAX, ins->ins_dst);
+            return;
+        case IR_JMP:
+            if (ins->ins_target != next_block_i)
+                emit_op1(ASM_JMP, opd_sym(bb_syms[ins->ins_target]));
+            return;
+        case IR_BR:
+            emit_op2(ASM_CMP, 8, opd_imm(0),
+                     emit_vreg_operand(ra, ins->ins_lhs));
+            emit_branch(CC_NE, ins->ins_target, ins->ins_target_else,
+                        next_block_i);
+            return;
+        case IR_BR_CMP:
+            emit_branch(emit_cmp(ra, ins->ins_imm, ins),
+                        ins->ins_target, ins->ins_target_else, next_block_i);
+            return;
+        case IR_RET:
+            if (ins->ins_lhs >= 0) emit_vreg_to_reg(ra, ins->ins_lhs, REG_RAX);
+            if (!is_last) emit_op1(ASM_JMP, opd_sym(return_sym));
+            return;
         default:
-            log_debug("no_kind=%s", mkt_node_kind_to_str[stmt->no_kind]);
+            log_debug("ins_op=%s", mkt_ir_op_to_str[ins->ins_op]);
             UNREACHABLE();
     }
 }
 
-static void emit(const parser_t* parser, FILE* asm_file) {
+static void emit_fn(const parser_t* parser, const mkt_ir_fn_t* irf) {
     CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)parser->par_nodes, !=, NULL, "%p");
-    CHECK((void*)asm_file, !=, NULL, "%p");
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    mkt_regalloc_t ra = {0};
+    ra_fn(irf, &ra);
+
+    const i32 blocks_len = buf_size(irf->irf_blocks);
+    buf_clear(bb_syms);
+    for (i32 b = 0; b < blocks_len; b++)
+        buf_push(bb_syms, asm_sym_make(output_asm, ".L.bb.%d.%d",
+                                       irf->irf_node_i, b));
+    return_sym = asm_sym_make(output_asm, ".L.return.%d", irf->irf_node_i);
+
+    fn_prolog(parser, irf, &ra);
+    emit_params(&ra, &irf->irf_blocks[0]);
+
+    i32 last_node_i = -1, ins_k = 0;
+    for (i32 b = 0; b < blocks_len; b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        asm_sym_here(output_asm, bb_syms[b]);
+
+        const i32 block_len = buf_size(block->bb_ins);
+        for (i32 i = 0; i < block_len; i++, ins_k++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_node_i >= 0 && ins->ins_node_i != last_node_i &&
+                ins->ins_op != IR_FN_ADDR) {
+                emit_loc(parser, ins->ins_node_i);
+                last_node_i = ins->ins_node_i;
+            }
 
-    output_file = asm_file;
+            emit_comment(mkt_ir_op_to_str[ins->ins_op]);
+            emit_ins(parser, &ra, ins, ins_k, b + 1,
+                     b == blocks_len - 1 && i == block_len - 1);
+        }
+    }
 
-    println(".file 1 \"%s\"", parser->par_file_name0);
+    fn_epilog(parser, irf->irf_node_i, &ra);
+    ra_free(&ra);
+}
 
-    for (u64 c = 0; c < buf_size(parser->par_class_decls); c++) {
-        const i32 node_class_i = parser->par_class_decls[c];
-        CHECK(node_class_i, >=, 0, "%d");
-        CHECK(node_class_i, <, (i32)buf_size(parser->par_nodes), "%d");
+// Symbols of all functions upfront since they may be referenced before being
+// defined
+static void emit_syms(const parser_t* parser, const mkt_ir_t* ir) {
+    buf_grow(fn_syms, buf_size(parser->par_nodes));
+    buf_grow(string_syms, buf_size(parser->par_nodes));
+    for (i32 i = 0; i < (i32)buf_size(parser->par_nodes); i++) {
+        buf_push(fn_syms, -1);
+        buf_push(string_syms, -1);
+    }
 
-        const mkt_node_t* const node_class = &parser->par_nodes[node_class_i];
-        CHECK(node_class->no_kind, ==, NODE_CLASS, "%d");
-        const mkt_class_t* const class = &node_class->no_n.no_class;
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++) {
+        const i32 node_fn_i = ir->ir_fns[f].irf_node_i;
+        CHECK(node_fn_i, >=, 0, "%d");
+        CHECK(node_fn_i, <, (i32)buf_size(parser->par_nodes), "%d");
+
+        const mkt_fn_t fn = parser->par_nodes[node_fn_i].no_n.no_fn;
+        const char* name = NULL;
+        i32 name_len = 0;
+        parser_tok_source(parser, fn.fd_name_tok_i, &name, &name_len);
+        CHECK((void*)name, !=, NULL, "%p");
+        CHECK(name_len, >=, 0, "%d");
+        CHECK(name_len, <, parser->par_lexer.lex_source_len, "%d");
+
+        fn_syms[node_fn_i] =
+            asm_sym_make(output_asm, MKT_PUB_PREFIX "%.*s", name_len, name);
+    }
 
-        for (i32 f = 0; f < (i32)buf_size(class->cl_methods); f++) {
-            const i32 node_fn_i = class->cl_methods[f];
-            CHECK(node_fn_i, >=, 0, "%d");
-            CHECK(node_fn_i, <, (i32)buf_size(parser->par_nodes), "%d");
+    for (i32 rt = 0; rt < RT_COUNT; rt++)
+        rt_syms[rt] = asm_sym_make(output_asm, MKT_PUB_PREFIX "%s",
+                                   mkt_ir_runtime_fn_to_str[rt]);
+    init_sym = asm_sym_make(output_asm, MKT_PUB_PREFIX "mkt_init");
+    flush_sym = asm_sym_make(output_asm, MKT_PUB_PREFIX "mkt_flush");
+    stack_maps_sym = asm_sym_make(output_asm, ".L.stack_maps");
+}
 
-            const mkt_fn_t fn = parser->par_nodes[node_fn_i].no_n.no_fn;
-            CHECK(fn.fd_name_tok_i, >=, 0, "%d");
-            CHECK(fn.fd_name_tok_i, <, parser->par_lexer.lex_source_len, "%d");
+// Each string literal is laid out like an object allocated by the runtime,
+// with a header marking it immortal so that the GC leaves it alone
+static void emit_strings(const parser_t* parser) {
+    asm_data_begin(output_asm, MKT_RODATA_SECTION);
+
+    for (i32 i = 0; i < (i32)buf_size(string_syms); i++) {
+        if (string_syms[i] == -1) continue;
+
+        const mkt_node_t* const node = &parser->par_nodes[i];
+        CHECK(node->no_kind, ==, NODE_STRING, "%d");
+
+        const char* source = NULL;
+        i32 source_len = 0;
+        parser_tok_source(parser, node->no_n.no_string.st_tok_i, &source,
+                          &source_len);
+        CHECK((void*)source, !=, NULL, "%p");
+        CHECK(source_len, >=, 0, "%d");
+        CHECK(source_len, <, parser->par_lexer.lex_source_len, "%d");
+
+        const u64 tag = RV_TAG_STRING | RV_TAG_IMMORTAL;
+        asm_align(output_asm, 16);
+        asm_quad(output_asm, opd_imm(0));  // Not in any list of objects
+        asm_quad(output_asm,
+                 opd_imm((i64)((u64)source_len | (tag << RV_TAG_SHIFT))));
+        asm_sym_here(output_asm, string_syms[i]);
+        asm_bytes(output_asm, source, source_len);
+    }
+}
 
-            const mkt_loc_t loc = parser->par_lexer.lex_locs[fn.fd_name_tok_i];
-            println(".loc 1 %d %d\t## %s:%d:%d", loc.loc_line, loc.loc_column,
-                    parser->par_file_name0, loc.loc_line, loc.loc_column);
+// Read by the GC to find the references on the stack, see
+// mkt_gc_scan_stack in mkt_stdlib.c: the number of call sites, then for each
+// one, in increasing address order, its return address, the index of its
+// first root and its number of roots. Then the roots
+static void emit_stack_maps(void) {
+    asm_data_begin(output_asm, MKT_STACK_MAPS_SECTION);
+    asm_align(output_asm, 8);
+    asm_sym_here(output_asm, stack_maps_sym);
+
+    asm_quad(output_asm, opd_imm(buf_size(stack_maps)));
+    for (i32 i = 0; i < (i32)buf_size(stack_maps); i++) {
+        asm_quad(output_asm, opd_sym(stack_maps[i].sm_ret_sym));
+        asm_quad(output_asm, opd_imm(stack_maps[i].sm_roots_i));
+        asm_quad(output_asm, opd_imm(stack_maps[i].sm_roots_len));
+    }
+    for (i32 i = 0; i < (i32)buf_size(stack_map_roots); i++)
+        asm_quad(output_asm, opd_imm(stack_map_roots[i]));
+}
 
-            const mkt_pos_range_t pos_range =
-                parser->par_lexer.lex_tok_pos_ranges[fn.fd_name_tok_i];
-            const char* const name =
-                &parser->par_lexer.lex_source[pos_range.pr_start];
-            const i32 name_len = pos_range.pr_end - pos_range.pr_start;
-            CHECK((void*)name, !=, NULL, "%p");
-            CHECK(name_len, >=, 0, "%d");
-            CHECK(name_len, <, parser->par_lexer.lex_source_len, "%d");
+static void emit(const parser_t* parser, const mkt_ir_t* ir, mkt_asm_t* as) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)parser->par_nodes, !=, NULL, "%p");
+    CHECK((void*)ir, !=, NULL, "%p");
+    CHECK((void*)as, !=, NULL, "%p");
 
-            if (fn.fd_flags & FN_FLAGS_PUBLIC)
-                println(".global " MKT_PUB_PREFIX "%.*s", name_len, name);
+    output_asm = as;
 
-            println(MKT_PUB_PREFIX "%.*s:", name_len, name);
+    emit_syms(parser, ir);
 
-            const u32 aligned_stack_size = emit_align_to_16(fn.fd_stack_size);
-            log_debug("%.*s: stack_size=%d aligned_stack_size=%d", name_len,
-                      name, fn.fd_stack_size, aligned_stack_size);
+    if (asm_is_text(as)) {
+        asm_puts(as, ".file 1 \"");
+        asm_puts(as, parser->par_file_name0);
+        asm_put(as, "\"\n", 2);
+    }
+    last_loc_line = -1;
 
-            fn_prolog(parser, node_fn_i, aligned_stack_size);
-            CHECK(stack_size, >=, aligned_stack_size, "%u");
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++) {
+        const mkt_ir_fn_t* const irf = &ir->ir_fns[f];
+        const i32 node_fn_i = irf->irf_node_i;
+        const mkt_fn_t fn = parser->par_nodes[node_fn_i].no_n.no_fn;
+        CHECK(fn.fd_name_tok_i, >=, 0, "%d");
+        CHECK(fn.fd_name_tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
-            emit_stmt(parser, fn.fd_body_node_i);
+        emit_loc_at(parser, lex_loc(&parser->par_lexer, fn.fd_name_tok_i));
 
-            if (node_fn_i == parser->par_main_fn_i) {
-                // In that case, no return means returning 0
-                println("mov $0, %%rax");
-            }
+        if (fn.fd_flags & FN_FLAGS_PUBLIC)
+            asm_sym_global(as, fn_syms[node_fn_i]);
+        asm_sym_here(as, fn_syms[node_fn_i]);
 
-            fn_epilog(aligned_stack_size, node_fn_i);
-        }
+        emit_fn(parser, irf);
     }
+    emit_strings(parser);
+    emit_stack_maps();
+    asm_resolve(as);
+
+    buf_free(fn_syms);
+    buf_free(string_syms);
+    buf_free(bb_syms);
+    buf_free(stack_maps);
+    buf_free(stack_map_roots);
 }
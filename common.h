@@ -12,6 +12,8 @@
 #define u32 uint32_t
 #define u16 uint16_t
 #define u8 uint8_t
+#define i8 int8_t
+#define i16 int16_t
 
 typedef enum {
     RES_OK,
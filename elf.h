@@ -0,0 +1,729 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "asm.h"
+
+// In-process static linker: the machine code of `mkt_asm_t` plus the
+// relocatable `mkt_stdlib.o` become a dynamically linked ELF64 executable
+// for x86_64 Linux, needing only libc at runtime. See the System V ABI and
+// its x86_64 supplement for the structures and relocations
+
+typedef struct {
+    u8 e_ident[16];
+    u16 e_type, e_machine;
+    u32 e_version;
+    u64 e_entry, e_phoff, e_shoff;
+    u32 e_flags;
+    u16 e_ehsize, e_phentsize, e_phnum, e_shentsize, e_shnum, e_shstrndx;
+} elf64_ehdr_t;
+
+typedef struct {
+    u32 p_type, p_flags;
+    u64 p_offset, p_vaddr, p_paddr, p_filesz, p_memsz, p_align;
+} elf64_phdr_t;
+
+typedef struct {
+    u32 sh_name, sh_type;
+    u64 sh_flags, sh_addr, sh_offset, sh_size;
+    u32 sh_link, sh_info;
+    u64 sh_addralign, sh_entsize;
+} elf64_shdr_t;
+
+typedef struct {
+    u32 st_name;
+    u8 st_info, st_other;
+    u16 st_shndx;
+    u64 st_value, st_size;
+} elf64_sym_t;
+
+typedef struct {
+    u64 r_offset, r_info;
+    i64 r_addend;
+} elf64_rela_t;
+
+typedef struct {
+    i64 d_tag;
+    u64 d_val;
+} elf64_dyn_t;
+
+#define ELF_ET_REL 1
+#define ELF_ET_EXEC 2
+#define ELF_EM_X86_64 62
+
+#define ELF_SHT_PROGBITS 1
+#define ELF_SHT_RELA 4
+#define ELF_SHT_NOBITS 8
+#define ELF_SHT_X86_64_UNWIND 0x70000001
+#define ELF_SHF_WRITE 0x1
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHF_EXECINSTR 0x4
+#define ELF_SHN_UNDEF 0
+#define ELF_SHN_ABS 0xfff1
+#define ELF_STB_LOCAL 0
+
+#define ELF_PT_LOAD 1
+#define ELF_PT_DYNAMIC 2
+#define ELF_PT_INTERP 3
+#define ELF_PT_PHDR 6
+#define ELF_PT_GNU_STACK 0x6474e551
+#define ELF_PF_X 1
+#define ELF_PF_W 2
+#define ELF_PF_R 4
+
+#define ELF_DT_NULL 0
+#define ELF_DT_NEEDED 1
+#define ELF_DT_HASH 4
+#define ELF_DT_STRTAB 5
+#define ELF_DT_SYMTAB 6
+#define ELF_DT_RELA 7
+#define ELF_DT_RELASZ 8
+#define ELF_DT_RELAENT 9
+#define ELF_DT_STRSZ 10
+#define ELF_DT_SYMENT 11
+#define ELF_DT_DEBUG 21
+#define ELF_DT_FLAGS 30
+#define ELF_DT_FLAGS_1 0x6ffffffb
+#define ELF_DF_BIND_NOW 0x8
+#define ELF_DF_1_NOW 0x1
+
+#define ELF_R_X86_64_NONE 0
+#define ELF_R_X86_64_64 1
+#define ELF_R_X86_64_PC32 2
+#define ELF_R_X86_64_PLT32 4
+#define ELF_R_X86_64_GLOB_DAT 6
+#define ELF_R_X86_64_GOTPCREL 9
+#define ELF_R_X86_64_32 10
+#define ELF_R_X86_64_32S 11
+#define ELF_R_X86_64_GOTPCRELX 41
+#define ELF_R_X86_64_REX_GOTPCRELX 42
+
+#define ELF_BASE_ADDR 0x400000
+#define ELF_PAGE_SIZE 0x1000
+#define ELF_PHDRS_LEN 6
+#define ELF_PLT_ENTRY_SIZE 8
+
+static const char elf_interp[] = "/lib64/ld-linux-x86-64.so.2";
+static const char elf_libc[] = "libc.so.6";
+
+// _start: calls `__libc_start_main(main, argc, argv, NULL, NULL, rtld_fini,
+// stack_end)` like crt1.o does. The two %rip-relative displacements are
+// patched with the address of `main` and the GOT slot of __libc_start_main
+static const u8 elf_start[] = {
+    0x31, 0xed,                                // xor %ebp, %ebp
+    0x49, 0x89, 0xd1,                          // mov %rdx, %r9
+    0x5e,                                      // pop %rsi
+    0x48, 0x89, 0xe2,                          // mov %rsp, %rdx
+    0x48, 0x83, 0xe4, 0xf0,                    // and $-16, %rsp
+    0x50,                                      // push %rax
+    0x54,                                      // push %rsp
+    0x45, 0x31, 0xc0,                          // xor %r8d, %r8d
+    0x31, 0xc9,                                // xor %ecx, %ecx
+    0x48, 0x8d, 0x3d, 0x00, 0x00, 0x00, 0x00,  // lea main(%rip), %rdi
+    0xff, 0x15, 0x00, 0x00, 0x00, 0x00,        // call *GOT(%rip)
+    0xf4,                                      // hlt
+};
+#define ELF_START_MAIN_DISP 23
+#define ELF_START_LIBC_DISP 29
+
+// The input object, read in memory, and where its sections end up
+typedef struct {
+    u8* ob_data;
+    u64 ob_size;
+    const elf64_shdr_t* ob_shdrs;
+    const elf64_sym_t* ob_syms;
+    const char* ob_strtab;
+    i32 ob_shdrs_len, ob_syms_len;
+    u64 *ob_addrs /* Section -> address, 0 when not loaded */,
+        *ob_offsets /* Section -> offset in the output file */;
+} elf_obj_t;
+
+// A GOT slot holds either the address of a symbol of the object, resolved
+// at link time, or of a libc symbol, resolved by the dynamic loader. Each
+// libc symbol also has a PLT entry jumping through its slot
+typedef struct {
+    const char* go_name;  // libc symbols
+    i32 go_sym;           // Symbols of the object, -1 for libc symbols
+} elf_got_t;
+
+#define ELF_DYNAMIC_LEN 13
+
+// File offsets, which are also the addresses minus ELF_BASE_ADDR since the
+// writable segment starts on its own page
+typedef struct {
+    const mkt_asm_t* li_as;
+    elf_obj_t li_obj;
+    elf_got_t* li_got;
+    char* li_dynstr;
+    u32* li_import_names;
+    i32 li_imports_len;
+    u64 li_interp, li_hash, li_dynsym, li_dynstr_offset, li_rela, li_start,
+        li_plt, li_text, li_rx_end, li_dynamic, li_got_offset, li_rw_end,
+        li_bss_end;
+    u64 li_got_addr, li_plt_addr;
+    u8* li_image;
+} elf_linker_t;
+
+static u64 elf_align(u64 n, u64 alignment) {
+    return alignment > 1 ? (n + alignment - 1) / alignment * alignment : n;
+}
+
+static mkt_res_t elf_obj_read(const char* path, elf_obj_t* obj) {
+    CHECK((void*)path, !=, NULL, "%p");
+    CHECK((void*)obj, !=, NULL, "%p");
+
+    const i32 fd = open(path, O_RDONLY);
+    struct stat st = {0};
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open `%s`: %s\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return RES_FAILED_LD;
+    }
+    obj->ob_size = st.st_size;
+    obj->ob_data = malloc(obj->ob_size);
+    CHECK((void*)obj->ob_data, !=, NULL, "%p");
+    const ssize_t read_bytes = read(fd, obj->ob_data, obj->ob_size);
+    close(fd);
+    if (read_bytes != (ssize_t)obj->ob_size) {
+        fprintf(stderr, "Failed to read `%s`: %s\n", path, strerror(errno));
+        return RES_FAILED_LD;
+    }
+
+    const elf64_ehdr_t* const ehdr = (const elf64_ehdr_t*)obj->ob_data;
+    if (obj->ob_size < sizeof(*ehdr) ||
+        memcmp(ehdr->e_ident, "\x7f" "ELF\x02\x01", 6) != 0 ||
+        ehdr->e_type != ELF_ET_REL || ehdr->e_machine != ELF_EM_X86_64 ||
+        ehdr->e_shoff + (u64)ehdr->e_shnum * sizeof(elf64_shdr_t) >
+            obj->ob_size) {
+        fprintf(stderr, "`%s` is not an x86_64 ELF64 relocatable object\n",
+                path);
+        return RES_FAILED_LD;
+    }
+
+    obj->ob_shdrs = (const elf64_shdr_t*)&obj->ob_data[ehdr->e_shoff];
+    obj->ob_shdrs_len = ehdr->e_shnum;
+    for (i32 i = 0; i < obj->ob_shdrs_len; i++) {
+        const elf64_shdr_t* const shdr = &obj->ob_shdrs[i];
+        if (shdr->sh_type != ELF_SHT_NOBITS &&
+            shdr->sh_offset + shdr->sh_size > obj->ob_size) {
+            fprintf(stderr, "`%s`: section #%d out of bounds\n", path, i);
+            return RES_FAILED_LD;
+        }
+        if (shdr->sh_type != 2 /* SHT_SYMTAB */) continue;
+
+        obj->ob_syms = (const elf64_sym_t*)&obj->ob_data[shdr->sh_offset];
+        obj->ob_syms_len = shdr->sh_size / sizeof(elf64_sym_t);
+        obj->ob_strtab =
+            (const char*)&obj->ob_data[obj->ob_shdrs[shdr->sh_link].sh_offset];
+    }
+    if (obj->ob_syms == NULL) {
+        fprintf(stderr, "`%s` has no symbol table\n", path);
+        return RES_FAILED_LD;
+    }
+
+    obj->ob_addrs = calloc(obj->ob_shdrs_len, sizeof(u64));
+    obj->ob_offsets = calloc(obj->ob_shdrs_len, sizeof(u64));
+    CHECK((void*)obj->ob_addrs, !=, NULL, "%p");
+    CHECK((void*)obj->ob_offsets, !=, NULL, "%p");
+
+    return RES_OK;
+}
+
+static bool elf_section_is_loaded(const elf64_shdr_t* shdr) {
+    return (shdr->sh_flags & ELF_SHF_ALLOC) &&
+           (shdr->sh_type == ELF_SHT_PROGBITS ||
+            shdr->sh_type == ELF_SHT_NOBITS ||
+            shdr->sh_type == ELF_SHT_X86_64_UNWIND);
+}
+
+// Global symbol defined by the object, -1 if none
+static i32 elf_obj_find(const elf_obj_t* obj, const char* name) {
+    for (i32 i = 1; i < obj->ob_syms_len; i++) {
+        const elf64_sym_t* const sym = &obj->ob_syms[i];
+        if ((sym->st_info >> 4) != ELF_STB_LOCAL &&
+            sym->st_shndx != ELF_SHN_UNDEF &&
+            strcmp(&obj->ob_strtab[sym->st_name], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Symbol of the object not defined by it: a libc symbol
+static bool elf_obj_sym_is_import(const elf_obj_t* obj, i32 sym) {
+    return obj->ob_syms[sym].st_shndx == ELF_SHN_UNDEF;
+}
+
+static i32 elf_got_find(const elf_linker_t* li, const char* name, i32 sym) {
+    for (i32 i = 0; i < (i32)buf_size(li->li_got); i++) {
+        const elf_got_t* const got = &li->li_got[i];
+        if (sym >= 0 ? got->go_sym == sym
+                     : got->go_sym == -1 && strcmp(got->go_name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// libc symbols come first in the GOT, in the same order as in the dynamic
+// symbol table and the PLT
+static i32 elf_got_import(elf_linker_t* li, const char* name) {
+    const i32 slot = elf_got_find(li, name, -1);
+    if (slot >= 0) return slot;
+
+    CHECK(li->li_imports_len, ==, (i32)buf_size(li->li_got), "%d");
+    const elf_got_t got = {.go_name = name, .go_sym = -1};
+    buf_push(li->li_got, got);
+    return li->li_imports_len++;
+}
+
+static bool elf_rel_is_got(u32 type) {
+    return type == ELF_R_X86_64_GOTPCREL || type == ELF_R_X86_64_GOTPCRELX ||
+           type == ELF_R_X86_64_REX_GOTPCRELX;
+}
+
+// First pass over the relocations: collect the libc symbols and the GOT
+static mkt_res_t elf_collect_got(elf_linker_t* li) {
+    const elf_obj_t* const obj = &li->li_obj;
+
+    elf_got_import(li, "__libc_start_main");
+    for (i32 i = 0; i < (i32)buf_size(li->li_as->as_fixups); i++) {
+        const i32 sym = li->li_as->as_fixups[i].fi_sym;
+        if (li->li_as->as_syms[sym].sy_offset != -1) continue;
+
+        const char* const name = asm_sym_name(li->li_as, sym);
+        if (elf_obj_find(obj, name) == -1) elf_got_import(li, name);
+    }
+
+    // Imports first, then slots for symbols of the object
+    elf_got_t* locals = NULL;
+    for (i32 s = 0; s < obj->ob_shdrs_len; s++) {
+        const elf64_shdr_t* const shdr = &obj->ob_shdrs[s];
+        if (shdr->sh_type != ELF_SHT_RELA ||
+            !elf_section_is_loaded(&obj->ob_shdrs[shdr->sh_info]))
+            continue;
+
+        const elf64_rela_t* const relas =
+            (const elf64_rela_t*)&obj->ob_data[shdr->sh_offset];
+        for (u64 r = 0; r < shdr->sh_size / sizeof(elf64_rela_t); r++) {
+            const i32 sym = relas[r].r_info >> 32;
+            const u32 type = relas[r].r_info & 0xffffffff;
+            if (sym == 0) continue;
+
+            if (elf_obj_sym_is_import(obj, sym)) {
+                elf_got_import(li, &obj->ob_strtab[obj->ob_syms[sym].st_name]);
+                continue;
+            }
+            if (!elf_rel_is_got(type)) continue;
+
+            bool found = false;
+            for (i32 i = 0; i < (i32)buf_size(locals); i++)
+                found |= locals[i].go_sym == sym;
+            if (!found) buf_push(locals, ((elf_got_t){.go_sym = sym}));
+        }
+    }
+    for (i32 i = 0; i < (i32)buf_size(locals); i++)
+        buf_push(li->li_got, locals[i]);
+    buf_free(locals);
+
+    return RES_OK;
+}
+
+// Address of a symbol of the object, or of the PLT entry of a libc symbol
+static u64 elf_obj_sym_addr(const elf_linker_t* li, i32 sym) {
+    const elf_obj_t* const obj = &li->li_obj;
+    const elf64_sym_t* const s = &obj->ob_syms[sym];
+
+    if (s->st_shndx == ELF_SHN_ABS) return s->st_value;
+    if (s->st_shndx == ELF_SHN_UNDEF) {
+        const i32 slot = elf_got_find(li, &obj->ob_strtab[s->st_name], -1);
+        CHECK(slot, >=, 0, "%d");
+        return li->li_plt_addr + (u64)slot * ELF_PLT_ENTRY_SIZE;
+    }
+    CHECK(s->st_shndx, <, obj->ob_shdrs_len, "%d");
+    return obj->ob_addrs[s->st_shndx] + s->st_value;
+}
+
+static void elf_write_u32(u8* at, u32 n) { memcpy(at, &n, sizeof(n)); }
+
+static void elf_write_u64(u8* at, u64 n) { memcpy(at, &n, sizeof(n)); }
+
+static mkt_res_t elf_write_rel32(u8* at, i64 value) {
+    if (value != (i32)value) {
+        fprintf(stderr, "Relocation out of range: %lld\n", (long long)value);
+        return RES_FAILED_LD;
+    }
+    elf_write_u32(at, (u32)value);
+    return RES_OK;
+}
+
+// Second pass over the relocations: patch the loaded sections
+static mkt_res_t elf_relocate(elf_linker_t* li) {
+    const elf_obj_t* const obj = &li->li_obj;
+
+    for (i32 s = 0; s < obj->ob_shdrs_len; s++) {
+        const elf64_shdr_t* const shdr = &obj->ob_shdrs[s];
+        const i32 target = shdr->sh_info;
+        if (shdr->sh_type != ELF_SHT_RELA ||
+            !elf_section_is_loaded(&obj->ob_shdrs[target]) ||
+            obj->ob_shdrs[target].sh_type == ELF_SHT_NOBITS)
+            continue;
+
+        const elf64_rela_t* const relas =
+            (const elf64_rela_t*)&obj->ob_data[shdr->sh_offset];
+        for (u64 r = 0; r < shdr->sh_size / sizeof(elf64_rela_t); r++) {
+            const elf64_rela_t rela = relas[r];
+            const i32 sym = rela.r_info >> 32;
+            const u32 type = rela.r_info & 0xffffffff;
+            const u64 p = obj->ob_addrs[target] + rela.r_offset;
+            u8* const at =
+                &li->li_image[obj->ob_offsets[target] + rela.r_offset];
+            const u64 s_addr = sym == 0 ? 0 : elf_obj_sym_addr(li, sym);
+            const bool is_import = sym != 0 && elf_obj_sym_is_import(obj, sym);
+
+            switch (type) {
+                case ELF_R_X86_64_NONE:
+                    break;
+                case ELF_R_X86_64_64:
+                    if (is_import) goto unsupported;
+                    elf_write_u64(at, s_addr + rela.r_addend);
+                    break;
+                case ELF_R_X86_64_PC32:
+                case ELF_R_X86_64_PLT32:
+                    TRY_OK(elf_write_rel32(at, s_addr + rela.r_addend - p));
+                    break;
+                case ELF_R_X86_64_32:
+                case ELF_R_X86_64_32S:
+                    if (is_import) goto unsupported;
+                    elf_write_u32(at, s_addr + rela.r_addend);
+                    break;
+                case ELF_R_X86_64_GOTPCREL:
+                case ELF_R_X86_64_GOTPCRELX:
+                case ELF_R_X86_64_REX_GOTPCRELX: {
+                    const char* const name =
+                        &obj->ob_strtab[obj->ob_syms[sym].st_name];
+                    const i32 slot = is_import ? elf_got_find(li, name, -1)
+                                               : elf_got_find(li, NULL, sym);
+                    CHECK(slot, >=, 0, "%d");
+                    const u64 g = li->li_got_addr + 8 * (u64)slot;
+                    TRY_OK(elf_write_rel32(at, g + rela.r_addend - p));
+                    break;
+                }
+                default:
+                unsupported:
+                    fprintf(stderr,
+                            "Unsupported relocation type %u to `%s` in the "
+                            "runtime object\n",
+                            type, &obj->ob_strtab[obj->ob_syms[sym].st_name]);
+                    return RES_FAILED_LD;
+            }
+        }
+    }
+    return RES_OK;
+}
+
+// Sections of the object of one kind: 0 for code, 1 for read-only data, 2
+// for writable data and 3 for zero-initialized data
+static u64 elf_layout_sections(elf_obj_t* obj, i32 kind, u64 offset) {
+    for (i32 s = 0; s < obj->ob_shdrs_len; s++) {
+        const elf64_shdr_t* const shdr = &obj->ob_shdrs[s];
+        if (!elf_section_is_loaded(shdr)) continue;
+
+        const i32 section_kind = (shdr->sh_flags & ELF_SHF_EXECINSTR) ? 0
+                                 : !(shdr->sh_flags & ELF_SHF_WRITE)  ? 1
+                                 : shdr->sh_type != ELF_SHT_NOBITS    ? 2
+                                                                      : 3;
+        if (section_kind != kind) continue;
+
+        offset = elf_align(offset, shdr->sh_addralign);
+        obj->ob_offsets[s] = offset;
+        obj->ob_addrs[s] = ELF_BASE_ADDR + offset;
+        offset += shdr->sh_size;
+    }
+    return offset;
+}
+
+static void elf_layout(elf_linker_t* li) {
+    elf_obj_t* const obj = &li->li_obj;
+
+    // Dynamic string table: libc, then the names of the imports
+    buf_push(li->li_dynstr, 0);
+    for (u64 i = 0; i < sizeof(elf_libc); i++)
+        buf_push(li->li_dynstr, elf_libc[i]);
+    for (i32 i = 0; i < li->li_imports_len; i++) {
+        buf_push(li->li_import_names, buf_size(li->li_dynstr));
+        const char* const name = li->li_got[i].go_name;
+        for (u64 c = 0; c <= strlen(name); c++)
+            buf_push(li->li_dynstr, name[c]);
+    }
+    const i32 dynsyms_len = 1 + li->li_imports_len;
+
+    // Read-only and executable segment: headers, dynamic linking tables,
+    // code, read-only data
+    u64 offset = sizeof(elf64_ehdr_t) + ELF_PHDRS_LEN * sizeof(elf64_phdr_t);
+    li->li_interp = offset;
+    offset += sizeof(elf_interp);
+    li->li_hash = offset = elf_align(offset, 8);
+    offset += (2 + 1 + dynsyms_len) * sizeof(u32);
+    li->li_dynsym = offset = elf_align(offset, 8);
+    offset += dynsyms_len * sizeof(elf64_sym_t);
+    li->li_dynstr_offset = offset;
+    offset += buf_size(li->li_dynstr);
+    li->li_rela = offset = elf_align(offset, 8);
+    offset += li->li_imports_len * sizeof(elf64_rela_t);
+
+    li->li_start = offset = elf_align(offset, 16);
+    offset += sizeof(elf_start);
+    li->li_plt = offset = elf_align(offset, 16);
+    offset += li->li_imports_len * ELF_PLT_ENTRY_SIZE;
+    li->li_text = offset = elf_align(offset, 16);
+    offset += buf_size(li->li_as->as_text);
+    offset = elf_layout_sections(obj, 0, offset);
+    li->li_rx_end = offset = elf_layout_sections(obj, 1, offset);
+
+    // Writable segment, on its own page
+    li->li_dynamic = offset = elf_align(offset, ELF_PAGE_SIZE);
+    offset += ELF_DYNAMIC_LEN * sizeof(elf64_dyn_t);
+    li->li_got_offset = offset;
+    offset += buf_size(li->li_got) * sizeof(u64);
+    li->li_rw_end = offset = elf_layout_sections(obj, 2, offset);
+    li->li_bss_end = elf_layout_sections(obj, 3, offset);
+
+    li->li_got_addr = ELF_BASE_ADDR + li->li_got_offset;
+    li->li_plt_addr = ELF_BASE_ADDR + li->li_plt;
+}
+
+static void elf_write_headers(elf_linker_t* li) {
+    u8* const image = li->li_image;
+
+    const elf64_ehdr_t ehdr = {
+        .e_ident = {0x7f, 'E', 'L', 'F', 2 /* 64 bits */,
+                    1 /* Little endian */, 1 /* Version */},
+        .e_type = ELF_ET_EXEC,
+        .e_machine = ELF_EM_X86_64,
+        .e_version = 1,
+        .e_entry = ELF_BASE_ADDR + li->li_start,
+        .e_phoff = sizeof(elf64_ehdr_t),
+        .e_ehsize = sizeof(elf64_ehdr_t),
+        .e_phentsize = sizeof(elf64_phdr_t),
+        .e_phnum = ELF_PHDRS_LEN,
+    };
+    memcpy(image, &ehdr, sizeof(ehdr));
+
+    const u64 phdrs_size = ELF_PHDRS_LEN * sizeof(elf64_phdr_t);
+    const u64 rw_file_size = li->li_rw_end - li->li_dynamic;
+    const elf64_phdr_t phdrs[ELF_PHDRS_LEN] = {
+        {.p_type = ELF_PT_PHDR,
+         .p_flags = ELF_PF_R,
+         .p_offset = sizeof(elf64_ehdr_t),
+         .p_vaddr = ELF_BASE_ADDR + sizeof(elf64_ehdr_t),
+         .p_filesz = phdrs_size,
+         .p_memsz = phdrs_size,
+         .p_align = 8},
+        {.p_type = ELF_PT_INTERP,
+         .p_flags = ELF_PF_R,
+         .p_offset = li->li_interp,
+         .p_vaddr = ELF_BASE_ADDR + li->li_interp,
+         .p_filesz = sizeof(elf_interp),
+         .p_memsz = sizeof(elf_interp),
+         .p_align = 1},
+        {.p_type = ELF_PT_LOAD,
+         .p_flags = ELF_PF_R | ELF_PF_X,
+         .p_vaddr = ELF_BASE_ADDR,
+         .p_filesz = li->li_rx_end,
+         .p_memsz = li->li_rx_end,
+         .p_align = ELF_PAGE_SIZE},
+        {.p_type = ELF_PT_LOAD,
+         .p_flags = ELF_PF_R | ELF_PF_W,
+         .p_offset = li->li_dynamic,
+         .p_vaddr = ELF_BASE_ADDR + li->li_dynamic,
+         .p_filesz = rw_file_size,
+         .p_memsz = li->li_bss_end - li->li_dynamic,
+         .p_align = ELF_PAGE_SIZE},
+        {.p_type = ELF_PT_DYNAMIC,
+         .p_flags = ELF_PF_R | ELF_PF_W,
+         .p_offset = li->li_dynamic,
+         .p_vaddr = ELF_BASE_ADDR + li->li_dynamic,
+         .p_filesz = ELF_DYNAMIC_LEN * sizeof(elf64_dyn_t),
+         .p_memsz = ELF_DYNAMIC_LEN * sizeof(elf64_dyn_t),
+         .p_align = 8},
+        {.p_type = ELF_PT_GNU_STACK,
+         .p_flags = ELF_PF_R | ELF_PF_W,
+         .p_align = 16},
+    };
+    memcpy(&image[sizeof(ehdr)], phdrs, sizeof(phdrs));
+}
+
+static void elf_write_dynamic(elf_linker_t* li) {
+    u8* const image = li->li_image;
+    const i32 dynsyms_len = 1 + li->li_imports_len;
+
+    // A single bucket chaining all symbols
+    u32* const hash = (u32*)&image[li->li_hash];
+    hash[0] = 1;
+    hash[1] = dynsyms_len;
+    hash[2] = dynsyms_len - 1;
+    for (i32 i = 1; i < dynsyms_len; i++) hash[3 + i] = i - 1;
+
+    memcpy(&image[li->li_interp], elf_interp, sizeof(elf_interp));
+    memcpy(&image[li->li_dynstr_offset], li->li_dynstr,
+           buf_size(li->li_dynstr));
+
+    elf64_sym_t* const dynsyms = (elf64_sym_t*)&image[li->li_dynsym];
+    elf64_rela_t* const relas = (elf64_rela_t*)&image[li->li_rela];
+    for (i32 i = 0; i < li->li_imports_len; i++) {
+        dynsyms[1 + i] = (elf64_sym_t){.st_name = li->li_import_names[i],
+                                       .st_info = 1 << 4 /* Global */};
+        relas[i] = (elf64_rela_t){
+            .r_offset = li->li_got_addr + 8 * (u64)i,
+            .r_info = ((u64)(1 + i) << 32) | ELF_R_X86_64_GLOB_DAT};
+    }
+
+    // libc symbols are resolved upfront so that the PLT needs no lazy binding
+    const elf64_dyn_t dynamic[ELF_DYNAMIC_LEN] = {
+        {ELF_DT_NEEDED, 1 /* Offset of libc in dynstr */},
+        {ELF_DT_HASH, ELF_BASE_ADDR + li->li_hash},
+        {ELF_DT_STRTAB, ELF_BASE_ADDR + li->li_dynstr_offset},
+        {ELF_DT_SYMTAB, ELF_BASE_ADDR + li->li_dynsym},
+        {ELF_DT_STRSZ, buf_size(li->li_dynstr)},
+        {ELF_DT_SYMENT, sizeof(elf64_sym_t)},
+        {ELF_DT_RELA, ELF_BASE_ADDR + li->li_rela},
+        {ELF_DT_RELASZ, li->li_imports_len * sizeof(elf64_rela_t)},
+        {ELF_DT_RELAENT, sizeof(elf64_rela_t)},
+        {ELF_DT_FLAGS, ELF_DF_BIND_NOW},
+        {ELF_DT_FLAGS_1, ELF_DF_1_NOW},
+        {ELF_DT_DEBUG, 0},
+        {ELF_DT_NULL, 0},
+    };
+    memcpy(&image[li->li_dynamic], dynamic, sizeof(dynamic));
+
+    // Slots of the symbols of the object, the others are zero until loading
+    for (i32 i = li->li_imports_len; i < (i32)buf_size(li->li_got); i++)
+        elf_write_u64(&image[li->li_got_offset + 8 * (u64)i],
+                      elf_obj_sym_addr(li, li->li_got[i].go_sym));
+}
+
+// Entry point, PLT and the generated code with its references to the
+// runtime resolved
+static mkt_res_t elf_write_text(elf_linker_t* li) {
+    const mkt_asm_t* const as = li->li_as;
+    u8* const image = li->li_image;
+
+    i32 main_sym = -1;
+    for (i32 i = 0; i < (i32)buf_size(as->as_syms) && main_sym == -1; i++)
+        if (strcmp(asm_sym_name(as, i), "main") == 0) main_sym = i;
+    if (main_sym == -1 || as->as_syms[main_sym].sy_offset == -1) {
+        fprintf(stderr, "Missing `main` function\n");
+        return RES_FAILED_LD;
+    }
+
+    memcpy(&image[li->li_start], elf_start, sizeof(elf_start));
+    const u64 main_addr =
+        ELF_BASE_ADDR + li->li_text + as->as_syms[main_sym].sy_offset;
+    const u64 start_addr = ELF_BASE_ADDR + li->li_start;
+    TRY_OK(elf_write_rel32(&image[li->li_start + ELF_START_MAIN_DISP],
+                           main_addr - (start_addr + ELF_START_MAIN_DISP + 4)));
+    const i32 libc_start_main = elf_got_find(li, "__libc_start_main", -1);
+    TRY_OK(elf_write_rel32(&image[li->li_start + ELF_START_LIBC_DISP],
+                           li->li_got_addr + 8 * (u64)libc_start_main -
+                               (start_addr + ELF_START_LIBC_DISP + 4)));
+
+    for (i32 i = 0; i < li->li_imports_len; i++) {
+        // jmp *slot(%rip), then a 2 bytes nop
+        u8* const entry = &image[li->li_plt + i * ELF_PLT_ENTRY_SIZE];
+        const u64 entry_addr = li->li_plt_addr + i * ELF_PLT_ENTRY_SIZE;
+        entry[0] = 0xff;
+        entry[1] = 0x25;
+        TRY_OK(elf_write_rel32(&entry[2], li->li_got_addr + 8 * (u64)i -
+                                              (entry_addr + 6)));
+        entry[6] = 0x66;
+        entry[7] = 0x90;
+    }
+
+    memcpy(&image[li->li_text], as->as_text, buf_size(as->as_text));
+    for (i32 i = 0; i < (i32)buf_size(as->as_fixups); i++) {
+        const mkt_asm_fixup_t fixup = as->as_fixups[i];
+        const i32 offset = as->as_syms[fixup.fi_sym].sy_offset;
+        if (fixup.fi_kind == FIX_ABS64) {
+            // Only to the generated code or its data
+            CHECK(offset, !=, -1, "%d");
+            elf_write_u64(&image[li->li_text + fixup.fi_offset],
+                          ELF_BASE_ADDR + li->li_text + offset +
+                              fixup.fi_addend);
+            continue;
+        }
+
+        const char* const name = asm_sym_name(as, fixup.fi_sym);
+        const i32 sym = elf_obj_find(&li->li_obj, name);
+        const u64 target =
+            sym >= 0 ? elf_obj_sym_addr(li, sym)
+                     : li->li_plt_addr + (u64)elf_got_find(li, name, -1) *
+                                             ELF_PLT_ENTRY_SIZE;
+        const u64 p = ELF_BASE_ADDR + li->li_text + fixup.fi_offset;
+        TRY_OK(elf_write_rel32(&image[li->li_text + fixup.fi_offset],
+                               target + fixup.fi_addend - p));
+    }
+
+    return RES_OK;
+}
+
+static mkt_res_t elf_link(elf_linker_t* li, const char* stdlib_path,
+                          const char* exe_path) {
+    elf_obj_t* const obj = &li->li_obj;
+    TRY_OK(elf_obj_read(stdlib_path, obj));
+    TRY_OK(elf_collect_got(li));
+    elf_layout(li);
+
+    li->li_image = calloc(li->li_rw_end, 1);
+    CHECK((void*)li->li_image, !=, NULL, "%p");
+
+    for (i32 s = 0; s < obj->ob_shdrs_len; s++) {
+        const elf64_shdr_t* const shdr = &obj->ob_shdrs[s];
+        if (!elf_section_is_loaded(shdr) || shdr->sh_type == ELF_SHT_NOBITS)
+            continue;
+        memcpy(&li->li_image[obj->ob_offsets[s]],
+               &obj->ob_data[shdr->sh_offset], shdr->sh_size);
+    }
+    elf_write_headers(li);
+    elf_write_dynamic(li);
+    TRY_OK(elf_write_text(li));
+    TRY_OK(elf_relocate(li));
+
+    const i32 fd = open(exe_path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open `%s`: %s\n", exe_path,
+                strerror(errno));
+        return RES_FAILED_LD;
+    }
+    const ssize_t written = write(fd, li->li_image, li->li_rw_end);
+    close(fd);
+    if (written != (ssize_t)li->li_rw_end) {
+        fprintf(stderr, "Failed to write `%s`: %s\n", exe_path,
+                strerror(errno));
+        return RES_FAILED_LD;
+    }
+
+    return RES_OK;
+}
+
+static mkt_res_t elf_write_exe(const mkt_asm_t* as, const char* stdlib_path,
+                               const char* exe_path) {
+    CHECK((void*)as, !=, NULL, "%p");
+    CHECK(asm_is_text(as), ==, false, "%d");
+    CHECK((void*)stdlib_path, !=, NULL, "%p");
+    CHECK((void*)exe_path, !=, NULL, "%p");
+
+    elf_linker_t li = {.li_as = as};
+    const mkt_res_t res = elf_link(&li, stdlib_path, exe_path);
+
+    buf_free(li.li_got);
+    buf_free(li.li_dynstr);
+    buf_free(li.li_import_names);
+    free(li.li_image);
+    free(li.li_obj.ob_data);
+    free(li.li_obj.ob_addrs);
+    free(li.li_obj.ob_offsets);
+    return res;
+}
@@ -0,0 +1,7 @@
+fun main() {
+    val x: Long = 5L
+    fun add(y: Long): Long {
+        return x + y
+    }
+    println(add(1L))
+}
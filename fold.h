@@ -0,0 +1,364 @@
+#pragma once
+
+#include "parse.h"
+
+// Constant folding over the AST, run once after parsing. Constant subtrees
+// are replaced by literal nodes, so that the later stages have less to do.
+typedef struct {
+    parser_t* fo_parser;
+    i32* fo_val_literals;  // `val` definition node -> literal node, or -1
+    i32 fo_nodes_len;      // Number of nodes before folding
+} folder_t;
+
+static i32 fold_node(folder_t* fo, i32 node_i);
+
+static bool fold_is_literal(const folder_t* fo, i32 node_i) {
+    if (node_i < 0) return false;
+
+    const mkt_node_kind_t kind = fo->fo_parser->par_nodes[node_i].no_kind;
+    return kind == NODE_NUM || kind == NODE_CHAR || kind == NODE_KEYWORD_BOOL;
+}
+
+static i64 fold_literal_val(const folder_t* fo, i32 node_i) {
+    CHECK(fold_is_literal(fo, node_i), ==, true, "%d");
+
+    return fo->fo_parser->par_nodes[node_i].no_n.no_num.nu_val;
+}
+
+static bool fold_type_is_integer(const folder_t* fo, i32 type_i) {
+    const mkt_type_kind_t kind = fo->fo_parser->par_types[type_i].ty_kind;
+    return kind == TYPE_LONG || kind == TYPE_INT || kind == TYPE_SHORT ||
+           kind == TYPE_BYTE;
+}
+
+// Same semantics as the generated code: integers smaller than a Long wrap
+// around and are sign extended
+static i64 fold_narrow(const folder_t* fo, i32 type_i, i64 val) {
+    switch (fo->fo_parser->par_types[type_i].ty_kind) {
+        case TYPE_INT:
+            return (i32)val;
+        case TYPE_SHORT:
+            return (i16)val;
+        case TYPE_BYTE:
+            return (i8)val;
+        default:
+            return val;
+    }
+}
+
+static i32 fold_literal_make(folder_t* fo, i32 type_i, i32 tok_i, i64 val) {
+    const i32 node_i = node_make_num(fo->fo_parser, type_i, tok_i, val);
+    if (fo->fo_parser->par_types[type_i].ty_kind == TYPE_CHAR)
+        fo->fo_parser->par_nodes[node_i].no_kind = NODE_CHAR;
+
+    return node_i;
+}
+
+// Variables are the only expressions without side effects which are not
+// literals
+static bool fold_is_pure(const folder_t* fo, i32 node_i) {
+    const mkt_node_kind_t kind = fo->fo_parser->par_nodes[node_i].no_kind;
+    return fold_is_literal(fo, node_i) || kind == NODE_VAR;
+}
+
+static bool fold_is_val(const folder_t* fo, i32 node_i, i64 val) {
+    return fold_is_literal(fo, node_i) && fold_literal_val(fo, node_i) == val;
+}
+
+// `x + 0`, `x * 1`, etc
+static i32 fold_simplify_binary(folder_t* fo, i32 node_i) {
+    const mkt_node_t* const node = &fo->fo_parser->par_nodes[node_i];
+    const mkt_binary_t bin = node->no_n.no_binary;
+    if (!fold_type_is_integer(fo, node->no_type_i)) return node_i;
+
+    switch (node->no_kind) {
+        case NODE_ADD:
+            if (fold_is_val(fo, bin.bi_rhs_i, 0)) return bin.bi_lhs_i;
+            if (fold_is_val(fo, bin.bi_lhs_i, 0)) return bin.bi_rhs_i;
+            return node_i;
+        case NODE_SUBTRACT:
+            if (fold_is_val(fo, bin.bi_rhs_i, 0)) return bin.bi_lhs_i;
+            return node_i;
+        case NODE_MULTIPLY:
+            if (fold_is_val(fo, bin.bi_rhs_i, 1)) return bin.bi_lhs_i;
+            if (fold_is_val(fo, bin.bi_lhs_i, 1)) return bin.bi_rhs_i;
+            if ((fold_is_val(fo, bin.bi_rhs_i, 0) &&
+                 fold_is_pure(fo, bin.bi_lhs_i)) ||
+                (fold_is_val(fo, bin.bi_lhs_i, 0) &&
+                 fold_is_pure(fo, bin.bi_rhs_i)))
+                return fold_literal_make(fo, node->no_type_i,
+                                         node_first_token(fo->fo_parser,
+                                                          node_i),
+                                         0);
+            return node_i;
+        case NODE_DIVIDE:
+            if (fold_is_val(fo, bin.bi_rhs_i, 1)) return bin.bi_lhs_i;
+            return node_i;
+        default:
+            return node_i;
+    }
+}
+
+static i32 fold_binary(folder_t* fo, i32 node_i) {
+    mkt_binary_t bin = fo->fo_parser->par_nodes[node_i].no_n.no_binary;
+    bin.bi_lhs_i = fold_node(fo, bin.bi_lhs_i);
+    bin.bi_rhs_i = fold_node(fo, bin.bi_rhs_i);
+
+    mkt_node_t* const node = &fo->fo_parser->par_nodes[node_i];
+    node->no_n.no_binary = bin;
+
+    if (!(fold_is_literal(fo, bin.bi_lhs_i) &&
+          fold_is_literal(fo, bin.bi_rhs_i)))
+        return fold_simplify_binary(fo, node_i);
+
+    const i32 type_i = node->no_type_i;
+    const mkt_node_kind_t kind = node->no_kind;
+    const i64 lhs = fold_literal_val(fo, bin.bi_lhs_i),
+              rhs = fold_literal_val(fo, bin.bi_rhs_i);
+    const bool is_integer = fold_type_is_integer(fo, type_i);
+    // Avoid signed overflow: the arithmetic is done on unsigned integers
+    const u64 ulhs = (u64)lhs, urhs = (u64)rhs;
+
+    i64 val = 0;
+    switch (kind) {
+        case NODE_ADD:
+            if (!is_integer) return node_i;
+            val = (i64)(ulhs + urhs);
+            break;
+        case NODE_SUBTRACT:
+            if (!is_integer) return node_i;
+            val = (i64)(ulhs - urhs);
+            break;
+        case NODE_MULTIPLY:
+            if (!is_integer) return node_i;
+            val = (i64)(ulhs * urhs);
+            break;
+        case NODE_DIVIDE:
+        case NODE_MODULO:
+            // Left to the runtime, which traps
+            if (!is_integer || rhs == 0 || (lhs == INT64_MIN && rhs == -1))
+                return node_i;
+            val = kind == NODE_DIVIDE ? lhs / rhs : lhs % rhs;
+            break;
+        case NODE_LT:
+            val = lhs < rhs;
+            break;
+        case NODE_LE:
+            val = lhs <= rhs;
+            break;
+        case NODE_EQ:
+            val = lhs == rhs;
+            break;
+        case NODE_NEQ:
+            val = lhs != rhs;
+            break;
+        default:
+            return node_i;
+    }
+
+    const i32 tok_i = node_first_token(fo->fo_parser, node_i);
+    return fold_literal_make(fo, type_i, tok_i, fold_narrow(fo, type_i, val));
+}
+
+// `true && x` is `x`, `false && x` is `false`, and conversely for `||`. The
+// right operand is only dropped when it would not have been evaluated
+static i32 fold_logical(folder_t* fo, i32 node_i) {
+    mkt_binary_t bin = fo->fo_parser->par_nodes[node_i].no_n.no_binary;
+    bin.bi_lhs_i = fold_node(fo, bin.bi_lhs_i);
+    bin.bi_rhs_i = fold_node(fo, bin.bi_rhs_i);
+    fo->fo_parser->par_nodes[node_i].no_n.no_binary = bin;
+
+    if (!fold_is_literal(fo, bin.bi_lhs_i)) return node_i;
+
+    const bool is_and = fo->fo_parser->par_nodes[node_i].no_kind == NODE_AND;
+    return fold_literal_val(fo, bin.bi_lhs_i) == is_and ? bin.bi_rhs_i
+                                                        : bin.bi_lhs_i;
+}
+
+static i32 fold_if(folder_t* fo, i32 node_i) {
+    mkt_if_t if_ = fo->fo_parser->par_nodes[node_i].no_n.no_if;
+    if_.if_node_cond_i = fold_node(fo, if_.if_node_cond_i);
+    if_.if_node_then_i = fold_node(fo, if_.if_node_then_i);
+    if_.if_node_else_i = fold_node(fo, if_.if_node_else_i);
+    fo->fo_parser->par_nodes[node_i].no_n.no_if = if_;
+
+    if (!fold_is_literal(fo, if_.if_node_cond_i)) return node_i;
+
+    const i32 taken_i = fold_literal_val(fo, if_.if_node_cond_i)
+                            ? if_.if_node_then_i
+                            : if_.if_node_else_i;
+    if (taken_i >= 0) {
+        // The branch is now the value of the `if` expression
+        const i32 type_i = fo->fo_parser->par_nodes[node_i].no_type_i;
+        mkt_node_t* const taken = &fo->fo_parser->par_nodes[taken_i];
+        if (taken->no_kind == NODE_BLOCK) taken->no_type_i = type_i;
+        return taken_i;
+    }
+
+    const i32 block_i = node_make_block(fo->fo_parser);
+    mkt_block_t* const block = &fo->fo_parser->par_nodes[block_i].no_n.no_block;
+    block->bl_first_tok_i = if_.if_first_tok_i;
+    block->bl_last_tok_i = if_.if_last_tok_i;
+    block->bl_parent_scope_i = -1;
+    return block_i;
+}
+
+static void fold_block(folder_t* fo, i32 node_i) {
+    const mkt_block_t block = fo->fo_parser->par_nodes[node_i].no_n.no_block;
+
+    for (i32 i = 0; i < (i32)buf_size(block.bl_nodes_i); i++) {
+        const i32 stmt_i = block.bl_nodes_i[i];
+        const mkt_node_t* const stmt = &fo->fo_parser->par_nodes[stmt_i];
+
+        // Definitions must stay in place, the NODE_ASSIGN following them
+        // holds the initial value
+        if (stmt->no_kind == NODE_VAR && stmt->no_n.no_var.va_var_node_i == -1)
+            continue;
+
+        block.bl_nodes_i[i] = fold_node(fo, stmt_i);
+    }
+}
+
+static i32 fold_assign(folder_t* fo, i32 node_i) {
+    mkt_binary_t bin = fo->fo_parser->par_nodes[node_i].no_n.no_binary;
+    bin.bi_rhs_i = fold_node(fo, bin.bi_rhs_i);
+    fo->fo_parser->par_nodes[node_i].no_n.no_binary = bin;
+
+    // Only the base of a member access is folded, a variable stays as is
+    if (fo->fo_parser->par_nodes[bin.bi_lhs_i].no_kind == NODE_MEMBER)
+        fold_node(fo, bin.bi_lhs_i);
+
+    const mkt_node_t* const lhs = &fo->fo_parser->par_nodes[bin.bi_lhs_i];
+
+    // A `val` initialized with a constant is itself a constant
+    if (lhs->no_kind == NODE_VAR && lhs->no_n.no_var.va_var_node_i == -1 &&
+        (lhs->no_n.no_var.va_flags & MKT_VAR_FLAGS_VAL) &&
+        bin.bi_lhs_i < fo->fo_nodes_len && fold_is_literal(fo, bin.bi_rhs_i)) {
+        const i32 type_i = lhs->no_type_i;
+        const i32 tok_i = lhs->no_n.no_var.va_tok_i;
+        const i64 val =
+            fold_narrow(fo, type_i, fold_literal_val(fo, bin.bi_rhs_i));
+        const i32 literal_i = fold_literal_make(fo, type_i, tok_i, val);
+        fo->fo_val_literals[bin.bi_lhs_i] = literal_i;
+    }
+
+    return node_i;
+}
+
+// Returns the node to use in place of `node_i`
+static i32 fold_node(folder_t* fo, i32 node_i) {
+    CHECK((void*)fo, !=, NULL, "%p");
+    if (node_i < 0) return node_i;
+    CHECK(node_i, <, (i32)buf_size(fo->fo_parser->par_nodes), "%d");
+
+    mkt_node_t* const node = &fo->fo_parser->par_nodes[node_i];
+
+    switch (node->no_kind) {
+        case NODE_BUILTIN_PRINTLN: {
+            const i32 arg_i =
+                fold_node(fo, node->no_n.no_builtin_println.bp_arg_i);
+            fo->fo_parser->par_nodes[node_i]
+                .no_n.no_builtin_println.bp_arg_i = arg_i;
+            return node_i;
+        }
+        case NODE_ADD:
+        case NODE_SUBTRACT:
+        case NODE_MULTIPLY:
+        case NODE_DIVIDE:
+        case NODE_MODULO:
+        case NODE_LT:
+        case NODE_LE:
+        case NODE_EQ:
+        case NODE_NEQ:
+            return fold_binary(fo, node_i);
+        case NODE_AND:
+        case NODE_OR:
+            return fold_logical(fo, node_i);
+        case NODE_NOT: {
+            const i32 first_tok_i = node->no_n.no_unary.un_first_tok_i;
+            const i32 operand_i = fold_node(fo, node->no_n.no_unary.un_node_i);
+            fo->fo_parser->par_nodes[node_i].no_n.no_unary.un_node_i =
+                operand_i;
+            if (!fold_is_literal(fo, operand_i)) return node_i;
+
+            return fold_literal_make(fo, TYPE_BOOL_I, first_tok_i,
+                                     !fold_literal_val(fo, operand_i));
+        }
+        case NODE_IF:
+            return fold_if(fo, node_i);
+        case NODE_BLOCK:
+            fold_block(fo, node_i);
+            return node_i;
+        case NODE_ASSIGN:
+            return fold_assign(fo, node_i);
+        case NODE_MEMBER: {
+            const i32 lhs_i = fold_node(fo, node->no_n.no_binary.bi_lhs_i);
+            fo->fo_parser->par_nodes[node_i].no_n.no_binary.bi_lhs_i = lhs_i;
+            return node_i;
+        }
+        case NODE_VAR: {
+            const mkt_var_t var = node->no_n.no_var;
+            if (var.va_var_node_i == -1 && node_i < fo->fo_nodes_len &&
+                fo->fo_val_literals[node_i] >= 0)
+                return fo->fo_val_literals[node_i];
+            return node_i;
+        }
+        case NODE_WHILE: {
+            mkt_while_t w = node->no_n.no_while;
+            w.wh_cond_i = fold_node(fo, w.wh_cond_i);
+            w.wh_body_i = fold_node(fo, w.wh_body_i);
+            fo->fo_parser->par_nodes[node_i].no_n.no_while = w;
+            return node_i;
+        }
+        case NODE_RETURN: {
+            const i32 val_i = fold_node(fo, node->no_n.no_return.re_node_i);
+            fo->fo_parser->par_nodes[node_i].no_n.no_return.re_node_i = val_i;
+            return node_i;
+        }
+        case NODE_CALL: {
+            const mkt_call_t call = node->no_n.no_call;
+            for (i32 i = 0; i < (i32)buf_size(call.ca_arg_nodes_i); i++)
+                call.ca_arg_nodes_i[i] = fold_node(fo, call.ca_arg_nodes_i[i]);
+            const i32 lhs_i = fold_node(fo, call.ca_lhs_node_i);
+            fo->fo_parser->par_nodes[node_i].no_n.no_call.ca_lhs_node_i = lhs_i;
+            return node_i;
+        }
+            // Nested functions are folded on their own
+        case NODE_FN:
+        case NODE_CLASS:
+        case NODE_INSTANCE:
+        case NODE_STRING:
+        case NODE_KEYWORD_BOOL:
+        case NODE_NUM:
+        case NODE_CHAR:
+            return node_i;
+        case NODE_COUNT:
+            UNREACHABLE();
+    }
+    UNREACHABLE();
+}
+
+static void fold(parser_t* parser) {
+    CHECK((void*)parser, !=, NULL, "%p");
+
+    folder_t fo = {.fo_parser = parser,
+                   .fo_nodes_len = buf_size(parser->par_nodes)};
+    buf_grow(fo.fo_val_literals, fo.fo_nodes_len);
+    for (i32 i = 0; i < fo.fo_nodes_len; i++) fo.fo_val_literals[i] = -1;
+
+    for (i32 c = 0; c < (i32)buf_size(parser->par_class_decls); c++) {
+        const i32 class_i = parser->par_class_decls[c];
+        CHECK(parser->par_nodes[class_i].no_kind, ==, NODE_CLASS, "%d");
+
+        const i32* const methods =
+            parser->par_nodes[class_i].no_n.no_class.cl_methods;
+        for (i32 m = 0; m < (i32)buf_size(methods); m++) {
+            const mkt_node_t* const fn = &parser->par_nodes[methods[m]];
+            CHECK(fn->no_kind, ==, NODE_FN, "%d");
+
+            fold_node(&fo, fn->no_n.no_fn.fd_body_node_i);
+        }
+    }
+
+    buf_free(fo.fo_val_literals);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string.h>
+
+#include "buf.h"
+#include "common.h"
+
+// String interning: equal strings get the same symbol, so that names can be
+// compared and hashed as integers
+typedef struct {
+    const char* is_str;  // Not owned, points into the source
+    i32 is_len;
+    u32 is_hash;
+} mkt_interned_t;
+
+typedef struct {
+    mkt_interned_t* in_strs;  // Symbol -> string
+    i32* in_table;  // Open addressing, the capacity is a power of two.
+                    // Slot -> symbol, or -1 when empty
+} mkt_interner_t;
+
+// FNV-1a
+static u32 intern_hash(const char* s, i32 len) {
+    u32 hash = 2166136261u;
+    for (i32 i = 0; i < len; i++) {
+        hash ^= (u8)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void intern_table_insert(mkt_interner_t* in, i32 sym) {
+    const u32 mask = buf_capacity(in->in_table) - 1;
+    u32 slot = in->in_strs[sym].is_hash & mask;
+    while (in->in_table[slot] != -1) slot = (slot + 1) & mask;
+
+    in->in_table[slot] = sym;
+}
+
+static void intern_grow(mkt_interner_t* in) {
+    const i32 cap = buf_capacity(in->in_table) ? 2 * buf_capacity(in->in_table)
+                                                : 64;
+    buf_free(in->in_table);
+    buf_grow(in->in_table, cap);
+    for (i32 i = 0; i < cap; i++) in->in_table[i] = -1;
+
+    for (i32 i = 0; i < (i32)buf_size(in->in_strs); i++)
+        intern_table_insert(in, i);
+}
+
+static i32 intern(mkt_interner_t* in, const char* s, i32 len) {
+    CHECK((void*)in, !=, NULL, "%p");
+    CHECK((void*)s, !=, NULL, "%p");
+    CHECK(len, >=, 0, "%d");
+
+    // Keep the load factor under 1/2
+    if (2 * buf_size(in->in_strs) >= buf_capacity(in->in_table))
+        intern_grow(in);
+
+    const u32 hash = intern_hash(s, len);
+    const u32 mask = buf_capacity(in->in_table) - 1;
+    u32 slot = hash & mask;
+    for (; in->in_table[slot] != -1; slot = (slot + 1) & mask) {
+        const mkt_interned_t* const str = &in->in_strs[in->in_table[slot]];
+        if (str->is_hash == hash && str->is_len == len &&
+            memcmp(str->is_str, s, len) == 0)
+            return in->in_table[slot];
+    }
+
+    buf_push(in->in_strs,
+             ((mkt_interned_t){.is_str = s, .is_len = len, .is_hash = hash}));
+    const i32 sym = buf_size(in->in_strs) - 1;
+    in->in_table[slot] = sym;
+
+    return sym;
+}
@@ -0,0 +1,1356 @@
+#pragma once
+
+#include "ast.h"
+#include "parse.h"
+
+// Lowered form of `par_nodes`: one mkt_ir_fn_t per function, made of basic
+// blocks of three-address instructions operating on virtual registers
+// (vregs). Locals (`val`/`var`) and parameters are vregs too since their
+// address can never be taken.
+
+typedef enum {
+    IR_IMM,      // ins_dst = ins_imm
+    IR_MOV,      // ins_dst = ins_lhs
+    IR_PARAM,    // ins_dst = argument #ins_imm
+    IR_ADD,      // ins_dst = ins_lhs + ins_rhs
+    IR_SUB,      // ins_dst = ins_lhs - ins_rhs
+    IR_MUL,      // ins_dst = ins_lhs * ins_rhs
+    IR_DIV,      // ins_dst = ins_lhs / ins_rhs
+    IR_MOD,      // ins_dst = ins_lhs % ins_rhs
+    IR_MULHI,    // ins_dst = high 64 bits of the signed ins_lhs * ins_imm
+    IR_SCALE,    // ins_dst = ins_lhs + ins_rhs * ins_imm, ins_imm being 1, 2,
+                 // 4 or 8
+    IR_SHL,      // ins_dst = ins_lhs << ins_imm
+    IR_SAR,      // ins_dst = ins_lhs >> ins_imm, arithmetic
+    IR_SHR,      // ins_dst = ins_lhs >> ins_imm, logical
+    IR_LT,       // ins_dst = ins_lhs < ins_rhs
+    IR_LE,       // ins_dst = ins_lhs <= ins_rhs
+    IR_EQ,       // ins_dst = ins_lhs == ins_rhs
+    IR_NEQ,      // ins_dst = ins_lhs != ins_rhs
+    IR_NOT,      // ins_dst = !ins_lhs
+    IR_SEXT,     // ins_dst = sign extension of the ins_size bytes of ins_lhs
+    IR_LOAD,     // ins_dst = *(ins_lhs + ins_imm), ins_size bytes
+    IR_STORE,    // *(ins_lhs + ins_imm) = ins_rhs, ins_size bytes
+    IR_FN_ADDR,  // ins_dst = address of the function ins_node_i
+    IR_STRING,   // ins_dst = address of the string literal ins_node_i
+    IR_CALL,     // ins_dst = (*ins_lhs)(ins_args...), or when ins_lhs is -1,
+                 // a direct call of the function ins_imm (a NODE_FN)
+    IR_CALL_RT,  // ins_dst = runtime function ins_imm (ins_args...)
+    IR_JMP,      // goto ins_target
+    IR_BR,       // if (ins_lhs) goto ins_target else goto ins_target_else
+    IR_BR_CMP,   // if (ins_lhs <op> ins_rhs) goto ins_target else goto
+                 // ins_target_else, <op> being the comparison ins_imm
+    IR_RET,      // return ins_lhs (-1 for none)
+    IR_PHI,      // ins_dst = ins_args[i] when coming from the block
+                 // ins_preds[i], -1 being undefined. Only in SSA form,
+                 // see ssa.h. ins_imm is the vreg before renaming
+    IR_COUNT,
+} mkt_ir_op_t;
+
+static const char mkt_ir_op_to_str[IR_COUNT][10] = {
+    [IR_IMM] = "imm",         [IR_MOV] = "mov",     [IR_PARAM] = "param",
+    [IR_ADD] = "add",         [IR_SUB] = "sub",     [IR_MUL] = "mul",
+    [IR_DIV] = "div",         [IR_MOD] = "mod",     [IR_MULHI] = "mulhi",
+    [IR_SCALE] = "scale",     [IR_SHL] = "shl",     [IR_SAR] = "sar",
+    [IR_SHR] = "shr",         [IR_LT] = "lt",       [IR_LE] = "le",
+    [IR_EQ] = "eq",           [IR_NEQ] = "neq",     [IR_NOT] = "not",
+    [IR_SEXT] = "sext",       [IR_LOAD] = "load",   [IR_STORE] = "store",
+    [IR_FN_ADDR] = "fn",      [IR_STRING] = "string", [IR_CALL] = "call",
+    [IR_CALL_RT] = "rt",      [IR_JMP] = "jmp",     [IR_BR] = "br",
+    [IR_BR_CMP] = "brcmp",    [IR_RET] = "ret",     [IR_PHI] = "phi",
+};
+
+// Functions of the runtime (see mkt_stdlib.c) called by generated code
+typedef enum {
+    RT_INSTANCE_MAKE,
+    RT_STRING_CONCAT,
+    RT_INT_PRINTLN,
+    RT_CHAR_PRINTLN,
+    RT_BOOL_PRINTLN,
+    RT_STRING_PRINTLN,
+    RT_INSTANCE_PRINTLN,
+    RT_COUNT,
+} mkt_ir_runtime_fn_t;
+
+static const char mkt_ir_runtime_fn_to_str[RT_COUNT][30] = {
+    [RT_INSTANCE_MAKE] = "mkt_instance_make",
+    [RT_STRING_CONCAT] = "mkt_string_concat",
+    [RT_INT_PRINTLN] = "mkt_int_println",
+    [RT_CHAR_PRINTLN] = "mkt_char_println",
+    [RT_BOOL_PRINTLN] = "mkt_bool_println",
+    [RT_STRING_PRINTLN] = "mkt_string_println",
+    [RT_INSTANCE_PRINTLN] = "mkt_instance_println",
+};
+
+typedef struct {
+    mkt_ir_op_t ins_op;
+    i32 ins_dst, ins_lhs, ins_rhs, ins_size, ins_target, ins_target_else,
+        ins_node_i /* Source node, for .loc and NODE_FN/NODE_STRING */,
+        *ins_args, *ins_preds;
+    i64 ins_imm, ins_rhs_imm /* When ins_rhs is IR_VREG_IMM or memory */;
+    bool ins_rhs_mem;  // The right operand is 8 bytes at ins_rhs+ins_rhs_imm
+} mkt_ir_ins_t;
+
+// In place of the vreg ins_rhs: the constant ins_rhs_imm, see ir_fold_imms
+static const i32 IR_VREG_IMM = -2;
+
+typedef struct {
+    mkt_ir_ins_t* bb_ins;
+} mkt_ir_block_t;
+
+typedef struct {
+    i32 vr_type_i;
+    bool vr_gc_ref;  // Holds a pointer to a GC object: String or instance
+} mkt_ir_vreg_t;
+
+typedef struct {
+    i32 irf_node_i, irf_arity;
+    mkt_ir_block_t* irf_blocks;  // In layout order, the first one is the entry
+    mkt_ir_vreg_t* irf_vregs;
+} mkt_ir_fn_t;
+
+typedef struct {
+    mkt_ir_fn_t* ir_fns;
+} mkt_ir_t;
+
+static bool ir_op_is_terminator(mkt_ir_op_t op) {
+    return op == IR_JMP || op == IR_BR || op == IR_BR_CMP || op == IR_RET;
+}
+
+// Calls into the runtime: they clobber the caller-saved registers
+static bool ir_op_is_runtime_call(mkt_ir_op_t op) {
+    return op == IR_CALL_RT;
+}
+
+// Computes ins_dst and nothing else, so it can go when ins_dst is not read.
+// Divisions can trap
+static bool ir_op_is_pure(mkt_ir_op_t op) {
+    switch (op) {
+        case IR_IMM:
+        case IR_MOV:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_MULHI:
+        case IR_SCALE:
+        case IR_SHL:
+        case IR_SAR:
+        case IR_SHR:
+        case IR_LT:
+        case IR_LE:
+        case IR_EQ:
+        case IR_NEQ:
+        case IR_NOT:
+        case IR_SEXT:
+        case IR_LOAD:
+        case IR_FN_ADDR:
+        case IR_STRING:
+        case IR_PHI:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Calls `fn(vreg, ctx)` for each vreg read by the instruction
+static void ir_ins_for_each_use(const mkt_ir_ins_t* ins,
+                                void (*fn)(i32 vreg, void* ctx), void* ctx) {
+    CHECK((void*)ins, !=, NULL, "%p");
+
+    if (ins->ins_lhs >= 0) fn(ins->ins_lhs, ctx);
+    if (ins->ins_rhs >= 0) fn(ins->ins_rhs, ctx);
+    for (i32 i = 0; i < (i32)buf_size(ins->ins_args); i++)
+        if (ins->ins_args[i] >= 0) fn(ins->ins_args[i], ctx);
+}
+
+static const mkt_ir_ins_t* ir_block_terminator(const mkt_ir_block_t* block) {
+    CHECK((void*)block, !=, NULL, "%p");
+
+    const i32 len = buf_size(block->bb_ins);
+    if (len == 0 || !ir_op_is_terminator(block->bb_ins[len - 1].ins_op))
+        return NULL;
+    return &block->bb_ins[len - 1];
+}
+
+static i32 ir_block_succs(const mkt_ir_block_t* block, i32 succs[2]) {
+    const mkt_ir_ins_t* const term = ir_block_terminator(block);
+    if (term == NULL) return 0;
+
+    switch (term->ins_op) {
+        case IR_JMP:
+            succs[0] = term->ins_target;
+            return 1;
+        case IR_BR:
+        case IR_BR_CMP:
+            succs[0] = term->ins_target;
+            succs[1] = term->ins_target_else;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// Lowering
+
+typedef struct {
+    const parser_t* lo_parser;
+    mkt_ir_fn_t* lo_fn;
+    i32 lo_block_i,
+        lo_body_block_i;  // Target of self tail calls, after the params
+    i32* lo_param_vregs;
+    i32 *lo_var_vregs,  // Node index of a var definition -> vreg
+        *lo_var_fns;    // Node index of a var definition -> owning function
+} ir_lowering_t;
+
+static i32 ir_lower_expr(ir_lowering_t* lo, i32 node_i);
+
+static i32 ir_vreg_make(ir_lowering_t* lo, i32 type_i) {
+    CHECK((void*)lo, !=, NULL, "%p");
+    CHECK(type_i, >=, 0, "%d");
+
+    const mkt_type_kind_t kind = lo->lo_parser->par_types[type_i].ty_kind;
+    buf_push(lo->lo_fn->irf_vregs,
+             ((mkt_ir_vreg_t){.vr_type_i = type_i,
+                              .vr_gc_ref = kind == TYPE_STRING ||
+                                           kind == TYPE_PTR}));
+    return buf_size(lo->lo_fn->irf_vregs) - 1;
+}
+
+static i32 ir_block_make(ir_lowering_t* lo) {
+    CHECK((void*)lo, !=, NULL, "%p");
+
+    buf_push(lo->lo_fn->irf_blocks, ((mkt_ir_block_t){.bb_ins = NULL}));
+    return buf_size(lo->lo_fn->irf_blocks) - 1;
+}
+
+static void ir_block_switch(ir_lowering_t* lo, i32 block_i) {
+    CHECK((void*)lo, !=, NULL, "%p");
+    CHECK(block_i, >=, 0, "%d");
+    CHECK(block_i, <, (i32)buf_size(lo->lo_fn->irf_blocks), "%d");
+
+    lo->lo_block_i = block_i;
+}
+
+static void ir_emit(ir_lowering_t* lo, mkt_ir_ins_t ins) {
+    CHECK((void*)lo, !=, NULL, "%p");
+
+    // Code following a `return` is unreachable but still has to live somewhere
+    if (ir_block_terminator(&lo->lo_fn->irf_blocks[lo->lo_block_i]) != NULL)
+        ir_block_switch(lo, ir_block_make(lo));
+
+    buf_push(lo->lo_fn->irf_blocks[lo->lo_block_i].bb_ins, ins);
+}
+
+static mkt_ir_ins_t ir_ins_make(mkt_ir_op_t op, i32 node_i) {
+    return (mkt_ir_ins_t){.ins_op = op,
+                          .ins_dst = -1,
+                          .ins_lhs = -1,
+                          .ins_rhs = -1,
+                          .ins_target = -1,
+                          .ins_target_else = -1,
+                          .ins_node_i = node_i};
+}
+
+static void ir_emit_jmp(ir_lowering_t* lo, i32 node_i, i32 target) {
+    if (ir_block_terminator(&lo->lo_fn->irf_blocks[lo->lo_block_i]) != NULL)
+        return;
+
+    mkt_ir_ins_t ins = ir_ins_make(IR_JMP, node_i);
+    ins.ins_target = target;
+    ir_emit(lo, ins);
+}
+
+static i32 ir_emit_call_rt(ir_lowering_t* lo, i32 node_i, i32 type_i,
+                           mkt_ir_runtime_fn_t rt, i32* args) {
+    mkt_ir_ins_t ins = ir_ins_make(IR_CALL_RT, node_i);
+    ins.ins_imm = rt;
+    ins.ins_args = args;
+    if (type_i != TYPE_UNIT_I) ins.ins_dst = ir_vreg_make(lo, type_i);
+    ir_emit(lo, ins);
+
+    return ins.ins_dst;
+}
+
+static const mkt_type_t* ir_node_type(const ir_lowering_t* lo, i32 node_i) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    CHECK(node->no_type_i, >=, 0, "%d");
+    CHECK(node->no_type_i, <, (i32)buf_size(lo->lo_parser->par_types), "%d");
+
+    return &lo->lo_parser->par_types[node->no_type_i];
+}
+
+static bool ir_type_is_integer(mkt_type_kind_t kind) {
+    return kind == TYPE_LONG || kind == TYPE_INT || kind == TYPE_SHORT ||
+           kind == TYPE_BYTE;
+}
+
+// Keep narrow integers canonical i.e. sign extended to 64 bits, so that e.g.
+// `Byte` arithmetic wraps around like it would in memory
+static i32 ir_emit_narrow(ir_lowering_t* lo, i32 node_i, i32 type_i, i32 vreg) {
+    const mkt_type_t* const type = &lo->lo_parser->par_types[type_i];
+    if (!ir_type_is_integer(type->ty_kind) || type->ty_size == 8) return vreg;
+
+    mkt_ir_ins_t ins = ir_ins_make(IR_SEXT, node_i);
+    ins.ins_dst = ir_vreg_make(lo, type_i);
+    ins.ins_lhs = vreg;
+    ins.ins_size = type->ty_size;
+    ir_emit(lo, ins);
+
+    return ins.ins_dst;
+}
+
+static i32 ir_lower_var_def(ir_lowering_t* lo, i32 node_i) {
+    CHECK((void*)lo, !=, NULL, "%p");
+
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    CHECK(node->no_kind, ==, NODE_VAR, "%d");
+    CHECK(node->no_n.no_var.va_var_node_i, ==, -1, "%d");
+
+    if (lo->lo_var_fns[node_i] != lo->lo_fn->irf_node_i) {
+        lo->lo_var_fns[node_i] = lo->lo_fn->irf_node_i;
+        lo->lo_var_vregs[node_i] = ir_vreg_make(lo, node->no_type_i);
+    }
+
+    return lo->lo_var_vregs[node_i];
+}
+
+static i32 ir_var_vreg(const ir_lowering_t* lo, i32 node_i) {
+    CHECK((void*)lo, !=, NULL, "%p");
+    CHECK(lo->lo_parser->par_nodes[node_i].no_kind, ==, NODE_VAR, "%d");
+
+    // Capturing the locals of an enclosing function is rejected by
+    // parser_resolve_var
+    CHECK(lo->lo_var_fns[node_i], ==, lo->lo_fn->irf_node_i, "%d");
+    return lo->lo_var_vregs[node_i];
+}
+
+// Address of a class member as a (base vreg, offset) pair
+static void ir_lower_member_addr(ir_lowering_t* lo, i32 node_i, i32* base,
+                                 i32* offset) {
+    CHECK((void*)lo, !=, NULL, "%p");
+    CHECK((void*)base, !=, NULL, "%p");
+    CHECK((void*)offset, !=, NULL, "%p");
+
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    CHECK(node->no_kind, ==, NODE_MEMBER, "%d");
+    const mkt_binary_t bin = node->no_n.no_binary;
+
+    CHECK(ir_node_type(lo, bin.bi_lhs_i)->ty_kind, ==, TYPE_PTR, "%d");
+    *base = ir_lower_expr(lo, bin.bi_lhs_i);
+
+    const mkt_node_t* const rhs = &lo->lo_parser->par_nodes[bin.bi_rhs_i];
+    CHECK(rhs->no_kind, ==, NODE_VAR, "%d");
+    CHECK(rhs->no_n.no_var.va_var_node_i, ==, -1, "%d");
+    *offset = rhs->no_n.no_var.va_offset;
+}
+
+static i32 ir_lower_binary(ir_lowering_t* lo, i32 node_i, mkt_ir_op_t op) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const mkt_binary_t bin = node->no_n.no_binary;
+
+    mkt_ir_ins_t ins = ir_ins_make(op, node_i);
+    ins.ins_lhs = ir_lower_expr(lo, bin.bi_lhs_i);
+    ins.ins_rhs = ir_lower_expr(lo, bin.bi_rhs_i);
+    ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+    ir_emit(lo, ins);
+
+    if (op == IR_LT || op == IR_LE || op == IR_EQ || op == IR_NEQ)
+        return ins.ins_dst;
+    return ir_emit_narrow(lo, node_i, node->no_type_i, ins.ins_dst);
+}
+
+static i32 ir_lower_assign(ir_lowering_t* lo, i32 node_i) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const mkt_binary_t bin = node->no_n.no_binary;
+    const mkt_node_t* const lhs = &lo->lo_parser->par_nodes[bin.bi_lhs_i];
+    const mkt_type_t* const lhs_type = ir_node_type(lo, bin.bi_lhs_i);
+
+    if (lhs->no_kind == NODE_MEMBER) {
+        i32 base = -1, offset = 0;
+        ir_lower_member_addr(lo, bin.bi_lhs_i, &base, &offset);
+
+        mkt_ir_ins_t ins = ir_ins_make(IR_STORE, node_i);
+        ins.ins_lhs = base;
+        ins.ins_rhs = ir_lower_expr(lo, bin.bi_rhs_i);
+        ins.ins_imm = offset;
+        ins.ins_size = lhs_type->ty_size;
+        ir_emit(lo, ins);
+        return ins.ins_rhs;
+    }
+
+    CHECK(lhs->no_kind, ==, NODE_VAR, "%d");
+    const i32 var_vreg = ir_var_vreg(lo, bin.bi_lhs_i);
+    i32 val = ir_lower_expr(lo, bin.bi_rhs_i);
+    if (ir_node_type(lo, bin.bi_rhs_i)->ty_size > lhs_type->ty_size)
+        val = ir_emit_narrow(lo, node_i, lhs->no_type_i, val);
+
+    mkt_ir_ins_t ins = ir_ins_make(IR_MOV, node_i);
+    ins.ins_dst = var_vreg;
+    ins.ins_lhs = val;
+    ir_emit(lo, ins);
+
+    return var_vreg;
+}
+
+// Branches of a condition still missing their target: block index * 2, plus 1
+// for `ins_target_else`. The branch is the terminator of the block
+static void ir_cond_patch(ir_lowering_t* lo, i32* jumps, i32 target) {
+    for (i32 i = 0; i < (i32)buf_size(jumps); i++) {
+        mkt_ir_block_t* const block = &lo->lo_fn->irf_blocks[jumps[i] / 2];
+        mkt_ir_ins_t* const br = &block->bb_ins[buf_size(block->bb_ins) - 1];
+        CHECK(ir_block_succs(block, (i32[2]){0}), ==, 2, "%d");
+
+        if (jumps[i] % 2)
+            br->ins_target_else = target;
+        else
+            br->ins_target = target;
+    }
+    buf_free(jumps);
+}
+
+// Branch on a Bool expression without materializing it when possible:
+// comparisons branch on the flags, and `!`, `&&` and `||` become jumps.
+// The targets are left to the caller, see ir_cond_patch
+static void ir_lower_cond(ir_lowering_t* lo, i32 node_i, i32** true_jumps,
+                          i32** false_jumps) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+
+    switch (node->no_kind) {
+        case NODE_NOT:
+            ir_lower_cond(lo, node->no_n.no_unary.un_node_i, false_jumps,
+                          true_jumps);
+            return;
+        case NODE_AND:
+        case NODE_OR: {
+            // The right operand is only evaluated when the left one does not
+            // decide
+            i32* undecided = NULL;
+            if (node->no_kind == NODE_AND)
+                ir_lower_cond(lo, node->no_n.no_binary.bi_lhs_i, &undecided,
+                              false_jumps);
+            else
+                ir_lower_cond(lo, node->no_n.no_binary.bi_lhs_i, true_jumps,
+                              &undecided);
+
+            const i32 rhs_block_i = ir_block_make(lo);
+            ir_cond_patch(lo, undecided, rhs_block_i);
+            ir_block_switch(lo, rhs_block_i);
+            ir_lower_cond(lo, node->no_n.no_binary.bi_rhs_i, true_jumps,
+                          false_jumps);
+            return;
+        }
+        case NODE_LT:
+        case NODE_LE:
+        case NODE_EQ:
+        case NODE_NEQ: {
+            mkt_ir_ins_t br = ir_ins_make(IR_BR_CMP, node_i);
+            br.ins_imm = node->no_kind == NODE_LT   ? IR_LT
+                         : node->no_kind == NODE_LE ? IR_LE
+                         : node->no_kind == NODE_EQ ? IR_EQ
+                                                    : IR_NEQ;
+            br.ins_lhs = ir_lower_expr(lo, node->no_n.no_binary.bi_lhs_i);
+            br.ins_rhs = ir_lower_expr(lo, node->no_n.no_binary.bi_rhs_i);
+            ir_emit(lo, br);
+            break;
+        }
+        default: {
+            mkt_ir_ins_t br = ir_ins_make(IR_BR, node_i);
+            br.ins_lhs = ir_lower_expr(lo, node_i);
+            ir_emit(lo, br);
+        }
+    }
+
+    buf_push(*true_jumps, 2 * lo->lo_block_i);
+    buf_push(*false_jumps, 2 * lo->lo_block_i + 1);
+}
+
+static i32 ir_lower_if(ir_lowering_t* lo, i32 node_i) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const mkt_if_t if_ = node->no_n.no_if;
+
+    const bool has_value = node->no_type_i != TYPE_UNIT_I;
+    const i32 res = has_value ? ir_vreg_make(lo, node->no_type_i) : -1;
+
+    i32 *true_jumps = NULL, *false_jumps = NULL;
+    ir_lower_cond(lo, if_.if_node_cond_i, &true_jumps, &false_jumps);
+    const i32 then_i = ir_block_make(lo), else_i = ir_block_make(lo),
+              end_i = ir_block_make(lo);
+    ir_cond_patch(lo, true_jumps, then_i);
+    ir_cond_patch(lo, false_jumps, else_i);
+
+    const i32 branches[2] = {if_.if_node_then_i, if_.if_node_else_i};
+    const i32 blocks[2] = {then_i, else_i};
+    for (i32 i = 0; i < 2; i++) {
+        ir_block_switch(lo, blocks[i]);
+        if (branches[i] >= 0) {
+            const i32 val = ir_lower_expr(lo, branches[i]);
+            if (has_value && val >= 0 &&
+                ir_block_terminator(&lo->lo_fn->irf_blocks[lo->lo_block_i]) ==
+                    NULL) {
+                mkt_ir_ins_t mov = ir_ins_make(IR_MOV, branches[i]);
+                mov.ins_dst = res;
+                mov.ins_lhs = val;
+                ir_emit(lo, mov);
+            }
+        }
+        ir_emit_jmp(lo, node_i, end_i);
+    }
+    ir_block_switch(lo, end_i);
+
+    return res;
+}
+
+// Rotated into `if (cond) do body while (cond)`: the condition is lowered
+// twice, so that each iteration ends with a single backward branch
+static void ir_lower_while(ir_lowering_t* lo, i32 node_i) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const mkt_while_t w = node->no_n.no_while;
+
+    i32 *true_jumps = NULL, *false_jumps = NULL;
+    ir_lower_cond(lo, w.wh_cond_i, &true_jumps, &false_jumps);
+    const i32 body_i = ir_block_make(lo);
+    ir_cond_patch(lo, true_jumps, body_i);
+
+    ir_block_switch(lo, body_i);
+    ir_lower_expr(lo, w.wh_body_i);
+    // No back edge after a `return`
+    i32* latch_false_jumps = NULL;
+    if (ir_block_terminator(&lo->lo_fn->irf_blocks[lo->lo_block_i]) == NULL) {
+        i32* latch_true_jumps = NULL;
+        ir_lower_cond(lo, w.wh_cond_i, &latch_true_jumps, &latch_false_jumps);
+        ir_cond_patch(lo, latch_true_jumps, body_i);
+    }
+
+    const i32 end_i = ir_block_make(lo);
+    ir_cond_patch(lo, false_jumps, end_i);
+    ir_cond_patch(lo, latch_false_jumps, end_i);
+    ir_block_switch(lo, end_i);
+}
+
+// `&&` and `||` as values: through branches, to short-circuit
+static i32 ir_lower_logical(ir_lowering_t* lo, i32 node_i) {
+    i32 *true_jumps = NULL, *false_jumps = NULL;
+    ir_lower_cond(lo, node_i, &true_jumps, &false_jumps);
+
+    const i32 res = ir_vreg_make(lo, TYPE_BOOL_I);
+    const i32 blocks[2] = {ir_block_make(lo), ir_block_make(lo)},
+              end_i = ir_block_make(lo);
+    ir_cond_patch(lo, true_jumps, blocks[0]);
+    ir_cond_patch(lo, false_jumps, blocks[1]);
+
+    for (i32 i = 0; i < 2; i++) {
+        ir_block_switch(lo, blocks[i]);
+        mkt_ir_ins_t imm = ir_ins_make(IR_IMM, node_i);
+        imm.ins_dst = res;
+        imm.ins_imm = i == 0;
+        ir_emit(lo, imm);
+        ir_emit_jmp(lo, node_i, end_i);
+    }
+    ir_block_switch(lo, end_i);
+
+    return res;
+}
+
+static i32 ir_lower_println(ir_lowering_t* lo, i32 node_i) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const i32 arg_i = node->no_n.no_builtin_println.bp_arg_i;
+    const mkt_type_kind_t kind = ir_node_type(lo, arg_i)->ty_kind;
+
+    mkt_ir_runtime_fn_t rt = RT_COUNT;
+    if (ir_type_is_integer(kind))
+        rt = RT_INT_PRINTLN;
+    else if (kind == TYPE_CHAR)
+        rt = RT_CHAR_PRINTLN;
+    else if (kind == TYPE_BOOL)
+        rt = RT_BOOL_PRINTLN;
+    else if (kind == TYPE_STRING)
+        rt = RT_STRING_PRINTLN;
+    else if (kind == TYPE_PTR)
+        rt = RT_INSTANCE_PRINTLN;
+    else {
+        log_debug("Type %s unimplemented", mkt_type_to_str[kind]);
+        UNIMPLEMENTED();
+    }
+
+    i32* args = NULL;
+    buf_push(args, ir_lower_expr(lo, arg_i));
+    ir_emit_call_rt(lo, node_i, TYPE_UNIT_I, rt, args);
+
+    return -1;
+}
+
+static i32 ir_lower_call(ir_lowering_t* lo, i32 node_i) {
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const mkt_call_t call = node->no_n.no_call;
+    CHECK(buf_size(call.ca_arg_nodes_i), <=, 6UL, "%zu");  // TODO
+
+    mkt_ir_ins_t ins = ir_ins_make(IR_CALL, node_i);
+    for (i32 i = 0; i < (i32)buf_size(call.ca_arg_nodes_i); i++)
+        buf_push(ins.ins_args, ir_lower_expr(lo, call.ca_arg_nodes_i[i]));
+
+    // Calling a function by its name needs no function value
+    const mkt_node_t* const lhs = &lo->lo_parser->par_nodes[call.ca_lhs_node_i];
+    const i32 fn_node_i = lhs->no_kind == NODE_VAR
+                              ? lhs->no_n.no_var.va_var_node_i
+                              : -1;
+    if (fn_node_i >= 0 &&
+        lo->lo_parser->par_nodes[fn_node_i].no_kind == NODE_FN)
+        ins.ins_imm = fn_node_i;
+    else
+        ins.ins_lhs = ir_lower_expr(lo, call.ca_lhs_node_i);
+    if (node->no_type_i != TYPE_UNIT_I)
+        ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+    ir_emit(lo, ins);
+
+    return ins.ins_dst;
+}
+
+// `return f(...)` inside `f` itself: assign the arguments to the params and
+// jump back to the top of the body, so that deep recursion runs in constant
+// stack space. Returns false if the call is not a self call
+static bool ir_lower_tail_call(ir_lowering_t* lo, i32 node_i) {
+    if (node_i < 0) return false;
+
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    if (node->no_kind != NODE_CALL) return false;
+
+    const mkt_call_t call = node->no_n.no_call;
+    const mkt_node_t* const lhs = &lo->lo_parser->par_nodes[call.ca_lhs_node_i];
+    if (lhs->no_kind != NODE_VAR ||
+        lhs->no_n.no_var.va_var_node_i != lo->lo_fn->irf_node_i)
+        return false;
+
+    const i32 arity = buf_size(call.ca_arg_nodes_i);
+    CHECK(arity, ==, lo->lo_fn->irf_arity, "%d");
+
+    // All the arguments are evaluated before any param is overwritten, since
+    // they may read the params (e.g. `return f(b, a)`)
+    i32 args[6] = {0};
+    CHECK(arity, <=, 6, "%d");
+    for (i32 i = 0; i < arity; i++) {
+        const i32 arg = ir_lower_expr(lo, call.ca_arg_nodes_i[i]);
+        const i32 type_i = lo->lo_fn->irf_vregs[arg].vr_type_i;
+        mkt_ir_ins_t tmp = ir_ins_make(IR_MOV, call.ca_arg_nodes_i[i]);
+        tmp.ins_dst = ir_vreg_make(lo, type_i);
+        tmp.ins_lhs = arg;
+        ir_emit(lo, tmp);
+        args[i] = tmp.ins_dst;
+    }
+    for (i32 i = 0; i < arity; i++) {
+        mkt_ir_ins_t mov = ir_ins_make(IR_MOV, call.ca_arg_nodes_i[i]);
+        mov.ins_dst = lo->lo_param_vregs[i];
+        mov.ins_lhs = args[i];
+        ir_emit(lo, mov);
+    }
+    ir_emit_jmp(lo, node_i, lo->lo_body_block_i);
+
+    return true;
+}
+
+// Returns the vreg holding the value of the expression, or -1 if it has none
+static i32 ir_lower_expr(ir_lowering_t* lo, i32 node_i) {
+    CHECK((void*)lo, !=, NULL, "%p");
+    if (node_i < 0) return -1;
+    CHECK(node_i, <, (i32)buf_size(lo->lo_parser->par_nodes), "%d");
+
+    const mkt_node_t* const node = &lo->lo_parser->par_nodes[node_i];
+    const mkt_type_t* const type = ir_node_type(lo, node_i);
+
+    switch (node->no_kind) {
+        case NODE_KEYWORD_BOOL:
+        case NODE_CHAR:
+        case NODE_NUM: {
+            mkt_ir_ins_t ins = ir_ins_make(IR_IMM, node_i);
+            ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+            ins.ins_imm = node->no_n.no_num.nu_val;
+            ir_emit(lo, ins);
+            return ins.ins_dst;
+        }
+        case NODE_STRING: {
+            mkt_ir_ins_t ins = ir_ins_make(IR_STRING, node_i);
+            ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+            ir_emit(lo, ins);
+            return ins.ins_dst;
+        }
+        case NODE_ADD: {
+            if (type->ty_kind != TYPE_STRING)
+                return ir_lower_binary(lo, node_i, IR_ADD);
+
+            const mkt_binary_t bin = node->no_n.no_binary;
+            i32* args = NULL;
+            buf_push(args, ir_lower_expr(lo, bin.bi_lhs_i));
+            buf_push(args, ir_lower_expr(lo, bin.bi_rhs_i));
+            return ir_emit_call_rt(lo, node_i, node->no_type_i,
+                                   RT_STRING_CONCAT, args);
+        }
+        case NODE_SUBTRACT:
+            return ir_lower_binary(lo, node_i, IR_SUB);
+        case NODE_MULTIPLY:
+            return ir_lower_binary(lo, node_i, IR_MUL);
+        case NODE_DIVIDE:
+            return ir_lower_binary(lo, node_i, IR_DIV);
+        case NODE_MODULO:
+            return ir_lower_binary(lo, node_i, IR_MOD);
+        case NODE_LT:
+            return ir_lower_binary(lo, node_i, IR_LT);
+        case NODE_LE:
+            return ir_lower_binary(lo, node_i, IR_LE);
+        case NODE_EQ:
+            return ir_lower_binary(lo, node_i, IR_EQ);
+        case NODE_NEQ:
+            return ir_lower_binary(lo, node_i, IR_NEQ);
+        case NODE_AND:
+        case NODE_OR:
+            return ir_lower_logical(lo, node_i);
+        case NODE_NOT: {
+            mkt_ir_ins_t ins = ir_ins_make(IR_NOT, node_i);
+            ins.ins_lhs = ir_lower_expr(lo, node->no_n.no_unary.un_node_i);
+            ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+            ir_emit(lo, ins);
+            return ins.ins_dst;
+        }
+        case NODE_MEMBER: {
+            i32 base = -1, offset = 0;
+            ir_lower_member_addr(lo, node_i, &base, &offset);
+
+            mkt_ir_ins_t ins = ir_ins_make(IR_LOAD, node_i);
+            ins.ins_lhs = base;
+            ins.ins_imm = offset;
+            ins.ins_size = type->ty_size;
+            ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+            ir_emit(lo, ins);
+            return ins.ins_dst;
+        }
+        case NODE_VAR: {
+            const mkt_var_t var = node->no_n.no_var;
+            if (type->ty_kind == TYPE_FN) {
+                CHECK(var.va_var_node_i, >=, 0, "%d");
+                mkt_ir_ins_t ins = ir_ins_make(IR_FN_ADDR, var.va_var_node_i);
+                ins.ins_dst = ir_vreg_make(lo, node->no_type_i);
+                ir_emit(lo, ins);
+                return ins.ins_dst;
+            }
+            if (var.va_var_node_i == -1) return ir_var_vreg(lo, node_i);
+            return ir_lower_expr(lo, var.va_var_node_i);
+        }
+        case NODE_ASSIGN:
+            return ir_lower_assign(lo, node_i);
+        case NODE_IF:
+            return ir_lower_if(lo, node_i);
+        case NODE_WHILE:
+            ir_lower_while(lo, node_i);
+            return -1;
+        case NODE_RETURN: {
+            if (ir_lower_tail_call(lo, node->no_n.no_return.re_node_i))
+                return -1;
+
+            mkt_ir_ins_t ins = ir_ins_make(IR_RET, node_i);
+            ins.ins_lhs = ir_lower_expr(lo, node->no_n.no_return.re_node_i);
+            ir_emit(lo, ins);
+            return -1;
+        }
+        case NODE_BUILTIN_PRINTLN:
+            return ir_lower_println(lo, node_i);
+        case NODE_BLOCK: {
+            const mkt_block_t block = node->no_n.no_block;
+            i32 val = -1;
+            for (i32 i = 0; i < (i32)buf_size(block.bl_nodes_i); i++) {
+                const i32 stmt_i = block.bl_nodes_i[i];
+                const mkt_node_t* const stmt =
+                    &lo->lo_parser->par_nodes[stmt_i];
+                // A definition is followed by the NODE_ASSIGN initializing it
+                if (stmt->no_kind == NODE_VAR &&
+                    stmt->no_n.no_var.va_var_node_i == -1)
+                    val = ir_lower_var_def(lo, stmt_i);
+                else
+                    val = ir_lower_expr(lo, stmt_i);
+            }
+            return val;
+        }
+        case NODE_CALL:
+            return ir_lower_call(lo, node_i);
+        case NODE_INSTANCE: {
+            CHECK(type->ty_kind, ==, TYPE_PTR, "%d");
+            CHECK(type->ty_ptr_type_i, >=, 0, "%d");
+            CHECK(type->ty_ptr_type_i, <,
+                  (i32)buf_size(lo->lo_parser->par_types), "%d");
+
+            const mkt_type_t* const instance_type =
+                &lo->lo_parser->par_types[type->ty_ptr_type_i];
+
+            mkt_ir_ins_t size = ir_ins_make(IR_IMM, node_i);
+            size.ins_dst = ir_vreg_make(lo, TYPE_LONG_I);
+            size.ins_imm = instance_type->ty_size;
+            ir_emit(lo, size);
+
+            i32* args = NULL;
+            buf_push(args, size.ins_dst);
+            return ir_emit_call_rt(lo, node_i, node->no_type_i,
+                                   RT_INSTANCE_MAKE, args);
+        }
+            // No-op: Generated on their own
+        case NODE_FN:
+            // No-op: Generated for NODE_INSTANCE, does not exist at runtime
+        case NODE_CLASS:
+            return -1;
+        default:
+            log_debug("no_kind=%s", mkt_node_kind_to_str[node->no_kind]);
+            UNREACHABLE();
+    }
+}
+
+static void ir_lower_fn(const parser_t* parser, i32 fn_node_i, i32* var_vregs,
+                        i32* var_fns, mkt_ir_fn_t* irf) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    const mkt_fn_t fn = parser->par_nodes[fn_node_i].no_n.no_fn;
+
+    *irf = (mkt_ir_fn_t){.irf_node_i = fn_node_i,
+                         .irf_arity = buf_size(fn.fd_arg_nodes_i)};
+    ir_lowering_t lo = {.lo_parser = parser,
+                        .lo_fn = irf,
+                        .lo_var_vregs = var_vregs,
+                        .lo_var_fns = var_fns};
+    ir_block_switch(&lo, ir_block_make(&lo));
+
+    CHECK(irf->irf_arity, <=, 6, "%d");  // FIXME: stack args
+    for (i32 i = 0; i < irf->irf_arity; i++) {
+        mkt_ir_ins_t ins = ir_ins_make(IR_PARAM, fn.fd_arg_nodes_i[i]);
+        ins.ins_dst = ir_lower_var_def(&lo, fn.fd_arg_nodes_i[i]);
+        ins.ins_imm = i;
+        ir_emit(&lo, ins);
+        buf_push(lo.lo_param_vregs, ins.ins_dst);
+    }
+    lo.lo_body_block_i = ir_block_make(&lo);
+    ir_emit_jmp(&lo, fn.fd_body_node_i, lo.lo_body_block_i);
+    ir_block_switch(&lo, lo.lo_body_block_i);
+
+    ir_lower_expr(&lo, fn.fd_body_node_i);
+
+    mkt_ir_ins_t ret = ir_ins_make(IR_RET, fn.fd_body_node_i);
+    if (fn_node_i == parser->par_main_fn_i) {
+        // In that case, no return means returning 0
+        mkt_ir_ins_t zero = ir_ins_make(IR_IMM, fn.fd_body_node_i);
+        zero.ins_dst = ir_vreg_make(&lo, TYPE_INT_I);
+        ir_emit(&lo, zero);
+        ret.ins_lhs = zero.ins_dst;
+    }
+    ir_emit(&lo, ret);
+    buf_free(lo.lo_param_vregs);
+}
+
+static bool ir_dump_enabled = false;  // -fdump-ir
+
+static void ir_dump_vreg(FILE* file, i32 vreg) {
+    if (vreg >= 0)
+        fprintf(file, " v%d", vreg);
+    else
+        fprintf(file, " undef");
+}
+
+// Human readable listing, for -fdump-ir
+static void ir_dump_rhs(FILE* file, const mkt_ir_ins_t* ins) {
+    if (ins->ins_rhs == IR_VREG_IMM)
+        fprintf(file, " $%lld", (long long)ins->ins_rhs_imm);
+    else if (ins->ins_rhs_mem)
+        fprintf(file, " [v%d+%lld]", ins->ins_rhs, (long long)ins->ins_rhs_imm);
+    else if (ins->ins_rhs >= 0)
+        ir_dump_vreg(file, ins->ins_rhs);
+}
+
+static void ir_dump_fn(FILE* file, const parser_t* parser,
+                       const mkt_ir_fn_t* irf) {
+    CHECK((void*)file, !=, NULL, "%p");
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    const mkt_fn_t fn = parser->par_nodes[irf->irf_node_i].no_n.no_fn;
+    const char* name = NULL;
+    i32 name_len = 0;
+    parser_tok_source(parser, fn.fd_name_tok_i, &name, &name_len);
+    fprintf(file, "fn %.*s: %d blocks %d vregs\n", name_len, name,
+            (i32)buf_size(irf->irf_blocks), (i32)buf_size(irf->irf_vregs));
+
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        fprintf(file, "  bb%d:\n", b);
+
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            fprintf(file, "    ");
+            if (ins->ins_dst >= 0) {
+                const i32 type_i = irf->irf_vregs[ins->ins_dst].vr_type_i;
+                fprintf(file, "v%d:%s = ", ins->ins_dst,
+                        mkt_type_to_str[parser->par_types[type_i].ty_kind]);
+            }
+            fprintf(file, "%s", mkt_ir_op_to_str[ins->ins_op]);
+
+            switch (ins->ins_op) {
+                case IR_IMM:
+                case IR_PARAM:
+                    fprintf(file, " %lld", (long long)ins->ins_imm);
+                    break;
+                case IR_LOAD:
+                case IR_STORE:
+                    fprintf(file, " [v%d+%lld]:%d", ins->ins_lhs,
+                            (long long)ins->ins_imm, ins->ins_size);
+                    ir_dump_rhs(file, ins);
+                    break;
+                case IR_SEXT:
+                    fprintf(file, " v%d:%d", ins->ins_lhs, ins->ins_size);
+                    break;
+                case IR_MULHI:
+                case IR_SCALE:
+                case IR_SHL:
+                case IR_SAR:
+                case IR_SHR:
+                    ir_dump_vreg(file, ins->ins_lhs);
+                    ir_dump_rhs(file, ins);
+                    fprintf(file, " %lld", (long long)ins->ins_imm);
+                    break;
+                case IR_FN_ADDR:
+                case IR_STRING:
+                    fprintf(file, " #%d", ins->ins_node_i);
+                    break;
+                case IR_CALL:
+                    if (ins->ins_lhs >= 0)
+                        ir_dump_vreg(file, ins->ins_lhs);
+                    else
+                        fprintf(file, " #%lld", (long long)ins->ins_imm);
+                    break;
+                case IR_CALL_RT:
+                    fprintf(file, " %s",
+                            mkt_ir_runtime_fn_to_str[ins->ins_imm]);
+                    break;
+                default:
+                    if (ins->ins_op == IR_BR_CMP)
+                        fprintf(file, " %s", mkt_ir_op_to_str[ins->ins_imm]);
+                    if (ins->ins_lhs >= 0) ir_dump_vreg(file, ins->ins_lhs);
+                    ir_dump_rhs(file, ins);
+            }
+
+            for (i32 a = 0; a < (i32)buf_size(ins->ins_args); a++) {
+                if (ins->ins_op == IR_PHI)
+                    fprintf(file, " [bb%d", ins->ins_preds[a]);
+                ir_dump_vreg(file, ins->ins_args[a]);
+                if (ins->ins_op == IR_PHI) fprintf(file, "]");
+            }
+            if (ins->ins_target >= 0) fprintf(file, " bb%d", ins->ins_target);
+            if (ins->ins_target_else >= 0)
+                fprintf(file, " bb%d", ins->ins_target_else);
+            fprintf(file, "\n");
+        }
+    }
+}
+
+static void ir_lower(const parser_t* parser, mkt_ir_t* ir) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    const i32 nodes_len = buf_size(parser->par_nodes);
+    i32 *var_vregs = NULL, *var_fns = NULL;
+    buf_grow(var_vregs, nodes_len);
+    buf_grow(var_fns, nodes_len);
+    for (i32 i = 0; i < nodes_len; i++) var_fns[i] = -1;
+
+    for (u64 c = 0; c < buf_size(parser->par_class_decls); c++) {
+        const i32 node_class_i = parser->par_class_decls[c];
+        CHECK(node_class_i, >=, 0, "%d");
+        CHECK(node_class_i, <, nodes_len, "%d");
+
+        const mkt_node_t* const node_class = &parser->par_nodes[node_class_i];
+        CHECK(node_class->no_kind, ==, NODE_CLASS, "%d");
+        const mkt_class_t* const class = &node_class->no_n.no_class;
+
+        for (i32 f = 0; f < (i32)buf_size(class->cl_methods); f++) {
+            const i32 node_fn_i = class->cl_methods[f];
+            CHECK(node_fn_i, >=, 0, "%d");
+            CHECK(node_fn_i, <, nodes_len, "%d");
+
+            mkt_ir_fn_t irf = {0};
+            ir_lower_fn(parser, node_fn_i, var_vregs, var_fns, &irf);
+            buf_push(ir->ir_fns, irf);
+        }
+    }
+
+    buf_free(var_vregs);
+    buf_free(var_fns);
+}
+
+// Inlining
+
+// Callees bigger than that, in instructions, are not inlined
+static const i32 IR_INLINE_BUDGET = 24;
+
+static bool ir_inline_enabled = true;  // -fno-inline
+
+static i32 ir_fn_size(const mkt_ir_fn_t* irf) {
+    i32 size = 0;
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++)
+        size += buf_size(irf->irf_blocks[b].bb_ins);
+    return size;
+}
+
+// Small leaf functions only: since they call nothing, inlining them always
+// terminates and a recursive function is never a candidate
+static bool ir_fn_is_inlinable(const parser_t* parser, const mkt_ir_fn_t* irf) {
+    if (irf->irf_node_i == parser->par_main_fn_i) return false;
+    if (ir_fn_size(irf) > IR_INLINE_BUDGET) return false;
+
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+            if (block->bb_ins[i].ins_op == IR_CALL) return false;
+    }
+    return true;
+}
+
+static i32 ir_inline_remap_block(i32 block_i, i32 offset) {
+    return block_i < 0 ? block_i : block_i + offset;
+}
+
+static i32 ir_inline_remap_vreg(i32 vreg, i32 offset) {
+    return vreg < 0 ? vreg : vreg + offset;
+}
+
+// Replaces the call `block_i`:`ins_i` with a copy of the body of `callee`.
+// The block is split at the call and the copied blocks are laid out in
+// between. The params become moves from the arguments and each `return`
+// becomes a move to the result followed by a jump to the rest of the block.
+// Returns the index of the block holding the instructions after the call
+static i32 ir_inline_call(mkt_ir_fn_t* irf, i32 block_i, i32 ins_i,
+                          const mkt_ir_fn_t* callee) {
+    const i32 callee_blocks_len = buf_size(callee->irf_blocks);
+    const i32 cont_i = block_i + callee_blocks_len + 1;
+    const i32 block_offset = block_i + 1;
+    const i32 vreg_offset = buf_size(irf->irf_vregs);
+
+    for (i32 v = 0; v < (i32)buf_size(callee->irf_vregs); v++)
+        buf_push(irf->irf_vregs, callee->irf_vregs[v]);
+
+    // Make room for the callee blocks and the continuation
+    for (i32 b = 0; b <= callee_blocks_len; b++)
+        buf_push(irf->irf_blocks, ((mkt_ir_block_t){.bb_ins = NULL}));
+    const i32 blocks_len = buf_size(irf->irf_blocks);
+    for (i32 b = blocks_len - 1; b >= cont_i + 1; b--)
+        irf->irf_blocks[b] = irf->irf_blocks[b - callee_blocks_len - 1];
+    for (i32 b = block_i + 1; b <= cont_i; b++)
+        irf->irf_blocks[b] = (mkt_ir_block_t){.bb_ins = NULL};
+
+    for (i32 b = 0; b < blocks_len; b++) {
+        if (b > block_i && b <= cont_i) continue;
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_target > block_i)
+                ins->ins_target += callee_blocks_len + 1;
+            if (ins->ins_target_else > block_i)
+                ins->ins_target_else += callee_blocks_len + 1;
+        }
+    }
+
+    // Split, dropping the call
+    mkt_ir_block_t* const block = &irf->irf_blocks[block_i];
+    mkt_ir_ins_t call = block->bb_ins[ins_i];
+    for (i32 i = ins_i + 1; i < (i32)buf_size(block->bb_ins); i++)
+        buf_push(irf->irf_blocks[cont_i].bb_ins, block->bb_ins[i]);
+    buf_ptr(block->bb_ins)->size = ins_i;
+
+    mkt_ir_ins_t jmp = ir_ins_make(IR_JMP, call.ins_node_i);
+    jmp.ins_target = block_offset;
+    buf_push(irf->irf_blocks[block_i].bb_ins, jmp);
+
+    for (i32 b = 0; b < callee_blocks_len; b++) {
+        const mkt_ir_block_t* const src = &callee->irf_blocks[b];
+        mkt_ir_block_t* const dst = &irf->irf_blocks[block_offset + b];
+
+        for (i32 i = 0; i < (i32)buf_size(src->bb_ins); i++) {
+            mkt_ir_ins_t ins = src->bb_ins[i];
+            ins.ins_dst = ir_inline_remap_vreg(ins.ins_dst, vreg_offset);
+            ins.ins_lhs = ir_inline_remap_vreg(ins.ins_lhs, vreg_offset);
+            ins.ins_rhs = ir_inline_remap_vreg(ins.ins_rhs, vreg_offset);
+            ins.ins_target = ir_inline_remap_block(ins.ins_target,
+                                                   block_offset);
+            ins.ins_target_else = ir_inline_remap_block(ins.ins_target_else,
+                                                        block_offset);
+            ins.ins_args = NULL;
+            for (i32 a = 0; a < (i32)buf_size(src->bb_ins[i].ins_args); a++)
+                buf_push(ins.ins_args,
+                         ir_inline_remap_vreg(src->bb_ins[i].ins_args[a],
+                                              vreg_offset));
+
+            if (ins.ins_op == IR_PARAM) {
+                CHECK((i32)ins.ins_imm, <, (i32)buf_size(call.ins_args), "%d");
+                ins.ins_op = IR_MOV;
+                ins.ins_lhs = call.ins_args[ins.ins_imm];
+                ins.ins_imm = 0;
+            } else if (ins.ins_op == IR_RET) {
+                if (call.ins_dst >= 0 && ins.ins_lhs >= 0) {
+                    mkt_ir_ins_t mov = ir_ins_make(IR_MOV, ins.ins_node_i);
+                    mov.ins_dst = call.ins_dst;
+                    mov.ins_lhs = ins.ins_lhs;
+                    buf_push(dst->bb_ins, mov);
+                }
+                ins = ir_ins_make(IR_JMP, ins.ins_node_i);
+                ins.ins_target = cont_i;
+            }
+            buf_push(dst->bb_ins, ins);
+        }
+    }
+    buf_free(call.ins_args);
+
+    return cont_i;
+}
+
+static void ir_inline(const parser_t* parser, mkt_ir_t* ir) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    const i32 fns_len = buf_size(ir->ir_fns);
+    // Node of a function -> index in ir_fns
+    i32* fn_indices = NULL;
+    for (i32 n = 0; n < (i32)buf_size(parser->par_nodes); n++)
+        buf_push(fn_indices, -1);
+    // Per function: 1 when inlinable, 0 when not, -1 when to be computed
+    // again, having been rewritten
+    i8* inlinable = NULL;
+    for (i32 f = 0; f < fns_len; f++) {
+        fn_indices[ir->ir_fns[f].irf_node_i] = f;
+        buf_push(inlinable, -1);
+    }
+
+    for (i32 f = 0; f < fns_len; f++) {
+        mkt_ir_fn_t* const irf = &ir->ir_fns[f];
+
+        for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+            for (i32 i = 0; i < (i32)buf_size(irf->irf_blocks[b].bb_ins);
+                 i++) {
+                const mkt_ir_ins_t* const ins = &irf->irf_blocks[b].bb_ins[i];
+                // Only direct calls
+                if (ins->ins_op != IR_CALL || ins->ins_lhs >= 0) continue;
+
+                const i32 c = fn_indices[ins->ins_imm];
+                if (c < 0 || c == f) continue;
+
+                const mkt_ir_fn_t* const callee = &ir->ir_fns[c];
+                if (inlinable[c] == -1)
+                    inlinable[c] = ir_fn_is_inlinable(parser, callee);
+                if (!inlinable[c] ||
+                    callee->irf_arity != (i32)buf_size(ins->ins_args))
+                    continue;
+
+                log_debug("inlining call of fn %d in fn %d",
+                          (i32)ins->ins_imm, irf->irf_node_i);
+                b = ir_inline_call(irf, b, i, callee);
+                i = -1;
+                inlinable[f] = -1;
+            }
+        }
+    }
+    buf_free(fn_indices);
+    buf_free(inlinable);
+}
+
+// Verification
+
+static void ir_verify_vreg(i32 vreg, void* ctx) {
+    CHECK(vreg, <, *(const i32*)ctx, "%d");
+}
+
+// Structural invariants that the passes rely on: operands in range,
+// terminators last, phis first
+static void ir_verify(const mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++) {
+        const mkt_ir_fn_t* const irf = &ir->ir_fns[f];
+        const i32 blocks_len = buf_size(irf->irf_blocks);
+        i32 vregs_len = buf_size(irf->irf_vregs);
+
+        for (i32 b = 0; b < blocks_len; b++) {
+            const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+            const i32 len = buf_size(block->bb_ins);
+            for (i32 i = 0; i < len; i++) {
+                const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+                CHECK(ins->ins_op, <, IR_COUNT, "%d");
+                CHECK(ins->ins_dst, <, vregs_len, "%d");
+                ir_ins_for_each_use(ins, ir_verify_vreg, &vregs_len);
+
+                if (ir_op_is_terminator(ins->ins_op))
+                    CHECK(i, ==, len - 1, "%d");
+                CHECK(ins->ins_target, <, blocks_len, "%d");
+                CHECK(ins->ins_target_else, <, blocks_len, "%d");
+
+                if (ins->ins_op != IR_PHI) continue;
+                CHECK(i == 0 || block->bb_ins[i - 1].ins_op == IR_PHI, ==,
+                      true, "%d");
+                CHECK(buf_size(ins->ins_args), ==, buf_size(ins->ins_preds),
+                      "%zu");
+            }
+        }
+    }
+}
+
+// Dead code elimination
+
+static void ir_count_use(i32 vreg, void* ctx) { ((i32*)ctx)[vreg] += 1; }
+
+static void ir_uncount_use(i32 vreg, void* ctx) { ((i32*)ctx)[vreg] -= 1; }
+
+// Removes the pure instructions whose result is never read. Going backwards,
+// the operands of a removed instruction may become dead in turn before they
+// are visited
+static void ir_dce_fn(mkt_ir_fn_t* irf) {
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    i32* uses = NULL;
+    for (i32 v = 0; v < (i32)buf_size(irf->irf_vregs); v++) buf_push(uses, 0);
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+            ir_ins_for_each_use(&block->bb_ins[i], ir_count_use, uses);
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 b = (i32)buf_size(irf->irf_blocks) - 1; b >= 0; b--) {
+            mkt_ir_block_t* const block = &irf->irf_blocks[b];
+            const i32 len = buf_size(block->bb_ins);
+            i32 kept = len;
+            for (i32 i = len - 1; i >= 0; i--) {
+                mkt_ir_ins_t* const ins = &block->bb_ins[i];
+                if (!ir_op_is_pure(ins->ins_op) || uses[ins->ins_dst] > 0) {
+                    block->bb_ins[--kept] = *ins;
+                    continue;
+                }
+
+                ir_ins_for_each_use(ins, ir_uncount_use, uses);
+                buf_free(ins->ins_args);
+                buf_free(ins->ins_preds);
+                changed = true;
+            }
+            for (i32 i = kept; i < len; i++)
+                block->bb_ins[i - kept] = block->bb_ins[i];
+            buf_ptr(block->bb_ins)->size = len - kept;
+        }
+    }
+    buf_free(uses);
+}
+
+static void ir_dce(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        ir_dce_fn(&ir->ir_fns[f]);
+}
+
+// Immediate operands, in SSA form: a constant right operand that fits the
+// 32 bits of an x86 immediate becomes IR_VREG_IMM, so that instruction
+// selection can use it as is (see emit_select). The IR_IMM left unused is
+// then removed by ir_dce
+
+static bool ir_fits_imm(i64 n) { return n == (i32)n; }
+
+static bool ir_op_is_commutative(mkt_ir_op_t op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NEQ;
+}
+
+static void ir_fold_imm(mkt_ir_ins_t* ins, const bool* is_const,
+                        const i64* consts) {
+    mkt_ir_op_t op = ins->ins_op;
+    if (op == IR_BR_CMP) op = ins->ins_imm;
+
+    switch (op) {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_LT:
+        case IR_LE:
+        case IR_EQ:
+        case IR_NEQ:
+        case IR_STORE:
+            break;
+        default:
+            return;
+    }
+
+    if (ins->ins_lhs < 0 || ins->ins_rhs < 0) return;
+    if (ir_op_is_commutative(op) && is_const[ins->ins_lhs] &&
+        !is_const[ins->ins_rhs]) {
+        const i32 lhs = ins->ins_lhs;
+        ins->ins_lhs = ins->ins_rhs;
+        ins->ins_rhs = lhs;
+    }
+    if (!is_const[ins->ins_rhs]) return;
+
+    const i64 imm = consts[ins->ins_rhs];
+    if (!ir_fits_imm(imm)) return;
+    // Subtracting is adding the opposite with `lea`
+    if (op == IR_SUB && !ir_fits_imm(-imm)) return;
+    // Stored with the size of the destination
+    if (op == IR_STORE && ins->ins_size < 4 &&
+        imm != (ins->ins_size == 1 ? (i8)imm : (i16)imm))
+        return;
+
+    ins->ins_rhs = IR_VREG_IMM;
+    ins->ins_rhs_imm = imm;
+}
+
+static void ir_fold_imms_fn(mkt_ir_fn_t* irf) {
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    // In SSA form, a constant has a single definition: an IR_IMM
+    bool* is_const = NULL;
+    i64* consts = NULL;
+    for (i32 v = 0; v < (i32)buf_size(irf->irf_vregs); v++) {
+        buf_push(is_const, false);
+        buf_push(consts, 0);
+    }
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_op != IR_IMM) continue;
+
+            is_const[ins->ins_dst] = true;
+            consts[ins->ins_dst] = ins->ins_imm;
+        }
+    }
+
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+            ir_fold_imm(&block->bb_ins[i], is_const, consts);
+    }
+    buf_free(is_const);
+    buf_free(consts);
+}
+
+static void ir_fold_imms(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        ir_fold_imms_fn(&ir->ir_fns[f]);
+}
+
+static void ir_free(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++) {
+        mkt_ir_fn_t* const irf = &ir->ir_fns[f];
+
+        for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+            mkt_ir_block_t* const block = &irf->irf_blocks[b];
+            for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+                buf_free(block->bb_ins[i].ins_args);
+                buf_free(block->bb_ins[i].ins_preds);
+            }
+            buf_free(block->bb_ins);
+        }
+        buf_free(irf->irf_blocks);
+        buf_free(irf->irf_vregs);
+    }
+    buf_free(ir->ir_fns);
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "ir.h"
+
+// Instruction selection over trees, in SSA form. A pure instruction read
+// once, in the same block, can be computed by its reader: the two make a
+// tree that one x86 instruction may cover, e.g. `lea (%x,%y,4)` for
+// `x + (y << 2)` or `add 8(%p), %x` for `x + load [p+8]`. For each
+// instruction, isel_select_ins keeps the cheapest of covering such a tree
+// with a pattern below and computing the operand on its own. The leaves left
+// are then matched once registers are allocated, see emit_select.
+
+typedef struct {
+    const mkt_ir_block_t* is_block;
+    i32 is_ins_i, is_operand_i;  // Root, and the definition of its operand
+} isel_tree_t;
+
+typedef struct {
+    mkt_ir_op_t ip_op, ip_operand_op;  // Root, and its right operand
+    bool (*ip_when)(const isel_tree_t* tree);  // Or NULL
+    i32 ip_cost;  // Instructions, plus memory accesses
+    void (*ip_rewrite)(mkt_ir_ins_t* ins, const mkt_ir_ins_t* operand);
+} isel_pattern_t;
+
+// Cost of an instruction on its own, as in emit_patterns
+static i32 isel_cost(const mkt_ir_ins_t* ins) {
+    return 1 + (ins->ins_op == IR_LOAD) + ins->ins_rhs_mem;
+}
+
+// A scale factor of `lea`
+static bool isel_is_scale(const isel_tree_t* tree) {
+    const i64 shift = tree->is_block->bb_ins[tree->is_operand_i].ins_imm;
+    return shift >= 1 && shift <= 3;
+}
+
+// x + (y << k) -> lea (%x,%y,1<<k)
+static void isel_scale(mkt_ir_ins_t* ins, const mkt_ir_ins_t* operand) {
+    ins->ins_op = IR_SCALE;
+    ins->ins_rhs = operand->ins_lhs;
+    ins->ins_imm = 1 << operand->ins_imm;
+}
+
+// A load of 64 bits, not sign extended, with no store nor call between it
+// and its reader
+static bool isel_is_foldable_load(const isel_tree_t* tree) {
+    const mkt_ir_ins_t* const ins = tree->is_block->bb_ins;
+    if (ins[tree->is_operand_i].ins_size != 8) return false;
+
+    for (i32 i = tree->is_operand_i + 1; i < tree->is_ins_i; i++)
+        if (ins[i].ins_op == IR_STORE || ins[i].ins_op == IR_CALL ||
+            ins[i].ins_op == IR_CALL_RT)
+            return false;
+    return true;
+}
+
+// op x, load [p+disp] -> op disp(%p), %x
+static void isel_load_operand(mkt_ir_ins_t* ins,
+                              const mkt_ir_ins_t* operand) {
+    ins->ins_rhs = operand->ins_lhs;
+    ins->ins_rhs_imm = operand->ins_imm;
+    ins->ins_rhs_mem = true;
+}
+
+static const isel_pattern_t isel_patterns[] = {
+    {IR_ADD, IR_SHL, isel_is_scale, 1, isel_scale},
+    {IR_ADD, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_SUB, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_MUL, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_LT, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_LE, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_EQ, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_NEQ, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+    {IR_BR_CMP, IR_LOAD, isel_is_foldable_load, 2, isel_load_operand},
+};
+
+typedef struct {
+    const i32* is_uses;
+    const i32 *is_def_blocks, *is_def_ins;  // Vreg -> where it is defined
+} isel_ctx_t;
+
+// Pattern covering `ins` and the definition of its right operand, with the
+// cost of the tree. NULL when there is none, or computing the operand on its
+// own is as cheap
+static const isel_pattern_t* isel_match(const isel_ctx_t* is,
+                                        const mkt_ir_block_t* block, i32 b,
+                                        i32 i, i32* cost) {
+    const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+    const i32 rhs = ins->ins_rhs;
+    if (rhs < 0 || ins->ins_rhs_mem || is->is_uses[rhs] != 1 ||
+        is->is_def_blocks[rhs] != b)
+        return NULL;
+
+    const isel_tree_t tree = {block, i, is->is_def_ins[rhs]};
+    const mkt_ir_ins_t* const operand = &block->bb_ins[tree.is_operand_i];
+    const isel_pattern_t* best = NULL;
+    *cost = isel_cost(ins) + isel_cost(operand);
+    for (i32 p = 0; p < (i32)(sizeof(isel_patterns) / sizeof(isel_patterns[0]));
+         p++) {
+        const isel_pattern_t* const pattern = &isel_patterns[p];
+        if (pattern->ip_op != ins->ins_op ||
+            pattern->ip_operand_op != operand->ins_op)
+            continue;
+        if (pattern->ip_when != NULL && !pattern->ip_when(&tree)) continue;
+        if (pattern->ip_cost < *cost) {
+            best = pattern;
+            *cost = pattern->ip_cost;
+        }
+    }
+    return best;
+}
+
+static void isel_swap(mkt_ir_ins_t* ins) {
+    const i32 lhs = ins->ins_lhs;
+    ins->ins_lhs = ins->ins_rhs;
+    ins->ins_rhs = lhs;
+}
+
+static void isel_select_ins(const isel_ctx_t* is, mkt_ir_block_t* block, i32 b,
+                            i32 i) {
+    mkt_ir_ins_t* const ins = &block->bb_ins[i];
+    mkt_ir_op_t op = ins->ins_op;
+    if (op == IR_BR_CMP) op = ins->ins_imm;
+
+    i32 cost = 0, swapped_cost = 0;
+    const isel_pattern_t* best = isel_match(is, block, b, i, &cost);
+    // The left operand of a commutative instruction can be its right one
+    if (ir_op_is_commutative(op) && ins->ins_lhs >= 0 && ins->ins_rhs >= 0) {
+        isel_swap(ins);
+        const isel_pattern_t* const swapped =
+            isel_match(is, block, b, i, &swapped_cost);
+        if (swapped != NULL && (best == NULL || swapped_cost < cost))
+            best = swapped;
+        else
+            isel_swap(ins);
+    }
+    if (best == NULL) return;
+
+    // The operand, now unused, is removed by ir_dce
+    const mkt_ir_ins_t operand = block->bb_ins[is->is_def_ins[ins->ins_rhs]];
+    best->ip_rewrite(ins, &operand);
+}
+
+static void isel_fn(mkt_ir_fn_t* irf) {
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+    i32 *uses = NULL, *def_blocks = NULL, *def_ins = NULL;
+    for (i32 v = 0; v < vregs_len; v++) {
+        buf_push(uses, 0);
+        buf_push(def_blocks, -1);
+        buf_push(def_ins, -1);
+    }
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            ir_ins_for_each_use(ins, ir_count_use, uses);
+            if (ins->ins_dst < 0 || !ir_op_is_pure(ins->ins_op)) continue;
+
+            def_blocks[ins->ins_dst] = b;
+            def_ins[ins->ins_dst] = i;
+        }
+    }
+
+    // The operands of a covered definition keep their count of uses: they
+    // are read by the tree instead once ir_dce removes it
+    const isel_ctx_t is = {uses, def_blocks, def_ins};
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+            isel_select_ins(&is, block, b, i);
+    }
+    buf_free(uses);
+    buf_free(def_blocks);
+    buf_free(def_ins);
+}
+
+static void isel_select(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        isel_fn(&ir->ir_fns[f]);
+}
@@ -2,6 +2,10 @@
 
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "buf.h"
 #include "common.h"
 
@@ -29,6 +33,8 @@ typedef enum {
     TOK_ID_NEQ,
     TOK_ID_EQ_EQ,
     TOK_ID_NOT,
+    TOK_ID_AMPAMP,
+    TOK_ID_PIPEPIPE,
     TOK_ID_IF,
     TOK_ID_ELSE,
     TOK_ID_LCURLY,
@@ -70,6 +76,8 @@ const char mkt_token_id_to_str[][30] = {
     [TOK_ID_NEQ] = "!=",
     [TOK_ID_EQ_EQ] = "==",
     [TOK_ID_NOT] = "!",
+    [TOK_ID_AMPAMP] = "&&",
+    [TOK_ID_PIPEPIPE] = "||",
     [TOK_ID_IF] = "if",
     [TOK_ID_ELSE] = "else",
     [TOK_ID_LCURLY] = "{",
@@ -97,49 +105,60 @@ typedef struct {
     i32 loc_line, loc_column;
 } mkt_loc_t;
 
+// 8 bytes: the line and column are only computed when needed, see lex_loc
 typedef struct {
-    mkt_token_id_t tok_id;
-    mkt_pos_range_t tok_pos_range;
+    i32 tok_start;  // File offset
+    u32 tok_len : 24, tok_id : 8 /* mkt_token_id_t */;
 } mkt_token_t;
 
+// Longest token tok_len can hold: longer ones are reported by lex_init
+static const i32 LEX_TOK_LEN_MAX = (1 << 24) - 1;
+
 typedef struct {
     mkt_token_id_t key_id;
+    i32 key_len;  // 0 for an empty slot
     const char key_str[20];
 } mkt_keyword_t;
 
-static const mkt_keyword_t keywords[] = {
-    {.key_id = TOK_ID_TRUE, .key_str = "true"},
-    {.key_id = TOK_ID_FALSE, .key_str = "false"},
-    {.key_id = TOK_ID_BUILTIN_PRINTLN, .key_str = "println"},
-    {.key_id = TOK_ID_IF, .key_str = "if"},
-    {.key_id = TOK_ID_ELSE, .key_str = "else"},
-    {.key_id = TOK_ID_VAL, .key_str = "val"},
-    {.key_id = TOK_ID_VAR, .key_str = "var"},
-    {.key_id = TOK_ID_WHILE, .key_str = "while"},
-    {.key_id = TOK_ID_FUN, .key_str = "fun"},
-    {.key_id = TOK_ID_RETURN, .key_str = "return"},
-    {.key_id = TOK_ID_CLASS, .key_str = "class"},
+// Perfect hash of the keywords, from their first and last characters and
+// their length. A collision between two keywords makes two initializers below
+// overlap, which -Woverride-init (in -Wextra) reports
+#define LEX_KEYWORD_HASH(first, last, len) \
+    ((4 * (u32)(u8)(first) + (u32)(u8)(last) + (u32)(len)) & 31)
+
+#define LEX_KEYWORD(id, str, first, last)            \
+    [LEX_KEYWORD_HASH(first, last, sizeof(str) - 1)] = { \
+        .key_id = id, .key_len = sizeof(str) - 1, .key_str = str}
+
+static const mkt_keyword_t keywords[32] = {
+    LEX_KEYWORD(TOK_ID_TRUE, "true", 't', 'e'),
+    LEX_KEYWORD(TOK_ID_FALSE, "false", 'f', 'e'),
+    LEX_KEYWORD(TOK_ID_BUILTIN_PRINTLN, "println", 'p', 'n'),
+    LEX_KEYWORD(TOK_ID_IF, "if", 'i', 'f'),
+    LEX_KEYWORD(TOK_ID_ELSE, "else", 'e', 'e'),
+    LEX_KEYWORD(TOK_ID_VAL, "val", 'v', 'l'),
+    LEX_KEYWORD(TOK_ID_VAR, "var", 'v', 'r'),
+    LEX_KEYWORD(TOK_ID_WHILE, "while", 'w', 'e'),
+    LEX_KEYWORD(TOK_ID_FUN, "fun", 'f', 'n'),
+    LEX_KEYWORD(TOK_ID_RETURN, "return", 'r', 'n'),
+    LEX_KEYWORD(TOK_ID_CLASS, "class", 'c', 's'),
 };
 
 typedef struct {
     const char* lex_source;
     i32 lex_source_len, lex_index;
-    mkt_loc_t* lex_locs;
     mkt_token_t* lex_tokens;
-    mkt_pos_range_t* lex_tok_pos_ranges;
+    i32* lex_line_starts;  // File offset of the first character of each line
 } mkt_lexer_t;
 
-// TODO: trie?
 static const mkt_token_id_t* token_get_keyword(const char* source_start,
                                                i32 len) {
-    const i32 keywords_len = sizeof(keywords) / sizeof(keywords[0]);
-    for (i32 i = 0; i < keywords_len; i++) {
-        const mkt_keyword_t* k = &keywords[i];
-        const i32 keyword_len = strlen(k->key_str);
+    CHECK(len, >, 0, "%d");
 
-        if (len == keyword_len && memcmp(source_start, k->key_str, len) == 0)
-            return &k->key_id;
-    }
+    const mkt_keyword_t* const k = &keywords[LEX_KEYWORD_HASH(
+        source_start[0], source_start[len - 1], len)];
+    if (k->key_len == len && memcmp(source_start, k->key_str, len) == 0)
+        return &k->key_id;
 
     return NULL;
 }
@@ -153,14 +172,77 @@ static bool lex_is_identifier_char(char c) {
            ('A' <= c && c <= 'Z') || c == '_';
 }
 
-static char lex_advance(mkt_lexer_t* lexer, i32* col) {
+static bool lex_is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Scanning of runs of characters, 16 at a time with SSE2. Each returns the
+// index of the first character at or after `i` ending the run, or `len`
+
+#if defined(__SSE2__)
+static __m128i lex_load(const char* s, i32 i) {
+    return _mm_loadu_si128((const __m128i*)(s + i));
+}
+
+// Bit i is set if `lo <= chars[i] <= hi`. Only for ASCII bounds: bytes past
+// 0x7f are negative and never in range
+static i32 lex_mask_range(__m128i chars, char lo, char hi) {
+    return _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(lo - 1)),
+                      _mm_cmplt_epi8(chars, _mm_set1_epi8(hi + 1))));
+}
+
+static i32 lex_mask_eq(__m128i chars, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8(c)));
+}
+#endif
+
+static i32 lex_scan_blanks(const char* s, i32 i, i32 len) {
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        const __m128i chars = lex_load(s, i);
+        const i32 blanks = lex_mask_eq(chars, ' ') | lex_mask_eq(chars, '\t') |
+                           lex_mask_eq(chars, '\r');
+        if (blanks != 0xffff) return i + __builtin_ctz(~blanks);
+    }
+#endif
+    while (i < len && lex_is_blank(s[i])) i++;
+    return i;
+}
+
+static i32 lex_scan_identifier(const char* s, i32 i, i32 len) {
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        const __m128i chars = lex_load(s, i);
+        // Setting bit 5 maps `A-Z` onto `a-z` and nothing else onto it
+        const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+        const i32 ident = lex_mask_range(lower, 'a', 'z') |
+                          lex_mask_range(chars, '0', '9') |
+                          lex_mask_eq(chars, '_');
+        if (ident != 0xffff) return i + __builtin_ctz(~ident);
+    }
+#endif
+    while (i < len && lex_is_identifier_char(s[i])) i++;
+    return i;
+}
+
+// Up to the first `a` or `b`
+static i32 lex_scan_until(const char* s, i32 i, i32 len, char a, char b) {
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        const __m128i chars = lex_load(s, i);
+        const i32 found = lex_mask_eq(chars, a) | lex_mask_eq(chars, b);
+        if (found != 0) return i + __builtin_ctz(found);
+    }
+#endif
+    while (i < len && s[i] != a && s[i] != b) i++;
+    return i;
+}
+
+static char lex_advance(mkt_lexer_t* lexer) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
     CHECK(lexer->lex_index, <=, lexer->lex_source_len, "%d");
 
     lexer->lex_index += 1;
-    *col += 1;
 
     return lexer->lex_source[lexer->lex_index - 1];
 }
@@ -198,80 +280,68 @@ static char lex_peek_next_next(const mkt_lexer_t* lexer) {
                : lexer->lex_source[lexer->lex_index + 2];
 }
 
-static bool lex_match(mkt_lexer_t* lexer, char c, i32* col) {
+static bool lex_match(mkt_lexer_t* lexer, char c) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
 
     if (lex_is_at_end(lexer)) return false;
 
     if (lex_peek(lexer) != c) return false;
 
-    lex_advance(lexer, col);
+    lex_advance(lexer);
     return true;
 }
 
-static void lex_advance_until_newline_or_eof(mkt_lexer_t* lexer, i32* col) {
+static void lex_advance_until_newline_or_eof(mkt_lexer_t* lexer) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
     CHECK(lexer->lex_index, <, lexer->lex_source_len - 1, "%d");
-    CHECK((void*)col, !=, NULL, "%p");
 
-    while (true) {
-        const char c = lex_peek(lexer);
-        if (c == '\n' || c == '\0') {
-            break;
-        }
-
-        lex_advance(lexer, col);
-    }
+    const i32 end = lex_scan_until(lexer->lex_source, lexer->lex_index,
+                                   lexer->lex_source_len, '\n', '\n');
+    lexer->lex_index = end;
 }
 
-static void lex_identifier(mkt_lexer_t* lexer, mkt_token_t* result, i32* col) {
+static void lex_identifier(mkt_lexer_t* lexer, mkt_token_t* result) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
     CHECK((void*)result, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
 
-    char c = lex_advance(lexer, col);
+    const char c = lex_advance(lexer);
     CHECK(lex_is_identifier_char(c), ==, true, "%d");
 
-    while (lexer->lex_index < lexer->lex_source_len) {
-        c = lex_peek(lexer);
-        if (!lex_is_identifier_char(c)) break;
-
-        lex_advance(lexer, col);
-    }
+    const i32 end = lex_scan_identifier(lexer->lex_source, lexer->lex_index,
+                                        lexer->lex_source_len);
+    lexer->lex_index = end;
 
     CHECK(lexer->lex_index, >=, 0, "%d");
     CHECK(lexer->lex_index, <, lexer->lex_source_len, "%d");
-    CHECK(lexer->lex_index, >=, result->tok_pos_range.pr_start, "%d");
+    CHECK(lexer->lex_index, >=, result->tok_start, "%d");
 
     const mkt_token_id_t* id = NULL;
 
     if ((id = token_get_keyword(
-             lexer->lex_source + result->tok_pos_range.pr_start,
-             lexer->lex_index - result->tok_pos_range.pr_start))) {
+             lexer->lex_source + result->tok_start,
+             lexer->lex_index - result->tok_start))) {
         result->tok_id = *id;
     } else {
         result->tok_id = TOK_ID_IDENTIFIER;
     }
 }
 
-static mkt_res_t lex_number(mkt_lexer_t* lexer, mkt_token_t* result, i32* col) {
+static mkt_res_t lex_number(mkt_lexer_t* lexer, mkt_token_t* result) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
     CHECK((void*)result, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
 
-    char c = lex_advance(lexer, col);
+    char c = lex_advance(lexer);
     CHECK(lex_is_digit(c), ==, true, "%d");
 
     while (lexer->lex_index < lexer->lex_source_len) {
         c = lex_peek(lexer);
         if (!(lex_is_digit(c) || c == 'L')) break;
 
-        lex_advance(lexer, col);
+        lex_advance(lexer);
     }
 
     result->tok_id = TOK_ID_NUM;
@@ -280,45 +350,46 @@ static mkt_res_t lex_number(mkt_lexer_t* lexer, mkt_token_t* result, i32* col) {
 
 // TODO: escape sequences
 // TODO: multiline
-static void lex_string(mkt_lexer_t* lexer, mkt_token_t* result, i32* line,
-                       i32* col) {
+static void lex_string(mkt_lexer_t* lexer, mkt_token_t* result) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
     CHECK((void*)result, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
 
     char c = lex_peek(lexer);
     CHECK(c, ==, '"', "%c");
-    lex_advance(lexer, col);
+    lex_advance(lexer);
 
     const bool multiline =
         lex_peek(lexer) == '"' && lex_peek_next(lexer) == '"';
     if (multiline) {
-        lex_advance(lexer, col);
-        lex_advance(lexer, col);
+        lex_advance(lexer);
+        lex_advance(lexer);
     }
 
     while (lexer->lex_index < lexer->lex_source_len) {
+        // Skip to the next character of interest
+        const i32 end = lex_scan_until(lexer->lex_source, lexer->lex_index,
+                                       lexer->lex_source_len, '"', '\n');
+        lexer->lex_index = end;
+        if (lex_is_at_end(lexer)) break;
+
         c = lex_peek(lexer);
         if (c == '"' && !multiline) {
             result->tok_id = TOK_ID_STRING;
-            lex_advance(lexer, col);
+            lex_advance(lexer);
             return;
         }
         if (c == '"' && lex_peek_next(lexer) == '"' &&
             lex_peek_next_next(lexer) == '"' && multiline) {
             result->tok_id = TOK_ID_STRING;
-            lex_advance(lexer, col);
-            lex_advance(lexer, col);
-            lex_advance(lexer, col);
+            lex_advance(lexer);
+            lex_advance(lexer);
+            lex_advance(lexer);
             return;
         }
-        if (c == '\n') {
-            *line += 1;
-            *col = 1;
-        }
+        if (c == '\n') buf_push(lexer->lex_line_starts, lexer->lex_index + 1);
 
-        lex_advance(lexer, col);
+        lex_advance(lexer);
     }
 
     log_debug(
@@ -330,22 +401,21 @@ static void lex_string(mkt_lexer_t* lexer, mkt_token_t* result, i32* line,
 
 // TODO: escape sequences
 // TODO: unicode literals
-static void lex_char(mkt_lexer_t* lexer, mkt_token_t* result, i32* col) {
+static void lex_char(mkt_lexer_t* lexer, mkt_token_t* result) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
     CHECK((void*)result, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
 
     char c = lex_peek(lexer);
     CHECK(c, ==, '\'', "%c");
-    lex_advance(lexer, col);
+    lex_advance(lexer);
 
     i32 len = 0;
     while (lexer->lex_index < lexer->lex_source_len) {
         c = lex_peek(lexer);
         if (c == '\'') break;
 
-        lex_advance(lexer, col);
+        lex_advance(lexer);
         len++;
     }
 
@@ -358,7 +428,7 @@ static void lex_char(mkt_lexer_t* lexer, mkt_token_t* result, i32* col) {
     } else {
         CHECK(c, ==, '\'', "%c");
         result->tok_id = TOK_ID_CHAR;
-        lex_advance(lexer, col);
+        lex_advance(lexer);
     }
 
     if (len != 1) {
@@ -366,16 +436,12 @@ static void lex_char(mkt_lexer_t* lexer, mkt_token_t* result, i32* col) {
     }
 }
 
-static mkt_token_t lex_next(mkt_lexer_t* lexer, i32* line, i32* start_col,
-                            i32* col) {
+static mkt_token_t lex_next(mkt_lexer_t* lexer) {
     CHECK((void*)lexer, !=, NULL, "%p");
     CHECK((void*)lexer->lex_source, !=, NULL, "%p");
-    CHECK((void*)line, !=, NULL, "%p");
-    CHECK((void*)start_col, !=, NULL, "%p");
-    CHECK((void*)col, !=, NULL, "%p");
 
     mkt_token_t result = {.tok_id = TOK_ID_EOF,
-                          .tok_pos_range = {.pr_start = lexer->lex_index}};
+                          .tok_start = lexer->lex_index};
 
     while (lexer->lex_index < lexer->lex_source_len) {
         const char c = lexer->lex_source[lexer->lex_index];
@@ -384,121 +450,133 @@ static mkt_token_t lex_next(mkt_lexer_t* lexer, i32* line, i32* start_col,
             case ' ':
             case '\r':
             case '\t': {
-                result.tok_pos_range.pr_start = lexer->lex_index + 1;
-                *start_col += 1;
-                break;
+                const i32 end = lex_scan_blanks(
+                    lexer->lex_source, lexer->lex_index, lexer->lex_source_len);
+                lexer->lex_index = result.tok_start = end;
+                continue;
             }
             case '\n': {
-                result.tok_pos_range.pr_start = lexer->lex_index + 1;
+                result.tok_start = lexer->lex_index + 1;
                 lexer->lex_index += 1;
-                *col = *start_col = 1;
-                *line += 1;
+                buf_push(lexer->lex_line_starts, lexer->lex_index);
                 continue;
             }
             case '/': {
                 if (lex_peek_next(lexer) == '/') {
-                    lex_advance_until_newline_or_eof(lexer, col);
+                    lex_advance_until_newline_or_eof(lexer);
                     result.tok_id = TOK_ID_COMMENT;
                     goto outer;
                 } else {
-                    lex_match(lexer, '/', col);
+                    lex_match(lexer, '/');
                     result.tok_id = TOK_ID_SLASH;
                     goto outer;
                 }
             }
             case '.': {
-                lex_match(lexer, '.', col);
+                lex_match(lexer, '.');
                 result.tok_id = TOK_ID_DOT;
 
                 goto outer;
             }
             case '=': {
-                lex_match(lexer, '=', col);
+                lex_match(lexer, '=');
                 result.tok_id =
-                    lex_match(lexer, '=', col) ? TOK_ID_EQ_EQ : TOK_ID_EQ;
+                    lex_match(lexer, '=') ? TOK_ID_EQ_EQ : TOK_ID_EQ;
                 goto outer;
             }
             case '!': {
-                lex_match(lexer, '!', col);
+                lex_match(lexer, '!');
                 result.tok_id =
-                    lex_match(lexer, '=', col) ? TOK_ID_NEQ : TOK_ID_NOT;
+                    lex_match(lexer, '=') ? TOK_ID_NEQ : TOK_ID_NOT;
+                goto outer;
+            }
+            case '&': {
+                lex_match(lexer, '&');
+                result.tok_id = lex_match(lexer, '&') ? TOK_ID_AMPAMP
+                                                           : TOK_ID_INVALID;
+                goto outer;
+            }
+            case '|': {
+                lex_match(lexer, '|');
+                result.tok_id = lex_match(lexer, '|') ? TOK_ID_PIPEPIPE
+                                                           : TOK_ID_INVALID;
                 goto outer;
             }
             case '<': {
-                lex_match(lexer, '<', col);
+                lex_match(lexer, '<');
                 result.tok_id =
-                    lex_match(lexer, '=', col) ? TOK_ID_LE : TOK_ID_LT;
+                    lex_match(lexer, '=') ? TOK_ID_LE : TOK_ID_LT;
                 goto outer;
             }
             case '>': {
-                lex_match(lexer, '>', col);
+                lex_match(lexer, '>');
                 result.tok_id =
-                    lex_match(lexer, '=', col) ? TOK_ID_GE : TOK_ID_GT;
+                    lex_match(lexer, '=') ? TOK_ID_GE : TOK_ID_GT;
                 goto outer;
             }
             case ':': {
-                lex_match(lexer, ':', col);
+                lex_match(lexer, ':');
                 result.tok_id = TOK_ID_COLON;
 
                 goto outer;
             }
             case '{': {
-                lex_match(lexer, '{', col);
+                lex_match(lexer, '{');
                 result.tok_id = TOK_ID_LCURLY;
 
                 goto outer;
             }
             case '}': {
-                lex_match(lexer, '}', col);
+                lex_match(lexer, '}');
                 result.tok_id = TOK_ID_RCURLY;
 
                 goto outer;
             }
             case '+': {
-                lex_match(lexer, '+', col);
+                lex_match(lexer, '+');
                 result.tok_id = TOK_ID_PLUS;
 
                 goto outer;
             }
             case '*': {
-                lex_match(lexer, '*', col);
+                lex_match(lexer, '*');
                 result.tok_id = TOK_ID_STAR;
 
                 goto outer;
             }
             case '-': {
-                lex_match(lexer, '-', col);
+                lex_match(lexer, '-');
                 result.tok_id = TOK_ID_MINUS;
 
                 goto outer;
             }
             case '%': {
-                lex_match(lexer, '%', col);
+                lex_match(lexer, '%');
                 result.tok_id = TOK_ID_PERCENT;
 
                 goto outer;
             }
             case '(': {
                 result.tok_id = TOK_ID_LPAREN;
-                lex_advance(lexer, col);
+                lex_advance(lexer);
                 goto outer;
             }
             case ')': {
                 result.tok_id = TOK_ID_RPAREN;
-                lex_advance(lexer, col);
+                lex_advance(lexer);
                 goto outer;
             }
             case ',': {
                 result.tok_id = TOK_ID_COMMA;
-                lex_advance(lexer, col);
+                lex_advance(lexer);
                 goto outer;
             }
             case '"': {
-                lex_string(lexer, &result, line, col);
+                lex_string(lexer, &result);
                 goto outer;
             }
             case '\'': {
-                lex_char(lexer, &result, col);
+                lex_char(lexer, &result);
                 goto outer;
             }
             case '_':
@@ -554,7 +632,7 @@ static mkt_token_t lex_next(mkt_lexer_t* lexer, i32* line, i32* start_col,
             case 'X':
             case 'Y':
             case 'Z': {
-                lex_identifier(lexer, &result, col);
+                lex_identifier(lexer, &result);
                 goto outer;
             }
             case '0':
@@ -567,40 +645,79 @@ static mkt_token_t lex_next(mkt_lexer_t* lexer, i32* line, i32* start_col,
             case '7':
             case '8':
             case '9': {
-                const mkt_res_t res = lex_number(lexer, &result, col);
+                const mkt_res_t res = lex_number(lexer, &result);
                 IGNORE(res);  // TODO: correct?
                 goto outer;
             }
             default: {
                 result.tok_id = TOK_ID_INVALID;
                 log_debug("Invalid token: `%c`", c);
-                lex_advance(lexer, col);
+                lex_advance(lexer);
                 goto outer;
             }
         }
-        lex_advance(lexer, col);
+        lex_advance(lexer);
     }
 outer:
-    result.tok_pos_range.pr_end = lexer->lex_index;
-    CHECK(result.tok_pos_range.pr_end, >=, result.tok_pos_range.pr_start, "%d");
+    CHECK(lexer->lex_index, >=, result.tok_start, "%d");
+    result.tok_len = lexer->lex_index - result.tok_start > LEX_TOK_LEN_MAX
+                         ? LEX_TOK_LEN_MAX
+                         : lexer->lex_index - result.tok_start;
 
     return result;
 }
 
+// Binary search of the line holding the file offset `pos`
+static mkt_loc_t lex_pos_loc(const mkt_lexer_t* lexer, i32 pos) {
+    CHECK((void*)lexer, !=, NULL, "%p");
+    CHECK(buf_size(lexer->lex_line_starts), >, 0UL, "%zu");
+    CHECK(pos, >=, 0, "%d");
+
+    i32 lo = 0, hi = buf_size(lexer->lex_line_starts) - 1;
+    while (lo < hi) {
+        const i32 mid = lo + (hi - lo + 1) / 2;
+        if (lexer->lex_line_starts[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return (mkt_loc_t){.loc_line = lo + 1,
+                       .loc_column = pos - lexer->lex_line_starts[lo] + 1};
+}
+
+static mkt_loc_t lex_loc(const mkt_lexer_t* lexer, i32 tok_i) {
+    CHECK(tok_i, >=, 0, "%d");
+    CHECK(tok_i, <, (i32)buf_size(lexer->lex_tokens), "%d");
+
+    return lex_pos_loc(lexer, lexer->lex_tokens[tok_i].tok_start);
+}
+
+static mkt_pos_range_t lex_pos_range(const mkt_lexer_t* lexer, i32 tok_i) {
+    CHECK((void*)lexer, !=, NULL, "%p");
+    CHECK(tok_i, >=, 0, "%d");
+    CHECK(tok_i, <, (i32)buf_size(lexer->lex_tokens), "%d");
+
+    const mkt_token_t tok = lexer->lex_tokens[tok_i];
+    return (mkt_pos_range_t){.pr_start = tok.tok_start,
+                             .pr_end = tok.tok_start + (i32)tok.tok_len};
+}
+
 static void token_dump(const mkt_token_t* t, i32 i, const mkt_lexer_t* lexer) {
     CHECK((void*)t, !=, NULL, "%p");
     CHECK((void*)lexer, !=, NULL, "%p");
 
-    mkt_loc_t loc = lexer->lex_locs[i];
 #if WITH_LOGS == 0
+    IGNORE(t);
     IGNORE(i);
-    IGNORE(loc);
-#endif
+    IGNORE(lexer);
+#else
+    const mkt_loc_t loc = lex_pos_loc(lexer, t->tok_start);
     log_debug("%d:%d:id=%s #%d %d..%d `%.*s`", loc.loc_line, loc.loc_column,
-              mkt_token_id_to_str[t->tok_id], i, t->tok_pos_range.pr_start,
-              t->tok_pos_range.pr_end,
-              t->tok_pos_range.pr_end - t->tok_pos_range.pr_start,
-              &lexer->lex_source[t->tok_pos_range.pr_start]);
+              mkt_token_id_to_str[t->tok_id], i, t->tok_start,
+              t->tok_start + (i32)t->tok_len, (i32)t->tok_len,
+              &lexer->lex_source[t->tok_start]);
+#endif
 }
 
 static mkt_res_t lex_init(const char* file_name0, const char* source,
@@ -612,25 +729,34 @@ static mkt_res_t lex_init(const char* file_name0, const char* source,
     lexer->lex_source = source;
     lexer->lex_source_len = source_len;
     buf_grow(lexer->lex_tokens, source_len / 8);
-    buf_grow(lexer->lex_tok_pos_ranges, source_len / 8);
+    buf_grow(lexer->lex_line_starts, source_len / 32 + 1);
+    buf_push(lexer->lex_line_starts, 0);
 
     bool err = false;
-    i32 i = 0, col = 1, line = 1;
+    i32 i = 0;
     while (true) {
-        i32 start_col = col;
-        const mkt_token_t token = lex_next(lexer, &line, &start_col, &col);
+        const mkt_token_t token = lex_next(lexer);
         if (token.tok_id == TOK_ID_INVALID) {
+            const mkt_loc_t loc = lex_pos_loc(lexer, token.tok_start);
             fprintf(stderr, "%s%s:%d:%d:Invalid token: %s%c\n",
-                    mkt_colors[is_tty][COL_GRAY], file_name0, line, start_col,
-                    mkt_colors[is_tty][COL_RESET],
-                    source[token.tok_pos_range.pr_start]);
+                    mkt_colors[is_tty][COL_GRAY], file_name0, loc.loc_line,
+                    loc.loc_column, mkt_colors[is_tty][COL_RESET],
+                    source[token.tok_start]);
+            err = true;
+        }
+        // lex_index is past the token just lexed
+        if (lexer->lex_index - token.tok_start > LEX_TOK_LEN_MAX) {
+            const mkt_loc_t loc = lex_pos_loc(lexer, token.tok_start);
+            fprintf(stderr,
+                    "%s%s:%d:%d:Token too long: %s%d bytes, the maximum is "
+                    "%d\n",
+                    mkt_colors[is_tty][COL_GRAY], file_name0, loc.loc_line,
+                    loc.loc_column, mkt_colors[is_tty][COL_RESET],
+                    lexer->lex_index - token.tok_start, LEX_TOK_LEN_MAX);
             err = true;
         }
 
         buf_push(lexer->lex_tokens, token);
-        buf_push(lexer->lex_tok_pos_ranges, token.tok_pos_range);
-        buf_push(lexer->lex_locs,
-                 ((mkt_loc_t){.loc_line = line, .loc_column = start_col}));
 
         token_dump(&token, i, lexer);
 
@@ -639,10 +765,6 @@ static mkt_res_t lex_init(const char* file_name0, const char* source,
     }
     if (err) return RES_ERR;
 
-    CHECK(buf_size(lexer->lex_tokens), ==, buf_size(lexer->lex_tok_pos_ranges),
-          "%zu");
-    CHECK(buf_size(lexer->lex_tokens), ==, buf_size(lexer->lex_locs), "%zu");
-
     return RES_OK;
 }
 
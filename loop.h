@@ -0,0 +1,255 @@
+#pragma once
+
+#include "ir.h"
+#include "ssa.h"
+
+// Loop invariant code motion, in SSA form. A loop is the natural loop of its
+// header: the blocks reaching a back edge to the header without going through
+// it, a back edge being an edge to a block dominating its source. The pure
+// instructions of a loop whose operands are all defined outside of it are
+// hoisted into a preheader, which runs once before the loop is entered.
+// Lowering rotates `while` loops (see ir_lower_while), so that the body is
+// the header and the guard its only predecessor outside of the loop.
+
+static bool loop_dominates(const ssa_cfg_t* cfg, i32 a, i32 b) {
+    for (;;) {
+        if (b == a) return true;
+        if (b == 0) return false;
+        b = cfg->cf_idom[b];
+    }
+}
+
+static bool loop_is_header(const ssa_cfg_t* cfg, i32 b) {
+    for (i32 p = 0; p < (i32)buf_size(cfg->cf_preds[b]); p++)
+        if (loop_dominates(cfg, b, cfg->cf_preds[b][p])) return true;
+    return false;
+}
+
+// Marks the blocks of the loop of `header` in `in_loop`
+static void loop_blocks(const ssa_cfg_t* cfg, i32 header, bool* in_loop) {
+    i32* stack = NULL;
+    in_loop[header] = true;
+    for (i32 p = 0; p < (i32)buf_size(cfg->cf_preds[header]); p++) {
+        const i32 latch = cfg->cf_preds[header][p];
+        if (!loop_dominates(cfg, header, latch) || in_loop[latch]) continue;
+
+        in_loop[latch] = true;
+        buf_push(stack, latch);
+    }
+    while (buf_size(stack) > 0) {
+        const i32 b = buf_pop(stack);
+        for (i32 p = 0; p < (i32)buf_size(cfg->cf_preds[b]); p++) {
+            const i32 pred = cfg->cf_preds[b][p];
+            if (in_loop[pred]) continue;
+
+            in_loop[pred] = true;
+            buf_push(stack, pred);
+        }
+    }
+    buf_free(stack);
+}
+
+// Memory is only read by IR_LOAD, which can be hoisted when nothing in the
+// loop writes to it. Constants stay: an immediate is as cheap as a register,
+// which would be held for the whole loop
+static bool loop_is_hoistable(const mkt_ir_ins_t* ins, bool loop_writes) {
+    if (!ir_op_is_pure(ins->ins_op)) return false;
+    switch (ins->ins_op) {
+        case IR_PHI:
+        case IR_IMM:
+        case IR_FN_ADDR:
+        case IR_STRING:
+            return false;
+        case IR_LOAD:
+            return !loop_writes;
+        default:
+            return true;
+    }
+}
+
+typedef struct {
+    mkt_ir_fn_t* li_fn;
+    i32* li_def_blocks;  // Vreg -> defining block, -1 outside the loop
+    const bool* li_in_loop;
+    const bool* li_is_imm;  // Defined by an IR_IMM
+    const i64* li_imms;
+    mkt_ir_ins_t* li_hoisted;
+    bool li_invariant;
+} loop_ctx_t;
+
+static void loop_check_operand(i32 vreg, void* ctx) {
+    loop_ctx_t* const lc = ctx;
+    const i32 def_block = lc->li_def_blocks[vreg];
+    if (def_block >= 0 && lc->li_in_loop[def_block] && !lc->li_is_imm[vreg])
+        lc->li_invariant = false;
+}
+
+// A constant of the loop used by a hoisted instruction is copied along
+static void loop_hoist_operand(loop_ctx_t* lc, i32 node_i, i32* vreg) {
+    if (*vreg < 0) return;
+    const i32 def_block = lc->li_def_blocks[*vreg];
+    if (def_block < 0 || !lc->li_in_loop[def_block]) return;
+
+    mkt_ir_ins_t imm = ir_ins_make(IR_IMM, node_i);
+    imm.ins_imm = lc->li_imms[*vreg];
+    imm.ins_dst = ssa_vreg_clone(lc->li_fn, *vreg);
+    buf_push(lc->li_hoisted, imm);
+    *vreg = imm.ins_dst;
+}
+
+// Moves the invariant instructions of the loop of `header` to its preheader.
+// Returns where a new block was inserted for it, -1 when none was
+static i32 loop_hoist(mkt_ir_fn_t* irf, i32 header) {
+    const i32 blocks_len = buf_size(irf->irf_blocks);
+    ssa_cfg_t cfg = {0};
+    ssa_cfg_make(irf, &cfg);
+
+    bool* in_loop = NULL;
+    for (i32 b = 0; b < blocks_len; b++) buf_push(in_loop, false);
+    loop_blocks(&cfg, header, in_loop);
+
+    // A single way in
+    i32 entry = -1;
+    for (i32 p = 0; p < (i32)buf_size(cfg.cf_preds[header]); p++) {
+        const i32 pred = cfg.cf_preds[header][p];
+        if (in_loop[pred] || pred == entry) continue;
+
+        entry = entry == -1 ? pred : -2;
+    }
+    if (entry < 0) {
+        ssa_cfg_free(&cfg);
+        buf_free(in_loop);
+        return -1;
+    }
+
+    loop_ctx_t lc = {.li_fn = irf, .li_in_loop = in_loop};
+    i32* def_blocks = NULL;
+    bool* is_imm = NULL;
+    i64* imms = NULL;
+    for (i32 v = 0; v < (i32)buf_size(irf->irf_vregs); v++) {
+        buf_push(def_blocks, -1);
+        buf_push(is_imm, false);
+        buf_push(imms, 0);
+    }
+    bool loop_writes = false;
+    for (i32 b = 0; b < blocks_len; b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_dst >= 0) def_blocks[ins->ins_dst] = b;
+            if (ins->ins_op == IR_IMM) {
+                is_imm[ins->ins_dst] = true;
+                imms[ins->ins_dst] = ins->ins_imm;
+            }
+            if (in_loop[b] &&
+                (ins->ins_op == IR_STORE || ins->ins_op == IR_CALL))
+                loop_writes = true;
+        }
+    }
+    lc.li_def_blocks = def_blocks;
+    lc.li_is_imm = is_imm;
+    lc.li_imms = imms;
+
+    // In reverse postorder, definitions come before their uses
+    for (i32 r = 0; r < (i32)buf_size(cfg.cf_rpo); r++) {
+        const i32 b = cfg.cf_rpo[r];
+        if (!in_loop[b]) continue;
+
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        const i32 len = buf_size(block->bb_ins);
+        i32 kept = 0;
+        for (i32 i = 0; i < len; i++) {
+            mkt_ir_ins_t ins = block->bb_ins[i];
+            lc.li_invariant = loop_is_hoistable(&ins, loop_writes);
+            if (lc.li_invariant)
+                ir_ins_for_each_use(&ins, loop_check_operand, &lc);
+            if (!lc.li_invariant) {
+                block->bb_ins[kept++] = ins;
+                continue;
+            }
+
+            // Pure instructions only have these operands
+            CHECK((void*)ins.ins_args, ==, NULL, "%p");
+            loop_hoist_operand(&lc, ins.ins_node_i, &ins.ins_lhs);
+            loop_hoist_operand(&lc, ins.ins_node_i, &ins.ins_rhs);
+            def_blocks[ins.ins_dst] = -1;
+            buf_push(lc.li_hoisted, ins);
+        }
+        buf_ptr(block->bb_ins)->size = kept;
+    }
+    ssa_cfg_free(&cfg);
+    buf_free(in_loop);
+    buf_free(def_blocks);
+    buf_free(is_imm);
+    buf_free(imms);
+
+    mkt_ir_ins_t* hoisted = lc.li_hoisted;
+    if (buf_size(hoisted) == 0) return -1;
+
+    // Into the predecessor when it only leads to the loop, otherwise into a
+    // new block between the two
+    i32 succs[2] = {-1, -1};
+    i32 inserted = -1;
+    if (ir_block_succs(&irf->irf_blocks[entry], succs) > 1) {
+        inserted = header;
+        ssa_block_insert(irf, inserted);
+        header += 1;
+        if (entry >= inserted) entry += 1;
+
+        mkt_ir_block_t* const from = &irf->irf_blocks[entry];
+        mkt_ir_ins_t* const br = &from->bb_ins[buf_size(from->bb_ins) - 1];
+        if (br->ins_target == header) br->ins_target = inserted;
+        if (br->ins_target_else == header) br->ins_target_else = inserted;
+
+        mkt_ir_ins_t jmp = ir_ins_make(IR_JMP, br->ins_node_i);
+        jmp.ins_target = header;
+        buf_push(irf->irf_blocks[inserted].bb_ins, jmp);
+
+        mkt_ir_block_t* const block = &irf->irf_blocks[header];
+        for (i32 i = 0; i < ssa_phis_len(block); i++) {
+            i32* const preds = block->bb_ins[i].ins_preds;
+            for (i32 p = 0; p < (i32)buf_size(preds); p++)
+                if (preds[p] == entry) preds[p] = inserted;
+        }
+        entry = inserted;
+    }
+
+    mkt_ir_block_t* const pre = &irf->irf_blocks[entry];
+    const mkt_ir_ins_t jmp = buf_pop(pre->bb_ins);
+    CHECK(jmp.ins_op, ==, IR_JMP, "%d");
+    for (i32 i = 0; i < (i32)buf_size(hoisted); i++)
+        buf_push(pre->bb_ins, hoisted[i]);
+    buf_push(pre->bb_ins, jmp);
+    buf_free(hoisted);
+
+    return inserted;
+}
+
+static void loop_licm_fn(mkt_ir_fn_t* irf) {
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    ssa_cfg_t cfg = {0};
+    ssa_cfg_make(irf, &cfg);
+    i32* headers = NULL;
+    for (i32 r = 0; r < (i32)buf_size(cfg.cf_rpo); r++)
+        if (loop_is_header(&cfg, cfg.cf_rpo[r]))
+            buf_push(headers, cfg.cf_rpo[r]);
+    ssa_cfg_free(&cfg);
+
+    // Inner loops first, so that what they hoist can leave the outer ones too
+    for (i32 h = (i32)buf_size(headers) - 1; h >= 0; h--) {
+        const i32 inserted = loop_hoist(irf, headers[h]);
+        if (inserted == -1) continue;
+
+        for (i32 k = 0; k < h; k++)
+            if (headers[k] >= inserted) headers[k] += 1;
+    }
+    buf_free(headers);
+}
+
+static void loop_licm(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        loop_licm_fn(&ir->ir_fns[f]);
+}
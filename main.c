@@ -6,6 +6,8 @@
 #include <unistd.h>
 
 #include "codegen.h"
+#include "elf.h"
+#include "pass.h"
 
 static bool is_file_name_valid(const char* file_name0) {
     const char suffix[] = ".kt";
@@ -36,7 +38,39 @@ static void base_source_file_name(const char* file_name0,
     base_file_name0[len - 1] = 0;
 }
 
-static i32 run(const char* file_name0) {
+// Encode the machine code and link the executable in-process, without
+// running `as` nor `ld`
+static mkt_res_t emit_exe(const parser_t* parser, const mkt_ir_t* ir,
+                          const char* base_file_name0) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)ir, !=, NULL, "%p");
+    CHECK((void*)base_file_name0, !=, NULL, "%p");
+
+#if !defined(__linux__) || !defined(__x86_64__) || WITH_ASAN == 1
+    fprintf(stderr, "-fdirect-elf is only supported on x86_64 Linux without "
+                    "ASan\n");
+    return RES_FAILED_LD;
+#else
+    const char* const stdlib = stdlib_obj_path();
+    CHECK((void*)stdlib, !=, NULL, "%p");
+
+    // Room for the suffix after a base name of up to MAXPATHLEN bytes
+    char exe_file_name0[MAXPATHLEN + sizeof(".exe")] = "";
+    snprintf(exe_file_name0, sizeof(exe_file_name0), "%s.exe",
+             base_file_name0);
+
+    mkt_asm_t as = {0};
+    emit(parser, ir, &as);
+    const mkt_res_t res = elf_write_exe(&as, stdlib, exe_file_name0);
+    asm_free(&as);
+    if (res == RES_OK)
+        log_debug("created executable `%s`", exe_file_name0);
+
+    return res;
+#endif
+}
+
+static i32 run(const char* file_name0, bool direct_elf, bool verbose_asm) {
     CHECK((void*)file_name0, !=, NULL, "%p");
 
     static char base_file_name0[MAXPATHLEN + 1] = "";
@@ -88,16 +122,29 @@ static i32 run(const char* file_name0) {
         return res;
 
     if ((res = parser_parse(&parser)) != RES_OK) return res;
+    mkt_ir_t ir = {0};
+    pass_run(&parser, &ir);
 
     for (i32 i = 0; i < (i32)buf_size(parser.par_class_decls); i++)
         node_dump(&parser, parser.par_class_decls[i], 0);
 
     const i32 file_name_len = strlen(file_name0);
+    memset(base_file_name0, 0, sizeof(base_file_name0));
+    memcpy(base_file_name0, file_name0, (size_t)file_name_len);
+    base_source_file_name(file_name0, base_file_name0);
+
+    if (direct_elf) {
+        res = emit_exe(&parser, &ir, base_file_name0);
+        ir_free(&ir);
+        return res;
+    }
+
     char asm_file_name0[MAXPATHLEN + 1] = "";
     snprintf(asm_file_name0, MAXPATHLEN, "%.*s.s", (i32)(file_name_len - 3),
              file_name0);
-    FILE* asm_file = fopen(asm_file_name0, "w");
-    if (asm_file == NULL) {
+    const i32 asm_file =
+        open(asm_file_name0, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (asm_file == -1) {
         res = RES_ASM_FILE_READ_FAILED;
         fprintf(stderr, "Failed to read asm file %s: %s\n", asm_file_name0,
                 strerror(errno));
@@ -106,14 +153,20 @@ static i32 run(const char* file_name0) {
 
     log_debug("writing asm output to `%s`", asm_file_name0);
 
-    emit(&parser, asm_file);
-    // Make sure everything has been written to the file and not simply buffered
-    fflush(asm_file);
+    mkt_asm_t as = {.as_is_text = true, .as_verbose = verbose_asm};
+    emit(&parser, &ir, &as);
+    ir_free(&ir);
+    res = asm_write(&as, asm_file);
+    asm_free(&as);
+    close(asm_file);
+    if (res != RES_OK) {
+        res = RES_ASM_FILE_READ_FAILED;
+        fprintf(stderr, "Failed to `write(2)` the asm file %s: %s\n",
+                asm_file_name0, strerror(errno));
+        return res;
+    }
 
     // as
-    memset(base_file_name0, 0, sizeof(base_file_name0));
-    memcpy(base_file_name0, file_name0, (size_t)file_name_len);
-    base_source_file_name(file_name0, base_file_name0);
     {
         memset(argv0, 0, sizeof(argv0));
         snprintf(argv0, sizeof(argv0), AS " %s -o %s.o", asm_file_name0,
@@ -183,12 +236,51 @@ static i32 run(const char* file_name0) {
 }
 
 i32 main(i32 argc, char* argv[]) {
-    if (argc != 2) {
-        printf("microkt: Tiny Kotlin compiler\nUsage: %s <file>\n", argv[0]);
+    const char* file_name0 = NULL;
+    bool direct_elf = false, verbose_asm = false, usage = false;
+    for (i32 i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-fdirect-elf") == 0)
+            direct_elf = true;
+        else if (strcmp(argv[i], "-fverbose-asm") == 0)
+            verbose_asm = true;
+        else if (strcmp(argv[i], "-fno-inline") == 0)
+            ir_inline_enabled = false;
+        else if (strcmp(argv[i], "-fdump-ir") == 0)
+            ir_dump_enabled = true;
+        else if (strcmp(argv[i], "--time-passes") == 0)
+            pass_time_enabled = true;
+        else if (argv[i][0] == '-' && argv[i][1] == 'O' &&
+                 argv[i][2] >= '0' && argv[i][2] <= '2' && argv[i][3] == 0)
+            pass_opt_level = argv[i][2] - '0';
+        else if (argv[i][0] == '-' || file_name0 != NULL)
+            usage = true;
+        else
+            file_name0 = argv[i];
+    }
+    if (usage || file_name0 == NULL) {
+        printf(
+            "microkt: Tiny Kotlin compiler\nUsage: %s [-O0|-O1|-O2] "
+            "[--time-passes] [-fdirect-elf] [-fdump-ir] [-fno-inline] "
+            "[-fverbose-asm] <file>\n"
+            "  -O0           Lower the AST as is, without optimizations\n"
+            "  -O1           Fold constants and optimize the IR in SSA form\n"
+            "  -O2           Also inline small functions and hoist loop "
+            "invariants (default)\n"
+            "  --time-passes Print the time and the size change of each pass "
+            "to stderr\n"
+            "  -fdirect-elf  Write the executable in-process, without `as` and "
+            "`ld` (x86_64 Linux only)\n"
+            "  -fdump-ir     Print the intermediate representation, in SSA "
+            "form from -O1, to stderr\n"
+            "  -fno-inline   Do not inline small functions at their call "
+            "sites\n"
+            "  -fverbose-asm Comment the assembly, with a `.loc` per "
+            "instruction\n",
+            argv[0]);
         return 0;
     };
     is_tty = isatty(2);
 
     i32 err = 0;
-    if ((err = run(argv[1])) != RES_OK) return err;
+    if ((err = run(file_name0, direct_elf, verbose_asm)) != RES_OK) return err;
 }
@@ -1,4 +1,11 @@
+// glibc only exposes MAP_ANONYMOUS, which is not POSIX, with this
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 // macOS Big Sur's mman.h header does not define MAP_ANONYMOUS for some reason
@@ -13,33 +20,83 @@
 
 static u64 gc_round = 0;
 static u64 gc_allocated_bytes = 0;
+// A collection happens when the allocated bytes reach the threshold. After
+// each one, the threshold becomes twice the surviving bytes so that the
+// collection work stays proportional to the allocation work.
+// The initial threshold, in bytes, can be set with the environment variable
+// MKT_GC_THRESHOLD. `0` collects before every allocation.
+static const char GC_THRESHOLD_ENV[] = "MKT_GC_THRESHOLD";
+static u64 gc_initial_threshold = 1 << 20;
+static u64 gc_threshold = 0;
+static bool gc_threshold_read = false;
 static const unsigned char RV_TAG_MARKED = 0x01;
 static const unsigned char RV_TAG_STRING = 0x02;
 static const unsigned char RV_TAG_INSTANCE = 0x04;
-static void* mkt_rsp = NULL;
-void* mkt_rbp = NULL;
+// String literals, emitted by the compiler in read-only data: never collected
+static const unsigned char RV_TAG_IMMORTAL = 0x08;
+// Frame pointer of `main`, where the stack walk stops
+static void* mkt_rbp = NULL;
+// Emitted by the compiler, see emit_stack_maps: the number of call sites, then
+// for each one, sorted by return address: the return address, the index of
+// its first root and its number of roots. Then the roots, which are offsets
+// from the frame pointer of the caller of the slots holding GC references
+// while the callee runs
+static const u64* gc_stack_maps = NULL;
+// References held by runtime functions while they allocate, since they are
+// not in any stack map
+static const void* gc_pinned[2] = {NULL, NULL};
+
+// Standard output goes through this buffer, flushed when full, at the end of
+// `main` (see fn_epilog) and after each line when it is a terminal
+static char out_buf[1 << 16];
+static u64 out_len = 0;
+static bool out_line_buffered = false;
+
+void mkt_init(void* rbp, const u64* stack_maps) {
+    CHECK(rbp, !=, NULL, "%p");
+    CHECK((void*)stack_maps, !=, NULL, "%p");
+
+    mkt_rbp = rbp;
+    gc_stack_maps = stack_maps;
+    out_line_buffered = isatty(1);
+}
+
+static void mkt_write_all(const char* s, u64 len) {
+    while (len > 0) {
+        const ssize_t written = write(1, s, len);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) return;  // Nowhere to report it
 
-void* mkt_save_rbp() {
-#define READ_RBP() __asm__ volatile("movq %%rbp, %0" : "=r"(mkt_rbp))
-    READ_RBP();
-#undef READ_RBP
+        s += written;
+        len -= written;
+    }
+}
 
-    return mkt_rbp;
+void mkt_flush(void) {
+    mkt_write_all(out_buf, out_len);
+    out_len = 0;
 }
 
-void* mkt_save_rsp() {
-#define READ_RSP() __asm__ volatile("movq %%rsp, %0" : "=r"(mkt_rsp))
-    READ_RSP();
-#undef READ_RSP
+static void mkt_out_write(const char* s, u64 len) {
+    if (out_len + len > sizeof(out_buf)) mkt_flush();
+    if (len > sizeof(out_buf)) {
+        mkt_write_all(s, len);
+        return;
+    }
 
-    return mkt_rsp;
+    memcpy(&out_buf[out_len], s, len);
+    out_len += len;
+}
+
+static void mkt_out_newline(void) {
+    mkt_out_write("\n", 1);
+    if (out_line_buffered) mkt_flush();
 }
 
-// TODO: optimize
 static void* mkt_alloc(u64 len) {
     void* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    CHECK(p, !=, NULL, "%p");
+    CHECK(p, !=, MAP_FAILED, "%p");
     return p;
 }
 
@@ -58,6 +115,146 @@ struct alloc_atom {
 typedef struct alloc_atom alloc_atom;
 static alloc_atom* objs = NULL;  // In use
 
+// Small atoms are carved out of arenas, each arena serving one size class:
+// multiples of 16 bytes up to 256 bytes, then powers of two up to 2 KiB.
+// Bigger atoms are mapped on their own.
+// Arenas are aligned on their size so that the arena of any address is found
+// by masking, and start with a header recording their size class.
+#define ARENA_SIZE ((u64)1 << 20)
+#define ARENA_HEADER_SIZE 16
+#define SIZE_CLASS_COUNT 19
+static const u64 SMALL_ATOM_MAX = 2048;
+
+typedef struct {
+    i32 ar_class_i;
+} arena_header_t;
+
+// Set of addresses with open addressing, used to know in O(1) whether an
+// address is the start of an arena or of a big atom
+typedef struct {
+    u64 *ps_slots, ps_cap, ps_len /* Including tombstones */;
+} ptr_set_t;
+
+static const u64 PTR_SET_EMPTY = 0;
+static const u64 PTR_SET_TOMBSTONE = 1;
+
+static ptr_set_t arenas;
+static ptr_set_t big_atoms;
+
+static u64 ptr_set_slot(const ptr_set_t* set, u64 addr) {
+    return (addr >> 4) * 0x9E3779B97F4A7C15ULL >> 32 & (set->ps_cap - 1);
+}
+
+static bool ptr_set_has(const ptr_set_t* set, u64 addr) {
+    if (set->ps_cap == 0 || addr == PTR_SET_EMPTY || addr == PTR_SET_TOMBSTONE)
+        return false;
+
+    for (u64 i = ptr_set_slot(set, addr);; i = (i + 1) & (set->ps_cap - 1)) {
+        if (set->ps_slots[i] == addr) return true;
+        if (set->ps_slots[i] == PTR_SET_EMPTY) return false;
+    }
+}
+
+static void ptr_set_add(ptr_set_t* set, u64 addr);
+
+static void ptr_set_grow(ptr_set_t* set) {
+    const ptr_set_t old = *set;
+    set->ps_cap = old.ps_cap ? 2 * old.ps_cap : 512;
+    set->ps_len = 0;
+    set->ps_slots = mkt_alloc(set->ps_cap * sizeof(u64));
+
+    for (u64 i = 0; i < old.ps_cap; i++) {
+        if (old.ps_slots[i] != PTR_SET_EMPTY &&
+            old.ps_slots[i] != PTR_SET_TOMBSTONE)
+            ptr_set_add(set, old.ps_slots[i]);
+    }
+    if (old.ps_slots != NULL)
+        CHECK(munmap(old.ps_slots, old.ps_cap * sizeof(u64)), ==, 0, "%d");
+}
+
+static void ptr_set_add(ptr_set_t* set, u64 addr) {
+    // Keep the load factor under 1/2
+    if (2 * (set->ps_len + 1) > set->ps_cap) ptr_set_grow(set);
+
+    u64 i = ptr_set_slot(set, addr);
+    while (set->ps_slots[i] != PTR_SET_EMPTY &&
+           set->ps_slots[i] != PTR_SET_TOMBSTONE)
+        i = (i + 1) & (set->ps_cap - 1);
+
+    if (set->ps_slots[i] == PTR_SET_EMPTY) set->ps_len += 1;
+    set->ps_slots[i] = addr;
+}
+
+static void ptr_set_remove(ptr_set_t* set, u64 addr) {
+    for (u64 i = ptr_set_slot(set, addr);; i = (i + 1) & (set->ps_cap - 1)) {
+        CHECK(set->ps_slots[i] != PTR_SET_EMPTY, ==, true, "%d");
+        if (set->ps_slots[i] == addr) {
+            set->ps_slots[i] = PTR_SET_TOMBSTONE;
+            return;
+        }
+    }
+}
+
+typedef struct {
+    char *sc_bump, *sc_end;  // Free space in the current arena
+    alloc_atom* sc_free;     // Swept atoms, linked through aa_next
+} size_class_t;
+
+static size_class_t size_classes[SIZE_CLASS_COUNT];
+
+static u64 atom_bytes(u64 size) {
+    return sizeof(runtime_val_header) + sizeof(alloc_atom*) + size;
+}
+
+static i32 size_class_of(u32 bytes) {
+    CHECK(bytes, <=, (u32)SMALL_ATOM_MAX, "%u");
+
+    if (bytes <= 256) return (bytes + 15) / 16 - 1;
+    // 512 -> 16, 1024 -> 17, 2048 -> 18
+    return 16 + (32 - __builtin_clz(bytes - 1)) - 9;
+}
+
+static u64 size_class_bytes(i32 class_i) {
+    if (class_i < 16) return 16 * (u64)(class_i + 1);
+    return (u64)512 << (class_i - 16);
+}
+
+static char* mkt_arena_make(i32 class_i) {
+    // Over-allocate and trim to get the alignment
+    char* const p = mkt_alloc(2 * ARENA_SIZE);
+    char* const arena =
+        (char*)(((u64)p + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1));
+    if (arena > p) CHECK(munmap(p, arena - p), ==, 0, "%d");
+    const u64 tail = p + 2 * ARENA_SIZE - (arena + ARENA_SIZE);
+    if (tail > 0) CHECK(munmap(arena + ARENA_SIZE, tail), ==, 0, "%d");
+
+    ((arena_header_t*)arena)->ar_class_i = class_i;
+    ptr_set_add(&arenas, (u64)arena);
+
+    return arena;
+}
+
+static alloc_atom* mkt_alloc_small(i32 class_i) {
+    size_class_t* const sc = &size_classes[class_i];
+
+    alloc_atom* atom = sc->sc_free;
+    if (atom != NULL) {  // Fast path: reuse a swept atom
+        sc->sc_free = atom->aa_next;
+        return atom;
+    }
+
+    const u64 bytes = size_class_bytes(class_i);
+    if (sc->sc_bump + bytes > sc->sc_end) {  // Slow path: new arena
+        char* const arena = mkt_arena_make(class_i);
+        sc->sc_bump = arena + ARENA_HEADER_SIZE;
+        sc->sc_end = arena + ARENA_SIZE;
+    }
+    atom = (alloc_atom*)sc->sc_bump;
+    sc->sc_bump += bytes;
+
+    return atom;
+}
+
 void atom_cons(alloc_atom* item, alloc_atom** head) {
     CHECK((void*)item, !=, NULL, "%p");
     CHECK((void*)head, !=, NULL, "%p");
@@ -73,8 +270,14 @@ void atom_cons(alloc_atom* item, alloc_atom** head) {
 }
 
 static alloc_atom* mkt_alloc_atom_make(u64 size) {
-    const u64 bytes = sizeof(runtime_val_header) + sizeof(alloc_atom*) + size;
-    alloc_atom* atom = mkt_alloc(bytes);
+    const u64 bytes = atom_bytes(size);
+    alloc_atom* atom = NULL;
+    if (bytes <= SMALL_ATOM_MAX)
+        atom = mkt_alloc_small(size_class_of(bytes));
+    else {
+        atom = mkt_alloc(bytes);
+        ptr_set_add(&big_atoms, (u64)atom);
+    }
     CHECK((void*)atom, !=, NULL, "%p");
     atom->aa_header = (runtime_val_header){0};
     atom->aa_next = NULL;
@@ -97,27 +300,81 @@ static void mkt_gc_obj_mark(runtime_val_header* header) {
     // UNIMPLEMENTED();  // TODO: gray worklist for objects
 }
 
-// TODO: optimize
+// Find the live atom whose data starts at `ptr`, in constant time
 static alloc_atom* mkt_gc_atom_find_data_by_addr(void* ptr) {
-    if (ptr == NULL) return NULL;
+    const u64 data_offset = offsetof(alloc_atom, aa_data);
+    const u64 addr = (u64)ptr;
+    if (addr % 16 != 0 || addr < data_offset) return NULL;
+
+    const u64 atom_addr = addr - data_offset;
+    alloc_atom* const atom = (alloc_atom*)atom_addr;
+
+    const u64 arena = atom_addr & ~(ARENA_SIZE - 1);
+    if (ptr_set_has(&arenas, arena)) {
+        const u64 first_atom = arena + ARENA_HEADER_SIZE;
+        const i32 class_i = ((const arena_header_t*)arena)->ar_class_i;
+        if (atom_addr < first_atom ||
+            (atom_addr - first_atom) % size_class_bytes(class_i) != 0)
+            return NULL;
+
+        // Swept or never allocated atoms have no tag
+        return atom->aa_header.rv_tag != 0 ? atom : NULL;
+    }
 
-    alloc_atom* atom = objs;
-    while (atom) {
-        if (ptr == &atom->aa_data) return atom;
-        atom = atom->aa_next;
+    return ptr_set_has(&big_atoms, atom_addr) ? atom : NULL;
+}
+
+// Roots are either NULL or references to an object with a header
+static void mkt_gc_mark_ref(const void* ptr) {
+    if (ptr == NULL) return;
+
+    const runtime_val_header* const header = (runtime_val_header*)ptr - 1;
+    if (header->rv_tag & RV_TAG_IMMORTAL) return;
+
+    alloc_atom* const atom = mkt_gc_atom_find_data_by_addr((void*)ptr);
+    if (atom != NULL) mkt_gc_obj_mark(&atom->aa_header);
+}
+
+// Stack map entry of a return address, NULL for call sites without GC
+// references live across them and for calls made by the runtime
+static const u64* mkt_gc_stack_map_find(u64 ret_addr) {
+    const u64* const entries = &gc_stack_maps[1];
+    u64 lo = 0, hi = gc_stack_maps[0];
+    while (lo < hi) {
+        const u64 mid = lo + (hi - lo) / 2;
+        const u64 addr = entries[3 * mid];
+        if (addr == ret_addr) return &entries[3 * mid];
+        if (addr < ret_addr)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
     return NULL;
 }
 
+// Walk the frames through the saved frame pointers, up to `main`. For each
+// frame, the return address into its caller tells which slots of the caller
+// hold references
 static void mkt_gc_scan_stack() {
-    CHECK((void*)mkt_rsp, <=, (void*)mkt_rbp, "%p");
-
-    for (char* p = (char*)mkt_rsp; p < (char*)mkt_rbp - sizeof(void*); p++) {
-        alloc_atom* atom = mkt_gc_atom_find_data_by_addr(*((void**)p));
-        if (atom == NULL) continue;
-
-        mkt_gc_obj_mark(&atom->aa_header);
+    CHECK(mkt_rbp, !=, NULL, "%p");
+
+    const u64* const roots = &gc_stack_maps[1 + 3 * gc_stack_maps[0]];
+    void** fp = __builtin_frame_address(0);
+    while (fp != mkt_rbp) {
+        CHECK((void*)fp, !=, NULL, "%p");
+        CHECK((void*)fp, <, mkt_rbp, "%p");
+
+        char* const caller_fp = fp[0];
+        const u64* const entry = mkt_gc_stack_map_find((u64)fp[1]);
+        for (u64 i = 0; entry != NULL && i < entry[2]; i++) {
+            const i64 offset = (i64)roots[entry[1] + i];
+            mkt_gc_mark_ref(*(void**)(caller_fp + offset));
+        }
+        fp = (void**)caller_fp;
     }
+
+    for (u64 i = 0; i < sizeof(gc_pinned) / sizeof(gc_pinned[0]); i++)
+        if (gc_pinned[i] != NULL) mkt_gc_mark_ref(gc_pinned[i]);
 }
 
 static void mkt_gc_obj_blacken(runtime_val_header* header) {
@@ -146,8 +403,7 @@ static void mkt_gc_sweep() {
         }
 
         // Remove
-        const u64 bytes = sizeof(runtime_val_header) + sizeof(alloc_atom*) +
-                          atom->aa_header.rv_size;
+        const u64 bytes = atom_bytes(atom->aa_header.rv_size);
         CHECK(gc_allocated_bytes, >=, bytes, "%llu");
 
         alloc_atom* to_free = atom;
@@ -158,16 +414,21 @@ static void mkt_gc_sweep() {
             objs = atom;
 
         MKT_GC_SWEEP_FREE(gc_round, gc_allocated_bytes, (void*)to_free);
-        CHECK(munmap(to_free, bytes), ==, 0, "%d");
+        if (bytes <= SMALL_ATOM_MAX) {
+            size_class_t* const sc = &size_classes[size_class_of(bytes)];
+            to_free->aa_header = (runtime_val_header){0};
+            to_free->aa_next = sc->sc_free;
+            sc->sc_free = to_free;
+        } else {
+            ptr_set_remove(&big_atoms, (u64)to_free);
+            CHECK(munmap(to_free, bytes), ==, 0, "%d");
+        }
         gc_allocated_bytes -= bytes;
     }
     MKT_GC_SWEEP_DONE(gc_round, gc_allocated_bytes);
 }
 
 void mkt_gc() {
-    mkt_save_rsp();
-    CHECK((void*)mkt_rsp, <=, (void*)mkt_rbp, "%p");
-
     gc_round += 1;
 
     mkt_gc_scan_stack();
@@ -175,9 +436,27 @@ void mkt_gc() {
     mkt_gc_sweep();
 }
 
-void* mkt_string_make(u64 size) {
+static void mkt_gc_maybe(u64 size) {
+    if (!gc_threshold_read) {
+        const char* const env = getenv(GC_THRESHOLD_ENV);
+        if (env != NULL) gc_initial_threshold = strtoull(env, NULL, 10);
+        gc_threshold = gc_initial_threshold;
+        gc_threshold_read = true;
+    }
+
+    if (gc_allocated_bytes + atom_bytes(size) < gc_threshold) return;
+
     mkt_gc();
 
+    if (gc_initial_threshold == 0) return;
+    gc_threshold = 2 * gc_allocated_bytes;
+    if (gc_threshold < gc_initial_threshold)
+        gc_threshold = gc_initial_threshold;
+}
+
+void* mkt_string_make(u64 size) {
+    mkt_gc_maybe(size);
+
     alloc_atom* atom = mkt_alloc_atom_make(size);
     CHECK((void*)atom, !=, NULL, "%p");
     atom->aa_header =
@@ -187,7 +466,7 @@ void* mkt_string_make(u64 size) {
 }
 
 void* mkt_instance_make(u64 size) {
-    mkt_gc();
+    mkt_gc_maybe(size);
 
     alloc_atom* atom = mkt_alloc_atom_make(size);
     CHECK((void*)atom, !=, NULL, "%p");
@@ -199,17 +478,18 @@ void* mkt_instance_make(u64 size) {
 
 void mkt_bool_println(i32 b) {
     if (b) {
-        const char s[] = "true\n";
-        write(1, s, sizeof(s) - 1);
+        const char s[] = "true";
+        mkt_out_write(s, sizeof(s) - 1);
     } else {
-        const char s[] = "false\n";
-        write(1, s, sizeof(s) - 1);
+        const char s[] = "false";
+        mkt_out_write(s, sizeof(s) - 1);
     }
+    mkt_out_newline();
 }
 
 void mkt_char_println(char c) {
-    char s[2] = {c, '\n'};
-    write(1, s, 2);
+    mkt_out_write(&c, 1);
+    mkt_out_newline();
 }
 
 static void mkt_int_to_string(i64 n, char* s, i32* s_len) {
@@ -236,9 +516,8 @@ void mkt_int_println(i64 n) {
     i32 s_len = 0;
     mkt_int_to_string(n, s, &s_len);
 
-    write(1, s + sizeof(s) - s_len, s_len);
-    const char newline = '\n';
-    write(1, &newline, 1);
+    mkt_out_write(s + sizeof(s) - s_len, s_len);
+    mkt_out_newline();
 }
 
 void mkt_string_println(char* s) {
@@ -247,9 +526,8 @@ void mkt_string_println(char* s) {
 
     CHECK(s_header->rv_tag & RV_TAG_STRING, !=, 0, "%u");
 
-    write(1, s, s_header->rv_size);
-    const char newline = '\n';
-    write(1, &newline, 1);
+    mkt_out_write(s, s_header->rv_size);
+    mkt_out_newline();
 }
 
 char* mkt_string_concat(const char* a, const char* b) {
@@ -263,7 +541,10 @@ char* mkt_string_concat(const char* a, const char* b) {
     CHECK(a_header->rv_tag & RV_TAG_STRING, !=, 0, "%u");
     CHECK(b_header->rv_tag & RV_TAG_STRING, !=, 0, "%u");
 
+    gc_pinned[0] = a;
+    gc_pinned[1] = b;
     char* const ret = mkt_string_make(a_header->rv_size + b_header->rv_size);
+    gc_pinned[0] = gc_pinned[1] = NULL;
     CHECK((void*)ret, !=, NULL, "%p");
     CHECK((void*)a, !=, NULL, "%p");
     CHECK((void*)b, !=, NULL, "%p");
@@ -279,7 +560,7 @@ void mkt_instance_println(void* addr) {
     CHECK(addr, !=, NULL, "%p");
 
     const char s[] = "Instance of size ";
-    write(1, s, sizeof(s) - 1);
+    mkt_out_write(s, sizeof(s) - 1);
 
     const runtime_val_header* const header =
         (runtime_val_header*)((u64)addr - sizeof(runtime_val_header*));
@@ -288,8 +569,6 @@ void mkt_instance_println(void* addr) {
     char size_s[23] = "";
     i32 size_s_len = 0;
     mkt_int_to_string(header->rv_size, size_s, &size_s_len);
-    write(1, size_s + sizeof(size_s) - size_s_len, size_s_len);
-
-    const char newline = '\n';
-    write(1, &newline, 1);
+    mkt_out_write(size_s + sizeof(size_s) - size_s_len, size_s_len);
+    mkt_out_newline();
 }
@@ -5,6 +5,7 @@
 
 #include "ast.h"
 #include "common.h"
+#include "intern.h"
 #include "lex.h"
 
 static const i32 TYPE_UNIT_I = 1;    // see parser_init
@@ -33,6 +34,8 @@ typedef struct {
     i32* par_class_decls;  // Class declarations
     mkt_type_t* par_types;
     udf_t* par_udfs;
+    mkt_interner_t par_interner;
+    i32* par_tok_syms;  // Token -> interned symbol, -1 if not interned yet
 } parser_t;
 
 static mkt_res_t parser_parse_expr(parser_t* parser, i32* new_node_i);
@@ -243,8 +246,79 @@ static mkt_res_t parser_resolve_member(const parser_t* parser, i32 tok_i,
     return RES_NONE;
 }
 
-// TODO: optimize, currently it is O(n*m) where n= # of stmt and m = # of var
-// def per scope
+static i32 parser_tok_sym(parser_t* parser, i32 tok_i) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK(tok_i, >=, 0, "%d");
+    CHECK(tok_i, <, (i32)buf_size(parser->par_lexer.lex_tokens), "%d");
+
+    if (parser->par_tok_syms[tok_i] == -1) {
+        const char* source = NULL;
+        i32 source_len = 0;
+        parser_tok_source(parser, tok_i, &source, &source_len);
+        parser->par_tok_syms[tok_i] =
+            intern(&parser->par_interner, source, source_len);
+    }
+    return parser->par_tok_syms[tok_i];
+}
+
+static void parser_scope_insert(mkt_block_t* block, i32 sym, i32 def_node_i) {
+    const u32 mask = buf_capacity(block->bl_decls) - 1;
+    u32 slot = ((u32)sym * 2654435769u) & mask;
+    for (; block->bl_decls[slot].de_sym != -1; slot = (slot + 1) & mask) {
+        // The first definition wins, as when scanning the statements in order
+        if (block->bl_decls[slot].de_sym == sym) return;
+    }
+
+    block->bl_decls[slot] =
+        (mkt_decl_t){.de_sym = sym, .de_node_i = def_node_i};
+    block->bl_decls_len++;
+}
+
+// Make the definition `def_node_i` named by `tok_i` visible in the scope
+static void parser_scope_declare(parser_t* parser, i32 scope_i, i32 tok_i,
+                                 i32 def_node_i) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK(scope_i, >=, 0, "%d");
+    CHECK(scope_i, <, (i32)buf_size(parser->par_nodes), "%d");
+    CHECK(def_node_i, >=, 0, "%d");
+
+    const i32 sym = parser_tok_sym(parser, tok_i);
+    mkt_block_t* const block = &parser->par_nodes[scope_i].no_n.no_block;
+
+    // Keep the load factor under 1/2
+    const i32 cap = buf_capacity(block->bl_decls);
+    if (2 * (block->bl_decls_len + 1) > cap) {
+        mkt_decl_t* old_decls = block->bl_decls;
+        const i32 new_cap = cap ? 2 * cap : 8;
+        block->bl_decls = NULL;
+        block->bl_decls_len = 0;
+        buf_grow(block->bl_decls, new_cap);
+        for (i32 i = 0; i < new_cap; i++) block->bl_decls[i].de_sym = -1;
+
+        for (i32 i = 0; i < cap; i++) {
+            if (old_decls[i].de_sym != -1)
+                parser_scope_insert(block, old_decls[i].de_sym,
+                                    old_decls[i].de_node_i);
+        }
+        buf_free(old_decls);
+    }
+
+    parser_scope_insert(block, sym, def_node_i);
+}
+
+static i32 parser_scope_lookup(const parser_t* parser, i32 scope_i, i32 sym) {
+    const mkt_block_t* const block = &parser->par_nodes[scope_i].no_n.no_block;
+    if (block->bl_decls_len == 0) return -1;
+
+    const u32 mask = buf_capacity(block->bl_decls) - 1;
+    u32 slot = ((u32)sym * 2654435769u) & mask;
+    for (; block->bl_decls[slot].de_sym != -1; slot = (slot + 1) & mask) {
+        if (block->bl_decls[slot].de_sym == sym)
+            return block->bl_decls[slot].de_node_i;
+    }
+    return -1;
+}
+
 static mkt_res_t parser_resolve_var(parser_t* parser, i32 tok_i,
                                     i32* def_node_i) {
     CHECK((void*)parser, !=, NULL, "%p");
@@ -257,76 +331,56 @@ static mkt_res_t parser_resolve_var(parser_t* parser, i32 tok_i,
     CHECK((void*)var_source, !=, NULL, "%p");
     CHECK(var_source_len, >=, 0, "%d");
 
+    const i32 sym = parser_tok_sym(parser, tok_i);
+
+    // Past the body of the current function, locals belong to an enclosing
+    // one
+    const i32 fn_body_i =
+        parser->par_fn_i >= 0
+            ? parser->par_nodes[parser->par_fn_i].no_n.no_fn.fd_body_node_i
+            : -1;
+    bool in_enclosing_fn = false;
+
     i32 current_scope_i = parser->par_scope_i;
     while (current_scope_i >= 0) {
         CHECK(current_scope_i, <, (i32)buf_size(parser->par_nodes), "%d");
 
-        const mkt_node_t* block = &parser->par_nodes[current_scope_i];
-        const mkt_block_t b = block->no_n.no_block;
-
         log_debug("resolving var %.*s in scope %d", var_source_len, var_source,
                   current_scope_i);
 
-        for (i32 i = 0; i < (i32)buf_size(b.bl_nodes_i); i++) {
-            const i32 stmt_i = b.bl_nodes_i[i];
-            CHECK(stmt_i, >=, 0, "%d");
-            CHECK(stmt_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-            const mkt_node_t* const stmt = &parser->par_nodes[stmt_i];
-            const char* def_source = NULL;
-            i32 def_source_len = 0;
-
-            i32 tok_i = -1;
-            switch (stmt->no_kind) {
-                case NODE_VAR: {
-                    const mkt_var_t var = stmt->no_n.no_var;
-                    if (var.va_var_node_i != -1)
-                        continue;  // Not a var definition, simply a var
-                                   // reference
-                    tok_i = var.va_tok_i;
-                    break;
-                }
-                case NODE_FN:
-                    tok_i = stmt->no_n.no_fn.fd_name_tok_i;
-                    break;
-                case NODE_CLASS:
-                    tok_i = stmt->no_n.no_class.cl_name_tok_i;
-                    break;
-                default:
-                    continue;
-            }
-
-            parser_tok_source(parser, tok_i, &def_source, &def_source_len);
-
-            CHECK((void*)def_source, !=, NULL, "%p");
-            CHECK(def_source_len, >=, 0, "%d");
-
-            log_debug("considering var def: name=`%.*s` kind=%s scope=%d",
-                      def_source_len, def_source,
-                      mkt_node_kind_to_str[stmt->no_kind], current_scope_i);
+        const i32 found_i = parser_scope_lookup(parser, current_scope_i, sym);
+        if (found_i >= 0) {
+            *def_node_i = found_i;
+            CHECK(*def_node_i, <, (i32)buf_size(parser->par_nodes), "%d");
 
-            if (def_source_len == var_source_len &&
-                memcmp(def_source, var_source, var_source_len) == 0) {
-                *def_node_i = stmt_i;
-                CHECK(*def_node_i, >=, 0, "%d");
-                CHECK(*def_node_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-                const mkt_node_t* const def_node =
-                    &parser->par_nodes[*def_node_i];
-                const mkt_type_t* const def_type =
-                    &parser->par_types[def_node->no_type_i];
-                IGNORE(def_type);  // When logs are disabled
-                log_debug(
-                    "resolved var: id=%d name=`%.*s` kind=%s scope=%d type=%s",
-                    *def_node_i, def_source_len, def_source,
-                    mkt_node_kind_to_str[stmt->no_kind], current_scope_i,
-                    mkt_type_to_str[def_type->ty_kind]);
-
-                return RES_OK;
+            const mkt_node_t* const def_node = &parser->par_nodes[*def_node_i];
+            const mkt_type_t* const def_type =
+                &parser->par_types[def_node->no_type_i];
+            IGNORE(def_type);  // When logs are disabled
+            log_debug(
+                "resolved var: id=%d name=`%.*s` kind=%s scope=%d type=%s",
+                *def_node_i, var_source_len, var_source,
+                mkt_node_kind_to_str[def_node->no_kind], current_scope_i,
+                mkt_type_to_str[def_type->ty_kind]);
+
+            if (in_enclosing_fn && def_node->no_kind == NODE_VAR) {
+                const mkt_loc_t loc = lex_loc(&parser->par_lexer, tok_i);
+                fprintf(stderr,
+                        "%s%s:%d:%d:%s Capturing the local %.*s of an "
+                        "enclosing function is not supported\n",
+                        mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
+                        loc.loc_line, loc.loc_column,
+                        mkt_colors[is_tty][COL_RESET], var_source_len,
+                        var_source);
+                parser_print_source_on_error(parser, tok_i, tok_i);
+                return RES_ERR;
             }
+            return RES_OK;
         }
+        if (current_scope_i == fn_body_i) in_enclosing_fn = true;
 
-        current_scope_i = b.bl_parent_scope_i;
+        current_scope_i =
+            parser->par_nodes[current_scope_i].no_n.no_block.bl_parent_scope_i;
     }
     // FIXME
     //    if (parser_resolve_member(parser, tok_i, parser_current_class(parser),
@@ -381,6 +435,8 @@ static void parser_class_begin(parser_t* parser, i32 first_tok_i,
         buf_push(
             parser->par_nodes[parser->par_scope_i].no_n.no_block.bl_nodes_i,
             *new_node_i);
+        parser_scope_declare(parser, parser->par_scope_i, name_tok_i,
+                             *new_node_i);
     }
 
     *body_node_i = parser->par_nodes[*new_node_i].no_n.no_class.cl_body_node_i =
@@ -397,8 +453,9 @@ static mkt_res_t parser_err_assigning_val(const parser_t* parser,
     CHECK(assign_tok_i, >=, 0, "%d");
     CHECK(assign_tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
-    const mkt_loc_t vd_loc_start = parser->par_lexer.lex_locs[var->va_tok_i];
-    const mkt_loc_t assign_loc_start = parser->par_lexer.lex_locs[assign_tok_i];
+    const mkt_loc_t vd_loc_start = lex_loc(&parser->par_lexer, var->va_tok_i);
+    const mkt_loc_t assign_loc_start =
+        lex_loc(&parser->par_lexer, assign_tok_i);
 
     fprintf(stderr,
             "%s%s:%d:%d:%sTrying to assign a variable declared with `val`\n",
@@ -423,7 +480,7 @@ static mkt_res_t parser_err_missing_rhs(const parser_t* parser, i32 first_tok_i,
     CHECK(last_tok_i, >=, first_tok_i, "%d");
     CHECK(last_tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
-    const mkt_loc_t first_tok_loc = parser->par_lexer.lex_locs[first_tok_i];
+    const mkt_loc_t first_tok_loc = lex_loc(&parser->par_lexer, first_tok_i);
 
     fprintf(stderr, "%s%s:%d:%d:%sMissing right hand-side operand\n",
             mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -597,12 +654,12 @@ static mkt_res_t parser_init(const char* file_name0, const char* source,
 
     // Add synthetic tokens for synthetic root class
     buf_push(parser->par_lexer.lex_tokens,
-             ((mkt_token_t){.tok_id = TOK_ID_IDENTIFIER,
-                            .tok_pos_range = {.pr_start = 0, .pr_end = 0}}));
-    buf_push(parser->par_lexer.lex_tok_pos_ranges,
-             ((mkt_pos_range_t){.pr_start = 0, .pr_end = 0}));
-    buf_push(parser->par_lexer.lex_locs,
-             ((mkt_loc_t){.loc_line = 1, .loc_column = 1}));
+             ((mkt_token_t){.tok_id = TOK_ID_IDENTIFIER, .tok_start = 0}));
+
+    const i32 tokens_len = buf_size(parser->par_lexer.lex_tokens);
+    CHECK((void*)parser->par_tok_syms, ==, NULL, "%p");
+    buf_grow(parser->par_tok_syms, tokens_len);
+    for (i32 i = 0; i < tokens_len; i++) parser->par_tok_syms[i] = -1;
 
     // Add root class
     i32 new_node_i = -1, old_class_i = -1, body_node_i = -1,
@@ -657,7 +714,7 @@ static mkt_res_t parser_init(const char* file_name0, const char* source,
 
 static i64 parse_tok_to_num(const parser_t* parser, i32 tok_i, i32* type_i) {
     CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)parser->par_lexer.lex_tok_pos_ranges, !=, NULL, "%p");
+    CHECK((void*)parser->par_lexer.lex_tokens, !=, NULL, "%p");
     CHECK((void*)parser->par_lexer.lex_source, !=, NULL, "%p");
     CHECK(tok_i, >=, 0, "%d");
     CHECK(tok_i, <, parser->par_lexer.lex_source_len, "%d");
@@ -666,7 +723,7 @@ static i64 parse_tok_to_num(const parser_t* parser, i32 tok_i, i32* type_i) {
     memset(string0, 0, sizeof(string0));
 
     const mkt_pos_range_t pos_range =
-        parser->par_lexer.lex_tok_pos_ranges[tok_i];
+        lex_pos_range(&parser->par_lexer, tok_i);
     const char* const string =
         &parser->par_lexer.lex_source[pos_range.pr_start];
     CHECK((void*)string, !=, NULL, "%p");
@@ -689,7 +746,7 @@ static char parse_tok_to_char(const parser_t* parser, i32 tok_i) {
     CHECK(tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
     const mkt_pos_range_t pos_range =
-        parser->par_lexer.lex_tok_pos_ranges[tok_i];
+        lex_pos_range(&parser->par_lexer, tok_i);
     const char* const string =
         &parser->par_lexer.lex_source[pos_range.pr_start + 1];
     CHECK((void*)string, !=, NULL, "%p");
@@ -742,6 +799,8 @@ static void node_dump(const parser_t* parser, i32 no_i, i32 indent) {
         case NODE_LE:
         case NODE_EQ:
         case NODE_NEQ:
+        case NODE_AND:
+        case NODE_OR:
         case NODE_MULTIPLY:
         case NODE_DIVIDE:
         case NODE_MODULO:
@@ -822,7 +881,7 @@ static void node_dump(const parser_t* parser, i32 no_i, i32 indent) {
         case NODE_VAR: {
             const mkt_var_t var = node->no_n.no_var;
             const mkt_pos_range_t pos_range =
-                parser->par_lexer.lex_tok_pos_ranges[var.va_tok_i];
+                lex_pos_range(&parser->par_lexer, var.va_tok_i);
 
             const char* const name =
                 &parser->par_lexer.lex_source[pos_range.pr_start];
@@ -850,7 +909,7 @@ static void node_dump(const parser_t* parser, i32 no_i, i32 indent) {
             const mkt_fn_t fn = node->no_n.no_fn;
             const i32 arity = buf_size(fn.fd_arg_nodes_i);
             const mkt_pos_range_t pos_range =
-                parser->par_lexer.lex_tok_pos_ranges[fn.fd_name_tok_i];
+                lex_pos_range(&parser->par_lexer, fn.fd_name_tok_i);
             const char* const name =
                 &parser->par_lexer.lex_source[pos_range.pr_start];
             const i32 name_len = pos_range.pr_end - pos_range.pr_start;
@@ -951,6 +1010,8 @@ static i32 node_first_token(const parser_t* parser, i32 node_i) {
         case NODE_LE:
         case NODE_EQ:
         case NODE_NEQ:
+        case NODE_AND:
+        case NODE_OR:
         case NODE_MULTIPLY:
         case NODE_DIVIDE:
         case NODE_MODULO:
@@ -1010,6 +1071,8 @@ static i32 node_last_token(const parser_t* parser, i32 node_i) {
         case NODE_LE:
         case NODE_EQ:
         case NODE_NEQ:
+        case NODE_AND:
+        case NODE_OR:
         case NODE_MULTIPLY:
         case NODE_DIVIDE:
         case NODE_MODULO:
@@ -1062,7 +1125,7 @@ static void parser_tok_source(const parser_t* parser, i32 tok_i,
 
     const mkt_token_id_t tok = parser->par_lexer.lex_tokens[tok_i].tok_id;
     const mkt_pos_range_t pos_range =
-        parser->par_lexer.lex_tok_pos_ranges[tok_i];
+        lex_pos_range(&parser->par_lexer, tok_i);
 
     // Without quotes for char/string
     if (tok == TOK_ID_CHAR) {
@@ -1073,7 +1136,7 @@ static void parser_tok_source(const parser_t* parser, i32 tok_i,
         *source_len = pos_range.pr_end - pos_range.pr_start - 2;
     } else if (tok == TOK_ID_STRING) {
         const mkt_pos_range_t pos_range =
-            parser->par_lexer.lex_tok_pos_ranges[tok_i];
+            lex_pos_range(&parser->par_lexer, tok_i);
         const bool multiline =
             parser->par_lexer.lex_source[pos_range.pr_end - 1] == '"' &&
             parser->par_lexer.lex_source[pos_range.pr_end - 2] == '"' &&
@@ -1111,14 +1174,6 @@ static mkt_token_id_t parser_current(const parser_t* parser) {
     return parser->par_lexer.lex_tokens[parser->par_tok_i].tok_id;
 }
 
-static mkt_token_id_t parser_previous(const parser_t* parser) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK(parser->par_tok_i, >, 1, "%d");
-    CHECK(parser->par_tok_i, <, (i32)buf_size(parser->par_lexer.lex_tokens),
-          "%d");
-
-    return parser->par_lexer.lex_tokens[parser->par_tok_i - 1].tok_id;
-}
 static void parser_advance_until_after(parser_t* parser, mkt_token_id_t id) {
     CHECK((void*)parser, !=, NULL, "%p");
     CHECK(parser->par_tok_i, >=, 0, "%d");
@@ -1167,11 +1222,11 @@ static void parser_print_source_on_error(const parser_t* parser,
     CHECK(last_tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
     const mkt_pos_range_t first_tok_pos_range =
-        parser->par_lexer.lex_tok_pos_ranges[first_tok_i];
-    const mkt_loc_t first_tok_loc = parser->par_lexer.lex_locs[first_tok_i];
+        lex_pos_range(&parser->par_lexer, first_tok_i);
+    const mkt_loc_t first_tok_loc = lex_loc(&parser->par_lexer, first_tok_i);
     const mkt_pos_range_t last_tok_pos_range =
-        parser->par_lexer.lex_tok_pos_ranges[last_tok_i];
-    const mkt_loc_t last_tok_loc = parser->par_lexer.lex_locs[last_tok_i];
+        lex_pos_range(&parser->par_lexer, last_tok_i);
+    const mkt_loc_t last_tok_loc = lex_loc(&parser->par_lexer, last_tok_i);
 
     const i32 first_line = first_tok_loc.loc_line;
     const i32 last_line = last_tok_loc.loc_line;
@@ -1182,7 +1237,7 @@ static void parser_print_source_on_error(const parser_t* parser,
         first_line_start_tok_i--;
 
         if (first_line_start_tok_i < 0 ||
-            parser->par_lexer.lex_locs[first_line_start_tok_i].loc_line <
+            lex_loc(&parser->par_lexer, first_line_start_tok_i).loc_line <
                 first_line) {
             first_line_start_tok_i++;
 
@@ -1195,16 +1250,16 @@ static void parser_print_source_on_error(const parser_t* parser,
     }
 
     mkt_pos_range_t first_line_start_tok_pos =
-        parser->par_lexer.lex_tok_pos_ranges[first_line_start_tok_i];
+        lex_pos_range(&parser->par_lexer, first_line_start_tok_i);
 
     i32 last_line_start_tok_i = last_tok_i;
     while (true) {
         last_line_start_tok_i++;
 
         if (last_line_start_tok_i >=
-                (i32)buf_size(parser->par_lexer.lex_locs) ||
+                (i32)buf_size(parser->par_lexer.lex_tokens) ||
             last_line <
-                parser->par_lexer.lex_locs[last_line_start_tok_i].loc_line) {
+                lex_loc(&parser->par_lexer, last_line_start_tok_i).loc_line) {
             last_line_start_tok_i--;
 
             CHECK(last_line_start_tok_i, >=, 0, "%d");
@@ -1218,7 +1273,7 @@ static void parser_print_source_on_error(const parser_t* parser,
     CHECK(last_line_start_tok_i, >=, first_line_start_tok_i, "%d");
 
     mkt_pos_range_t last_line_start_tok_pos =
-        parser->par_lexer.lex_tok_pos_ranges[last_line_start_tok_i];
+        lex_pos_range(&parser->par_lexer, last_line_start_tok_i);
 
     const char* source =
         &parser->par_lexer.lex_source[first_line_start_tok_pos.pr_start];
@@ -1264,7 +1319,7 @@ static mkt_res_t parser_err_unexpected_token(const parser_t* parser,
                                              mkt_token_id_t expected) {
     CHECK((void*)parser, !=, NULL, "%p");
 
-    const mkt_loc_t loc_start = parser->par_lexer.lex_locs[parser->par_tok_i];
+    const mkt_loc_t loc_start = lex_loc(&parser->par_lexer, parser->par_tok_i);
 
     fprintf(stderr, "%s%s:%d:%d:%sUnexpected token. Expected `%s`, got `%s`\n",
             mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -1344,7 +1399,7 @@ static mkt_res_t parser_err_non_matching_types(const parser_t* parser,
     CHECK(rhs_last_tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
     const mkt_loc_t lhs_first_tok_loc =
-        parser->par_lexer.lex_locs[lhs_first_tok_i];
+        lex_loc(&parser->par_lexer, lhs_first_tok_i);
 
     fprintf(stderr, "%s%s:%d:%d:%sTypes do not match. Expected %s, got %s\n",
             mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -1381,7 +1436,7 @@ static mkt_res_t parser_err_unexpected_type(
     CHECK(lhs_last_tok_i, <, parser->par_lexer.lex_source_len, "%d");
 
     const mkt_loc_t lhs_first_tok_loc =
-        parser->par_lexer.lex_locs[lhs_first_tok_i];
+        lex_loc(&parser->par_lexer, lhs_first_tok_i);
 
     fprintf(stderr, "%s%s:%d:%d:%sTypes do not match. Expected %s, got %s\n",
             mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -1488,7 +1543,7 @@ static mkt_res_t parser_parse_jump_expr(parser_t* parser, i32* new_node_i) {
     mkt_res_t res = RES_NONE;
     if (parser_match(parser, &tok_i, 1, TOK_ID_RETURN)) {
         if (parser->par_fn_i < 0) {
-            const mkt_loc_t loc = parser->par_lexer.lex_locs[tok_i];
+            const mkt_loc_t loc = lex_loc(&parser->par_lexer, tok_i);
             fprintf(stderr,
                     "%s%s:%d:%d:%sUnexpected return outside of a function\n",
                     mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -1518,8 +1573,8 @@ static mkt_res_t parser_parse_jump_expr(parser_t* parser, i32* new_node_i) {
                     ? fn.fd_return_type_tok_i
                     : node_first_token(parser, fn.fd_body_node_i);
             const mkt_loc_t declared_loc =
-                parser->par_lexer.lex_locs[declared_return_type_tok_i];
-            const mkt_loc_t actual_loc = parser->par_lexer.lex_locs[tok_i];
+                lex_loc(&parser->par_lexer, declared_return_type_tok_i);
+            const mkt_loc_t actual_loc = lex_loc(&parser->par_lexer, tok_i);
             fprintf(stderr,
                     "%s%s:%d:%d:%sDeclared return type %s does not match the "
                     "actual "
@@ -1592,7 +1647,7 @@ static mkt_res_t parser_parse_primary_expr(parser_t* parser, i32* new_node_i) {
         CHECK(tok_i, >=, 0, "%d");
         CHECK(tok_i, <, parser->par_lexer.lex_source_len, "%d");
         const mkt_pos_range_t pos_range =
-            parser->par_lexer.lex_tok_pos_ranges[tok_i];
+            lex_pos_range(&parser->par_lexer, tok_i);
 
         CHECK(pos_range.pr_start, >=, 0, "%d");
         CHECK(pos_range.pr_start, <, parser->par_lexer.lex_source_len, "%d");
@@ -1607,7 +1662,7 @@ static mkt_res_t parser_parse_primary_expr(parser_t* parser, i32* new_node_i) {
     }
     if (parser_match(parser, &tok_i, 1, TOK_ID_STRING)) {
         const mkt_pos_range_t pos_range =
-            parser->par_lexer.lex_tok_pos_ranges[tok_i];
+            lex_pos_range(&parser->par_lexer, tok_i);
         const bool multiline =
             parser->par_lexer.lex_source[pos_range.pr_end - 1] == '"' &&
             parser->par_lexer.lex_source[pos_range.pr_end - 2] == '"' &&
@@ -1648,11 +1703,13 @@ static mkt_res_t parser_parse_primary_expr(parser_t* parser, i32* new_node_i) {
     }
     if (parser_match(parser, &tok_i, 1, TOK_ID_IDENTIFIER)) {
         i32 no_def_i = -1;
-        if (parser_resolve_var(parser, tok_i, &no_def_i) != RES_OK) {
+        const mkt_res_t res = parser_resolve_var(parser, tok_i, &no_def_i);
+        if (res == RES_ERR) return res;
+        if (res != RES_OK) {
             const char* src = NULL;
             i32 src_len = 0;
             parser_tok_source(parser, tok_i, &src, &src_len);
-            const mkt_loc_t loc = parser->par_lexer.lex_locs[tok_i];
+            const mkt_loc_t loc = lex_loc(&parser->par_lexer, tok_i);
             fprintf(stderr, "%s%s:%d:%sUndefined variable %.*s\n",
                     mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
                     loc.loc_line, mkt_colors[is_tty][COL_RESET], src_len, src);
@@ -1707,7 +1764,7 @@ static mkt_res_t parser_parse_navigation_suffix(parser_t* parser, i32 lhs_i,
         i32 rhs_src_len = 0;
         parser_tok_source(parser, member_tok_i, &rhs_src, &rhs_src_len);
 
-        const mkt_loc_t loc = parser->par_lexer.lex_locs[member_tok_i];
+        const mkt_loc_t loc = lex_loc(&parser->par_lexer, member_tok_i);
         fprintf(stderr,
                 "%s%s:%d:%sTrying to access member %.*s of non-instance type "
                 "(%s)\n",
@@ -1732,7 +1789,7 @@ static mkt_res_t parser_parse_navigation_suffix(parser_t* parser, i32 lhs_i,
         const char* src = NULL;
         i32 src_len = 0;
         parser_tok_source(parser, member_tok_i, &src, &src_len);
-        const mkt_loc_t loc = parser->par_lexer.lex_locs[member_tok_i];
+        const mkt_loc_t loc = lex_loc(&parser->par_lexer, member_tok_i);
         fprintf(stderr, "%s%s:%d:%sUndefined member %.*s\n",
                 mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
                 loc.loc_line, mkt_colors[is_tty][COL_RESET], src_len, src);
@@ -1820,181 +1877,6 @@ static mkt_res_t parser_parse_prefix_unary_expr(parser_t* parser,
     return parser_parse_postfix_unary_expr(parser, new_node_i);
 }
 
-static mkt_res_t parser_parse_as_expr(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_prefix_unary_expr(parser, new_node_i);
-}
-
-static mkt_res_t parser_parse_multiplicative_expr(parser_t* parser,
-                                                  i32* new_node_i) {
-    mkt_res_t res = RES_NONE;
-
-    i32 lhs_i = -1;
-    TRY_OK(parser_parse_as_expr(parser, &lhs_i));
-    CHECK(lhs_i, >=, 0, "%d");
-    CHECK(lhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-    const i32 lhs_type_i = parser->par_nodes[lhs_i].no_type_i;
-    CHECK(lhs_type_i, >=, 0, "%d");
-    CHECK(lhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
-
-    const mkt_type_kind_t lhs_type_kind = parser->par_types[lhs_type_i].ty_kind;
-
-    *new_node_i = lhs_i;
-
-    while (parser_match(parser, new_node_i, 3, TOK_ID_STAR, TOK_ID_SLASH,
-                        TOK_ID_PERCENT)) {
-        if (lhs_type_kind != TYPE_LONG && lhs_type_kind != TYPE_INT &&
-            lhs_type_kind != TYPE_SHORT && lhs_type_kind != TYPE_BYTE) {
-            log_debug("non matching types: lhs should be numerical, was: %s",
-                      mkt_type_to_str[lhs_type_kind]);
-            return parser_err_unexpected_type(parser, lhs_i, TYPE_LONG);
-        }
-
-        const i32 tok_i = parser->par_tok_i - 1;
-        const i32 tok_id = parser_previous(parser);
-
-        i32 rhs_i = -1;
-        res = parser_parse_as_expr(parser, &rhs_i);
-        if (res == RES_NONE)
-            return parser_err_missing_rhs(parser, tok_i, parser->par_tok_i);
-        else if (res != RES_OK)
-            return res;
-
-        CHECK(rhs_i, >=, 0, "%d");
-        CHECK(rhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-        const i32 rhs_type_i = parser->par_nodes[rhs_i].no_type_i;
-        CHECK(rhs_type_i, >=, 0, "%d");
-        CHECK(rhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
-
-        const mkt_type_kind_t rhs_type_kind =
-            parser->par_types[rhs_type_i].ty_kind;
-
-        if (rhs_type_kind != TYPE_LONG && rhs_type_kind != TYPE_INT &&
-            rhs_type_kind != TYPE_SHORT && rhs_type_kind != TYPE_BYTE) {
-            log_debug("non matching types: rhs should be numerical, was: %s",
-                      mkt_type_to_str[rhs_type_kind]);
-            return parser_err_unexpected_type(parser, lhs_i, TYPE_LONG);
-        }
-
-        if (lhs_type_kind != rhs_type_kind) {
-            log_debug("non matching types: lhs=%s rhs=%s",
-                      mkt_type_to_str[lhs_type_kind],
-                      mkt_type_to_str[rhs_type_kind]);
-            return parser_err_non_matching_types(parser, lhs_i, rhs_i);
-        }
-
-        buf_push(parser->par_nodes,
-                 ((mkt_node_t){
-                     .no_kind = (tok_id == TOK_ID_STAR)
-                                    ? NODE_MULTIPLY
-                                    : (tok_id == TOK_ID_SLASH ? NODE_DIVIDE
-                                                              : NODE_MODULO),
-                     .no_type_i = lhs_type_i,
-                     .no_n = {.no_binary = ((mkt_binary_t){
-                                  .bi_lhs_i = lhs_i, .bi_rhs_i = rhs_i})}}));
-        *new_node_i = lhs_i = (i32)buf_size(parser->par_nodes) - 1;
-    }
-
-    return RES_OK;
-}
-
-static mkt_res_t parser_parse_additive_expr(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    i32 lhs_i = -1;
-    TRY_OK(parser_parse_multiplicative_expr(parser, &lhs_i));
-
-    CHECK(lhs_i, >=, 0, "%d");
-    CHECK(lhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-    const i32 lhs_type_i = parser->par_nodes[lhs_i].no_type_i;
-    CHECK(lhs_type_i, >=, 0, "%d");
-    CHECK(lhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
-
-    const mkt_type_kind_t lhs_type_kind = parser->par_types[lhs_type_i].ty_kind;
-    *new_node_i = lhs_i;
-
-    while (parser_match(parser, new_node_i, 2, TOK_ID_PLUS, TOK_ID_MINUS)) {
-        const i32 tok_i = parser->par_tok_i - 1;
-        const i32 tok_id = parser_previous(parser);
-
-        i32 rhs_i = -1;
-
-        mkt_res_t res = parser_parse_multiplicative_expr(parser, &rhs_i);
-        if (res == RES_NONE)
-            return parser_err_missing_rhs(parser, tok_i, parser->par_tok_i);
-        else if (res != RES_OK)
-            return res;
-
-        CHECK(rhs_i, >=, 0, "%d");
-        CHECK(rhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-        const i32 rhs_type_i = parser->par_nodes[rhs_i].no_type_i;
-        CHECK(rhs_type_i, >=, 0, "%d");
-        CHECK(rhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
-
-        const mkt_type_kind_t rhs_type_kind =
-            parser->par_types[rhs_type_i].ty_kind;
-
-        if (lhs_type_kind != rhs_type_kind)
-            return parser_err_non_matching_types(parser, lhs_i, rhs_i);
-
-        buf_push(
-            parser->par_nodes,
-            ((mkt_node_t){
-                .no_kind = tok_id == TOK_ID_PLUS ? NODE_ADD : NODE_SUBTRACT,
-                .no_type_i = lhs_type_i,
-                .no_n = {.no_binary = ((mkt_binary_t){.bi_lhs_i = lhs_i,
-                                                      .bi_rhs_i = rhs_i})}}));
-        *new_node_i = lhs_i = (i32)buf_size(parser->par_nodes) - 1;
-    }
-
-    return RES_OK;
-}
-
-static mkt_res_t parser_parse_range_expr(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_additive_expr(parser, new_node_i);
-}
-
-static mkt_res_t parser_parse_infix_fn_call(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_range_expr(parser, new_node_i);
-}
-
-static mkt_res_t parser_parse_elvis_expr(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_infix_fn_call(parser, new_node_i);
-}
-
-static mkt_res_t parser_parse_infix_op(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_elvis_expr(parser, new_node_i);
-}
-
 static mkt_res_t parser_parse_value_arg(parser_t* parser, i32* new_node_i) {
     CHECK((void*)parser, !=, NULL, "%p");
     CHECK((void*)new_node_i, !=, NULL, "%p");
@@ -2056,7 +1938,7 @@ static mkt_res_t parser_parse_call_suffix(parser_t* parser, i32 lhs_i,
         const char* src = NULL;
         i32 src_len = 0;
         parser_tok_source(parser, first_tok_i, &src, &src_len);
-        const mkt_loc_t loc = parser->par_lexer.lex_locs[first_tok_i];
+        const mkt_loc_t loc = lex_loc(&parser->par_lexer, first_tok_i);
         const mkt_node_kind_t node_kind =
             parser->par_nodes[*new_node_i].no_kind;
         fprintf(stderr,
@@ -2079,7 +1961,7 @@ static mkt_res_t parser_parse_call_suffix(parser_t* parser, i32 lhs_i,
         const i32 declared_arity = buf_size(fn.fd_arg_nodes_i);
         const i32 found_arity = buf_size(arg_nodes_i);
         if (declared_arity != found_arity) {
-            const mkt_loc_t call_loc = parser->par_lexer.lex_locs[first_tok_i];
+            const mkt_loc_t call_loc = lex_loc(&parser->par_lexer, first_tok_i);
 
             fprintf(stderr, "%s%s:%d:%d:%sMismatched arity in call\n",
                     mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -2092,7 +1974,7 @@ static mkt_res_t parser_parse_call_suffix(parser_t* parser, i32 lhs_i,
             parser_print_source_on_error(parser, first_tok_i, first_tok_i);
 
             const i32 decl_tok_i = node_first_token(parser, callable_node_i);
-            const mkt_loc_t decl_loc = parser->par_lexer.lex_locs[decl_tok_i];
+            const mkt_loc_t decl_loc = lex_loc(&parser->par_lexer, decl_tok_i);
             fprintf(stderr, "%s%s:%d:%d:%sDeclared with %d arguments\n",
                     mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
                     decl_loc.loc_line, decl_loc.loc_column,
@@ -2160,114 +2042,96 @@ static mkt_res_t parser_parse_call_suffix(parser_t* parser, i32 lhs_i,
     return RES_OK;
 }
 
-static mkt_res_t parser_parse_generical_call_like_comparison(parser_t* parser,
-                                                             i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    return parser_parse_infix_op(parser, new_node_i);
-}
+// Binding power of the binary operators, from the loosest to the tightest.
+// All of them are left associative
+typedef enum {
+    PREC_NONE,
+    PREC_DISJUNCTION,
+    PREC_CONJUNCTION,
+    PREC_EQUALITY,
+    PREC_COMPARISON,
+    PREC_ADDITIVE,
+    PREC_MULTIPLICATIVE,
+} mkt_precedence_t;
 
-static mkt_res_t parser_parse_comparison(parser_t* parser, i32* new_node_i) {
+typedef struct {
+    u8 bo_prec;    // PREC_NONE when the token is not a binary operator
+    u8 bo_kind;    // mkt_node_kind_t
+    bool bo_swap;  // `a > b` is `b < a`, `a >= b` is `b <= a`
+} mkt_binary_op_t;
+
+static const mkt_binary_op_t parser_binary_ops[TOK_ID_INVALID + 1] = {
+    [TOK_ID_PIPEPIPE] = {.bo_prec = PREC_DISJUNCTION, .bo_kind = NODE_OR},
+    [TOK_ID_AMPAMP] = {.bo_prec = PREC_CONJUNCTION, .bo_kind = NODE_AND},
+    [TOK_ID_EQ_EQ] = {.bo_prec = PREC_EQUALITY, .bo_kind = NODE_EQ},
+    [TOK_ID_NEQ] = {.bo_prec = PREC_EQUALITY, .bo_kind = NODE_NEQ},
+    [TOK_ID_LT] = {.bo_prec = PREC_COMPARISON, .bo_kind = NODE_LT},
+    [TOK_ID_LE] = {.bo_prec = PREC_COMPARISON, .bo_kind = NODE_LE},
+    [TOK_ID_GT] = {.bo_prec = PREC_COMPARISON,
+                   .bo_kind = NODE_LT,
+                   .bo_swap = true},
+    [TOK_ID_GE] = {.bo_prec = PREC_COMPARISON,
+                   .bo_kind = NODE_LE,
+                   .bo_swap = true},
+    [TOK_ID_PLUS] = {.bo_prec = PREC_ADDITIVE, .bo_kind = NODE_ADD},
+    [TOK_ID_MINUS] = {.bo_prec = PREC_ADDITIVE, .bo_kind = NODE_SUBTRACT},
+    [TOK_ID_STAR] = {.bo_prec = PREC_MULTIPLICATIVE, .bo_kind = NODE_MULTIPLY},
+    [TOK_ID_SLASH] = {.bo_prec = PREC_MULTIPLICATIVE, .bo_kind = NODE_DIVIDE},
+    [TOK_ID_PERCENT] = {.bo_prec = PREC_MULTIPLICATIVE,
+                        .bo_kind = NODE_MODULO},
+};
+
+static bool parser_is_numerical(const parser_t* parser, i32 node_i) {
+    const mkt_type_kind_t kind =
+        parser->par_types[parser->par_nodes[node_i].no_type_i].ty_kind;
+    return kind == TYPE_LONG || kind == TYPE_INT || kind == TYPE_SHORT ||
+           kind == TYPE_BYTE;
+}
+
+// Precedence climbing: parse operators binding at least as tight as
+// `min_prec`, the operands being prefix unary expressions. A lone operand
+// costs a single call
+static mkt_res_t parser_parse_binary_expr(parser_t* parser, i32 min_prec,
+                                          i32* new_node_i) {
     CHECK((void*)parser, !=, NULL, "%p");
     CHECK((void*)new_node_i, !=, NULL, "%p");
+    CHECK(min_prec, >, PREC_NONE, "%d");
 
     i32 lhs_i = -1;
-    TRY_OK(parser_parse_generical_call_like_comparison(parser, &lhs_i));
-
+    TRY_OK(parser_parse_prefix_unary_expr(parser, &lhs_i));
     CHECK(lhs_i, >=, 0, "%d");
     CHECK(lhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-    const i32 lhs_type_i = parser->par_nodes[lhs_i].no_type_i;
-    CHECK(lhs_type_i, >=, 0, "%d");
-    CHECK(lhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
-
-    const mkt_type_kind_t lhs_type_kind = parser->par_types[lhs_type_i].ty_kind;
     *new_node_i = lhs_i;
 
-    while (parser_match(parser, new_node_i, 4, TOK_ID_LT, TOK_ID_LE, TOK_ID_GT,
-                        TOK_ID_GE)) {
-        const i32 tok_id = parser_previous(parser);
-
-        i32 rhs_i = -1;
-        TRY_OK(parser_parse_generical_call_like_comparison(parser, &rhs_i));
-
-        CHECK(rhs_i, >=, 0, "%d");
-        CHECK(rhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
-
-        const i32 rhs_type_i = parser->par_nodes[rhs_i].no_type_i;
-        CHECK(rhs_type_i, >=, 0, "%d");
-        CHECK(rhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
-
-        const mkt_type_kind_t rhs_type_kind =
-            parser->par_types[rhs_type_i].ty_kind;
-
-        if (lhs_type_kind != rhs_type_kind)
-            return parser_err_non_matching_types(parser, lhs_i, rhs_i);
-
-        if (tok_id == TOK_ID_LT)
-            buf_push(
-                parser->par_nodes,
-                ((mkt_node_t){
-                    .no_kind = NODE_LT,
-                    .no_type_i = TYPE_BOOL_I,
-                    .no_n = {.no_binary = ((mkt_binary_t){
-                                 .bi_lhs_i = lhs_i, .bi_rhs_i = rhs_i})}}));
-        else if (tok_id == TOK_ID_LE)
-            buf_push(
-                parser->par_nodes,
-                ((mkt_node_t){
-                    .no_kind = NODE_LE,
-                    .no_type_i = TYPE_BOOL_I,
-                    .no_n = {.no_binary = ((mkt_binary_t){
-                                 .bi_lhs_i = lhs_i, .bi_rhs_i = rhs_i})}}));
-        else if (tok_id == TOK_ID_GE)
-            buf_push(
-                parser->par_nodes,
-                ((mkt_node_t){
-                    .no_kind = NODE_LE,
-                    .no_type_i = TYPE_BOOL_I,
-                    .no_n = {.no_binary = ((mkt_binary_t){
-                                 .bi_lhs_i = rhs_i, .bi_rhs_i = lhs_i})}}));
-        else if (tok_id == TOK_ID_GT)
-            buf_push(
-                parser->par_nodes,
-                ((mkt_node_t){
-                    .no_kind = NODE_LT,
-                    .no_type_i = TYPE_BOOL_I,
-                    .no_n = {.no_binary = ((mkt_binary_t){
-                                 .bi_lhs_i = rhs_i, .bi_rhs_i = lhs_i})}}));
-        else
-            UNREACHABLE();
-
-        *new_node_i = lhs_i = (i32)buf_size(parser->par_nodes) - 1;
-    }
-
-    return RES_OK;
-}
-
-static mkt_res_t parser_parse_equality(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    i32 lhs_i = -1;
-    TRY_OK(parser_parse_comparison(parser, &lhs_i));
+    while (!parser_is_at_end(parser)) {
+        const mkt_binary_op_t op = parser_binary_ops[parser_peek(parser)];
+        if (op.bo_prec < min_prec) break;
 
-    CHECK(lhs_i, >=, 0, "%d");
-    CHECK(lhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
+        const i32 tok_i = parser->par_tok_i;
+        parser->par_tok_i += 1;
 
-    const i32 lhs_type_i = parser->par_nodes[lhs_i].no_type_i;
-    CHECK(lhs_type_i, >=, 0, "%d");
-    CHECK(lhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
+        const i32 lhs_type_i = parser->par_nodes[lhs_i].no_type_i;
+        CHECK(lhs_type_i, >=, 0, "%d");
+        CHECK(lhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
 
-    const mkt_type_kind_t lhs_type_kind = parser->par_types[lhs_type_i].ty_kind;
-    *new_node_i = lhs_i;
+        if (op.bo_prec <= PREC_CONJUNCTION &&
+            parser->par_types[lhs_type_i].ty_kind != TYPE_BOOL)
+            return parser_err_unexpected_type(parser, lhs_i, TYPE_BOOL);
 
-    while (parser_match(parser, new_node_i, 2, TOK_ID_EQ_EQ, TOK_ID_NEQ)) {
-        const i32 tok_id = parser_previous(parser);
+        if (op.bo_prec == PREC_MULTIPLICATIVE &&
+            !parser_is_numerical(parser, lhs_i)) {
+            log_debug("non matching types: lhs should be numerical, was: %s",
+                      mkt_type_to_str[parser->par_types[lhs_type_i].ty_kind]);
+            return parser_err_unexpected_type(parser, lhs_i, TYPE_LONG);
+        }
 
         i32 rhs_i = -1;
-        TRY_OK(parser_parse_comparison(parser, &rhs_i));
+        const mkt_res_t res =
+            parser_parse_binary_expr(parser, op.bo_prec + 1, &rhs_i);
+        if (res == RES_NONE && op.bo_prec >= PREC_ADDITIVE)
+            return parser_err_missing_rhs(parser, tok_i, parser->par_tok_i);
+        else if (res != RES_OK)
+            return res;
 
         CHECK(rhs_i, >=, 0, "%d");
         CHECK(rhs_i, <, (i32)buf_size(parser->par_nodes), "%d");
@@ -2276,47 +2140,42 @@ static mkt_res_t parser_parse_equality(parser_t* parser, i32* new_node_i) {
         CHECK(rhs_type_i, >=, 0, "%d");
         CHECK(rhs_type_i, <, (i32)buf_size(parser->par_types), "%d");
 
-        const mkt_type_kind_t rhs_type_kind =
-            parser->par_types[rhs_type_i].ty_kind;
+        if (op.bo_prec <= PREC_CONJUNCTION) {
+            if (parser->par_types[rhs_type_i].ty_kind != TYPE_BOOL)
+                return parser_err_unexpected_type(parser, rhs_i, TYPE_BOOL);
+        } else {
+            if (op.bo_prec == PREC_MULTIPLICATIVE &&
+                !parser_is_numerical(parser, rhs_i)) {
+                log_debug(
+                    "non matching types: rhs should be numerical, was: %s",
+                    mkt_type_to_str[parser->par_types[rhs_type_i].ty_kind]);
+                return parser_err_unexpected_type(parser, lhs_i, TYPE_LONG);
+            }
 
-        if (lhs_type_kind != rhs_type_kind)
-            return parser_err_non_matching_types(parser, lhs_i, rhs_i);
+            if (parser->par_types[lhs_type_i].ty_kind !=
+                parser->par_types[rhs_type_i].ty_kind)
+                return parser_err_non_matching_types(parser, lhs_i, rhs_i);
+        }
 
         buf_push(parser->par_nodes,
                  ((mkt_node_t){
-                     .no_kind = tok_id == TOK_ID_EQ_EQ ? NODE_EQ : NODE_NEQ,
-                     .no_type_i = TYPE_BOOL_I,
+                     .no_kind = op.bo_kind,
+                     .no_type_i = op.bo_prec >= PREC_ADDITIVE ? lhs_type_i
+                                                              : TYPE_BOOL_I,
                      .no_n = {.no_binary = ((mkt_binary_t){
-                                  .bi_lhs_i = lhs_i, .bi_rhs_i = rhs_i})}}));
+                                  .bi_lhs_i = op.bo_swap ? rhs_i : lhs_i,
+                                  .bi_rhs_i = op.bo_swap ? lhs_i : rhs_i})}}));
         *new_node_i = lhs_i = (i32)buf_size(parser->par_nodes) - 1;
     }
 
     return RES_OK;
 }
 
-static mkt_res_t parser_parse_conjunction(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_equality(parser, new_node_i);
-}
-
-static mkt_res_t parser_parse_disjunction(parser_t* parser, i32* new_node_i) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    // TODO
-
-    return parser_parse_conjunction(parser, new_node_i);
-}
-
 static mkt_res_t parser_parse_expr(parser_t* parser, i32* new_node_i) {
     CHECK((void*)parser, !=, NULL, "%p");
     CHECK((void*)new_node_i, !=, NULL, "%p");
 
-    return parser_parse_disjunction(parser, new_node_i);
+    return parser_parse_binary_expr(parser, PREC_DISJUNCTION, new_node_i);
 }
 
 static mkt_res_t parser_parse_stmts(parser_t* parser) {
@@ -2459,40 +2318,27 @@ static mkt_res_t parser_parse_builtin_println(parser_t* parser,
     return RES_NONE;
 }
 
-static void parser_reset(parser_t* parser, const parser_t* old_parser) {
-    CHECK((void*)parser, !=, NULL, "%p");
-    CHECK((void*)old_parser, !=, NULL, "%p");
-
-    parser->par_class_i = old_parser->par_class_i;
-    parser->par_fn_i = old_parser->par_fn_i;
-    parser->par_main_fn_i = old_parser->par_main_fn_i;
-    parser->par_scope_i = old_parser->par_scope_i;
-    parser->par_lexer = old_parser->par_lexer;
-    parser->par_tok_i = old_parser->par_tok_i;
-}
-
-static mkt_res_t parser_parse_assignment(parser_t* parser, i32* new_node_i) {
+// The expression `lhs_node_i` was parsed as a statement and turns out to be
+// the target of an assignment: no need to parse it again. Returns RES_NONE if
+// no `=` follows
+static mkt_res_t parser_parse_assignment(parser_t* parser, i32 lhs_node_i,
+                                         i32* new_node_i) {
     CHECK((void*)parser, !=, NULL, "%p");
     CHECK((void*)new_node_i, !=, NULL, "%p");
-
-    i32 lhs_node_i = -1, eq_tok_i = -1, rhs_node_i = -1;
-    const parser_t old_parser = *parser;
-    mkt_res_t res = parser_parse_postfix_unary_expr(parser, &lhs_node_i);
-    if (res != RES_OK) {
-        parser_reset(parser, &old_parser);
-        return res;
-    }
     CHECK(lhs_node_i, >=, 0, "%d");
     CHECK(lhs_node_i, <, (i32)buf_size(parser->par_nodes), "%d");
 
-    if (!parser_match(parser, &eq_tok_i, 1, TOK_ID_EQ)) {
-        parser_reset(parser, &old_parser);
-        return RES_NONE;
-    }
+    // Anything else followed by `=` is reported as an unexpected token by
+    // the caller
+    const mkt_node_kind_t lhs_kind = parser->par_nodes[lhs_node_i].no_kind;
+    if (lhs_kind != NODE_VAR && lhs_kind != NODE_MEMBER) return RES_NONE;
+
+    i32 eq_tok_i = -1, rhs_node_i = -1;
+    if (!parser_match(parser, &eq_tok_i, 1, TOK_ID_EQ)) return RES_NONE;
 
     TRY_OK(parser_check_var_assignable(parser, lhs_node_i, eq_tok_i));
 
-    res = parser_parse_expr(parser, &rhs_node_i);
+    const mkt_res_t res = parser_parse_expr(parser, &rhs_node_i);
     if (res == RES_NONE) {
         log_debug("Missing assignment rhs %d", lhs_node_i);
         return RES_EXPECTED_PRIMARY;
@@ -2566,7 +2412,7 @@ static mkt_res_t parser_parse_property_declaration(parser_t* parser,
         i32 src_len = 0;
         parser_tok_source(parser, type_tok_i, &src, &src_len);
 
-        const mkt_loc_t loc = parser->par_lexer.lex_locs[type_tok_i];
+        const mkt_loc_t loc = lex_loc(&parser->par_lexer, type_tok_i);
 
         fprintf(stderr, "%s%s:%d:%d:%s Unknown type %.*s\n",
                 mkt_colors[is_tty][COL_GRAY], parser->par_file_name0,
@@ -2596,6 +2442,7 @@ static mkt_res_t parser_parse_property_declaration(parser_t* parser,
     mkt_node_t* block = parser_current_block(parser);
     CHECK((void*)block, !=, NULL, "%p");
     buf_push(block->no_n.no_block.bl_nodes_i, buf_size(parser->par_nodes) - 1);
+    parser_scope_declare(parser, parser->par_scope_i, name_tok_i, *new_node_i);
 
     node_make_assign(parser, type_i, *new_node_i, init_node_i);
     block = parser_current_block(parser);
@@ -2733,6 +2580,9 @@ static mkt_res_t parser_parse_fn_declaration(parser_t* parser,
                       &parser->par_nodes[*new_node_i].no_n.no_fn.fd_name_tok_i,
                       1, TOK_ID_IDENTIFIER))
         return parser_err_unexpected_token(parser, TOK_ID_IDENTIFIER);
+    parser_scope_declare(
+        parser, parser->par_scope_i,
+        parser->par_nodes[*new_node_i].no_n.no_fn.fd_name_tok_i, *new_node_i);
 
     // Qualifies as entrypoint?
     {
@@ -2766,6 +2616,10 @@ static mkt_res_t parser_parse_fn_declaration(parser_t* parser,
     TRY_OK(parser_parse_fn_value_params(parser, &arg_nodes_i));
 
     parser->par_nodes[body_node_i].no_n.no_block.bl_nodes_i = arg_nodes_i;
+    for (i32 i = 0; i < (i32)buf_size(arg_nodes_i); i++) {
+        const mkt_var_t arg = parser->par_nodes[arg_nodes_i[i]].no_n.no_var;
+        parser_scope_declare(parser, body_node_i, arg.va_tok_i, arg_nodes_i[i]);
+    }
 
     for (i32 i = 0; i < (i32)buf_size(arg_nodes_i); i++)
         buf_push(parser->par_nodes[*new_node_i].no_n.no_fn.fd_arg_nodes_i,
@@ -2827,7 +2681,7 @@ static mkt_res_t parser_parse_fn_declaration(parser_t* parser,
 
     const bool seen_return = fn->fd_flags & FN_FLAGS_SEEN_RETURN;
     if (declared_return_type != TYPE_UNIT && !seen_return) {
-        const mkt_loc_t loc = parser->par_lexer.lex_locs[last_tok_i];
+        const mkt_loc_t loc = lex_loc(&parser->par_lexer, last_tok_i);
 
         fprintf(stderr,
                 "%s%s:%d:%d:%sThe function has declared to "
@@ -2991,10 +2845,14 @@ static mkt_res_t parser_parse_stmt(parser_t* parser, i32* new_node_i) {
     if (parser_peek(parser) == TOK_ID_EOF) return RES_NONE;
 
     TRY_NONE(parser_parse_declaration(parser, new_node_i));
-    TRY_NONE(parser_parse_assignment(parser, new_node_i));
     TRY_NONE(parser_parse_loop(parser, new_node_i));
 
-    return parser_parse_expr(parser, new_node_i);
+    i32 expr_node_i = -1;
+    TRY_OK(parser_parse_expr(parser, &expr_node_i));
+    *new_node_i = expr_node_i;
+    TRY_NONE(parser_parse_assignment(parser, expr_node_i, new_node_i));
+
+    return RES_OK;
 }
 
 static mkt_res_t parser_parse(parser_t* parser) {
@@ -3019,12 +2877,12 @@ static mkt_res_t parser_parse(parser_t* parser) {
 
     if (parser_peek(parser) != TOK_ID_EOF) {
         CHECK(parser->par_tok_i, <,
-              (i32)buf_size(parser->par_lexer.lex_tok_pos_ranges), "%d");
+              (i32)buf_size(parser->par_lexer.lex_tokens), "%d");
         const mkt_pos_range_t pos_range_start =
-            parser->par_lexer.lex_tok_pos_ranges[parser->par_tok_i];
-        CHECK(parser->par_tok_i, <, (i32)buf_size(parser->par_lexer.lex_locs),
+            lex_pos_range(&parser->par_lexer, parser->par_tok_i);
+        CHECK(parser->par_tok_i, <, (i32)buf_size(parser->par_lexer.lex_tokens),
               "%d");
-        const mkt_loc_t loc = parser->par_lexer.lex_locs[parser->par_tok_i];
+        const mkt_loc_t loc = lex_loc(&parser->par_lexer, parser->par_tok_i);
 
         const char* const src_start =
             parser->par_lexer.lex_source + pos_range_start.pr_start;
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <time.h>
+
+#include "fold.h"
+#include "ir.h"
+#include "isel.h"
+#include "loop.h"
+#include "ssa.h"
+#include "strength.h"
+
+// The pipeline between parsing and code generation, as a list of passes run
+// in order. Each one states the lowest -O level it runs at.
+typedef enum {
+    PASS_ANALYSIS,   // Inspects the IR without changing it
+    PASS_TRANSFORM,  // Rewrites the AST or the IR
+} mkt_pass_kind_t;
+
+typedef struct {
+    const char* pa_name;
+    mkt_pass_kind_t pa_kind;
+    i32 pa_min_level;
+    void (*pa_run)(parser_t* parser, mkt_ir_t* ir);
+    const bool* pa_enabled;  // Set by a command line flag, or NULL
+} mkt_pass_t;
+
+static i32 pass_opt_level = 2;           // -O0, -O1, -O2
+static bool pass_time_enabled = false;  // --time-passes
+
+static void pass_fold(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(ir);
+    fold(parser);
+}
+
+static void pass_lower(parser_t* parser, mkt_ir_t* ir) { ir_lower(parser, ir); }
+
+static void pass_inline(parser_t* parser, mkt_ir_t* ir) {
+    ir_inline(parser, ir);
+}
+
+static void pass_ssa(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    ssa_construct(ir);
+}
+
+static void pass_simplify(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    ssa_simplify(ir);
+}
+
+static void pass_strength(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    sr_reduce_strength(ir);
+}
+
+static void pass_licm(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    loop_licm(ir);
+}
+
+static void pass_imms(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    ir_fold_imms(ir);
+}
+
+static void pass_isel(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    isel_select(ir);
+}
+
+static void pass_dce(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    ir_dce(ir);
+}
+
+static void pass_dump(parser_t* parser, mkt_ir_t* ir) {
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        ir_dump_fn(stderr, parser, &ir->ir_fns[f]);
+}
+
+static void pass_ssa_out(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    ssa_destruct(ir);
+}
+
+static void pass_verify(parser_t* parser, mkt_ir_t* ir) {
+    IGNORE(parser);
+    ir_verify(ir);
+}
+
+static const mkt_pass_t passes[] = {
+    {"fold", PASS_TRANSFORM, 1, pass_fold, NULL},
+    {"lower", PASS_TRANSFORM, 0, pass_lower, NULL},
+    {"inline", PASS_TRANSFORM, 2, pass_inline, &ir_inline_enabled},
+    {"ssa", PASS_TRANSFORM, 1, pass_ssa, NULL},
+    {"simplify", PASS_TRANSFORM, 1, pass_simplify, NULL},
+    {"strength", PASS_TRANSFORM, 1, pass_strength, NULL},
+    {"licm", PASS_TRANSFORM, 2, pass_licm, NULL},
+    {"imms", PASS_TRANSFORM, 1, pass_imms, NULL},
+    {"isel", PASS_TRANSFORM, 1, pass_isel, NULL},
+    {"dce", PASS_TRANSFORM, 1, pass_dce, NULL},
+    {"dump", PASS_ANALYSIS, 0, pass_dump, &ir_dump_enabled},
+    {"ssa-out", PASS_TRANSFORM, 1, pass_ssa_out, NULL},
+    {"verify", PASS_ANALYSIS, 0, pass_verify, NULL},
+};
+
+static u64 pass_now_ns(void) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 * 1000 * 1000 + (u64)ts.tv_nsec;
+}
+
+// What the passes work on: AST nodes until the IR exists, IR instructions
+// after
+static i32 pass_size(const parser_t* parser, const mkt_ir_t* ir,
+                     const char** unit) {
+    if (buf_size(ir->ir_fns) == 0) {
+        *unit = "nodes";
+        return buf_size(parser->par_nodes);
+    }
+
+    *unit = "ins";
+    i32 size = 0;
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        size += ir_fn_size(&ir->ir_fns[f]);
+    return size;
+}
+
+static void pass_run(parser_t* parser, mkt_ir_t* ir) {
+    CHECK((void*)parser, !=, NULL, "%p");
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    u64 total_ns = 0;
+    for (i32 p = 0; p < (i32)(sizeof(passes) / sizeof(passes[0])); p++) {
+        const mkt_pass_t* const pass = &passes[p];
+        if (pass_opt_level < pass->pa_min_level) continue;
+        if (pass->pa_enabled != NULL && !*pass->pa_enabled) continue;
+
+        if (!pass_time_enabled) {
+            pass->pa_run(parser, ir);
+            continue;
+        }
+
+        const char *unit_before = NULL, *unit_after = NULL;
+        const i32 size_before = pass_size(parser, ir, &unit_before);
+        const u64 start = pass_now_ns();
+        pass->pa_run(parser, ir);
+        const u64 elapsed_ns = pass_now_ns() - start;
+        total_ns += elapsed_ns;
+
+        fprintf(stderr, "%-10s %10.3fms", pass->pa_name, elapsed_ns / 1e6);
+        if (pass->pa_kind == PASS_TRANSFORM) {
+            const i32 size_after = pass_size(parser, ir, &unit_after);
+            fprintf(stderr, " %8d %-5s -> %8d %s", size_before, unit_before,
+                    size_after, unit_after);
+            if (unit_before == unit_after)
+                fprintf(stderr, " (%+d)", size_after - size_before);
+        }
+        fputc('\n', stderr);
+    }
+    if (pass_time_enabled)
+        fprintf(stderr, "%-10s %10.3fms\n", "total", total_ns / 1e6);
+}
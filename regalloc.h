@@ -0,0 +1,472 @@
+#pragma once
+
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include "asm.h"
+#include "ir.h"
+
+// %rax (accumulator and return value), %rdx (idiv), %r10 (call target) and
+// %r11 (base addresses, cycles in parallel moves) are kept as scratch
+// registers for the emitter. Caller-saved registers come first so that
+// short-lived values do not force a save of callee-saved registers in the
+// prolog
+static const mkt_reg_t ra_allocatable[] = {
+    REG_RCX, REG_RSI, REG_RDI, REG_R8,  REG_R9,
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+static bool ra_reg_is_callee_saved(mkt_reg_t reg) {
+    return reg == REG_RBX || reg == REG_R12 || reg == REG_R13 ||
+           reg == REG_R14 || reg == REG_R15;
+}
+
+typedef struct {
+    i32 it_vreg, it_start, it_end;
+    bool it_crosses_call, it_crosses_runtime_call;
+} ra_interval_t;
+
+typedef struct {
+    i32 *ra_regs /* vreg -> mkt_reg_t, -1 when spilled */,
+        *ra_spill_offsets /* vreg -> offset from %rbp when spilled */,
+        ra_frame_size /* Bytes below %rbp: saved registers and spills */;
+    u16 ra_callee_saved /* Bitset of mkt_reg_t */,
+        *ra_saved_across /* Instruction #k -> bitset of caller-saved
+                            registers live across that runtime call */;
+    i32** ra_gc_roots /* Instruction #k -> offsets from %rbp of the GC
+                         references live across that call */;
+} mkt_regalloc_t;
+
+typedef struct {
+    u64 *li_in, *li_out, *li_use, *li_def;
+    i32 li_words;  // Per block
+} ra_liveness_t;
+
+static bool ra_bit_get(const u64* set, i32 i) {
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static void ra_bit_set(u64* set, i32 i) { set[i / 64] |= 1ULL << (i % 64); }
+
+typedef struct {
+    u64 *uc_use, *uc_def;
+} ra_use_ctx_t;
+
+static void ra_collect_use(i32 vreg, void* ctx) {
+    ra_use_ctx_t* const c = ctx;
+    if (!ra_bit_get(c->uc_def, vreg)) ra_bit_set(c->uc_use, vreg);
+}
+
+static void ra_liveness(const mkt_ir_fn_t* irf, ra_liveness_t* li) {
+    CHECK((void*)irf, !=, NULL, "%p");
+    CHECK((void*)li, !=, NULL, "%p");
+
+    const i32 blocks_len = buf_size(irf->irf_blocks);
+    const i32 words = (buf_size(irf->irf_vregs) + 63) / 64;
+    li->li_words = words;
+    li->li_in = calloc(blocks_len * words + 1, sizeof(u64));
+    li->li_out = calloc(blocks_len * words + 1, sizeof(u64));
+    li->li_use = calloc(blocks_len * words + 1, sizeof(u64));
+    li->li_def = calloc(blocks_len * words + 1, sizeof(u64));
+    CHECK((void*)li->li_in, !=, NULL, "%p");
+    CHECK((void*)li->li_out, !=, NULL, "%p");
+    CHECK((void*)li->li_use, !=, NULL, "%p");
+    CHECK((void*)li->li_def, !=, NULL, "%p");
+
+    for (i32 b = 0; b < blocks_len; b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        ra_use_ctx_t ctx = {.uc_use = &li->li_use[b * words],
+                            .uc_def = &li->li_def[b * words]};
+
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            ir_ins_for_each_use(ins, ra_collect_use, &ctx);
+            if (ins->ins_dst >= 0) ra_bit_set(ctx.uc_def, ins->ins_dst);
+        }
+    }
+
+    // Backward dataflow until a fixed point is reached
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 b = blocks_len - 1; b >= 0; b--) {
+            u64* const out = &li->li_out[b * words];
+            u64* const in = &li->li_in[b * words];
+            const u64* const use = &li->li_use[b * words];
+            const u64* const def = &li->li_def[b * words];
+
+            i32 succs[2] = {-1, -1};
+            const i32 succs_len = ir_block_succs(&irf->irf_blocks[b], succs);
+            for (i32 s = 0; s < succs_len; s++) {
+                const u64* const succ_in = &li->li_in[succs[s] * words];
+                for (i32 w = 0; w < words; w++) out[w] |= succ_in[w];
+            }
+
+            for (i32 w = 0; w < words; w++) {
+                const u64 new_in = use[w] | (out[w] & ~def[w]);
+                if (new_in != in[w]) {
+                    in[w] = new_in;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static void ra_liveness_free(ra_liveness_t* li) {
+    CHECK((void*)li, !=, NULL, "%p");
+
+    free(li->li_in);
+    free(li->li_out);
+    free(li->li_use);
+    free(li->li_def);
+}
+
+typedef struct {
+    ra_interval_t* ic_intervals;
+    i32 ic_pos;
+} ra_interval_ctx_t;
+
+static void ra_interval_extend(ra_interval_t* it, i32 pos) {
+    it->it_start = MIN(it->it_start, pos);
+    it->it_end = MAX(it->it_end, pos);
+}
+
+static void ra_collect_interval_use(i32 vreg, void* ctx) {
+    ra_interval_ctx_t* const c = ctx;
+    ra_interval_extend(&c->ic_intervals[vreg], c->ic_pos);
+}
+
+static int ra_interval_cmp(const void* a, const void* b) {
+    const ra_interval_t* const lhs = a;
+    const ra_interval_t* const rhs = b;
+
+    if (lhs->it_start != rhs->it_start) return lhs->it_start - rhs->it_start;
+    return lhs->it_vreg - rhs->it_vreg;
+}
+
+// Each vreg gets one interval, the hull of all the positions where it is live.
+// Instruction #k is at position 2k. A vreg live on entry (resp. exit) of a
+// block is extended to the odd position right before (resp. after) it
+static ra_interval_t* ra_intervals(const mkt_ir_fn_t* irf,
+                                   const ra_liveness_t* li) {
+    CHECK((void*)irf, !=, NULL, "%p");
+    CHECK((void*)li, !=, NULL, "%p");
+
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+    ra_interval_t* intervals = NULL;
+    buf_grow(intervals, vregs_len);
+    for (i32 v = 0; v < vregs_len; v++)
+        buf_push(intervals, ((ra_interval_t){.it_vreg = v,
+                                              .it_start = INT32_MAX,
+                                              .it_end = -1}));
+
+    // Number of calls (resp. runtime calls) before instruction #k
+    i32 *calls_before = NULL, *runtime_calls_before = NULL;
+    buf_push(calls_before, 0);
+    buf_push(runtime_calls_before, 0);
+
+    ra_interval_ctx_t ctx = {.ic_intervals = intervals};
+    i32 k = 0, last_param_pos = -1;
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        const i32 block_len = buf_size(block->bb_ins);
+        const i32 first_pos = 2 * k, last_pos = 2 * (k + block_len - 1);
+
+        // One word at a time, only visiting the bits set
+        const u64* const in = &li->li_in[b * li->li_words];
+        const u64* const out = &li->li_out[b * li->li_words];
+        for (i32 w = 0; w < li->li_words; w++) {
+            for (u64 bits = in[w]; bits != 0; bits &= bits - 1)
+                ra_interval_extend(&intervals[64 * w + __builtin_ctzll(bits)],
+                                   first_pos - 1);
+            for (u64 bits = out[w]; bits != 0; bits &= bits - 1)
+                ra_interval_extend(&intervals[64 * w + __builtin_ctzll(bits)],
+                                   last_pos + 1);
+        }
+
+        for (i32 i = 0; i < block_len; i++, k++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            ctx.ic_pos = 2 * k;
+            ir_ins_for_each_use(ins, ra_collect_interval_use, &ctx);
+            if (ins->ins_dst >= 0)
+                ra_interval_extend(&intervals[ins->ins_dst], 2 * k);
+            if (ins->ins_op == IR_PARAM) last_param_pos = 2 * k;
+
+            buf_push(calls_before,
+                     calls_before[k] + (ins->ins_op == IR_CALL ? 1 : 0));
+            buf_push(runtime_calls_before,
+                     runtime_calls_before[k] +
+                         (ir_op_is_runtime_call(ins->ins_op) ? 1 : 0));
+        }
+    }
+
+    for (i32 v = 0; v < vregs_len; v++) {
+        ra_interval_t* const it = &intervals[v];
+        if (it->it_end < 0) continue;
+
+        // Parameters are all moved at once on entry so they must not share
+        // registers
+        if (last_param_pos >= 0 && it->it_start <= last_param_pos &&
+            it->it_start >= 0) {
+            const mkt_ir_ins_t* const ins =
+                &irf->irf_blocks[0].bb_ins[it->it_start / 2];
+            if (ins->ins_op == IR_PARAM && ins->ins_dst == v) {
+                it->it_start = 0;
+                it->it_end = MAX(it->it_end, last_param_pos);
+            }
+        }
+
+        // Only calls strictly inside the interval clobber it: arguments are
+        // read before, and the result written after, the call
+        const i32 lo = MAX(0, it->it_start / 2 + 1), hi = (it->it_end - 1) / 2;
+        if (hi >= lo && hi < k) {
+            it->it_crosses_call = calls_before[hi + 1] - calls_before[lo] > 0;
+            it->it_crosses_runtime_call =
+                runtime_calls_before[hi + 1] - runtime_calls_before[lo] > 0;
+        }
+    }
+    buf_free(calls_before);
+    buf_free(runtime_calls_before);
+
+    qsort(intervals, vregs_len, sizeof(ra_interval_t), ra_interval_cmp);
+    return intervals;
+}
+
+// Binary min-heap of indices into `intervals`, by end
+static void ra_heap_push(i32** heap, const ra_interval_t* intervals, i32 i) {
+    buf_push(*heap, i);
+    i32* const h = *heap;
+    for (i32 c = buf_size(h) - 1; c > 0;) {
+        const i32 parent = (c - 1) / 2;
+        if (intervals[h[parent]].it_end <= intervals[h[c]].it_end) break;
+
+        const i32 tmp = h[parent];
+        h[parent] = h[c];
+        h[c] = tmp;
+        c = parent;
+    }
+}
+
+static i32 ra_heap_pop(i32* heap, const ra_interval_t* intervals) {
+    const i32 top = heap[0], last = buf_pop(heap), len = buf_size(heap);
+    if (len == 0) return top;
+
+    heap[0] = last;
+    for (i32 p = 0;;) {
+        const i32 l = 2 * p + 1, r = l + 1;
+        i32 min = p;
+        if (l < len && intervals[heap[l]].it_end < intervals[heap[min]].it_end)
+            min = l;
+        if (r < len && intervals[heap[r]].it_end < intervals[heap[min]].it_end)
+            min = r;
+        if (min == p) break;
+
+        const i32 tmp = heap[p];
+        heap[p] = heap[min];
+        heap[min] = tmp;
+        p = min;
+    }
+    return top;
+}
+
+// Caller-saved registers to preserve around each runtime call: only those
+// holding a value still needed afterwards. And the GC roots of each call.
+// The intervals, sorted by start, are swept along with the calls: the ones
+// strictly containing the position of the call are active
+static void ra_calls(const mkt_ir_fn_t* irf, const ra_interval_t* intervals,
+                     mkt_regalloc_t* ra) {
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+    i32 *heap = NULL, *active_roots = NULL, *root_slots = NULL;
+    for (i32 v = 0; v < vregs_len; v++) buf_push(root_slots, -1);
+    i32 live_in_reg[REG_COUNT] = {0};
+    i32 next = 0, pos = 0;
+
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++, pos += 2) {
+            const mkt_ir_op_t op = block->bb_ins[i].ins_op;
+            u16 saved = 0;
+            i32* roots = NULL;
+
+            if (op == IR_CALL || ir_op_is_runtime_call(op)) {
+                for (; next < vregs_len && intervals[next].it_start < pos;
+                     next++) {
+                    ra_heap_push(&heap, intervals, next);
+                    const i32 vreg = intervals[next].it_vreg;
+                    const i32 reg = ra->ra_regs[vreg];
+                    if (reg >= 0) live_in_reg[reg] += 1;
+                    if (!irf->irf_vregs[vreg].vr_gc_ref) continue;
+
+                    root_slots[vreg] = buf_size(active_roots);
+                    buf_push(active_roots, vreg);
+                }
+
+                while (buf_size(heap) > 0 &&
+                       intervals[heap[0]].it_end <= pos) {
+                    const i32 vreg =
+                        intervals[ra_heap_pop(heap, intervals)].it_vreg;
+                    const i32 reg = ra->ra_regs[vreg];
+                    if (reg >= 0) live_in_reg[reg] -= 1;
+                    if (root_slots[vreg] < 0) continue;
+
+                    // Swap with the last one
+                    const i32 moved = buf_pop(active_roots);
+                    if (moved != vreg) {
+                        active_roots[root_slots[vreg]] = moved;
+                        root_slots[moved] = root_slots[vreg];
+                    }
+                    root_slots[vreg] = -1;
+                }
+                for (i32 r = 0; r < REG_COUNT; r++)
+                    if (live_in_reg[r] > 0 && !ra_reg_is_callee_saved(r) &&
+                        ir_op_is_runtime_call(op))
+                        saved |= 1 << r;
+                for (i32 a = 0; a < (i32)buf_size(active_roots); a++) {
+                    const i32 vreg = active_roots[a];
+                    CHECK(ra->ra_regs[vreg], ==, -1, "%d");
+                    buf_push(roots, ra->ra_spill_offsets[vreg]);
+                }
+            }
+            buf_push(ra->ra_saved_across, saved);
+            buf_push(ra->ra_gc_roots, roots);
+        }
+    }
+    buf_free(heap);
+    buf_free(active_roots);
+    buf_free(root_slots);
+}
+
+static void ra_spill(mkt_regalloc_t* ra, i32 vreg, i32* spills_len) {
+    ra->ra_regs[vreg] = -1;
+    ra->ra_spill_offsets[vreg] = *spills_len;  // Slot index until the end
+    *spills_len += 1;
+}
+
+// Linear scan, see Poletto & Sarkar, 1999
+static void ra_fn(const mkt_ir_fn_t* irf, mkt_regalloc_t* ra) {
+    CHECK((void*)irf, !=, NULL, "%p");
+    CHECK((void*)ra, !=, NULL, "%p");
+
+    ra_liveness_t li = {0};
+    ra_liveness(irf, &li);
+    ra_interval_t* intervals = ra_intervals(irf, &li);
+    ra_liveness_free(&li);
+
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+    *ra = (mkt_regalloc_t){0};
+    buf_grow(ra->ra_regs, vregs_len);
+    buf_grow(ra->ra_spill_offsets, vregs_len);
+    for (i32 v = 0; v < vregs_len; v++) {
+        ra->ra_regs[v] = -1;
+        ra->ra_spill_offsets[v] = -1;
+    }
+
+    // Indices into `intervals`, unordered
+    i32* active = NULL;
+    bool used[REG_COUNT] = {0};
+    i32 spills_len = 0;
+
+    for (i32 i = 0; i < vregs_len; i++) {
+        const ra_interval_t* const cur = &intervals[i];
+        if (cur->it_end < 0) continue;  // Never used
+
+        for (i32 a = 0; a < (i32)buf_size(active);) {
+            const ra_interval_t* const it = &intervals[active[a]];
+            if (it->it_end < cur->it_start) {
+                used[ra->ra_regs[it->it_vreg]] = false;
+                active[a] = buf_pop(active);
+            } else
+                a++;
+        }
+
+        // The GC only finds references in the stack slots listed by the
+        // stack maps of the call sites, see emit_stack_maps
+        if (irf->irf_vregs[cur->it_vreg].vr_gc_ref &&
+            (cur->it_crosses_call || cur->it_crosses_runtime_call)) {
+            ra_spill(ra, cur->it_vreg, &spills_len);
+            continue;
+        }
+
+        // Across a runtime call a callee-saved register costs one push in
+        // the prolog instead of a push and a pop around each call
+        const bool prefer_callee_saved =
+            cur->it_crosses_call || cur->it_crosses_runtime_call;
+        i32 reg = -1;
+        for (u32 pass = prefer_callee_saved ? 0 : 1; pass < 2 && reg == -1;
+             pass++) {
+            for (u32 r = 0; r < ARR_SIZE(ra_allocatable); r++) {
+                const mkt_reg_t candidate = ra_allocatable[r];
+                if (used[candidate]) continue;
+                if ((pass == 0 || cur->it_crosses_call) &&
+                    !ra_reg_is_callee_saved(candidate))
+                    continue;
+
+                reg = candidate;
+                break;
+            }
+        }
+
+        if (reg == -1) {
+            // Spill whichever compatible interval ends last
+            i32 victim = -1;
+            for (i32 a = 0; a < (i32)buf_size(active); a++) {
+                const ra_interval_t* const it = &intervals[active[a]];
+                if (cur->it_crosses_call &&
+                    !ra_reg_is_callee_saved(ra->ra_regs[it->it_vreg]))
+                    continue;
+                if (victim == -1 ||
+                    it->it_end > intervals[active[victim]].it_end)
+                    victim = a;
+            }
+
+            if (victim == -1 ||
+                intervals[active[victim]].it_end <= cur->it_end) {
+                ra_spill(ra, cur->it_vreg, &spills_len);
+                continue;
+            }
+
+            const i32 victim_vreg = intervals[active[victim]].it_vreg;
+            reg = ra->ra_regs[victim_vreg];
+            ra_spill(ra, victim_vreg, &spills_len);
+            active[victim] = buf_pop(active);
+        }
+
+        CHECK(reg, >=, 0, "%d");
+        used[reg] = true;
+        ra->ra_regs[cur->it_vreg] = reg;
+        buf_push(active, i);
+        if (ra_reg_is_callee_saved(reg)) ra->ra_callee_saved |= 1 << reg;
+    }
+
+    // Frame: saved callee-saved registers, then spill slots
+    i32 callee_saved_len = 0;
+    for (i32 r = 0; r < REG_COUNT; r++)
+        callee_saved_len += (ra->ra_callee_saved >> r) & 1;
+
+    for (i32 v = 0; v < vregs_len; v++) {
+        if (ra->ra_regs[v] != -1 || ra->ra_spill_offsets[v] == -1) continue;
+        ra->ra_spill_offsets[v] =
+            -8 * (callee_saved_len + ra->ra_spill_offsets[v] + 1);
+    }
+    ra->ra_frame_size = (8 * (callee_saved_len + spills_len) + 15) / 16 * 16;
+
+    log_debug("regalloc: vregs=%d spills=%d callee_saved=%d frame_size=%d",
+              vregs_len, spills_len, callee_saved_len, ra->ra_frame_size);
+
+    ra_calls(irf, intervals, ra);
+
+    buf_free(active);
+    buf_free(intervals);
+}
+
+static void ra_free(mkt_regalloc_t* ra) {
+    CHECK((void*)ra, !=, NULL, "%p");
+
+    buf_free(ra->ra_regs);
+    buf_free(ra->ra_spill_offsets);
+    buf_free(ra->ra_saved_across);
+    for (i32 k = 0; k < (i32)buf_size(ra->ra_gc_roots); k++)
+        buf_free(ra->ra_gc_roots[k]);
+    buf_free(ra->ra_gc_roots);
+}
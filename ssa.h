@@ -0,0 +1,678 @@
+#pragma once
+
+#include "ir.h"
+
+// Static single assignment form: each vreg has exactly one definition. The
+// vregs lowering assigns in several places (`var`, params reassigned by a
+// tail call, the value of an `if`, the result of an inlined function...) get
+// one version per assignment, merged by IR_PHI at the start of the blocks
+// where versions meet. Built after lowering and inlining with the algorithm
+// of Cytron et al., 1991, and taken back out with copies before register
+// allocation.
+// Blocks not reachable from the entry are left untouched.
+
+typedef struct {
+    i32 *cf_rpo /* Reachable blocks in reverse postorder */,
+        *cf_order /* Block -> position in cf_rpo, -1 when unreachable */,
+        *cf_idom /* Block -> immediate dominator, itself for the entry */;
+    i32 **cf_preds /* Block -> reachable predecessors */,
+        **cf_children /* Block -> blocks it immediately dominates */,
+        **cf_frontier /* Block -> dominance frontier */;
+    i32 cf_blocks_len;
+} ssa_cfg_t;
+
+static i32 ssa_dom_intersect(const ssa_cfg_t* cfg, i32 a, i32 b) {
+    while (a != b) {
+        while (cfg->cf_order[a] > cfg->cf_order[b]) a = cfg->cf_idom[a];
+        while (cfg->cf_order[b] > cfg->cf_order[a]) b = cfg->cf_idom[b];
+    }
+    return a;
+}
+
+// Dominators with the iterative algorithm of Cooper, Harvey & Kennedy, 2001
+static void ssa_cfg_make(const mkt_ir_fn_t* irf, ssa_cfg_t* cfg) {
+    CHECK((void*)irf, !=, NULL, "%p");
+    CHECK((void*)cfg, !=, NULL, "%p");
+
+    const i32 blocks_len = buf_size(irf->irf_blocks);
+    *cfg = (ssa_cfg_t){.cf_blocks_len = blocks_len};
+    for (i32 b = 0; b < blocks_len; b++) {
+        buf_push(cfg->cf_order, -1);
+        buf_push(cfg->cf_idom, -1);
+        buf_push(cfg->cf_preds, NULL);
+        buf_push(cfg->cf_children, NULL);
+        buf_push(cfg->cf_frontier, NULL);
+    }
+
+    // Depth first search without recursion: the stack holds the blocks along
+    // with how many of their successors were visited so far
+    i32 *stack = NULL, *next_succ = NULL, *postorder = NULL;
+    for (i32 b = 0; b < blocks_len; b++) buf_push(next_succ, 0);
+    buf_push(stack, 0);
+    cfg->cf_order[0] = 0;  // Visited
+    while (buf_size(stack) > 0) {
+        const i32 b = stack[buf_size(stack) - 1];
+        i32 succs[2] = {-1, -1};
+        const i32 succs_len = ir_block_succs(&irf->irf_blocks[b], succs);
+        if (next_succ[b] < succs_len) {
+            const i32 s = succs[next_succ[b]++];
+            if (cfg->cf_order[s] == -1) {
+                cfg->cf_order[s] = 0;
+                buf_push(stack, s);
+            }
+            continue;
+        }
+        buf_push(postorder, buf_pop(stack));
+    }
+    for (i32 i = (i32)buf_size(postorder) - 1; i >= 0; i--) {
+        cfg->cf_order[postorder[i]] = buf_size(cfg->cf_rpo);
+        buf_push(cfg->cf_rpo, postorder[i]);
+    }
+    buf_free(stack);
+    buf_free(next_succ);
+    buf_free(postorder);
+
+    const i32 rpo_len = buf_size(cfg->cf_rpo);
+    for (i32 i = 0; i < rpo_len; i++) {
+        const i32 b = cfg->cf_rpo[i];
+        i32 succs[2] = {-1, -1};
+        const i32 succs_len = ir_block_succs(&irf->irf_blocks[b], succs);
+        for (i32 s = 0; s < succs_len; s++)
+            buf_push(cfg->cf_preds[succs[s]], b);
+    }
+
+    cfg->cf_idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 i = 1; i < rpo_len; i++) {
+            const i32 b = cfg->cf_rpo[i];
+            i32 idom = -1;
+            for (i32 p = 0; p < (i32)buf_size(cfg->cf_preds[b]); p++) {
+                const i32 pred = cfg->cf_preds[b][p];
+                if (cfg->cf_idom[pred] == -1) continue;
+                idom = idom == -1 ? pred : ssa_dom_intersect(cfg, pred, idom);
+            }
+            if (idom != cfg->cf_idom[b]) {
+                cfg->cf_idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (i32 i = 1; i < rpo_len; i++) {
+        const i32 b = cfg->cf_rpo[i];
+        buf_push(cfg->cf_children[cfg->cf_idom[b]], b);
+
+        const i32* const preds = cfg->cf_preds[b];
+        if (buf_size(preds) < 2) continue;
+        for (i32 p = 0; p < (i32)buf_size(preds); p++) {
+            for (i32 runner = preds[p]; runner != cfg->cf_idom[b];
+                 runner = cfg->cf_idom[runner]) {
+                i32* const frontier = cfg->cf_frontier[runner];
+                if (buf_size(frontier) > 0 &&
+                    frontier[buf_size(frontier) - 1] == b)
+                    break;
+                buf_push(cfg->cf_frontier[runner], b);
+            }
+        }
+    }
+}
+
+static void ssa_cfg_free(ssa_cfg_t* cfg) {
+    CHECK((void*)cfg, !=, NULL, "%p");
+
+    for (i32 b = 0; b < cfg->cf_blocks_len; b++) {
+        buf_free(cfg->cf_preds[b]);
+        buf_free(cfg->cf_children[b]);
+        buf_free(cfg->cf_frontier[b]);
+    }
+    buf_free(cfg->cf_rpo);
+    buf_free(cfg->cf_order);
+    buf_free(cfg->cf_idom);
+    buf_free(cfg->cf_preds);
+    buf_free(cfg->cf_children);
+    buf_free(cfg->cf_frontier);
+}
+
+static i32 ssa_vreg_clone(mkt_ir_fn_t* irf, i32 vreg) {
+    CHECK(vreg, >=, 0, "%d");
+    CHECK(vreg, <, (i32)buf_size(irf->irf_vregs), "%d");
+
+    const mkt_ir_vreg_t copy = irf->irf_vregs[vreg];
+    buf_push(irf->irf_vregs, copy);
+    return buf_size(irf->irf_vregs) - 1;
+}
+
+static i32 ssa_phis_len(const mkt_ir_block_t* block) {
+    i32 len = 0;
+    while (len < (i32)buf_size(block->bb_ins) &&
+           block->bb_ins[len].ins_op == IR_PHI)
+        len++;
+    return len;
+}
+
+// Places the phis of the vregs defined more than once at the iterated
+// dominance frontiers of their definitions
+static void ssa_place_phis(mkt_ir_fn_t* irf, const ssa_cfg_t* cfg,
+                           const bool* is_var) {
+    const i32 blocks_len = cfg->cf_blocks_len;
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+
+    i32** def_blocks = NULL;  // Var -> reachable blocks defining it
+    for (i32 v = 0; v < vregs_len; v++) buf_push(def_blocks, NULL);
+    for (i32 i = 0; i < (i32)buf_size(cfg->cf_rpo); i++) {
+        const i32 b = cfg->cf_rpo[i];
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 j = 0; j < (i32)buf_size(block->bb_ins); j++) {
+            const i32 dst = block->bb_ins[j].ins_dst;
+            if (dst < 0 || !is_var[dst]) continue;
+
+            i32* const defs = def_blocks[dst];
+            if (buf_size(defs) == 0 || defs[buf_size(defs) - 1] != b)
+                buf_push(def_blocks[dst], b);
+        }
+    }
+
+    // Block -> last var with a phi there, resp. queued for it, to not
+    // clear those for every var
+    i32 *has_phi = NULL, *queued = NULL, **block_phis = NULL;
+    for (i32 b = 0; b < blocks_len; b++) {
+        buf_push(has_phi, -1);
+        buf_push(queued, -1);
+        buf_push(block_phis, NULL);
+    }
+
+    i32* work = NULL;
+    for (i32 v = 0; v < vregs_len; v++) {
+        if (!is_var[v]) continue;
+
+        for (i32 i = 0; i < (i32)buf_size(def_blocks[v]); i++) {
+            queued[def_blocks[v][i]] = v;
+            buf_push(work, def_blocks[v][i]);
+        }
+        while (buf_size(work) > 0) {
+            const i32 b = buf_pop(work);
+            for (i32 i = 0; i < (i32)buf_size(cfg->cf_frontier[b]); i++) {
+                const i32 f = cfg->cf_frontier[b][i];
+                if (has_phi[f] == v) continue;
+
+                has_phi[f] = v;
+                buf_push(block_phis[f], v);
+                if (queued[f] != v) {
+                    queued[f] = v;
+                    buf_push(work, f);
+                }
+            }
+        }
+        buf_free(def_blocks[v]);
+    }
+    buf_free(work);
+    buf_free(def_blocks);
+    buf_free(has_phi);
+    buf_free(queued);
+
+    for (i32 b = 0; b < blocks_len; b++) {
+        if (block_phis[b] == NULL) continue;
+
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        const i32 node_i =
+            buf_size(block->bb_ins) > 0 ? block->bb_ins[0].ins_node_i : -1;
+        mkt_ir_ins_t* ins = NULL;
+        for (i32 i = 0; i < (i32)buf_size(block_phis[b]); i++) {
+            mkt_ir_ins_t phi = ir_ins_make(IR_PHI, node_i);
+            phi.ins_dst = block_phis[b][i];
+            phi.ins_imm = block_phis[b][i];
+            for (i32 p = 0; p < (i32)buf_size(cfg->cf_preds[b]); p++) {
+                buf_push(phi.ins_args, -1);
+                buf_push(phi.ins_preds, cfg->cf_preds[b][p]);
+            }
+            buf_push(ins, phi);
+        }
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+            buf_push(ins, block->bb_ins[i]);
+        buf_free(block->bb_ins);
+        block->bb_ins = ins;
+        buf_free(block_phis[b]);
+    }
+    buf_free(block_phis);
+}
+
+static void ssa_rename_use(i32* vreg, const bool* is_var, const i32* current) {
+    if (*vreg >= 0 && *vreg < (i32)buf_size(is_var) && is_var[*vreg] &&
+        current[*vreg] >= 0)
+        *vreg = current[*vreg];
+}
+
+// Gives each definition of a var its own vreg, walking the dominator tree so
+// that the uses see the closest dominating definition
+static void ssa_rename(mkt_ir_fn_t* irf, const ssa_cfg_t* cfg,
+                       const bool* is_var) {
+    const i32 vars_len = buf_size(irf->irf_vregs);
+
+    // Var -> its version at the current point of the walk, and the undo log
+    // of that mapping as (var, previous version) pairs
+    i32 *current = NULL, *undo = NULL, *undo_marks = NULL;
+    for (i32 v = 0; v < vars_len; v++) buf_push(current, -1);
+    for (i32 b = 0; b < cfg->cf_blocks_len; b++) buf_push(undo_marks, 0);
+
+    // Entering block b is pushed as b, leaving it as ~b
+    i32* stack = NULL;
+    buf_push(stack, 0);
+    while (buf_size(stack) > 0) {
+        const i32 top = buf_pop(stack);
+        if (top < 0) {
+            const i32 b = ~top;
+            while ((i32)buf_size(undo) > undo_marks[b]) {
+                const i32 previous = buf_pop(undo);
+                current[buf_pop(undo)] = previous;
+            }
+            continue;
+        }
+
+        const i32 b = top;
+        undo_marks[b] = buf_size(undo);
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_op != IR_PHI) {
+                ssa_rename_use(&ins->ins_lhs, is_var, current);
+                ssa_rename_use(&ins->ins_rhs, is_var, current);
+                for (i32 a = 0; a < (i32)buf_size(ins->ins_args); a++)
+                    ssa_rename_use(&ins->ins_args[a], is_var, current);
+            }
+
+            const i32 var = ins->ins_dst;
+            if (var < 0 || var >= vars_len || !is_var[var]) continue;
+            buf_push(undo, var);
+            buf_push(undo, current[var]);
+            current[var] = ins->ins_dst = ssa_vreg_clone(irf, var);
+        }
+
+        i32 succs[2] = {-1, -1};
+        const i32 succs_len = ir_block_succs(block, succs);
+        for (i32 s = 0; s < succs_len; s++) {
+            mkt_ir_block_t* const succ = &irf->irf_blocks[succs[s]];
+            for (i32 i = 0; i < ssa_phis_len(succ); i++) {
+                mkt_ir_ins_t* const phi = &succ->bb_ins[i];
+                for (i32 p = 0; p < (i32)buf_size(phi->ins_preds); p++)
+                    if (phi->ins_preds[p] == b)
+                        phi->ins_args[p] = current[phi->ins_imm];
+            }
+        }
+
+        buf_push(stack, ~b);
+        for (i32 c = 0; c < (i32)buf_size(cfg->cf_children[b]); c++)
+            buf_push(stack, cfg->cf_children[b][c]);
+    }
+
+    buf_free(current);
+    buf_free(undo);
+    buf_free(undo_marks);
+    buf_free(stack);
+}
+
+static i32 ssa_alias_find(i32* alias, i32 vreg) {
+    if (vreg < 0) return vreg;
+
+    i32 root = vreg;
+    while (alias[root] != root) root = alias[root];
+    while (alias[vreg] != root) {
+        const i32 next = alias[vreg];
+        alias[vreg] = root;
+        vreg = next;
+    }
+    return root;
+}
+
+// Removes what the renaming leaves behind: copies, phis whose operands are
+// all the same version, and phis nobody reads
+static void ssa_simplify_fn(mkt_ir_fn_t* irf, const ssa_cfg_t* cfg) {
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+    const i32 rpo_len = buf_size(cfg->cf_rpo);
+
+    // Vreg -> the vreg it is a copy of
+    i32* alias = NULL;
+    for (i32 v = 0; v < vregs_len; v++) buf_push(alias, v);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 i = 0; i < rpo_len; i++) {
+            const mkt_ir_block_t* const block =
+                &irf->irf_blocks[cfg->cf_rpo[i]];
+            for (i32 j = 0; j < (i32)buf_size(block->bb_ins); j++) {
+                const mkt_ir_ins_t* const ins = &block->bb_ins[j];
+                const i32 dst = ins->ins_dst;
+                if (dst < 0 || alias[dst] != dst) continue;
+
+                i32 same = -1;
+                if (ins->ins_op == IR_MOV) {
+                    same = ssa_alias_find(alias, ins->ins_lhs);
+                    if (irf->irf_vregs[same].vr_gc_ref !=
+                        irf->irf_vregs[dst].vr_gc_ref)
+                        continue;
+                } else if (ins->ins_op == IR_PHI) {
+                    for (i32 a = 0; a < (i32)buf_size(ins->ins_args); a++) {
+                        const i32 arg = ssa_alias_find(alias, ins->ins_args[a]);
+                        if (arg == -1 || arg == dst || arg == same) continue;
+                        same = same == -1 ? arg : -2;
+                    }
+                }
+                if (same < 0 || same == dst) continue;
+
+                alias[dst] = same;
+                changed = true;
+            }
+        }
+    }
+
+    // Phis only read by dead phis are dead: mark from the other
+    // instructions, then through the phis
+    bool* live = NULL;
+    for (i32 v = 0; v < vregs_len; v++) buf_push(live, false);
+    i32* work = NULL;
+    for (i32 i = 0; i < rpo_len; i++) {
+        mkt_ir_block_t* const block = &irf->irf_blocks[cfg->cf_rpo[i]];
+        for (i32 j = 0; j < (i32)buf_size(block->bb_ins); j++) {
+            mkt_ir_ins_t* const ins = &block->bb_ins[j];
+            ins->ins_lhs = ssa_alias_find(alias, ins->ins_lhs);
+            ins->ins_rhs = ssa_alias_find(alias, ins->ins_rhs);
+            for (i32 a = 0; a < (i32)buf_size(ins->ins_args); a++)
+                ins->ins_args[a] = ssa_alias_find(alias, ins->ins_args[a]);
+            if (ins->ins_op == IR_PHI) continue;
+
+            if (ins->ins_lhs >= 0) buf_push(work, ins->ins_lhs);
+            if (ins->ins_rhs >= 0) buf_push(work, ins->ins_rhs);
+            for (i32 a = 0; a < (i32)buf_size(ins->ins_args); a++)
+                buf_push(work, ins->ins_args[a]);
+        }
+    }
+
+    // Vreg -> the block and index of its phi, -1 if it has none
+    i32 *phi_blocks = NULL, *phi_indices = NULL;
+    for (i32 v = 0; v < vregs_len; v++) {
+        buf_push(phi_blocks, -1);
+        buf_push(phi_indices, -1);
+    }
+    for (i32 i = 0; i < rpo_len; i++) {
+        const i32 b = cfg->cf_rpo[i];
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 j = 0; j < ssa_phis_len(block); j++) {
+            phi_blocks[block->bb_ins[j].ins_dst] = b;
+            phi_indices[block->bb_ins[j].ins_dst] = j;
+        }
+    }
+    while (buf_size(work) > 0) {
+        const i32 v = buf_pop(work);
+        if (live[v]) continue;
+        live[v] = true;
+        if (phi_blocks[v] < 0) continue;
+
+        const mkt_ir_ins_t* const phi =
+            &irf->irf_blocks[phi_blocks[v]].bb_ins[phi_indices[v]];
+        for (i32 a = 0; a < (i32)buf_size(phi->ins_args); a++)
+            if (phi->ins_args[a] >= 0) buf_push(work, phi->ins_args[a]);
+    }
+
+    for (i32 i = 0; i < rpo_len; i++) {
+        mkt_ir_block_t* const block = &irf->irf_blocks[cfg->cf_rpo[i]];
+        i32 len = 0;
+        for (i32 j = 0; j < (i32)buf_size(block->bb_ins); j++) {
+            mkt_ir_ins_t* const ins = &block->bb_ins[j];
+            const bool copy =
+                (ins->ins_op == IR_MOV || ins->ins_op == IR_PHI) &&
+                alias[ins->ins_dst] != ins->ins_dst;
+            if (copy || (ins->ins_op == IR_PHI && !live[ins->ins_dst])) {
+                buf_free(ins->ins_args);
+                buf_free(ins->ins_preds);
+                continue;
+            }
+            block->bb_ins[len++] = *ins;
+        }
+        buf_ptr(block->bb_ins)->size = len;
+    }
+
+    buf_free(alias);
+    buf_free(live);
+    buf_free(work);
+    buf_free(phi_blocks);
+    buf_free(phi_indices);
+}
+
+static void ssa_construct_fn(mkt_ir_fn_t* irf) {
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    const i32 vregs_len = buf_size(irf->irf_vregs);
+    i32* defs = NULL;
+    for (i32 v = 0; v < vregs_len; v++) buf_push(defs, 0);
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+            if (block->bb_ins[i].ins_dst >= 0)
+                defs[block->bb_ins[i].ins_dst] += 1;
+    }
+    bool* is_var = NULL;
+    bool any_var = false;
+    for (i32 v = 0; v < vregs_len; v++) {
+        buf_push(is_var, defs[v] > 1);
+        any_var |= defs[v] > 1;
+    }
+    buf_free(defs);
+
+    ssa_cfg_t cfg = {0};
+    ssa_cfg_make(irf, &cfg);
+    if (any_var) {
+        ssa_place_phis(irf, &cfg, is_var);
+        ssa_rename(irf, &cfg, is_var);
+    }
+
+    ssa_cfg_free(&cfg);
+    buf_free(is_var);
+}
+
+static void ssa_construct(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        ssa_construct_fn(&ir->ir_fns[f]);
+}
+
+static void ssa_simplify(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++) {
+        ssa_cfg_t cfg = {0};
+        ssa_cfg_make(&ir->ir_fns[f], &cfg);
+        ssa_simplify_fn(&ir->ir_fns[f], &cfg);
+        ssa_cfg_free(&cfg);
+    }
+}
+
+// Out of SSA
+
+// Inserts an empty block at `at`, shifting the following ones
+static void ssa_block_insert(mkt_ir_fn_t* irf, i32 at) {
+    buf_push(irf->irf_blocks, ((mkt_ir_block_t){.bb_ins = NULL}));
+    const i32 blocks_len = buf_size(irf->irf_blocks);
+    for (i32 b = blocks_len - 1; b > at; b--)
+        irf->irf_blocks[b] = irf->irf_blocks[b - 1];
+    irf->irf_blocks[at] = (mkt_ir_block_t){.bb_ins = NULL};
+
+    for (i32 b = 0; b < blocks_len; b++) {
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_target >= at) ins->ins_target += 1;
+            if (ins->ins_target_else >= at) ins->ins_target_else += 1;
+            for (i32 p = 0; p < (i32)buf_size(ins->ins_preds); p++)
+                if (ins->ins_preds[p] >= at) ins->ins_preds[p] += 1;
+        }
+    }
+}
+
+// Appends `dsts[i] = srcs[i]` for all i at once to `ins`: a move is only
+// emitted when its destination is not read by a pending one, and cycles
+// (e.g. swaps) go through a temporary
+static void ssa_parallel_copy(mkt_ir_fn_t* irf, i32* dsts, i32* srcs, i32 len,
+                              i32 node_i, mkt_ir_ins_t** ins) {
+    while (len > 0) {
+        i32 ready = -1;
+        for (i32 i = 0; i < len && ready == -1; i++) {
+            ready = i;
+            for (i32 j = 0; j < len; j++)
+                if (j != i && srcs[j] == dsts[i]) ready = -1;
+        }
+
+        mkt_ir_ins_t mov = ir_ins_make(IR_MOV, node_i);
+        if (ready == -1) {
+            // All destinations are still to be read: save one
+            mov.ins_dst = ssa_vreg_clone(irf, dsts[0]);
+            mov.ins_lhs = dsts[0];
+            for (i32 j = 0; j < len; j++)
+                if (srcs[j] == dsts[0]) srcs[j] = mov.ins_dst;
+            buf_push(*ins, mov);
+            continue;
+        }
+
+        mov.ins_dst = dsts[ready];
+        mov.ins_lhs = srcs[ready];
+        buf_push(*ins, mov);
+        dsts[ready] = dsts[len - 1];
+        srcs[ready] = srcs[len - 1];
+        len--;
+    }
+}
+
+static bool ssa_ins_reads(const mkt_ir_ins_t* ins, i32 vreg) {
+    if (ins->ins_lhs == vreg || ins->ins_rhs == vreg) return true;
+    for (i32 a = 0; a < (i32)buf_size(ins->ins_args); a++)
+        if (ins->ins_args[a] == vreg) return true;
+    return false;
+}
+
+// Makes the definition of the operand of `phi` coming from its predecessor
+// #p write the phi destination directly, instead of copying it there. Only
+// when the operand is defined in that predecessor and read nowhere else, and
+// the destination is not read after that, like e.g. `i = i + 1` at the end
+// of a loop. Returns false if that is not the case
+static bool ssa_coalesce(mkt_ir_fn_t* irf, const mkt_ir_block_t* block,
+                         const mkt_ir_ins_t* phi, i32 p, const i32* uses) {
+    const i32 dst = phi->ins_dst, src = phi->ins_args[p];
+    if (uses[src] != 1 ||
+        irf->irf_vregs[src].vr_gc_ref != irf->irf_vregs[dst].vr_gc_ref)
+        return false;
+
+    // Read on the same edge by another phi
+    for (i32 i = 0; i < ssa_phis_len(block); i++)
+        if (block->bb_ins[i].ins_args[p] == dst) return false;
+
+    mkt_ir_block_t* const pred = &irf->irf_blocks[phi->ins_preds[p]];
+    const i32 len = buf_size(pred->bb_ins);
+    i32 def_i = -1;
+    for (i32 i = 0; i < len && def_i == -1; i++)
+        if (pred->bb_ins[i].ins_dst == src) def_i = i;
+    if (def_i == -1 || pred->bb_ins[def_i].ins_op == IR_PHI) return false;
+
+    for (i32 i = def_i + 1; i < len; i++)
+        if (ssa_ins_reads(&pred->bb_ins[i], dst)) return false;
+
+    pred->bb_ins[def_i].ins_dst = dst;
+    return true;
+}
+
+// Replaces the phis of a block with copies at the end of its predecessors.
+// An edge from a block with another successor is split first, so that the
+// copies only run on that edge
+static void ssa_destruct_block(mkt_ir_fn_t* irf, i32* b, const i32* uses) {
+    const i32 phis_len = ssa_phis_len(&irf->irf_blocks[*b]);
+    if (phis_len == 0) return;
+
+    i32* const preds = irf->irf_blocks[*b].bb_ins[0].ins_preds;
+    i32 *dsts = NULL, *srcs = NULL;
+    for (i32 p = 0; p < (i32)buf_size(preds); p++) {
+        bool seen = false;
+        for (i32 q = 0; q < p; q++) seen |= preds[q] == preds[p];
+        if (seen) continue;  // Both branches of a conditional jump
+
+        i32 pred = preds[p];
+        i32 succs[2] = {-1, -1};
+        const bool split = ir_block_succs(&irf->irf_blocks[pred], succs) > 1;
+
+        buf_clear(dsts);
+        buf_clear(srcs);
+        for (i32 i = 0; i < phis_len; i++) {
+            const mkt_ir_block_t* const block = &irf->irf_blocks[*b];
+            const mkt_ir_ins_t* const phi = &block->bb_ins[i];
+            CHECK(phi->ins_preds[p], ==, preds[p], "%d");
+            if (phi->ins_args[p] < 0 || phi->ins_args[p] == phi->ins_dst)
+                continue;
+            if (!split && ssa_coalesce(irf, block, phi, p, uses)) continue;
+
+            buf_push(dsts, phi->ins_dst);
+            buf_push(srcs, phi->ins_args[p]);
+        }
+        if (buf_size(dsts) == 0) continue;
+
+        if (split) {
+            // The block of a back edge goes right before the loop header and
+            // falls through into it, keeping one branch per iteration
+            const i32 at = pred < *b ? pred + 1 : *b;
+            ssa_block_insert(irf, at);
+            if (*b >= at) *b += 1;
+            if (pred >= at) pred += 1;
+            mkt_ir_block_t* const from = &irf->irf_blocks[pred];
+            mkt_ir_ins_t* const br = &from->bb_ins[buf_size(from->bb_ins) - 1];
+            if (br->ins_target == *b) br->ins_target = at;
+            if (br->ins_target_else == *b) br->ins_target_else = at;
+
+            mkt_ir_ins_t jmp = ir_ins_make(IR_JMP, br->ins_node_i);
+            jmp.ins_target = *b;
+            buf_push(irf->irf_blocks[at].bb_ins, jmp);
+            pred = at;
+        }
+
+        mkt_ir_block_t* const block = &irf->irf_blocks[pred];
+        const mkt_ir_ins_t jmp = buf_pop(block->bb_ins);
+        CHECK(jmp.ins_op, ==, IR_JMP, "%d");
+        ssa_parallel_copy(irf, dsts, srcs, buf_size(dsts), jmp.ins_node_i,
+                          &block->bb_ins);
+        buf_push(block->bb_ins, jmp);
+    }
+    buf_free(dsts);
+    buf_free(srcs);
+
+    mkt_ir_block_t* const block = &irf->irf_blocks[*b];
+    for (i32 i = 0; i < phis_len; i++) {
+        buf_free(block->bb_ins[i].ins_args);
+        buf_free(block->bb_ins[i].ins_preds);
+    }
+    const i32 len = buf_size(block->bb_ins);
+    for (i32 i = phis_len; i < len; i++)
+        block->bb_ins[i - phis_len] = block->bb_ins[i];
+    buf_ptr(block->bb_ins)->size = len - phis_len;
+}
+
+static void ssa_count_use(i32 vreg, void* ctx) { ((i32*)ctx)[vreg] += 1; }
+
+static void ssa_destruct(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++) {
+        mkt_ir_fn_t* const irf = &ir->ir_fns[f];
+
+        // Vreg -> number of reads
+        i32* uses = NULL;
+        for (i32 v = 0; v < (i32)buf_size(irf->irf_vregs); v++)
+            buf_push(uses, 0);
+        for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+            const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+            for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++)
+                ir_ins_for_each_use(&block->bb_ins[i], ssa_count_use, uses);
+        }
+
+        for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++)
+            ssa_destruct_block(irf, &b, uses);
+        buf_free(uses);
+    }
+}
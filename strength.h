@@ -0,0 +1,191 @@
+#pragma once
+
+#include "ir.h"
+#include "ssa.h"
+
+// Strength reduction, in SSA form: multiplications, divisions and modulos by
+// a constant become shifts, `lea` and multiplications by a magic number,
+// instead of `imul` and `idiv`. See Hacker's Delight, chapter 10.
+
+typedef struct {
+    mkt_ir_fn_t* sr_fn;
+    mkt_ir_ins_t* sr_out;        // Rewritten instructions of the block
+    const mkt_ir_ins_t* sr_ins;  // Being reduced
+} sr_ctx_t;
+
+// Appends `dst = op lhs, rhs, imm`, with a new vreg when `dst` is -1
+static i32 sr_emit(sr_ctx_t* sr, mkt_ir_op_t op, i32 lhs, i32 rhs, i64 imm,
+                   i32 dst) {
+    mkt_ir_ins_t ins = ir_ins_make(op, sr->sr_ins->ins_node_i);
+    ins.ins_lhs = lhs;
+    ins.ins_rhs = rhs;
+    ins.ins_imm = imm;
+    ins.ins_dst =
+        dst >= 0 ? dst : ssa_vreg_clone(sr->sr_fn, sr->sr_ins->ins_dst);
+    buf_push(sr->sr_out, ins);
+    return ins.ins_dst;
+}
+
+static bool sr_is_pow2(i64 c) { return c > 0 && (c & (c - 1)) == 0; }
+
+// Magic number and shift such that `x / d` is the high half of `x * magic`,
+// plus `x` when the magic number is negative, shifted right by `shift` and
+// rounded towards zero. `d` is at least 2
+static void sr_magic(i64 d, i64* magic, i32* shift) {
+    CHECK((long long)d, >=, 2LL, "%lld");
+
+    const u64 two63 = 1ULL << 63, ad = d;
+    const u64 anc = two63 - 1 - two63 % ad;  // Largest multiple of d, minus 1
+    u64 q1 = two63 / anc, r1 = two63 - q1 * anc;
+    u64 q2 = two63 / ad, r2 = two63 - q2 * ad;
+    u64 delta = 0;
+    i32 p = 63;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (i64)(q2 + 1);
+    *shift = p - 64;
+}
+
+// `x * c` as a shift, or a `lea` by 3, 5 or 9 followed by a shift. -1 when
+// `imul` does as well
+static i32 sr_mul(sr_ctx_t* sr, i32 x, i64 c, i32 dst) {
+    if (c == 0) return sr_emit(sr, IR_IMM, -1, -1, 0, dst);
+    if (c == 1) return sr_emit(sr, IR_MOV, x, -1, 0, dst);
+    if (c < 0) return -1;
+
+    const i32 k = __builtin_ctzll(c);
+    const i64 m = c >> k;
+    if (m != 1 && m != 3 && m != 5 && m != 9) return -1;
+
+    i32 v = x;
+    if (m != 1) v = sr_emit(sr, IR_SCALE, x, x, m - 1, k == 0 ? dst : -1);
+    if (k != 0) v = sr_emit(sr, IR_SHL, v, -1, k, dst);
+    return v;
+}
+
+// `x / c` rounded towards zero, `c` being at least 2
+static i32 sr_div(sr_ctx_t* sr, i32 x, i64 c, i32 dst) {
+    CHECK((long long)c, >=, 2LL, "%lld");
+
+    if (sr_is_pow2(c)) {
+        // A negative dividend is biased by c - 1 first
+        const i32 k = __builtin_ctzll(c);
+        const i32 sign = k == 1 ? x : sr_emit(sr, IR_SAR, x, -1, 63, -1);
+        const i32 bias = sr_emit(sr, IR_SHR, sign, -1, 64 - k, -1);
+        const i32 sum = sr_emit(sr, IR_ADD, x, bias, 0, -1);
+        return sr_emit(sr, IR_SAR, sum, -1, k, dst);
+    }
+
+    i64 magic = 0;
+    i32 shift = 0;
+    sr_magic(c, &magic, &shift);
+    i32 q = sr_emit(sr, IR_MULHI, x, -1, magic, -1);
+    if (magic < 0) q = sr_emit(sr, IR_ADD, q, x, 0, -1);
+    if (shift > 0) q = sr_emit(sr, IR_SAR, q, -1, shift, -1);
+    // Plus one for a negative dividend
+    const i32 sign = sr_emit(sr, IR_SHR, x, -1, 63, -1);
+    return sr_emit(sr, IR_ADD, q, sign, 0, dst);
+}
+
+// Whether `sr_ins` was rewritten into `sr_out`
+static bool sr_reduce(sr_ctx_t* sr, const bool* is_const, const i64* consts) {
+    const mkt_ir_ins_t* const ins = sr->sr_ins;
+
+    switch (ins->ins_op) {
+        case IR_MUL: {
+            const bool lhs_const = is_const[ins->ins_lhs];
+            const i32 x = lhs_const ? ins->ins_rhs : ins->ins_lhs,
+                      c = lhs_const ? ins->ins_lhs : ins->ins_rhs;
+            if (!is_const[c]) return false;
+
+            return sr_mul(sr, x, consts[c], ins->ins_dst) >= 0;
+        }
+        case IR_DIV:
+        case IR_MOD: {
+            // Negative divisors are left to `idiv`
+            const i32 x = ins->ins_lhs;
+            if (!is_const[ins->ins_rhs] || consts[ins->ins_rhs] < 1)
+                return false;
+            const i64 c = consts[ins->ins_rhs];
+
+            if (c == 1) {
+                if (ins->ins_op == IR_DIV)
+                    sr_emit(sr, IR_MOV, x, -1, 0, ins->ins_dst);
+                else
+                    sr_emit(sr, IR_IMM, -1, -1, 0, ins->ins_dst);
+                return true;
+            }
+            if (ins->ins_op == IR_DIV) {
+                sr_div(sr, x, c, ins->ins_dst);
+                return true;
+            }
+
+            // x - x / c * c
+            const i32 q = sr_div(sr, x, c, -1);
+            i32 p = sr_mul(sr, q, c, -1);
+            if (p == -1) p = sr_emit(sr, IR_MUL, q, ins->ins_rhs, 0, -1);
+            sr_emit(sr, IR_SUB, x, p, 0, ins->ins_dst);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void sr_fn(mkt_ir_fn_t* irf) {
+    CHECK((void*)irf, !=, NULL, "%p");
+
+    // In SSA form, a constant has a single definition: an IR_IMM
+    bool* is_const = NULL;
+    i64* consts = NULL;
+    for (i32 v = 0; v < (i32)buf_size(irf->irf_vregs); v++) {
+        buf_push(is_const, false);
+        buf_push(consts, 0);
+    }
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        const mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            const mkt_ir_ins_t* const ins = &block->bb_ins[i];
+            if (ins->ins_op != IR_IMM) continue;
+
+            is_const[ins->ins_dst] = true;
+            consts[ins->ins_dst] = ins->ins_imm;
+        }
+    }
+
+    for (i32 b = 0; b < (i32)buf_size(irf->irf_blocks); b++) {
+        mkt_ir_block_t* const block = &irf->irf_blocks[b];
+        sr_ctx_t sr = {.sr_fn = irf};
+        for (i32 i = 0; i < (i32)buf_size(block->bb_ins); i++) {
+            sr.sr_ins = &block->bb_ins[i];
+            if (!sr_reduce(&sr, is_const, consts))
+                buf_push(sr.sr_out, block->bb_ins[i]);
+        }
+        buf_free(block->bb_ins);
+        block->bb_ins = sr.sr_out;
+    }
+    buf_free(is_const);
+    buf_free(consts);
+}
+
+static void sr_reduce_strength(mkt_ir_t* ir) {
+    CHECK((void*)ir, !=, NULL, "%p");
+
+    for (i32 f = 0; f < (i32)buf_size(ir->ir_fns); f++)
+        sr_fn(&ir->ir_fns[f]);
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "buf.h"
@@ -191,7 +192,9 @@ static mkt_res_t err_test_run(const char* source_file_name) {
     i32 ret_code = 0;
     if (proc_run(argv, output, &read_bytes, &ret_code) != RES_OK)
         return RES_ERR;
-    if (ret_code == 0) {
+    // The error must be reported, not crash the compiler
+    if (ret_code == 0 || WIFSIGNALED(ret_code) ||
+        WEXITSTATUS(ret_code) >= 128) {
         fprintf(stderr, "%s✘ %s:%s ret_code=%d\n", mkt_colors[is_tty][COL_RED],
                 source_file_name, mkt_colors[is_tty][COL_RESET], ret_code);
         return RES_ERR;
@@ -206,6 +209,7 @@ i32 main() {
     is_tty = isatty(2);
 
     const char simple_tests[][MAXPATHLEN] = {
+        "./tests/arith_loop.kt",
         "./tests/assign.kt",
         "./tests/bool.kt",
         "./tests/char.kt",
@@ -214,17 +218,26 @@ i32 main() {
         "./tests/fibo_iter.kt",
         "./tests/fibonacci_rec.kt",
         "./tests/fn.kt",
+        "./tests/fold.kt",
         "./tests/grouping.kt",
         "./tests/hello_world.kt",
         "./tests/if.kt",
+        "./tests/inline.kt",
         "./tests/integers.kt",
+        "./tests/isel.kt",
+        "./tests/logic.kt",
+        "./tests/loop.kt",
         "./tests/math_integers.kt",
         "./tests/negation.kt",
+        "./tests/phi.kt",
+        "./tests/strength.kt",
         "./tests/string.kt",
+        "./tests/tail_call.kt",
         "./tests/var.kt",
         "./tests/while.kt",
     };
     const char err_tests[][MAXPATHLEN] = {
+        "./err/capture_enclosing_local.kt",
         "./err/empty.kt",
         "./err/fn_mismatched_types.kt",
         "./err/fn_missing_return.kt",
@@ -0,0 +1,11 @@
+fun main() {
+  var i: Long = 0L
+  var a: Long = 1L
+  var b: Long = 0L
+  while (i < 50000000L) {
+    a = a * 3L + i
+    b = b + a - i * 2L
+    i = i + 1L
+  }
+  println(b) // expect: 796298911905035520
+}
@@ -0,0 +1,26 @@
+fun main() {
+  println(2147483647 + 1) // expect: -2147483648
+  println(2147483647L + 1L) // expect: 2147483648
+
+  val b: Byte = 127
+  val one: Byte = 1
+  println(b + one) // expect: -128
+
+  val s: Short = 32767
+  val two: Short = 2
+  println(s * two) // expect: -2
+
+  println(7 / 2 * 2 + 7 % 2) // expect: 7
+  println(1 < 2) // expect: true
+  println('a' == 'b') // expect: false
+  println(!(3 <= 3)) // expect: false
+
+  val limit: Int = 10 * 10
+  var x: Int = 5
+  println(x * 1 + 0 + limit) // expect: 105
+  println(x * 0) // expect: 0
+
+  if (limit > 50) println("big") else println("small") // expect: big
+  if (limit == 0) println("zero")
+  println(if (false) 'n' else 'y') // expect: y
+}
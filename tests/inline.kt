@@ -0,0 +1,33 @@
+fun main() {
+  fun square(x: Long): Long { return x * x }
+
+  fun abs(x: Long): Long {
+    if (x < 0L) return 0L - x
+
+    return x
+  }
+
+  fun greet(name: String): String { return "hello " + name }
+
+  fun shout(s: String) { println(s + "!") }
+
+  fun sum_squares(n: Long): Long {
+    var i: Long = 0L
+    var acc: Long = 0L
+    while (i < n) {
+      acc = acc + square(abs(i - 5L))
+      i = i + 1L
+    }
+    return acc
+  }
+
+  println(square(7L)) // expect: 49
+  println(abs(0L - 3L) + abs(4L)) // expect: 7
+  println(sum_squares(10L)) // expect: 85
+  println(greet("world")) // expect: hello world
+  shout("hey") // expect: hey!
+
+  // Arguments are evaluated once, before the body runs
+  var n: Long = 3L
+  println(square(n + 1L)) // expect: 16
+}
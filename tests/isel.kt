@@ -0,0 +1,67 @@
+class Fields{
+  var l: Long = 0L
+  var i: Int = 0
+  var c: Char = 'a'
+  var b: Boolean = false
+}
+
+fun add(x: Long, y: Long): Long {
+    return (x + 5L) + (7L + y) + (x + y) + (x - 2147483648L) + (x + 4294967296L)
+}
+
+fun cmp(x: Long): Long {
+    var n: Long = 0L
+    if (x < 10L) { n = n + 1L }
+    if (3L == x) { n = n + 10L }
+    if (x != 2147483648L) { n = n + 100L }
+    if (x <= 0L - 5L) { n = n + 1000L }
+    return n
+}
+
+fun scaled(x: Long, y: Long): Long {
+    return (x + y * 2L) + (x + y * 4L) + (y * 8L + x) + (x + y * 16L)
+}
+
+fun shared(x: Long, y: Long): Long {
+    val t: Long = y * 4L
+    return (x + t) * t
+}
+
+fun fields(f: Fields, x: Long): Long {
+    var n: Long = (x + f.l) * 2L - (x - f.l) + f.l * x
+    if (x < f.l) { n = n + 1L }
+    if (f.l == x) { n = n + 10L }
+    while (n != f.l) { n = n - 1L }
+    return n
+}
+
+fun main() {
+    println(add(1L, 2L)) // expect: 2147483668
+    println(add(0L - 10L, 0L - 20L)) // expect: 2147483580
+    println(cmp(3L)) // expect: 111
+    println(cmp(0L - 9L)) // expect: 1101
+    println(cmp(2147483648L)) // expect: 0
+
+    val f: Fields = Fields()
+    f.l = 0L - 8589934592L
+    f.i = 0 - 42
+    f.c = 'z'
+    f.b = true
+    println(f.l) // expect: -8589934592
+    println(f.i) // expect: -42
+    println(f.c) // expect: z
+    println(f.b) // expect: true
+    f.l = f.l * 9L + 4294967295L
+    println(f.l) // expect: -73014444033
+
+    println(scaled(3L, 5L)) // expect: 162
+    println(scaled(0L - 3L, 0L - 1L)) // expect: -42
+    println(shared(1L, 2L)) // expect: 72
+    f.l = 7L
+    println(fields(f, 3L)) // expect: 7
+    f.l = 3L
+    println(fields(f, 3L)) // expect: 3
+    val old: Long = f.l
+    f.l = 100L
+    println(old + f.l) // expect: 103
+}
@@ -0,0 +1,36 @@
+fun loud(b: Boolean): Boolean {
+  println(b)
+  return b
+}
+
+fun main() {
+  println(true && true) // expect: true
+  println(true && false) // expect: false
+  println(false || true) // expect: true
+  println(false || false) // expect: false
+
+  val a: Int = 3
+  val b: Int = 5
+  println(a < b && b < 10) // expect: true
+  println(a > b || !(b == 5)) // expect: false
+  println(a == 3 || a == 4 && b == 0) // expect: true
+
+  // The right operand is only evaluated when needed
+  println(loud(false) && loud(true))
+  // expect: false
+  // expect: false
+  println(loud(true) || loud(false))
+  // expect: true
+  // expect: true
+
+  var i: Int = 0
+  var n: Int = 0
+  while (i < 10 && !(i == 7)) {
+    if (i % 2 == 0 || i == 5) {
+      n = n + 1
+    }
+    i = i + 1
+  }
+  println(i) // expect: 7
+  println(n) // expect: 5
+}
@@ -0,0 +1,48 @@
+class Counter{
+  var step: Long = 0
+  var total: Long = 0
+}
+
+fun find(limit: Long): Long {
+    var i: Long = 0L
+    while (i < limit) {
+        if (i * i > 50L) { return i }
+        i = i + 1L
+    }
+    return 0L - 1L
+}
+
+fun main() {
+    val c: Counter = Counter()
+    c.step = 3L
+    var i: Long = 0L
+    while (i < 4L) {
+        c.total = c.total + c.step * 2L
+        c.step = c.step + 1L
+        i = i + 1L
+    }
+    println(c.total) // expect: 36
+
+    var zero: Long = 0L
+    var n: Long = 0L
+    while (n > 0L) {
+        n = n / zero
+    }
+    println(n) // expect: 0
+
+    var a: Long = 0L
+    var b: Long = 0L
+    var s: Long = 0L
+    while (a < 3L) {
+        b = 0L
+        while (b < a * 2L || b == 0L) {
+            s = s + c.step * a + b
+            b = b + 1L
+        }
+        a = a + 1L
+    }
+    println(s) // expect: 77
+
+    println(find(100L)) // expect: 8
+    println(find(5L)) // expect: -1
+}
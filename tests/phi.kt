@@ -0,0 +1,40 @@
+fun rotate(n: Long, a: Long, b: Long): Long {
+    if (n == 0L) { return a * 10L + b }
+    return rotate(n - 1L, b, a)
+}
+
+fun main() {
+    var x: Long = 1L
+    var y: Long = 2L
+    var n: Long = 0L
+    while (n < 3L) {
+        val tmp: Long = x
+        x = y
+        y = tmp
+        n = n + 1L
+    }
+    println(x * 10L + y) // expect: 21
+
+    println(rotate(3L, 1L, 2L)) // expect: 21
+    println(rotate(4L, 1L, 2L)) // expect: 12
+
+    var i: Long = 0L
+    var j: Long = 0L
+    var s: String = ""
+    while (i < 5L && j < 6L) {
+        if (i % 2L == 0L) { j = j + 2L } else { j = j + 1L }
+        s = s + "."
+        i = i + 1L
+    }
+    println(i) // expect: 4
+    println(j) // expect: 6
+    println(s) // expect: ....
+
+    var done: Boolean = false
+    var count: Long = 0L
+    while (!done || count < 2L) {
+        done = !done
+        count = count + 1L
+    }
+    println(count) // expect: 3
+}
@@ -0,0 +1,42 @@
+fun div(x: Long): Long {
+    return x / 2L + x / 8L + x / 3L + x / 7L + x / 10L + x / 1000000007L
+}
+
+fun mod(x: Long): Long {
+    return x % 2L + x % 8L + x % 3L + x % 7L + x % 10L + x % 1000000007L
+}
+
+fun mul(x: Long): Long {
+    return x * 3L + x * 5L + x * 9L + x * 6L + x * 40L + x * 7L + x * 1L
+}
+
+fun digits(n: Long): Long {
+    var x: Long = n
+    var sum: Long = 0L
+    while (x != 0L) {
+        sum = sum + x % 10L
+        x = x / 10L
+    }
+    return sum
+}
+
+fun main() {
+    println(div(1000L)) // expect: 1200
+    println(div(0L - 1000L)) // expect: -1200
+    println(div(0L - 1L)) // expect: 0
+    println(div(9223372036854775807L)) // expect: -7367717415454669183
+    println(mod(1000L)) // expect: 1007
+    println(mod(0L - 1000L)) // expect: -1007
+    println(mod(0L - 9223372036854775807L - 1L)) // expect: -291172015
+    println(mul(11L)) // expect: 781
+    println(mul(0L - 11L)) // expect: -781
+
+    println(digits(9876543210L)) // expect: 45
+    println(digits(0L - 12345L)) // expect: -15
+
+    var i: Int = 2147483647
+    println(i * 9) // expect: 2147483639
+    println(i / 16 + i % 16) // expect: 134217742
+    println((0 - i) / 10) // expect: -214748364
+    println(i / (0 - 3)) // expect: -715827882
+}
@@ -0,0 +1,33 @@
+fun main() {
+  // Deep enough to overflow the stack without tail call elimination
+  fun count(n: Long, acc: Long): Long {
+    if (n == 0L) return acc
+
+    return count(n - 1L, acc + 1L)
+  }
+  println(count(10000000L, 0L)) // expect: 10000000
+
+  // The arguments read the params they replace
+  fun gcd(a: Long, b: Long): Long {
+    if (b == 0L) return a
+
+    return gcd(b, a % b)
+  }
+  println(gcd(1071L, 462L)) // expect: 21
+
+  fun repeat(s: String, n: Long): String {
+    if (n == 0L) return s
+
+    return repeat(s + "ab", n - 1L)
+  }
+  println(repeat("", 3L)) // expect: ababab
+
+  fun countdown(n: Long) {
+    if (n > 0L) {
+      println(n)
+      return countdown(n - 1L)
+    }
+  }
+  countdown(2L) // expect: 2
+  // expect: 1
+}